@@ -7,7 +7,9 @@
       'type': 'static_library',
       'sources': [
         'src/json.c',
-        'src/codius-util.c'
+        'src/codius-cbor.c',
+        'src/codius-util.c',
+        'src/codius-shm.c'
       ],
       'include_dirs': [
         'include',
@@ -24,10 +26,21 @@
         'test/syscall-tester.c'
       ]
     },
+    { 'target_name': 'json-bench',
+      'type': 'executable',
+      'sources': [
+        'test/json-bench.c'
+      ],
+      'dependencies': [
+        'codius-sandbox-rpc'
+      ],
+      'cflags': ['-O2 -Wall -Werror']
+    },
     { 'target_name': 'node-codius-sandbox',
       'sources': [
         'src/sandbox-node-module.cpp',
         'src/node-filesystem.cpp',
+        'src/json-v8.cpp',
       ],
       'include_dirs': [
         'include'
@@ -48,12 +61,48 @@
         '<!@(<(pkg-config) --libs-only-l libseccomp) -ldl'
       ]
     },
+    { 'target_name': 'node-codius-sandbox-test',
+      'sources': [
+        'src/sandbox-node-module.cpp',
+        'src/node-filesystem.cpp',
+        'src/json-v8.cpp',
+      ],
+      'include_dirs': [
+        'include'
+      ],
+      'defines': [
+        'CODIUS_TEST_HOOKS'
+      ],
+      'dependencies': [
+        'codius-sandbox'
+      ],
+      'cflags': [
+        '<!@(<(pkg-config) --cflags libseccomp) -fPIC --std=c++11 -g -Wall -Werror'
+      ],
+      'ldflags': [
+        '<!@(<(pkg-config) --libs-only-L --libs-only-other libseccomp)'
+      ],
+      'libraries': [
+        '<!@(<(pkg-config) --libs-only-l libseccomp) -ldl'
+      ]
+    },
     { 'target_name': 'codius-unittests',
       'type': 'executable',
       'sources': [
         'test/main.cpp',
         'test/sandbox.cpp',
-        'test/ipc.cpp'
+        'test/ipc.cpp',
+        'test/codius-cbor.cpp',
+        'test/codius-shm.cpp',
+        'test/json-parser.cpp',
+        'test/token-pool.cpp',
+        'test/dirent-builder.cpp',
+        'test/image-filesystem.cpp',
+        'test/blob-filesystem.cpp',
+        'test/overlay-filesystem.cpp',
+        'test/tmp-filesystem.cpp',
+        'test/native-filesystem.cpp',
+        'test/uring-filesystem.cpp'
       ],
       'include_dirs': [
         'include',
@@ -86,8 +135,15 @@
           'src/sandbox.cpp',
           'src/sandbox-ipc.cpp',
           'src/vfs.cpp',
+          'src/filesystem.cpp',
           'src/dirent-builder.cpp',
-          'src/native-filesystem.cpp'
+          'src/native-filesystem.cpp',
+          'src/image-filesystem.cpp',
+          'src/blob-filesystem.cpp',
+          'src/overlay-filesystem.cpp',
+          'src/arena.cpp',
+          'src/tmp-filesystem.cpp',
+          'src/uring-filesystem.cpp'
         ],
         'include_dirs': [
           'include',
@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * Bump allocator that hands out memory from large blocks and frees all of it
+ * at once.
+ *
+ * Objects allocated from an arena are never destroyed individually, so they
+ * must be trivially destructible. Callers that need to reuse memory keep their
+ * own free lists.
+ */
+class Arena {
+public:
+  /**
+   * Constructor
+   *
+   * @param blockSize Size of each block requested from the heap
+   * @param limit Most bytes the arena may reserve in total, or 0 for no limit
+   */
+  Arena(size_t blockSize = 65536, size_t limit = 0);
+
+  /**
+   * Returns @p size bytes aligned to @p align, or null if the limit would be
+   * exceeded
+   */
+  void* allocate(size_t size, size_t align = alignof (max_align_t));
+
+  /**
+   * Allocates and value-initializes a T, or returns null
+   */
+  template<typename T> T* create()
+  {
+    void* mem = allocate (sizeof (T), alignof (T));
+    return mem ? new (mem) T() : nullptr;
+  }
+
+  /**
+   * Frees every block
+   */
+  void reset();
+
+  /**
+   * Bytes reserved from the heap
+   */
+  size_t reserved() const {return m_reserved;}
+
+private:
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  std::vector<std::unique_ptr<char[]> > m_blocks;
+  size_t m_blockSize;
+  size_t m_limit;
+  size_t m_reserved;
+  char* m_next;
+  char* m_end;
+};
+
+#endif // ARENA_H
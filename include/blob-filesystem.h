@@ -0,0 +1,161 @@
+#ifndef BLOB_FILESYSTEM_H
+#define BLOB_FILESYSTEM_H
+
+#include "filesystem.h"
+#include "dirent-builder.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Contents of a single file, mapped read-only from a BlobStore
+ */
+class Blob {
+public:
+  using Ptr = std::shared_ptr<const Blob>;
+
+  Blob(const std::string& hash, const char* data, size_t size);
+  ~Blob();
+
+  const std::string& hash() const {return m_hash;}
+  const char* data() const {return m_data;}
+  size_t size() const {return m_size;}
+
+private:
+  std::string m_hash;
+  const char* m_data;
+  size_t m_size;
+};
+
+/**
+ * Host-wide store of file contents, keyed by the hash of each file as listed
+ * in a contract's manifest.
+ *
+ * Each blob is a file named after its hash in the store's directory. A blob is
+ * mapped the first time it is requested and the mapping is shared by every
+ * caller until the last reference to it is dropped, so identical files used by
+ * many sandboxes only take up memory once.
+ */
+class BlobStore {
+public:
+  using Ptr = std::shared_ptr<BlobStore>;
+
+  /**
+   * Constructor
+   *
+   * @param directory Directory that holds the blobs
+   */
+  BlobStore(const std::string& directory);
+
+  /**
+   * Returns the store for @p directory, creating it the first time
+   */
+  static Ptr shared(const std::string& directory);
+
+  /**
+   * Maps a blob, or returns the existing mapping
+   *
+   * @param hash Hash of the blob, as lowercase hex
+   * @return The blob, or null if it is not in the store
+   */
+  Blob::Ptr get(const std::string& hash);
+
+  /**
+   * Returns the length of a blob without mapping it
+   *
+   * @param hash Hash of the blob, as lowercase hex
+   * @return The length in bytes, or -1 if it is not in the store
+   */
+  off_t size(const std::string& hash);
+
+  /**
+   * Adds a blob to the store. An existing blob with the same hash is kept.
+   *
+   * @param hash Hash of @p data, as lowercase hex. It is not verified.
+   * @param data Contents of the blob
+   * @param size Length of @p data
+   * @return true on success, false otherwise. @p errno will be set on failure.
+   */
+  bool put(const std::string& hash, const void* data, size_t size);
+
+  /**
+   * Number of blobs that are currently mapped
+   */
+  size_t mapped() const;
+
+  /**
+   * Returns true if @p hash is safe to use as a blob name
+   */
+  static bool isValidHash(const std::string& hash);
+
+private:
+  std::string m_directory;
+  std::map<std::string, std::weak_ptr<const Blob> > m_blobs;
+};
+
+/**
+ * A read-only filesystem that maps each path of a contract to a blob
+ *
+ * Directories are implied by the paths in the manifest.
+ */
+class BlobFilesystem : public Filesystem {
+public:
+  /**
+   * Maps absolute paths to blob hashes
+   */
+  using Manifest = std::map<std::string, std::string>;
+
+  /**
+   * Constructor
+   *
+   * @param store Store to read file contents from
+   * @param manifest Files to serve
+   */
+  BlobFilesystem(BlobStore::Ptr store, const Manifest& manifest);
+
+  virtual int open(const char* name, int flags, int mode);
+  virtual ssize_t read(int fd, void* buf, size_t count);
+  virtual int close(int fd);
+  virtual int fstat(int fd, struct stat* buf);
+  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
+  virtual off_t lseek(int fd, off_t offset, int whence);
+  virtual ssize_t write(int fd, void* buf, size_t count);
+  virtual int access(const char* name, int mode);
+  virtual int stat(const char* path, struct stat* buf);
+  virtual int lstat(const char* path, struct stat* buf);
+  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual ssize_t readInPlace(int fd, size_t count, const void** data);
+
+private:
+  struct Node {
+    uint64_t inode;
+    std::string hash;
+    std::vector<DirentCursor::Entry> children;
+    bool directory;
+    // Length of the blob, or -1 until it is first looked up
+    mutable off_t size;
+  };
+
+  struct OpenFile {
+    const Node* node;
+    Blob::Ptr blob;
+    off_t offset;
+    DirentCursor cursor;
+    bool used;
+  };
+
+  OpenFile* getOpenFile(int fd);
+  const Node* find(const char* path) const;
+  int fillStat(const Node* node, struct stat* buf);
+  int readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format);
+
+  BlobStore::Ptr m_store;
+  std::map<std::string, Node> m_nodes;
+  std::vector<OpenFile> m_openFiles;
+  std::vector<int> m_freeFDs;
+};
+
+#endif // BLOB_FILESYSTEM_H
@@ -0,0 +1,94 @@
+#ifndef __CODIUS_CBOR_H_
+#define __CODIUS_CBOR_H_
+
+#include <stddef.h>
+#include "json.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum nesting depth accepted by codius_cbor_decode()
+ */
+#define CODIUS_CBOR_MAX_DEPTH 512
+
+/**
+ * Growable output buffer used by the CBOR encoder
+ */
+typedef struct codius_cbor_buf_s {
+  char* data;
+  size_t len;
+  size_t cap;
+} codius_cbor_buf_t;
+
+/**
+ * Appends the CBOR (RFC 7049) encoding of a JSON tree to a buffer.
+ *
+ * Integral numbers that fit in 53 bits are encoded as CBOR integers, all other
+ * numbers as doubles. Objects become maps with text string keys.
+ *
+ * @param buf Buffer to append to. Must be zeroed before first use, and its
+ * data freed with free() when finished.
+ * @param node Tree to encode
+ * @return Zero on success, -1 if memory could not be allocated
+ */
+int codius_cbor_encode (codius_cbor_buf_t* buf, const JsonNode* node);
+
+/**
+ * Appends raw bytes to a buffer
+ *
+ * @return Zero on success, -1 if memory could not be allocated
+ */
+int codius_cbor_append (codius_cbor_buf_t* buf, const void* data, size_t len);
+
+/**
+ * Appends a CBOR unsigned integer to a buffer
+ *
+ * @return Zero on success, -1 if memory could not be allocated
+ */
+int codius_cbor_encode_uint (codius_cbor_buf_t* buf, unsigned long long value);
+
+/**
+ * Appends the head of a CBOR array to a buffer. The @p count items must be
+ * appended after it.
+ *
+ * @return Zero on success, -1 if memory could not be allocated
+ */
+int codius_cbor_encode_array (codius_cbor_buf_t* buf, size_t count);
+
+/**
+ * Appends a CBOR text string to a buffer
+ *
+ * @return Zero on success, -1 if memory could not be allocated
+ */
+int codius_cbor_encode_string (codius_cbor_buf_t* buf, const char* str);
+
+/**
+ * Decodes one CBOR data item into a JSON tree.
+ *
+ * Only the subset of CBOR that maps onto JSON is accepted: integers, floats,
+ * UTF-8 text strings, arrays, maps with text string keys, booleans and null.
+ * Undefined and non-finite floats are read as null.
+ *
+ * @param data Encoded data
+ * @param len Length of @p data
+ * @param consumed If not null, set to the number of bytes the item used
+ * @return A new tree that must be freed with json_delete(), or NULL if the
+ * data is malformed, unsupported or nested deeper than CODIUS_CBOR_MAX_DEPTH
+ */
+JsonNode* codius_cbor_decode (const char* data, size_t len, size_t* consumed);
+
+/**
+ * Like codius_cbor_decode(), but allocates the tree from @p arena.
+ *
+ * @return A new tree that is freed along with @p arena, or NULL
+ */
+JsonNode* codius_cbor_decode_in (const char* data, size_t len, size_t* consumed,
+                                 JsonArena* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CODIUS_CBOR_H_ */
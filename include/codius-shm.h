@@ -0,0 +1,158 @@
+#ifndef __CODIUS_SHM_H_
+#define __CODIUS_SHM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Default capacity of each ring, in bytes
+ */
+#define CODIUS_SHM_DEFAULT_RING_SIZE (256 * 1024)
+
+typedef struct codius_shm_s codius_shm_t;
+
+/**
+ * Which end of a channel an endpoint is. The guest sends on the request ring
+ * and receives on the result ring; the host does the opposite.
+ */
+typedef enum {
+  CODIUS_SHM_HOST,
+  CODIUS_SHM_GUEST
+} codius_shm_side_t;
+
+/**
+ * Creates a shared memory channel: a memfd holding two single-producer,
+ * single-consumer rings, plus an eventfd doorbell for each side.
+ *
+ * A side only rings the other's doorbell when the other has announced that
+ * it is about to sleep, so a busy channel exchanges messages without any
+ * syscalls.
+ *
+ * @param ring_size Capacity of each ring. Rounded up to a power of two.
+ * @return The host end of the channel, or NULL on failure. errno will be set
+ * on failure.
+ */
+codius_shm_t* codius_shm_create (size_t ring_size);
+
+/**
+ * Attaches to a channel created by codius_shm_create()
+ *
+ * @param side Which end to attach as
+ * @param memfd Descriptor of the shared memory
+ * @param host_doorbell Doorbell the host sleeps on
+ * @param guest_doorbell Doorbell the guest sleeps on
+ * @return The endpoint, or NULL if the memory is not a valid channel. The
+ * descriptors are owned by the endpoint from then on.
+ */
+codius_shm_t* codius_shm_attach (codius_shm_side_t side, int memfd,
+                                 int host_doorbell, int guest_doorbell);
+
+/**
+ * Unmaps the channel and closes the endpoint's descriptors
+ */
+void codius_shm_free (codius_shm_t* shm);
+
+/**
+ * Attaches data that a layer above keeps for the channel, replacing any data
+ * attached before
+ *
+ * @param shm Endpoint to attach to
+ * @param context Data to attach
+ * @param free_fn Called with @p context when the endpoint is freed, or NULL
+ */
+void codius_shm_set_context (codius_shm_t* shm, void* context,
+                             void (*free_fn)(void*));
+
+/**
+ * Data attached with codius_shm_set_context(), or NULL
+ */
+void* codius_shm_context (codius_shm_t* shm);
+
+int codius_shm_memfd (codius_shm_t* shm);
+int codius_shm_host_doorbell (codius_shm_t* shm);
+int codius_shm_guest_doorbell (codius_shm_t* shm);
+
+/**
+ * Doorbell this endpoint sleeps on. It becomes readable when the peer has
+ * sent a message or freed space after codius_shm_recv() or codius_shm_send()
+ * reported EAGAIN.
+ */
+int codius_shm_doorbell (codius_shm_t* shm);
+
+/**
+ * Copies a message into the outgoing ring
+ *
+ * @param shm Endpoint to send from
+ * @param data Message to send
+ * @param len Length of @p data. Must be at most a quarter of the ring size.
+ * @param block If zero, fail with EAGAIN instead of waiting for space
+ * @return Zero on success, -1 on failure with errno set
+ */
+int codius_shm_send (codius_shm_t* shm, const void* data, size_t len, int block);
+
+/**
+ * Sends a message without ever blocking. If the ring is full, or earlier
+ * messages are still queued, the message is queued locally until
+ * codius_shm_flush() finds room for it. At most the ring size is queued.
+ *
+ * @return Zero on success, -1 on failure with errno set; ENOBUFS means the
+ * peer has stopped draining the ring and the queue is full
+ */
+int codius_shm_send_queued (codius_shm_t* shm, const void* data, size_t len);
+
+/**
+ * Moves locally queued messages into the outgoing ring, as far as they fit
+ *
+ * @return Number of bytes still queued
+ */
+size_t codius_shm_flush (codius_shm_t* shm);
+
+/**
+ * Takes the next message from the incoming ring
+ *
+ * @param shm Endpoint to receive on
+ * @param len Set to the length of the message
+ * @param block If zero, fail with EAGAIN instead of waiting for a message
+ * @return The message, NUL-terminated and valid until the next call, or NULL
+ * on failure with errno set
+ */
+char* codius_shm_recv (codius_shm_t* shm, size_t* len, int block);
+
+/**
+ * Checks whether a message is waiting in the incoming ring
+ */
+int codius_shm_readable (codius_shm_t* shm);
+
+/**
+ * Announces that this endpoint is about to wait on its doorbell, so the peer
+ * rings it on the next message. Must be called before every wait.
+ *
+ * @return Non-zero if it is safe to wait, or zero if a message arrived in the
+ * meantime
+ */
+int codius_shm_arm (codius_shm_t* shm);
+
+/**
+ * Announces that this endpoint is about to wait on its doorbell for room in
+ * the outgoing ring, so the peer rings it once it has taken a message
+ *
+ * @return Non-zero if it is safe to wait, or zero if room was made in the
+ * meantime
+ */
+int codius_shm_arm_send (codius_shm_t* shm);
+
+/**
+ * Clears a signalled doorbell. Call it before draining the rings when the
+ * doorbell polls as readable.
+ */
+void codius_shm_clear_doorbell (codius_shm_t* shm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CODIUS_SHM_H_ */
@@ -2,11 +2,16 @@
 #define __CODIUS_UTIL_H_
 
 #include "json.h"
+#include "codius-shm.h"
 
 // 129 KB
 #define CODIUS_MAX_MESSAGE_SIZE 132096
 // 256 MB
 #define CODIUS_MAX_RESPONSE_SIZE 268435456
+// 16 MB. Requests come from the guest and are buffered whole by the host.
+#define CODIUS_MAX_REQUEST_SIZE 16777216
+// 4 MB of replies a guest may leave unread on a descriptor
+#define CODIUS_MAX_REPLY_BACKLOG 4194304
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +20,18 @@ extern "C" {
 typedef struct codius_rpc_header_s codius_rpc_header_t;
 typedef struct codius_result_s codius_result_t;
 
+/**
+ * Encodings of message bodies. Which one a message uses is given by the magic
+ * bytes of its header, and a result is always sent in the encoding of the
+ * request it answers, so JSON-only peers keep working unchanged.
+ */
+typedef enum {
+  /** JSON text */
+  CODIUS_ENCODING_JSON,
+  /** CBOR, with api and method names optionally interned */
+  CODIUS_ENCODING_CBOR
+} codius_encoding_t;
+
 #pragma pack(push)
 #pragma pack(1)
 struct codius_rpc_header_s {
@@ -29,6 +46,8 @@ struct codius_result_s {
   JsonNode* data;
 /* PRIVATE */
   unsigned long _id;
+  codius_encoding_t _encoding;
+  JsonArena* _arena;
 };
 
 typedef struct codius_request_s codius_request_t;
@@ -37,13 +56,38 @@ struct codius_request_s {
   char* api_name;
   char* method_name;
   JsonNode* data;
+  /** Encoding to send the request in. Defaults to codius_set_encoding(). */
+  codius_encoding_t encoding;
 
 /* PRIVATE */
   unsigned long _id;
   int _fd;
+  unsigned long _fd_serial;
+  codius_shm_t* _shm;
+  JsonArena* _arena;
 };
 
 static const unsigned long CODIUS_MAGIC_BYTES = 0xC0D105FE;
+static const unsigned long CODIUS_MAGIC_BYTES_CBOR = 0xC0D1CB0E;
+
+/**
+ * Sets the encoding that new requests are sent in
+ *
+ * @param encoding Encoding for requests created after this call
+ */
+void codius_set_encoding (codius_encoding_t encoding);
+
+/**
+ * Interns an api or method name. CBOR messages carry interned names as their
+ * small integer ID instead of the full string.
+ *
+ * Only the sending side interns names. The first request that uses a name on
+ * a connection defines its ID there, so the receiver needs no setup.
+ *
+ * @param name Name to intern
+ * @return The ID of the name, or -1 if the table is full
+ */
+int codius_intern_name (const char* name);
 
 /**
  * Sends a codius IPC request and blocks until a response is received
@@ -56,8 +100,95 @@ static const unsigned long CODIUS_MAGIC_BYTES = 0xC0D105FE;
 codius_result_t*
 codius_sync_call(codius_request_t* request);
 
+typedef struct codius_client_s codius_client_t;
+
+/**
+ * Called when the result of a request submitted through a codius_client_t
+ * arrives. The callback takes ownership of @p result and must free it with
+ * codius_result_free().
+ */
+typedef void (*codius_callback_t)(codius_result_t* result, void* user_data);
+
+/**
+ * Creates a client that can have many requests in flight on one descriptor.
+ * Results are matched to their request by ID, in whatever order the host
+ * sends them.
+ *
+ * A client is not thread safe, and codius_sync_call() must not be used on
+ * the same descriptor while the client has requests in flight.
+ *
+ * @param fd Descriptor connected to the host, usually 3
+ * @return A new client. Must be freed with codius_client_free()
+ */
+codius_client_t* codius_client_new (int fd);
+
+/**
+ * Frees a client. Callbacks of requests still in flight are never called.
+ *
+ * @param client Client to free
+ */
+void codius_client_free (codius_client_t* client);
+
+/**
+ * Creates a client that sends requests and receives results over a shared
+ * memory channel instead of a descriptor
+ *
+ * @param shm Guest end of the channel. It is not freed with the client.
+ * @return A new client. Must be freed with codius_client_free()
+ */
+codius_client_t* codius_client_new_shm (codius_shm_t* shm);
+
+/**
+ * Sends a request without waiting for its result
+ *
+ * @param client Client to send through
+ * @param request Request to send. It can be freed as soon as this returns.
+ * @param callback Called from codius_client_dispatch() with the result, or
+ * NULL to collect the result with codius_client_wait() instead. A shared
+ * memory client also dispatches results while it waits for room to send, so
+ * callbacks of earlier requests may run before this returns.
+ * @param user_data Passed to @p callback
+ * @return Zero on success, non-zero on failure
+ */
+int codius_client_submit (codius_client_t* client, codius_request_t* request,
+                          codius_callback_t callback, void* user_data);
+
+/**
+ * Reads the results that have arrived and completes their requests
+ *
+ * @param client Client to dispatch
+ * @param block If non-zero, waits until at least one request completes
+ * @return Number of requests completed, or -1 on failure
+ */
+int codius_client_dispatch (codius_client_t* client, int block);
+
 /**
- * Sends a result in response to a request
+ * Blocks until the result of one request arrives. Other results that arrive
+ * in the meantime are dispatched as usual.
+ *
+ * @param client Client the request was submitted through
+ * @param id ID of a request submitted without a callback
+ * @return The result, which must be freed with codius_result_free(), or NULL
+ * on failure
+ */
+codius_result_t* codius_client_wait (codius_client_t* client, unsigned long id);
+
+/**
+ * Descriptor to poll for readability. When it is readable, or when
+ * codius_has_buffered_message() reports a message, codius_client_dispatch()
+ * has results to complete. For a shared memory client this is the doorbell,
+ * which only signals after a codius_client_dispatch() that found nothing.
+ */
+int codius_client_fd (codius_client_t* client);
+
+/**
+ * Number of requests whose result has not been handed out yet
+ */
+size_t codius_client_pending (codius_client_t* client);
+
+/**
+ * Sends a result in response to a request. On a non-blocking descriptor, what
+ * does not fit is left queued as by codius_queue_reply().
  *
  * @param request Request that is being replied to
  * @param result Response
@@ -66,6 +197,53 @@ codius_sync_call(codius_request_t* request);
 int
 codius_send_reply(codius_request_t* request, codius_result_t* result);
 
+/**
+ * Queues a result in response to a request without sending it. Queued replies
+ * are coalesced into a single write by codius_flush_replies().
+ *
+ * Only requests read with codius_read_request() can be replied to, and only
+ * until codius_forget_fd() is called for their descriptor; later replies fail
+ * with EBADF. A reply that would leave more than CODIUS_MAX_REPLY_BACKLOG
+ * bytes unsent fails with ENOBUFS, unless nothing else is queued.
+ *
+ * @param request Request that is being replied to
+ * @param result Response. It is encoded immediately and may be freed once
+ * this returns.
+ * @return Zero on success, non-zero on failure. Errno is also set on failure.
+ * @see codius_send_reply()
+ */
+int
+codius_queue_reply(codius_request_t* request, codius_result_t* result);
+
+/**
+ * Writes the replies queued for a descriptor. On a non-blocking descriptor
+ * this stops once the socket is full, and the rest stays queued until the
+ * next call; see codius_reply_backlog().
+ *
+ * @param fd File descriptor replies were queued for
+ * @return Zero on success, non-zero on failure, after which the queued
+ * replies are dropped. Errno is also set on failure.
+ */
+int
+codius_flush_replies(int fd);
+
+/**
+ * Number of bytes of replies queued for a descriptor that have not been
+ * written yet
+ *
+ * @param fd File descriptor replies were queued for
+ */
+size_t
+codius_reply_backlog(int fd);
+
+/**
+ * Calls codius_flush_replies() for every descriptor with queued replies
+ *
+ * @return Zero on success, non-zero if any descriptor failed
+ */
+int
+codius_flush_all_replies();
+
 /**
  * Creates a new IPC request. Must be later freed with codius_request_free()
  * 
@@ -80,21 +258,70 @@ codius_request_t* codius_request_new (const char* api_name,
 /**
  * Frees a previously created IPC request.
  *
+ * The data of a request that was read or parsed is allocated from an arena
+ * owned by the request, and is freed along with it unless taken with
+ * codius_request_take_data(). The data of a request built with
+ * codius_request_new() still belongs to the caller.
+ *
  * @param request Request to free
  * @see codius_request_new
  */
 void codius_request_free (codius_request_t* request);
 
 /**
- * Reads an IPC request from a file descriptor
+ * Detaches the data of a request, so it outlives codius_request_free().
+ *
+ * The data may live in the request's arena, which moves along with it. Once
+ * done with the data, free it with json_delete() and then the arena with
+ * json_arena_free().
+ *
+ * @param request Request to take the data from
+ * @param arena Set to the arena holding the data, or NULL if it has none
+ * @return The data, which the request no longer refers to
+ */
+JsonNode* codius_request_take_data (codius_request_t* request,
+                                    JsonArena** arena);
+
+/**
+ * Reads an IPC request from a file descriptor. Messages are read through a
+ * receive buffer kept for each descriptor, so a message split across several
+ * reads is reassembled and several messages may be received by one read.
+ *
+ * Requests larger than CODIUS_MAX_REQUEST_SIZE are rejected with EMSGSIZE,
+ * since a request is buffered whole before it is parsed.
+ *
+ * If @p fd is non-blocking and the next message has not fully arrived, the
+ * bytes read so far stay buffered and NULL is returned with errno EAGAIN. The
+ * next call, e.g. once @p fd polls readable again, resumes from them.
  *
  * @param fd File descriptor to read from
- * @return A new request. Must be freed with codius_request_free()
+ * @return A new request, which must be freed with codius_request_free(), or
+ * NULL with errno set
  * @see codius_write_request()
  * @see codius_request_from_string()
  */
 codius_request_t* codius_read_request (int fd);
 
+/**
+ * Checks whether a complete message from @p fd is already buffered, so that
+ * the next codius_read_request() or codius_read_result() will not read from
+ * the descriptor. Callers that wait for readiness before reading must drain
+ * these first, since the descriptor will not become readable again for them.
+ *
+ * @param fd File descriptor messages are read from
+ * @return Non-zero if a message is buffered
+ */
+int codius_has_buffered_message (int fd);
+
+/**
+ * Releases the receive buffer and any queued replies of a descriptor. Must be called before a
+ * descriptor that messages were read from is closed, or unread bytes could
+ * be handed to the next user of the same descriptor number.
+ *
+ * @param fd File descriptor to forget
+ */
+void codius_forget_fd (int fd);
+
 /**
  * Writes an IPC request to a file descriptor
  *
@@ -110,7 +337,8 @@ int codius_write_request (int fd, codius_request_t* request);
  * Builds an IPC request from a json string
  *
  * @param buf String to read
- * @return The new request. Must be freed with codius_request_free()
+ * @return The new request, which must be freed with codius_request_free(), or
+ * NULL if @p buf is not a valid request
  * @see codius_read_request()
  * @see codius_request_to_string
  */
@@ -135,7 +363,9 @@ char* codius_request_to_string (codius_request_t* request);
 codius_result_t* codius_result_new ();
 
 /**
- * Frees a previously allocated IPC result
+ * Frees a previously allocated IPC result and its data. The tree of a result
+ * that was read or parsed is released in one go with the result's arena.
+ * Use codius_result_take_data() to keep the data.
  *
  * @param result The result to free
  * @see codius_result_new
@@ -143,7 +373,23 @@ codius_result_t* codius_result_new ();
 void codius_result_free (codius_result_t* result);
 
 /**
- * Reads an IPC result from a file descriptor
+ * Detaches the data of a result, so it outlives codius_result_free().
+ *
+ * The data may live in the result's arena, which moves along with it. Once
+ * done with the data, free it with json_delete() and then the arena with
+ * json_arena_free().
+ *
+ * @param result Result to take the data from
+ * @param arena Set to the arena holding the data, or NULL if it has none
+ * @return The data, which the result no longer refers to
+ */
+JsonNode* codius_result_take_data (codius_result_t* result,
+                                   JsonArena** arena);
+
+/**
+ * Reads an IPC result from a file descriptor. JSON results larger than
+ * CODIUS_MAX_MESSAGE_SIZE are parsed while they are read, so they are never
+ * buffered whole.
  *
  * @param fd File descriptor to read from
  * @return A new IPC result. Must be freed with codius_result_free()
@@ -181,6 +427,43 @@ int codius_write_result (int fd, codius_result_t* result);
  */
 char* codius_result_to_string (codius_result_t* result);
 
+/**
+ * Writes an IPC request to a shared memory channel, waiting for space if the
+ * ring is full
+ *
+ * @param shm Guest end of the channel
+ * @param request Request to send
+ * @return Zero on success, non-zero on failure. Errno will also be set on
+ * failure; EMSGSIZE means the request is larger than the ring allows.
+ */
+int codius_shm_write_request (codius_shm_t* shm, codius_request_t* request);
+
+/**
+ * Takes the next IPC request from a shared memory channel without blocking.
+ * Replies sent with codius_send_reply() or codius_queue_reply() go back over
+ * the same channel.
+ *
+ * Requests are not taken while replies are still queued because the guest
+ * has not drained them, so a guest that stops reading cannot make the host
+ * queue without bound.
+ *
+ * @param shm Host end of the channel
+ * @return A new request, which must be freed with codius_request_free(), or
+ * NULL. errno is EAGAIN if the ring was merely empty or replies are still
+ * queued, in which case the doorbell will signal when the next request
+ * arrives or the guest has made room.
+ */
+codius_request_t* codius_shm_read_request (codius_shm_t* shm);
+
+/**
+ * Reads an IPC result from a shared memory channel
+ *
+ * @param shm Guest end of the channel
+ * @param block If zero, fail with EAGAIN instead of waiting for a result
+ * @return A new IPC result. Must be freed with codius_result_free()
+ */
+codius_result_t* codius_shm_read_result (codius_shm_t* shm, int block);
+
 #ifdef __cplusplus
 }
 #endif
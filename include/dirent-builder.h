@@ -2,6 +2,7 @@
 #define DIRENT_BUILDER_H
 
 #include <dirent.h>
+#include <stdint.h>
 #include <vector>
 #include <string>
 
@@ -15,6 +16,18 @@ struct linux_dirent {
    */
 };
 
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * Encodes directory records in place into a caller-supplied buffer, without
+ * allocating
+ */
 class DirentBuilder {
 public:
   enum DirentType {
@@ -28,14 +41,115 @@ public:
     Socket = DT_SOCK
   };
 
-  DirentBuilder(int startIdx = 1);
-  void append(const std::string& name, DirentType type = Regular);
-  std::vector<char> data() const;
+  /**
+   * Record layout to build
+   */
+  enum Format {
+    Dirent,   ///< struct linux_dirent, as returned by getdents()
+    Dirent64  ///< struct linux_dirent64, as returned by getdents64()
+  };
+
+  /**
+   * Constructor
+   *
+   * @param buf Buffer that records are written to
+   * @param size Size of @p buf
+   * @param format Record layout to use
+   */
+  DirentBuilder(void* buf, size_t size, Format format = Dirent);
+
+  /**
+   * Appends a record, if there is room left for it
+   *
+   * @param name Entry name
+   * @param nameLen Length of @p name
+   * @param inode Inode number to report
+   * @param offset Offset of the next entry, reported as d_off
+   * @param type Entry type
+   * @return true if the record was written, false if it does not fit
+   */
+  bool append(const char* name, size_t nameLen, uint64_t inode, int64_t offset, DirentType type = Regular);
+  bool append(const std::string& name, uint64_t inode, int64_t offset, DirentType type = Regular);
+
+  /**
+   * Bytes written so far
+   */
+  size_t size() const;
+
+  /**
+   * Records written so far
+   */
+  size_t count() const;
+
+  /**
+   * Length of a record for a name of @p nameLen bytes, including padding
+   */
+  static size_t recordLength(size_t nameLen, Format format);
+
+private:
+  char* m_buf;
+  size_t m_capacity;
+  size_t m_size;
+  size_t m_count;
+  Format m_format;
+};
+
+/**
+ * Position within a directory listing that is read in slices by getdents()
+ *
+ * The listing is fetched once. Each read() then encodes as many whole records
+ * as fit straight into the caller's buffer, resuming after the last one
+ * returned. Offsets are entry indices, matching the d_off of the records.
+ */
+class DirentCursor {
+public:
+  /**
+   * A directory entry. @p inode must be the st_ino that stat() reports for
+   * the same entry, since tools such as find and du pair the two.
+   */
+  struct Entry {
+    std::string name;
+    uint64_t inode;
+    DirentBuilder::DirentType type;
+  };
+
+  DirentCursor();
+
+  /**
+   * Replaces the listing and rewinds to the start
+   *
+   * @param entries The directory's entries
+   */
+  void load(const std::vector<Entry>& entries);
+
+  /**
+   * Returns true once a listing has been loaded
+   */
+  bool loaded() const;
+
+  /**
+   * Copies the next records into @p buf
+   *
+   * @param buf Buffer to write to
+   * @param count Size of @p buf
+   * @param format Record layout to use
+   * @return Bytes written, 0 at the end of the listing, or -EINVAL if @p count
+   * is too small for the next record
+   */
+  int read(void* buf, unsigned int count, DirentBuilder::Format format);
+
+  /**
+   * Moves to the entry at @p offset, as passed in a record's d_off. Seeking to
+   * 0 also drops the listing, so it is fetched again as with rewinddir().
+   *
+   * @return The new offset
+   */
+  off_t seek(off_t offset);
 
 private:
-  std::vector<char> m_buf;
-  int m_idx;
-  int m_inode;
+  std::vector<Entry> m_entries;
+  bool m_loaded;
+  size_t m_next;
 };
 
 #endif // DIRENT_BUILDER_H
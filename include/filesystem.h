@@ -2,28 +2,98 @@
 #define FILESYSTEM_H
 
 #include <unistd.h>
+#include <functional>
+#include <string>
 
 /**
  * Interface for implementing concrete filesystems
  *
- * Each function is an implementation of a specific POSIX syscall.
+ * Each function is an implementation of a specific POSIX syscall, and returns
+ * a negative error number on failure in the same way as the raw syscall.
+ *
+ * Backends implement either the synchronous calls or their asynchronous
+ * counterparts. The defaults for the synchronous calls fail with -ENOSYS, and
+ * the defaults for the asynchronous calls run the synchronous call and
+ * complete immediately.
  *
  * @see VFS
  * @see Syscall manpages
  */
 class Filesystem {
 public:
-  virtual int open(const char* name, int flags, int mode) = 0;
-  virtual ssize_t read(int fd, void* buf, size_t count) = 0;
-  virtual int close(int fd) = 0;
-  virtual int fstat(int fd, struct stat* buf) = 0;
-  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count) = 0;
-  virtual off_t lseek(int fd, off_t offset, int whence) = 0;
-  virtual ssize_t write(int fd, void* buf, size_t count) = 0;
-  virtual int access(const char* name, int mode) = 0;
-  virtual int stat(const char* path, struct stat *buf) = 0;
-  virtual int lstat(const char* path, struct stat *buf) = 0;
-  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize) = 0;
+  virtual ~Filesystem() {}
+
+  /**
+   * Receives the result of an asynchronous call
+   */
+  using Completion = std::function<void(ssize_t)>;
+
+  virtual int open(const char* name, int flags, int mode);
+  virtual ssize_t read(int fd, void* buf, size_t count);
+  virtual int close(int fd);
+  virtual int fstat(int fd, struct stat* buf);
+  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
+  virtual off_t lseek(int fd, off_t offset, int whence);
+  virtual ssize_t write(int fd, void* buf, size_t count);
+  virtual int access(const char* name, int mode);
+  virtual int stat(const char* path, struct stat *buf);
+  virtual int lstat(const char* path, struct stat *buf);
+  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual int unlink(const char* path);
+  virtual int mkdir(const char* path, int mode);
+  virtual int rmdir(const char* path);
+
+  /**
+   * Zero-copy read for backends that already hold file data in memory. Points
+   * @p data at the next bytes of @p fd and advances the offset as read() does,
+   * so VFS can write them straight into the sandbox.
+   *
+   * @return Number of bytes available at @p data, at most @p count, or
+   * -ENOSYS if the backend does not support this.
+   */
+  virtual ssize_t readInPlace(int fd, size_t count, const void** data);
+
+  /**
+   * Asynchronous variants of the calls above, as used by VFS. Strings are only
+   * valid for the duration of the call, while buffers stay valid until @p done
+   * has been invoked.
+   */
+  virtual void openAsync(const char* name, int flags, int mode, Completion done);
+  virtual void readAsync(int fd, void* buf, size_t count, Completion done);
+  virtual void closeAsync(int fd, Completion done);
+  virtual void fstatAsync(int fd, struct stat* buf, Completion done);
+  virtual void getdentsAsync(int fd, struct linux_dirent* dirs, unsigned int count, Completion done);
+  virtual void getdents64Async(int fd, struct linux_dirent64* dirs, unsigned int count, Completion done);
+  virtual void lseekAsync(int fd, off_t offset, int whence, Completion done);
+  virtual void writeAsync(int fd, void* buf, size_t count, Completion done);
+  virtual void accessAsync(const char* name, int mode, Completion done);
+  virtual void statAsync(const char* path, struct stat* buf, Completion done);
+  virtual void lstatAsync(const char* path, struct stat* buf, Completion done);
+  virtual void readlinkAsync(const char* path, char* buf, size_t bufsize, Completion done);
+  virtual void unlinkAsync(const char* path, Completion done);
+  virtual void mkdirAsync(const char* path, int mode, Completion done);
+  virtual void rmdirAsync(const char* path, Completion done);
+
+  /**
+   * Lexically normalizes a path into an absolute one, dropping empty and "."
+   * components and resolving ".." against the preceding component.
+   *
+   * @param path Path to normalize
+   * @return Normalized path, always starting with "/"
+   */
+  static std::string normalizePath(const std::string& path);
+
+  /**
+   * Computes the target of a seek by @p offset from @p base without
+   * overflowing, as lseek() implementations need for guest supplied offsets.
+   *
+   * @param base Current offset or file size the seek is relative to
+   * @param offset Offset requested by the guest
+   * @return New offset, -EINVAL if it would be negative or -EOVERFLOW if it
+   * does not fit in off_t
+   */
+  static off_t seekOffset(off_t base, off_t offset);
 };
 
 #endif // FILESYSTEM_H
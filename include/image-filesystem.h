@@ -0,0 +1,163 @@
+#ifndef IMAGE_FILESYSTEM_H
+#define IMAGE_FILESYSTEM_H
+
+#include "filesystem.h"
+#include "dirent-builder.h"
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Header at the start of a filesystem image. Offsets are from the start of
+ * the image file, and all integers are in host byte order.
+ */
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t inodeCount;
+  uint32_t entryCount;
+  uint32_t hashSlots;
+  uint64_t inodeTable;
+  uint64_t entryTable;
+  uint64_t hashTable;
+  uint64_t stringTable;
+  uint64_t stringTableSize;
+};
+
+/**
+ * A file, directory or symlink. Inode 0 is the root directory.
+ */
+struct ImageInode {
+  uint32_t mode;
+  /** Directories: number of entries */
+  uint32_t entryCount;
+  /** Regular files: length of the data. Symlinks: length of the target. */
+  uint64_t size;
+  /**
+   * Regular files: offset of the data. Symlinks: offset of the target in the
+   * string table. Directories: index of the first entry.
+   */
+  uint64_t offset;
+  int64_t mtime;
+};
+
+/**
+ * Directory entry. The entries of each directory are contiguous and sorted by
+ * name.
+ */
+struct ImageEntry {
+  uint32_t nameOffset;
+  uint32_t nameLength;
+  uint32_t inode;
+  uint32_t reserved;
+};
+
+/**
+ * Slot of the open-addressed path hash table
+ */
+struct ImageHashSlot {
+  uint64_t hash;
+  uint32_t pathOffset;
+  uint32_t pathLength;
+  uint32_t inode;
+  uint32_t reserved;
+};
+
+/**
+ * An immutable filesystem image, packed into a single file and mapped into
+ * memory.
+ *
+ * Paths are looked up through a hash table of full paths, directory listings
+ * are read straight from the sorted entry table and each file's data is one
+ * contiguous extent. Images are mapped once per process and shared by every
+ * ImageFilesystem that mounts them.
+ */
+class FilesystemImage {
+public:
+  using Ptr = std::shared_ptr<const FilesystemImage>;
+
+  ~FilesystemImage();
+
+  /**
+   * Maps an image, or returns the existing mapping if it is already open
+   *
+   * @param path Path of the image file
+   * @return The image, or null if it could not be opened or is invalid
+   */
+  static Ptr open(const std::string& path);
+
+  /**
+   * Packs a directory tree on the host into an image
+   *
+   * @param root Directory to pack
+   * @param imagePath Image file to write
+   * @return true on success, false otherwise. @p errno will be set on failure.
+   */
+  static bool pack(const std::string& root, const std::string& imagePath);
+
+  /**
+   * Looks up a normalized absolute path, without following symlinks
+   *
+   * @return Inode number, or a negative error number
+   */
+  int lookup(const std::string& path) const;
+
+  const ImageInode* inode(uint32_t idx) const;
+  const ImageEntry* entries(const ImageInode* dir) const;
+  const char* string(uint64_t offset, uint64_t length) const;
+  const char* data(const ImageInode* file) const;
+
+private:
+  FilesystemImage(const char* base, size_t size);
+  bool validate() const;
+
+  const char* m_base;
+  size_t m_size;
+  const ImageHeader* m_header;
+};
+
+/**
+ * A read-only filesystem served from a FilesystemImage
+ */
+class ImageFilesystem : public Filesystem {
+public:
+  /**
+   * Constructor
+   *
+   * @param image Image to serve files from
+   */
+  ImageFilesystem(FilesystemImage::Ptr image);
+
+  virtual int open(const char* name, int flags, int mode);
+  virtual ssize_t read(int fd, void* buf, size_t count);
+  virtual int close(int fd);
+  virtual int fstat(int fd, struct stat* buf);
+  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
+  virtual off_t lseek(int fd, off_t offset, int whence);
+  virtual ssize_t write(int fd, void* buf, size_t count);
+  virtual int access(const char* name, int mode);
+  virtual int stat(const char* path, struct stat* buf);
+  virtual int lstat(const char* path, struct stat* buf);
+  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual ssize_t readInPlace(int fd, size_t count, const void** data);
+
+private:
+  struct OpenFile {
+    uint32_t inode;
+    off_t offset;
+    bool used;
+  };
+
+  OpenFile* getOpenFile(int fd);
+  int resolve(const char* path, bool follow) const;
+  void fillStat(uint32_t idx, struct stat* buf) const;
+  int readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format);
+
+  FilesystemImage::Ptr m_image;
+  std::vector<OpenFile> m_openFiles;
+  std::vector<int> m_freeFDs;
+};
+
+#endif // IMAGE_FILESYSTEM_H
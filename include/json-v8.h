@@ -0,0 +1,53 @@
+#ifndef JSON_V8_H
+#define JSON_V8_H
+
+#include "json.h"
+#include <v8.h>
+
+/**
+ * Converts JsonNode trees to and from V8 values directly, without going
+ * through JSON text and the JS JSON object.
+ */
+class JsonV8 {
+public:
+  /**
+   * Maximum nesting depth accepted by toValue() and fromValue()
+   */
+  static const int maxDepth = 512;
+
+  /**
+   * Builds the V8 value for a JsonNode tree
+   *
+   * @param node Node to convert. Null is converted to undefined.
+   * @return The value, or an empty handle if @p node is nested deeper than
+   * maxDepth
+   */
+  static v8::Handle<v8::Value> toValue(const JsonNode* node);
+
+  /**
+   * Builds a JsonNode tree from a V8 value, following the rules of
+   * JSON.stringify(): toJSON() is honoured, undefined and function members are
+   * dropped from objects and become null in arrays, and non-finite numbers
+   * become null.
+   *
+   * @return A new tree that must be freed with json_delete(), or null if
+   * @p value has no JSON representation, is nested deeper than maxDepth or a
+   * toJSON() or getter threw
+   */
+  static JsonNode* fromValue(v8::Handle<v8::Value> value);
+
+  /**
+   * Same as fromValue() above, but tells a value that JSON.stringify() skips,
+   * such as undefined, apart from one that cannot be converted
+   *
+   * @param node Set to the new tree, or to null for a skipped value
+   * @return false if @p value cannot be converted
+   */
+  static bool fromValue(v8::Handle<v8::Value> value, JsonNode** node);
+
+private:
+  static v8::Handle<v8::Value> toValue(const JsonNode* node, int depth);
+  static bool fromValue(v8::Handle<v8::Value> value, int depth, JsonNode** node);
+};
+
+#endif // JSON_V8_H
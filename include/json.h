@@ -27,6 +27,10 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum {
 	JSON_NULL,
 	JSON_BOOL,
@@ -37,6 +41,8 @@ typedef enum {
 } JsonTag;
 
 typedef struct JsonNode JsonNode;
+typedef struct JsonArena JsonArena;
+typedef struct JsonIndex JsonIndex;
 
 struct JsonNode
 {
@@ -45,9 +51,14 @@ struct JsonNode
 	JsonNode *prev, *next;
 	
 	/* only if parent is an object (NULL otherwise) */
-	char *key; /* Must be valid UTF-8. */
+	char *key; /* Must be valid UTF-8. Allocated from the parent's arena.
+	              Must not be changed while the node is in an object. */
 	
 	JsonTag tag;
+	
+	/* Allocated, along with its string, from an arena that frees it */
+	bool in_arena;
+	
 	union {
 		/* JSON_BOOL */
 		bool bool_;
@@ -62,6 +73,11 @@ struct JsonNode
 		/* JSON_OBJECT */
 		struct {
 			JsonNode *head, *tail;
+			
+			/* JSON_OBJECT: the arena of its keys and hash index of its
+			   members, built by json_find_member() once objects get large
+			   (NULL for a heap object that has not been indexed) */
+			JsonIndex *index;
 		} children;
 	};
 };
@@ -72,10 +88,79 @@ JsonNode   *json_decode         (const char *json);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
+
+/*
+ * Like json_encode(), but starts with room for @size_hint bytes and stores the
+ * length of the result in @len (unless @len is NULL).
+ */
+char       *json_encode_n       (const JsonNode *node, size_t size_hint, size_t *len);
+
+/*
+ * Encodes @node after the first @len bytes of @*buf, a malloc'd buffer of
+ * @*cap bytes (or NULL), which is grown with realloc() as needed. Returns the
+ * new length. The encoding is followed by a NUL, which is not counted.
+ */
+size_t      json_encode_append  (const JsonNode *node, char **buf, size_t *cap, size_t len);
 void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
 
+/*** Streaming decoding ***/
+
+/*
+ * Incremental parser. Input is fed in pieces of any size, split anywhere, and
+ * each value is reported as soon as it is complete, so the whole document
+ * never has to be held in memory at once.
+ */
+typedef struct JsonParser JsonParser;
+
+/* Nesting deeper than this is rejected, as it is by the CBOR decoder. */
+#define JSON_PARSER_MAX_DEPTH 512
+
+/*
+ * SAX-style callbacks. Strings are NUL-terminated, valid UTF-8 and only valid
+ * during the call. Returning false stops the parse with an error.
+ */
+typedef struct {
+	bool (*null_value)   (void *ctx);
+	bool (*bool_value)   (void *ctx, bool b);
+	bool (*number_value) (void *ctx, double n);
+	bool (*string_value) (void *ctx, const char *str, size_t len);
+	bool (*start_array)  (void *ctx);
+	bool (*end_array)    (void *ctx);
+	bool (*start_object) (void *ctx);
+	bool (*object_key)   (void *ctx, const char *key, size_t len);
+	bool (*end_object)   (void *ctx);
+} JsonCallbacks;
+
+JsonParser *json_parser_new       (const JsonCallbacks *callbacks, void *ctx);
+JsonParser *json_parser_new_tree  (void);
+bool        json_parser_feed      (JsonParser *parser, const char *data, size_t len);
+bool        json_parser_finish    (JsonParser *parser);
+JsonNode   *json_parser_take_root (JsonParser *parser);
+void        json_parser_free      (JsonParser *parser);
+
+/*** Arena allocation ***/
+
+/*
+ * An arena hands out the nodes, keys and strings of a tree from a few large
+ * blocks, and releases them all at once. json_delete() on an arena node only
+ * detaches it; the memory goes away with json_arena_free(). A tree built in an
+ * arena must only contain nodes from that same arena.
+ */
+JsonArena  *json_arena_new          (void);
+void        json_arena_free         (JsonArena *arena);
+
+JsonNode   *json_decode_in          (const char *json, JsonArena *arena);
+JsonParser *json_parser_new_tree_in (JsonArena *arena);
+
+JsonNode *json_mknull_in(JsonArena *arena);
+JsonNode *json_mkbool_in(JsonArena *arena, bool b);
+JsonNode *json_mkstring_in(JsonArena *arena, const char *s, size_t len);
+JsonNode *json_mknumber_in(JsonArena *arena, double n);
+JsonNode *json_mkarray_in(JsonArena *arena);
+JsonNode *json_mkobject_in(JsonArena *arena);
+
 /*** Lookup and traversal ***/
 
 JsonNode   *json_find_element   (JsonNode *array, int index);
@@ -100,6 +185,7 @@ JsonNode *json_mkobject(void);
 void json_append_element(JsonNode *array, JsonNode *element);
 void json_prepend_element(JsonNode *array, JsonNode *element);
 void json_append_member(JsonNode *object, const char *key, JsonNode *value);
+void json_append_member_n(JsonNode *object, const char *key, size_t len, JsonNode *value);
 void json_prepend_member(JsonNode *object, const char *key, JsonNode *value);
 
 void json_remove_from_parent(JsonNode *node);
@@ -114,4 +200,8 @@ void json_remove_from_parent(JsonNode *node);
  */
 bool json_check(const JsonNode *node, char errmsg[256]);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
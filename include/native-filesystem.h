@@ -2,11 +2,41 @@
 #define NATIVE_FILESYSTEM_H
 
 #include "filesystem.h"
+#include <list>
+#include <memory>
 #include <string>
 #include <map>
 
+/**
+ * A directory descriptor that is closed once the last reference to it is
+ * dropped
+ */
+class DirectoryFD {
+public:
+  using Ptr = std::shared_ptr<DirectoryFD>;
+
+  explicit DirectoryFD(int fd) : m_fd (fd) {}
+  ~DirectoryFD();
+
+  int fd() const {return m_fd;}
+
+private:
+  DirectoryFD(const DirectoryFD&) = delete;
+  DirectoryFD& operator=(const DirectoryFD&) = delete;
+
+  int m_fd;
+};
+
 /**
  * A filesystem that directly interacts with the host's local filesystem
+ *
+ * Every lookup is made relative to a descriptor for the root and is confined
+ * beneath it with openat2(RESOLVE_BENEATH), so neither ".." nor symlinks can
+ * reach outside the root. Kernels without openat2() get the same confinement
+ * by walking the path one component at a time. Descriptors for recently used
+ * directories are cached, so lookups in deep trees start from their parent
+ * directory instead of walking the whole path again. The cache is dropped
+ * whenever the tree is modified.
  */
 class NativeFilesystem : public Filesystem {
 public:
@@ -16,21 +46,54 @@ public:
    * @param root Root of this filesystem
    */
   NativeFilesystem(const std::string& root);
+  ~NativeFilesystem();
+
   virtual int open(const char* name, int flags, int mode);
   virtual ssize_t read(int fd, void* buf, size_t count);
   virtual int close(int fd);
   virtual int fstat(int fd, struct stat* buf);
   virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
   virtual off_t lseek(int fd, off_t offset, int whence);
   virtual ssize_t write(int fd, void* buf, size_t count);
   virtual int access(const char* name, int mode);
   virtual int stat(const char* path, struct stat* buf);
   virtual int lstat(const char* path, struct stat* buf);
   virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual int unlink(const char* path);
+  virtual int mkdir(const char* path, int mode);
+  virtual int rmdir(const char* path);
+
+  /**
+   * Most directory descriptors kept open by the lookup cache
+   */
+  static constexpr size_t maxCachedDirs = 64;
+
+  /**
+   * Most symlinks followed in a single lookup
+   */
+  static constexpr int maxSymlinks = 40;
+
+protected:
+  int openBeneath(int dirFD, const std::string& path, int flags, int mode);
+  int openWalk(int dirFD, const std::string& path, int flags, int mode);
+  int openPath(const char* name, int flags, int mode);
+  int lookupParent(const char* name, std::string& leaf, DirectoryFD::Ptr* hold = nullptr);
+  void invalidateDirectories();
 
-private:
   std::string m_root;
-  std::map<int, std::string> m_openFiles;
+  int m_rootFD;
+
+private:
+  struct CachedDir {
+    DirectoryFD::Ptr dir;
+    /** Position in m_dirLRU */
+    std::list<std::string>::iterator lru;
+  };
+
+  std::map<std::string, CachedDir> m_dirFDs;
+  /** Cached directories, most recently used first */
+  std::list<std::string> m_dirLRU;
 };
 
 #endif // NATIVE_FILESYSTEM_H
@@ -7,6 +7,10 @@
 
 class NodeSandbox;
 
+/**
+ * A filesystem that forwards every call to the sandbox's onVFS() handler in
+ * JS. Calls complete asynchronously once JS calls finishVFS().
+ */
 class CodiusNodeFilesystem : public Filesystem {
 public:
   CodiusNodeFilesystem(NodeSandbox* sbox);
@@ -16,23 +20,71 @@ public:
     v8::Handle<v8::Value> result;
   };
 
-  VFSResult doVFS(const std::string& name, v8::Handle<v8::Value> argv[], int argc);
+  using VFSCallback = std::function<void(const VFSResult&)>;
 
-  int open(const char* name, int flags, int mode) override;
-  ssize_t read(int fd, void* buf, size_t count) override;
-  int close (int fd) override;
-  int fstat (int fd, struct stat* buf) override;
-  int getdents (int fd, struct linux_dirent* dirs, unsigned int count) override;
-  off_t lseek (int fd, off_t offset, int whence) override;
-  ssize_t write(int fd, void* buf, size_t count) override;
-  int access (const char* name, int mode) override;
-  int stat (const char* name, struct stat* buf) override;
-  int lstat (const char* name, struct stat* buf) override;
-  ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  /**
+   * Layout of the Float64Array that JS returns stat, lstat and fstat results
+   * in. Times are in seconds since the epoch and may have a fractional part.
+   */
+  enum StatField {
+    StatDev,
+    StatIno,
+    StatMode,
+    StatNlink,
+    StatUid,
+    StatGid,
+    StatRdev,
+    StatSize,
+    StatBlksize,
+    StatBlocks,
+    StatAtime,
+    StatMtime,
+    StatCtime,
+    StatFieldCount
+  };
+
+  /**
+   * Descriptors returned by JS must be below this, or the open fails with EIO
+   */
+  static constexpr int maxFDs = 4096;
+
+  void doVFS(const std::string& name, v8::Handle<v8::Value> argv[], int argc, VFSCallback callback);
+
+  void openAsync(const char* name, int flags, int mode, Completion done) override;
+  void readAsync(int fd, void* buf, size_t count, Completion done) override;
+  void closeAsync(int fd, Completion done) override;
+  void fstatAsync(int fd, struct stat* buf, Completion done) override;
+  void getdentsAsync(int fd, struct linux_dirent* dirs, unsigned int count, Completion done) override;
+  void getdents64Async(int fd, struct linux_dirent64* dirs, unsigned int count, Completion done) override;
+  void lseekAsync(int fd, off_t offset, int whence, Completion done) override;
+  void writeAsync(int fd, void* buf, size_t count, Completion done) override;
+  void accessAsync(const char* name, int mode, Completion done) override;
+  void statAsync(const char* name, struct stat* buf, Completion done) override;
+  void lstatAsync(const char* name, struct stat* buf, Completion done) override;
+  void readlinkAsync(const char* path, char* buf, size_t bufsize, Completion done) override;
 
 private:
+  /**
+   * State kept natively for each descriptor opened through JS
+   */
+  struct OpenFile {
+    off_t offset;
+    /** Size last reported by JS or extended by writes, or -1 if unknown */
+    off_t size;
+    int flags;
+    bool directory;
+    DirentCursor cursor;
+    bool used;
+  };
+
+  OpenFile* getOpenFile(int fd);
+  void statCall(const char* op, v8::Handle<v8::Value> arg, struct stat* buf, Completion done);
+  void withSize(int fd, std::function<void(int)> next);
+  void readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format, Completion done);
+
   NodeSandbox* m_sbox;
-  std::map<int, int> m_offsets;
+  /** Indexed by the descriptors JS hands out, which are small integers */
+  std::vector<OpenFile> m_files;
 };
 
 #endif // NODE_FILESYSTEM_H
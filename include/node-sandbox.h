@@ -2,10 +2,11 @@
 #define NODE_SANDBOX_H
 
 #include "sandbox.h"
+#include "token-pool.h"
 #include <node.h>
 #include <memory>
 #include <vector>
-#include <future>
+#include <functional>
 
 class NodeSandbox;
 
@@ -21,17 +22,23 @@ class SandboxWrapper : public node::ObjectWrap {
 class NodeSandbox : public Sandbox {
 public:
   NodeSandbox(SandboxWrapper* _wrap);
+  ~NodeSandbox();
 
   std::vector<char> mapFilename(std::vector<char> fname);
   void emitEvent(const std::string& name, std::vector<v8::Handle<v8::Value> >& argv);
   SyscallCall mapFilename(const SyscallCall& call);
   SyscallCall handleSyscall(const SyscallCall &call) override;
 
-  using VFSPromise = std::promise<v8::Persistent<v8::Value> >;
-  using VFSFuture = std::shared_future<v8::Persistent<v8::Value> >;
-  VFSFuture doVFS(const std::string& name, v8::Handle<v8::Value> argv[], int argc);
+  using VFSCallback = std::function<void(v8::Handle<v8::Value>)>;
+
+  /**
+   * Calls onVFS() in JS. @p callback runs with the result once JS calls
+   * finishVFS(), without blocking the event loop in the meantime.
+   */
+  void doVFS(const std::string& name, v8::Handle<v8::Value> argv[], int argc, VFSCallback callback);
 
   void handleIPC(codius_request_t* request) override;
+  void handleIPCClosed(SandboxIPC& ipc) override;
   void handleExit(int status) override;
   void launchDebugger();
   void handleSignal(int signal) override;
@@ -40,8 +47,14 @@ public:
 
 private:
     bool m_debuggerOnCrash;
+    TokenPool<VFSCallback> m_vfsCallbacks;
+    TokenPool<codius_request_t*> m_ipcRequests;
+    void replyError(codius_request_t* request, const char* message);
     static v8::Handle<v8::Value> node_spawn(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_kill(const v8::Arguments& args);
+#ifdef CODIUS_TEST_HOOKS
+    static v8::Handle<v8::Value> node_json_round_trip(const v8::Arguments& args);
+#endif
     static v8::Handle<v8::Value> node_finish_ipc(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_finish_vfs(const v8::Arguments& args);
     static v8::Handle<v8::Value> node_new(const v8::Arguments& args);
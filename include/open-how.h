@@ -0,0 +1,23 @@
+#ifndef OPEN_HOW_H
+#define OPEN_HOW_H
+
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+/**
+ * Layout of struct open_how, for systems without linux/openat2.h
+ */
+struct OpenHow {
+  uint64_t flags;
+  uint64_t mode;
+  uint64_t resolve;
+};
+
+static const uint64_t resolveNoMagicLinks = 0x02;
+static const uint64_t resolveBeneath = 0x08;
+
+#endif // OPEN_HOW_H
@@ -0,0 +1,105 @@
+#ifndef OVERLAY_FILESYSTEM_H
+#define OVERLAY_FILESYSTEM_H
+
+#include "filesystem.h"
+#include "dirent-builder.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * A copy-on-write filesystem that layers a private, in-memory upper layer over
+ * a read-only lower Filesystem.
+ *
+ * Reads of unmodified files go straight to the lower layer, which can be
+ * shared by many sandboxes. A file is copied into the upper layer the first
+ * time it is written to, or replaced there by an empty one when it is opened
+ * with O_TRUNC. Deleting a file that exists in the lower layer leaves a
+ * whiteout that hides it. A directory created where a lower one
+ * was removed is opaque, so the lower directory's entries stay hidden.
+ *
+ * The lower layer is only ever called through its synchronous calls, so it
+ * must implement them; NativeFilesystem, ImageFilesystem and BlobFilesystem
+ * all do.
+ */
+class OverlayFilesystem : public Filesystem {
+public:
+  /**
+   * Constructor
+   *
+   * @param lower Read-only layer to serve unmodified files from
+   * @param quota Most bytes of file data the upper layer may hold
+   */
+  OverlayFilesystem(std::shared_ptr<Filesystem> lower, size_t quota);
+
+  virtual int open(const char* name, int flags, int mode);
+  virtual ssize_t read(int fd, void* buf, size_t count);
+  virtual int close(int fd);
+  virtual int fstat(int fd, struct stat* buf);
+  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
+  virtual off_t lseek(int fd, off_t offset, int whence);
+  virtual ssize_t write(int fd, void* buf, size_t count);
+  virtual int access(const char* name, int mode);
+  virtual int stat(const char* path, struct stat* buf);
+  virtual int lstat(const char* path, struct stat* buf);
+  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual int unlink(const char* path);
+  virtual int mkdir(const char* path, int mode);
+  virtual int rmdir(const char* path);
+  virtual ssize_t readInPlace(int fd, size_t count, const void** data);
+
+  /**
+   * Number of bytes held by files in the upper layer, including deleted files
+   * that are still open
+   */
+  size_t upperSize() const;
+
+private:
+  struct UpperNode {
+    uint64_t inode;
+    int mode;
+    bool opaque;
+    time_t mtime;
+    std::vector<char> data;
+  };
+
+  struct OpenFile {
+    std::string path;
+    /** Set for files and directories in the upper layer */
+    std::shared_ptr<UpperNode> upper;
+    /** Descriptor in the lower layer, or -1 */
+    int lowerFD;
+    int flags;
+    off_t offset;
+    DirentCursor cursor;
+    bool used;
+  };
+
+  OpenFile* getOpenFile(int fd);
+  bool isHidden(const std::string& path) const;
+  std::shared_ptr<UpperNode> findUpper(const std::string& path) const;
+  int lowerStat(const std::string& path, struct stat* buf, bool follow) const;
+  int mergedStat(const std::string& path, struct stat* buf, bool follow) const;
+  int checkParent(const std::string& path) const;
+  int copyUp(OpenFile& file);
+  std::shared_ptr<UpperNode> makeUpper(const std::string& path, int mode);
+  void release(std::shared_ptr<UpperNode>& node);
+  int listDirectory(const std::string& path, std::vector<DirentCursor::Entry>& entries) const;
+  void fillStat(const UpperNode& node, struct stat* buf) const;
+  int readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format);
+
+  std::shared_ptr<Filesystem> m_lower;
+  std::map<std::string, std::shared_ptr<UpperNode> > m_upper;
+  std::set<std::string> m_whiteouts;
+  std::vector<OpenFile> m_openFiles;
+  std::vector<int> m_freeFDs;
+  uint64_t m_nextInode;
+  size_t m_quota;
+  size_t m_used;
+};
+
+#endif // OVERLAY_FILESYSTEM_H
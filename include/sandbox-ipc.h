@@ -6,6 +6,9 @@
 
 #include <uv.h>
 #include <memory>
+#include <vector>
+
+#include "codius-util.h"
 
 class SandboxIPC;
 
@@ -23,7 +26,7 @@ public:
    * @param _dupAs File descriptor that will be exposed within the sandbox
    */
   SandboxIPC(int _dupAs);
-  ~SandboxIPC();
+  virtual ~SandboxIPC();
 
   using Ptr = std::unique_ptr<SandboxIPC>;
 
@@ -31,7 +34,32 @@ public:
    * calls dup2(child, dupAs), resulting in the descriptor referred to by @p dupAs
    * now pointing to @p child.
    */
-  bool dup();
+  virtual bool dup();
+
+  /**
+   * Descriptors that dup() binds inside the sandbox, which must stay open
+   */
+  virtual std::vector<int> childFDs() const;
+
+  /**
+   * Reads the next request sent out of the sandbox
+   *
+   * @return A new request, or NULL. errno is EAGAIN if there was nothing
+   * left to read, or only part of a request so far.
+   */
+  virtual codius_request_t* readRequest();
+
+  /**
+   * Checks whether another request can be read without waiting for the
+   * channel to poll as readable again
+   */
+  virtual bool hasBufferedRequest();
+
+  /**
+   * Checks whether @p request was read from this channel, and would be
+   * replied to through it
+   */
+  virtual bool owns(const codius_request_t* request) const;
 
   /**
    * Attaches the parent side of the IPC channel to the libuv event loop
@@ -45,6 +73,24 @@ public:
    */
   bool stopPoll();
 
+  /**
+   * Stops serving a channel whose guest sent something unreadable. The guest
+   * sees the channel closed; the descriptors stay open until destruction.
+   */
+  virtual void disconnect();
+
+  /**
+   * Called once a reply has been queued for this channel. Queued replies are
+   * written when the channel polls writable, so those finished during one
+   * loop iteration go out together and a full socket never blocks the loop.
+   */
+  virtual void replyQueued();
+
+  /**
+   * Writes as many queued replies as the channel takes right now
+   */
+  virtual void flushReplies();
+
   uv_poll_t poll;
 
   /**
@@ -67,8 +113,24 @@ public:
    */
   virtual void onReadReady() = 0;
 
+protected:
+  /**
+   * Constructor for channels that bring their own descriptors
+   *
+   * @param _dupAs File descriptor that will be exposed within the sandbox
+   * @param _parent Descriptor polled outside the sandbox. Owned from then on.
+   * @param _child Descriptor to bind as @p _dupAs, or -1. Owned from then on.
+   */
+  SandboxIPC(int _dupAs, int _parent, int _child);
+
 private:
+  void watchWritable(bool writable);
   static void cb_forward (uv_poll_t* req, int status, int events);
+
+  /**
+   * Events being polled for, or 0 while the channel is not polled
+   */
+  int m_events;
 };
 
 /**
@@ -90,9 +152,57 @@ public:
   void setCallback(SandboxIPCCallback cb, void* user_data);
 
   using Ptr = std::unique_ptr<CallbackIPC>;
+
+protected:
+  CallbackIPC (int dupAs, int parent, int child);
+
 private:
   SandboxIPCCallback m_cb;
   void* m_cb_data;
 };
 
+/**
+ * A @p CallbackIPC that carries requests and results through a pair of shared
+ * memory rings instead of a socket. Inside the sandbox the memory is bound as
+ * @p dupAs, the host's doorbell as @p dupAs + 1 and the guest's doorbell as
+ * @p dupAs + 2; see codius_shm_attach().
+ *
+ * Neither side makes a syscall for a message unless the other is asleep, so
+ * busy sandboxes exchange requests at memory speed.
+ */
+class ShmIPC : public CallbackIPC {
+public:
+  /**
+   * Constructor
+   *
+   * @param shm Host end of a channel from codius_shm_create(). Owned from
+   * then on.
+   * @param dupAs First of the three descriptors exposed within the sandbox
+   * @param doorbell Copy of the host's doorbell to poll. Owned from then on.
+   */
+  ShmIPC (codius_shm_t* shm, int dupAs, int doorbell);
+  ~ShmIPC();
+
+  /**
+   * Creates a channel with the default ring size
+   *
+   * @return The channel, or an empty pointer if shared memory is unavailable
+   */
+  static std::unique_ptr<ShmIPC> create (int dupAs);
+
+  bool dup() override;
+  std::vector<int> childFDs() const override;
+  codius_request_t* readRequest() override;
+  bool hasBufferedRequest() override;
+  bool owns(const codius_request_t* request) const override;
+  void onReadReady() override;
+  void disconnect() override;
+  void replyQueued() override;
+
+  using Ptr = std::unique_ptr<ShmIPC>;
+
+private:
+  codius_shm_t* m_shm;
+};
+
 #endif // CODIUS_SANDBOX_IPC_H
@@ -39,8 +39,8 @@ class Sandbox {
      */
     class SyscallCall {
       public:
-        SyscallCall () : id(-1), pid(-1) {}
-        SyscallCall (pid_t pid) : id(-1), pid(pid) {}
+        SyscallCall () : id(-1), pid(-1), deferred(false) {}
+        SyscallCall (pid_t pid) : id(-1), pid(pid), deferred(false) {}
 
         /**
          * Syscall number
@@ -55,6 +55,13 @@ class Sandbox {
         Word returnVal;
 
         pid_t pid;
+
+        /**
+         * Set by a handler that cannot finish the call right away. The calling
+         * thread stays stopped until resumeSyscall() is called with the
+         * completed call.
+         */
+        bool deferred;
     };
 
     /**
@@ -66,6 +73,15 @@ class Sandbox {
      */
     virtual SyscallCall handleSyscall(const SyscallCall &call) = 0;
 
+    /**
+     * Finishes a call that was previously deferred by a handler, writing its
+     * arguments and return value back to the stopped thread and letting it
+     * continue.
+     *
+     * @param call Completed call
+     */
+    void resumeSyscall(const SyscallCall& call);
+
     /**
      * Called when an IPC request from within the sandbox is generated.
      *
@@ -74,6 +90,15 @@ class Sandbox {
      */
     virtual void handleIPC(codius_request_t*) = 0;
 
+    /**
+     * Called before an IPC channel is torn down. Requests read from it that
+     * are still unanswered must be freed, and never replied to.
+     *
+     * @param ipc Channel that is going away
+     * @see SandboxIPC::owns()
+     */
+    virtual void handleIPCClosed(SandboxIPC& ipc) {}
+
     /**
      * Called when the sandboxed child receives a signal.
      *
@@ -95,6 +120,26 @@ class Sandbox {
      */
     void addIPC(std::unique_ptr<SandboxIPC>&& ipc);
 
+    /**
+     * Queues a reply to @p request on the channel it was read from. A guest
+     * that leaves too many replies unread is disconnected rather than waited
+     * on.
+     *
+     * @param request Request that is being replied to
+     * @param result Response, which may be freed once this returns
+     * @return 0 on success, -1 if the reply was dropped. errno is EBADF if
+     * the request's channel is gone.
+     * @see SandboxIPC::replyQueued()
+     */
+    int queueReply(codius_request_t* request, codius_result_t* result);
+
+    /**
+     * Also offers the guest the shared memory IPC channel on fds 4 to 6.
+     * Off by default, since the channel costs a memfd and two eventfds.
+     * Must be called before spawn().
+     */
+    void enableSharedMemoryIPC();
+
     /**
      * Read a word of the child process' memory
      *
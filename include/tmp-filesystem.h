@@ -0,0 +1,122 @@
+#ifndef TMP_FILESYSTEM_H
+#define TMP_FILESYSTEM_H
+
+#include "filesystem.h"
+#include "dirent-builder.h"
+#include "arena.h"
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+/**
+ * A writable filesystem held entirely in memory, for use as scratch space such
+ * as /tmp
+ *
+ * Inodes, directory entries and file data all come from a single Arena. Data
+ * is stored in fixed-size chunks, so files grow without being copied and holes
+ * take no space. Freed inodes, entries and chunks are recycled through free
+ * lists, and everything is released at once when the filesystem is destroyed.
+ */
+class TmpFilesystem : public Filesystem {
+public:
+  /**
+   * Size of each chunk of file data
+   */
+  static constexpr size_t chunkSize = 4096;
+
+  /**
+   * Largest size a file may grow to. Offsets are kept below it, so the size
+   * of a file's chunk table never overflows.
+   */
+  static constexpr off_t maxFileSize = static_cast<off_t>(1) << 40;
+
+  /**
+   * Constructor
+   *
+   * @param quota Most bytes of memory the filesystem may use, including its
+   * own bookkeeping
+   */
+  TmpFilesystem(size_t quota);
+
+  virtual int open(const char* name, int flags, int mode);
+  virtual ssize_t read(int fd, void* buf, size_t count);
+  virtual int close(int fd);
+  virtual int fstat(int fd, struct stat* buf);
+  virtual int getdents(int fd, struct linux_dirent* dirs, unsigned int count);
+  virtual int getdents64(int fd, struct linux_dirent64* dirs, unsigned int count);
+  virtual off_t lseek(int fd, off_t offset, int whence);
+  virtual ssize_t write(int fd, void* buf, size_t count);
+  virtual int access(const char* name, int mode);
+  virtual int stat(const char* path, struct stat* buf);
+  virtual int lstat(const char* path, struct stat* buf);
+  virtual ssize_t readlink(const char* path, char* buf, size_t bufsize);
+  virtual int unlink(const char* path);
+  virtual int mkdir(const char* path, int mode);
+  virtual int rmdir(const char* path);
+  virtual ssize_t readInPlace(int fd, size_t count, const void** data);
+
+  /**
+   * Bytes of memory reserved so far
+   */
+  size_t used() const;
+
+private:
+  struct Entry;
+
+  struct Inode {
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t links;
+    uint32_t openCount;
+    time_t mtime;
+    /** Files: length of the data */
+    uint64_t size;
+    /** Files: table of chunks, with null for holes */
+    char** chunks;
+    size_t chunkCapacity;
+    /** Directories: entries, in creation order */
+    Entry* entries;
+    Inode* parent;
+    Inode* nextFree;
+  };
+
+  struct Entry {
+    Entry* next;
+    Inode* inode;
+    size_t nameCapacity;
+    size_t nameLength;
+    char* name;
+  };
+
+  struct OpenFile {
+    Inode* inode;
+    off_t offset;
+    int flags;
+    DirentCursor cursor;
+    bool used;
+  };
+
+  OpenFile* getOpenFile(int fd);
+  int resolve(const char* path, Inode** parent, Inode** node, std::string* name);
+  Entry* findEntry(Inode* dir, const std::string& name, Entry*** link);
+  Inode* allocInode(uint32_t mode);
+  void releaseInode(Inode* node);
+  Entry* allocEntry(const std::string& name);
+  void releaseEntry(Entry* entry);
+  char* allocChunk();
+  void truncate(Inode* node, uint64_t size);
+  int link(Inode* dir, const std::string& name, uint32_t mode, Inode** node);
+  void fillStat(const Inode* node, struct stat* buf) const;
+  int readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format);
+
+  Arena m_arena;
+  Inode* m_root;
+  Inode* m_freeInodes;
+  std::vector<Entry*> m_freeEntries;
+  char* m_freeChunks;
+  uint64_t m_nextIno;
+  std::vector<OpenFile> m_openFiles;
+  std::vector<int> m_freeFDs;
+};
+
+#endif // TMP_FILESYSTEM_H
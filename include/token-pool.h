@@ -0,0 +1,164 @@
+#ifndef TOKEN_POOL_H
+#define TOKEN_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <utility>
+
+/**
+ * Pool of completion tokens that are handed out to JS in place of raw
+ * pointers.
+ *
+ * Released slots are recycled through a free list, so acquire() and release()
+ * are O(1) and the pool only ever grows to the largest number of tokens that
+ * were in flight at the same time. Every token carries the generation of its
+ * slot, so a token that was already released, or one that was never handed
+ * out, is rejected instead of reaching a recycled slot.
+ *
+ * Tokens stay below 2^53, so they survive a round trip through a JS number.
+ *
+ * Slots are allocated through @p Allocator.
+ */
+template<typename T, typename Allocator = std::allocator<T>>
+class TokenPool {
+public:
+  using Token = uint64_t;
+
+  /**
+   * Never returned by acquire()
+   */
+  static constexpr Token invalidToken = 0;
+
+  TokenPool() : m_freeHead (noSlot), m_used (0) {}
+
+  /**
+   * Stores @p value in a free slot
+   *
+   * @param value Value to store
+   * @return Token that identifies the slot until it is released
+   */
+  Token acquire(T value)
+  {
+    uint32_t idx;
+    if (m_freeHead != noSlot) {
+      idx = m_freeHead;
+      m_freeHead = m_slots[idx].nextFree;
+    } else {
+      idx = m_slots.size();
+      m_slots.push_back (Slot());
+    }
+
+    Slot& slot = m_slots[idx];
+    slot.value = std::move (value);
+    slot.used = true;
+    m_used++;
+    return static_cast<Token>(slot.generation) << indexBits | idx;
+  }
+
+  /**
+   * Returns the value stored for @p token and frees its slot
+   *
+   * @param token Token previously returned by acquire()
+   * @param value Set to the stored value
+   * @return true on success, false if @p token is not live
+   */
+  bool release(Token token, T& value)
+  {
+    Slot* slot = find (token);
+    if (!slot)
+      return false;
+
+    value = std::move (slot->value);
+    slot->value = T();
+    slot->used = false;
+    slot->generation = slot->generation % maxGeneration + 1;
+    slot->nextFree = m_freeHead;
+    m_freeHead = token & indexMask;
+    m_used--;
+    return true;
+  }
+
+  /**
+   * Looks up the value stored for a live token
+   *
+   * @return Pointer to the value, or null if @p token is not live
+   */
+  T* get(Token token)
+  {
+    Slot* slot = find (token);
+    return slot ? &slot->value : nullptr;
+  }
+
+  /**
+   * Releases every live token whose value satisfies @p pred
+   *
+   * @param pred Called with each stored value
+   * @return The values that were released
+   */
+  template<typename Predicate>
+  std::vector<T> releaseIf(Predicate pred)
+  {
+    std::vector<T> released;
+    T value;
+    for (uint32_t idx = 0; idx < m_slots.size(); idx++) {
+      if (m_slots[idx].used && pred (const_cast<const T&>(m_slots[idx].value))) {
+        release (static_cast<Token>(m_slots[idx].generation) << indexBits | idx, value);
+        released.push_back (std::move (value));
+      }
+    }
+    return released;
+  }
+
+  /**
+   * Releases every live token, so none of them is accepted again
+   *
+   * @return The values that were released
+   */
+  std::vector<T> clear()
+  {
+    return releaseIf ([] (const T&) {return true;});
+  }
+
+  /**
+   * Number of live tokens
+   */
+  size_t size() const {return m_used;}
+
+  /**
+   * Number of slots allocated, live or free
+   */
+  size_t capacity() const {return m_slots.size();}
+
+private:
+  static constexpr unsigned indexBits = 32;
+  static constexpr Token indexMask = 0xffffffff;
+  static constexpr uint32_t maxGeneration = (1 << 21) - 1;
+  static constexpr uint32_t noSlot = 0xffffffff;
+
+  struct Slot {
+    Slot() : value(), generation (1), nextFree (noSlot), used (false) {}
+    T value;
+    uint32_t generation;
+    uint32_t nextFree;
+    bool used;
+  };
+
+  Slot* find(Token token)
+  {
+    Token idx = token & indexMask;
+    if (idx >= m_slots.size())
+      return nullptr;
+    Slot& slot = m_slots[idx];
+    if (!slot.used || slot.generation != token >> indexBits)
+      return nullptr;
+    return &slot;
+  }
+
+  std::vector<Slot, typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>> m_slots;
+  uint32_t m_freeHead;
+  size_t m_used;
+};
+
+#endif // TOKEN_POOL_H
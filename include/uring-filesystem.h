@@ -0,0 +1,109 @@
+#ifndef URING_FILESYSTEM_H
+#define URING_FILESYSTEM_H
+
+#include "native-filesystem.h"
+#include "token-pool.h"
+#include <uv.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * A NativeFilesystem whose open, read, write, stat, fstat and close calls are
+ * submitted to an io_uring instead of blocking the event loop.
+ *
+ * Each asynchronous call completes once its completion is reaped, either from
+ * a libuv loop or by calling reap() directly. The first call submitted starts
+ * polling the default loop, which is the one Sandbox runs on, unless
+ * startPoll() already chose another. The poll only keeps the loop alive
+ * while calls are in flight. Lookups are
+ * still confined beneath the root as in NativeFilesystem. If the kernel does
+ * not support io_uring, every call falls back to the blocking implementation.
+ */
+class UringFilesystem : public NativeFilesystem {
+public:
+  /**
+   * Constructor
+   *
+   * @param root Root of this filesystem
+   * @param entries Size of the submission queue
+   */
+  UringFilesystem(const std::string& root, unsigned int entries = 256);
+  ~UringFilesystem();
+
+  /**
+   * Returns true if calls are submitted to an io_uring
+   */
+  bool isAsync() const;
+
+  /**
+   * Reaps completions from the libuv event loop
+   *
+   * @param loop A libuv event loop
+   */
+  bool startPoll(uv_loop_t* loop);
+
+  /**
+   * Stops reaping completions from the libuv event loop
+   */
+  bool stopPoll();
+
+  /**
+   * Runs the completions of every finished call
+   *
+   * @return Number of calls completed
+   */
+  size_t reap();
+
+  /**
+   * Number of calls that have been submitted but not completed
+   */
+  size_t pending() const;
+
+  /**
+   * Descriptor of the io_uring, which is readable when completions are ready
+   */
+  int ringFD() const;
+
+  virtual void openAsync(const char* name, int flags, int mode, Completion done);
+  virtual void readAsync(int fd, void* buf, size_t count, Completion done);
+  virtual void closeAsync(int fd, Completion done);
+  virtual void fstatAsync(int fd, struct stat* buf, Completion done);
+  virtual void writeAsync(int fd, void* buf, size_t count, Completion done);
+  virtual void statAsync(const char* path, struct stat* buf, Completion done);
+  virtual void lstatAsync(const char* path, struct stat* buf, Completion done);
+
+private:
+  struct io_uring_sqe* getSqe();
+  void submit(struct io_uring_sqe* sqe, Completion done);
+  void openBeneathAsync(DirectoryFD::Ptr dir, int dirFD, const std::string& path, int flags, int mode, Completion done);
+  void statxAsync(DirectoryFD::Ptr dir, int dirFD, const std::string& path, int flags, struct stat* buf, Completion done);
+  void updateRef();
+  static void cb_poll(uv_poll_t* req, int status, int events);
+  static void cb_close(uv_handle_t* handle);
+
+  int m_ringFD;
+  unsigned int m_entries;
+
+  void* m_sqRing;
+  size_t m_sqRingSize;
+  void* m_cqRing;
+  size_t m_cqRingSize;
+  struct io_uring_sqe* m_sqes;
+  size_t m_sqesSize;
+
+  unsigned int* m_sqHead;
+  unsigned int* m_sqTail;
+  unsigned int* m_sqMask;
+  unsigned int* m_sqArray;
+  unsigned int* m_cqHead;
+  unsigned int* m_cqTail;
+  unsigned int* m_cqMask;
+  struct io_uring_cqe* m_cqes;
+
+  TokenPool<Completion> m_pending;
+  uv_poll_t* m_poll;
+};
+
+#endif // URING_FILESYSTEM_H
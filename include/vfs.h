@@ -4,13 +4,15 @@
 #include "dirent-builder.h"
 #include "sandbox.h"
 #include "filesystem.h"
+#include "token-pool.h"
 
+#include <functional>
 #include <memory>
 #include <vector>
 
 class File {
 public:
-  File(int localFD, const std::string& path, std::shared_ptr<Filesystem>& fs);
+  File(int localFD, const std::string& path, const std::shared_ptr<Filesystem>& fs);
   ~File();
 
   using Ptr = std::shared_ptr<File>;
@@ -19,12 +21,14 @@ public:
   int virtualFD() const;
   std::shared_ptr<Filesystem> fs() const;
 
-  int close();
-  int fstat(struct stat* buf);
-  int getdents(struct linux_dirent* dirs, unsigned int count);
-  ssize_t read(void* buf, size_t count);
-  off_t lseek(off_t offset, int whence);
-  ssize_t write(void* buf, size_t count);
+  void close(Filesystem::Completion done);
+  void fstat(struct stat* buf, Filesystem::Completion done);
+  void getdents(struct linux_dirent* dirs, unsigned int count, Filesystem::Completion done);
+  void getdents64(struct linux_dirent64* dirs, unsigned int count, Filesystem::Completion done);
+  void read(void* buf, size_t count, Filesystem::Completion done);
+  ssize_t readInPlace(size_t count, const void** data);
+  void lseek(off_t offset, int whence, Filesystem::Completion done);
+  void write(void* buf, size_t count, Filesystem::Completion done);
 
   std::string path() const;
 
@@ -47,6 +51,7 @@ public:
    * @param sandbox Sandbox this VFS is attached to
    */
   VFS(Sandbox* sandbox);
+  ~VFS();
 
   /**
    * Handles filesystem related syscalls
@@ -93,25 +98,29 @@ public:
   static constexpr int firstVirtualFD = 4096;
 
   /**
-   * Mount a Filesystem onto a given path
+   * Mount a Filesystem onto a given path. The path must end in "/". Paths are
+   * served by the filesystem with the longest matching mount point.
    */
   void mountFilesystem(const std::string& path, std::shared_ptr<Filesystem> fs);
 
   /**
    * Get the path of the current directory for this VFS
    *
-   * @return Path of the current directory
+   * @return Path of the current directory, or an empty string while none has
+   * been set
    */
   std::string getCWD() const;
 
   /**
    * Set the current directory used for local path resolution. The underlying
-   * filesystem must support open() with O_DIRECTORY.
+   * filesystem must support open() with O_DIRECTORY. The directory is opened
+   * asynchronously, and the cwd changes once that has finished.
    *
    * @param path Path to set new cwd to
-   * @return 0 on success, negative error number otherwise.
+   * @param done Optional completion, receiving 0 on success or a negative
+   * error number otherwise.
    */
-  int setCWD(const std::string& path);
+  void setCWD(const std::string& path, Filesystem::Completion done = Filesystem::Completion());
 
 private:
   Sandbox* m_sbox;
@@ -119,16 +128,56 @@ private:
   std::map<int, File::Ptr> m_openFiles;
   std::vector<std::string> m_whitelist;
   File::Ptr m_cwd;
+  std::shared_ptr<TokenPool<Filesystem::Completion>> m_pending;
 
   bool isWhitelisted(const std::string& str);
 
+  /**
+   * Wraps a completion that refers to this VFS or its sandbox. If the VFS
+   * has been destroyed by the time the filesystem completes, the result is
+   * dropped instead.
+   */
+  Filesystem::Completion guard(Filesystem::Completion done);
+
+  /**
+   * Wraps the completion handed to a filesystem so that it keeps @p buf
+   * alive. A guarded completion that is dropped with the VFS takes its
+   * continuation along, but the filesystem may still be writing into the
+   * buffer until it calls back.
+   */
+  template<typename T>
+  static Filesystem::Completion holding(std::shared_ptr<T> buf, Filesystem::Completion done)
+  {
+    return [buf, done] (ssize_t ret) {done (ret);};
+  }
+
+  /**
+   * Post-processes the result of a filesystem call, e.g. by copying data into
+   * the sandbox, before the syscall is completed.
+   */
+  using Continuation = std::function<void(Sandbox::SyscallCall&, ssize_t)>;
+
+  /**
+   * Runs an asynchronous filesystem call on behalf of @p call. If it completes
+   * right away @p call is finished in place, otherwise it is deferred and
+   * resumed from the filesystem's completion.
+   *
+   * @param call Syscall being emulated
+   * @param op Starts the filesystem call, which reports back to the given
+   * completion
+   * @param finish Continuation to run on the result. May be empty.
+   */
+  void dispatch(Sandbox::SyscallCall& call, std::function<void(Filesystem::Completion)> op, Continuation finish);
+
   void openFile(Sandbox::SyscallCall& call, const std::string& fname, int flags, mode_t mode);
+  void unread(const File::Ptr& file, ssize_t count);
 
   void do_open(Sandbox::SyscallCall& call);
   void do_close(Sandbox::SyscallCall& call);
   void do_read(Sandbox::SyscallCall& call);
   void do_fstat(Sandbox::SyscallCall& call);
   void do_getdents(Sandbox::SyscallCall& call);
+  void do_getdents64(Sandbox::SyscallCall& call);
   void do_openat(Sandbox::SyscallCall& call);
   void do_lseek(Sandbox::SyscallCall& call);
   void do_write(Sandbox::SyscallCall& call);
@@ -139,8 +188,11 @@ private:
   void do_lstat(Sandbox::SyscallCall& call);
   void do_getcwd(Sandbox::SyscallCall& call);
   void do_readlink(Sandbox::SyscallCall& call);
+  void do_unlink(Sandbox::SyscallCall& call);
+  void do_mkdir(Sandbox::SyscallCall& call);
+  void do_rmdir(Sandbox::SyscallCall& call);
 
-  File::Ptr makeFile (int fd, const std::string& path, std::shared_ptr<Filesystem>& fs);
+  File::Ptr makeFile (int fd, const std::string& path, const std::shared_ptr<Filesystem>& fs);
 };
 
 #endif // VFS_H
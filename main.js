@@ -43,6 +43,41 @@ Sandbox.prototype.mapFilename = function (filename) {
   return filename;
 };
 
+/**
+ * Number of entries in a packed stat result
+ * @memberof Sandbox
+ * @type number
+ */
+Sandbox.STAT_FIELDS = 13;
+
+/**
+ * Packs an fs.Stats into the Float64Array that 'stat', 'lstat' and 'fstat'
+ * VFS calls must return. The layout is dev, ino, mode, nlink, uid, gid, rdev,
+ * size, blksize, blocks, atime, mtime, ctime, with times in seconds.
+ * @function packStat
+ * @memberof Sandbox
+ * @param {fs.Stats} stats Stats to pack
+ * @param {Float64Array} [out] Array to reuse instead of allocating one
+ * @returns {Float64Array}
+ */
+Sandbox.packStat = function (stats, out) {
+  out = out || new Float64Array(Sandbox.STAT_FIELDS);
+  out[0] = stats.dev;
+  out[1] = stats.ino;
+  out[2] = stats.mode;
+  out[3] = stats.nlink;
+  out[4] = stats.uid;
+  out[5] = stats.gid;
+  out[6] = stats.rdev;
+  out[7] = stats.size;
+  out[8] = stats.blksize || 0;
+  out[9] = stats.blocks || 0;
+  out[10] = stats.atime.getTime() / 1000;
+  out[11] = stats.mtime.getTime() / 1000;
+  out[12] = stats.ctime.getTime() / 1000;
+  return out;
+};
+
 /**
  * Internal function. Sets up stdio IPC channels upon construction
  * @memberof Sandbox
@@ -108,7 +143,35 @@ Sandbox.prototype.onData = function (fd, chunk) {
  * @instance
  */
 
-/** 
+/**
+ * Called when a VFS operation occurs inside the sandbox. The result must be
+ * passed back through finishVFS() as {error: errno, result: value}.
+ *
+ * 'read' is called as (cookie, 'read', fd, buffer, position): the data must be
+ * copied into buffer, and the result is the number of bytes read. 'write' is
+ * called as (cookie, 'write', fd, buffer, position) and the result is the
+ * number of bytes written. Both buffers are copies owned by JS, and the read
+ * buffer is copied back when finishVFS() is called. 'stat', 'lstat' and
+ * 'fstat' must return a Float64Array, as built by Sandbox.packStat().
+ * 'getdents' returns an array of names, or of {name, ino} objects whose ino
+ * matches what stat reports.
+ * @function onVFS
+ * @memberof Sandbox
+ * @instance
+ * @param {object} cookie Opaque cookie for finishVFS()
+ * @param {string} op Operation being called
+ */
+
+/**
+ * Completes a VFS operation started by onVFS()
+ * @function finishVFS
+ * @memberof Sandbox
+ * @instance
+ * @param {object} cookie The cookie passed to onVFS()
+ * @param {object} result Result of the operation
+ */
+
+/**
  * Launch GDB when the child crashes
  * @member debuggerOnCrash
  * @memberof Sandbox
@@ -0,0 +1,48 @@
+#include "arena.h"
+#include <stdint.h>
+
+Arena::Arena(size_t blockSize, size_t limit)
+  : m_blockSize (blockSize),
+    m_limit (limit),
+    m_reserved (0),
+    m_next (nullptr),
+    m_end (nullptr)
+{
+}
+
+void*
+Arena::allocate(size_t size, size_t align)
+{
+  uintptr_t next = (reinterpret_cast<uintptr_t>(m_next) + align - 1) & ~static_cast<uintptr_t>(align - 1);
+  if (m_next && next + size <= reinterpret_cast<uintptr_t>(m_end)) {
+    m_next = reinterpret_cast<char*>(next + size);
+    return reinterpret_cast<void*>(next);
+  }
+
+  // Large allocations get a block of their own, so the current block can
+  // still be used for small ones
+  size_t blockSize = size + align > m_blockSize / 4 ? size + align : m_blockSize;
+  if (m_limit && m_reserved + blockSize > m_limit)
+    return nullptr;
+
+  std::unique_ptr<char[]> block (new char[blockSize]);
+  char* base = block.get();
+  m_blocks.push_back (std::move (block));
+  m_reserved += blockSize;
+
+  next = (reinterpret_cast<uintptr_t>(base) + align - 1) & ~static_cast<uintptr_t>(align - 1);
+  if (blockSize == m_blockSize) {
+    m_next = reinterpret_cast<char*>(next + size);
+    m_end = base + blockSize;
+  }
+  return reinterpret_cast<void*>(next);
+}
+
+void
+Arena::reset()
+{
+  m_blocks.clear();
+  m_reserved = 0;
+  m_next = nullptr;
+  m_end = nullptr;
+}
@@ -0,0 +1,450 @@
+#include "blob-filesystem.h"
+
+#include <algorithm>
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+Blob::Blob(const std::string& hash, const char* data, size_t size)
+  : m_hash (hash),
+    m_data (data),
+    m_size (size)
+{
+}
+
+Blob::~Blob()
+{
+  if (m_size > 0)
+    munmap (const_cast<char*>(m_data), m_size);
+}
+
+BlobStore::BlobStore(const std::string& directory)
+  : m_directory (directory)
+{
+}
+
+BlobStore::Ptr
+BlobStore::shared(const std::string& directory)
+{
+  static std::map<std::string, Ptr> s_stores;
+
+  Ptr& store = s_stores[directory];
+  if (!store)
+    store = Ptr (new BlobStore (directory));
+  return store;
+}
+
+bool
+BlobStore::isValidHash(const std::string& hash)
+{
+  if (hash.empty() || hash.size() > 128)
+    return false;
+  for (auto i = hash.cbegin(); i != hash.cend(); i++) {
+    if (!((*i >= '0' && *i <= '9') || (*i >= 'a' && *i <= 'f')))
+      return false;
+  }
+  return true;
+}
+
+Blob::Ptr
+BlobStore::get(const std::string& hash)
+{
+  auto cached = m_blobs.find (hash);
+  if (cached != m_blobs.end()) {
+    Blob::Ptr blob = cached->second.lock();
+    if (blob)
+      return blob;
+    m_blobs.erase (cached);
+  }
+
+  if (!isValidHash (hash))
+    return nullptr;
+
+  int fd = ::open ((m_directory + "/" + hash).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat sbuf;
+  if (::fstat (fd, &sbuf) < 0 || !S_ISREG (sbuf.st_mode)) {
+    ::close (fd);
+    return nullptr;
+  }
+
+  void* data = nullptr;
+  if (sbuf.st_size > 0) {
+    data = mmap (NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close (fd);
+      return nullptr;
+    }
+  }
+  ::close (fd);
+
+  Blob::Ptr blob (new Blob (hash, static_cast<const char*>(data), sbuf.st_size));
+  m_blobs[hash] = blob;
+  return blob;
+}
+
+off_t
+BlobStore::size(const std::string& hash)
+{
+  auto cached = m_blobs.find (hash);
+  if (cached != m_blobs.end()) {
+    Blob::Ptr blob = cached->second.lock();
+    if (blob)
+      return blob->size();
+  }
+
+  if (!isValidHash (hash))
+    return -1;
+
+  struct stat sbuf;
+  if (::stat ((m_directory + "/" + hash).c_str(), &sbuf) < 0 || !S_ISREG (sbuf.st_mode))
+    return -1;
+  return sbuf.st_size;
+}
+
+bool
+BlobStore::put(const std::string& hash, const void* data, size_t size)
+{
+  if (!isValidHash (hash)) {
+    errno = EINVAL;
+    return false;
+  }
+
+  std::string path (m_directory + "/" + hash);
+  if (::access (path.c_str(), F_OK) == 0)
+    return true;
+
+  // Write to a temporary name first, so a blob is never seen half written.
+  // The name is unique, so concurrent writers of one hash never share it.
+  std::string tmpPath (path + ".XXXXXX");
+  int fd = mkstemp (&tmpPath[0]);
+  if (fd < 0)
+    return false;
+
+  const char* p = static_cast<const char*>(data);
+  size_t left = size;
+  bool ok = fchmod (fd, 0644) == 0;
+  while (ok && left > 0) {
+    ssize_t written = ::write (fd, p, left);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      ok = false;
+      break;
+    }
+    p += written;
+    left -= written;
+  }
+  if (::close (fd) < 0)
+    ok = false;
+  if (ok && ::rename (tmpPath.c_str(), path.c_str()) < 0)
+    ok = false;
+  if (!ok) {
+    int err = errno;
+    ::unlink (tmpPath.c_str());
+    errno = err;
+  }
+  return ok;
+}
+
+size_t
+BlobStore::mapped() const
+{
+  size_t count = 0;
+  for (auto i = m_blobs.cbegin(); i != m_blobs.cend(); i++) {
+    if (!i->second.expired())
+      count++;
+  }
+  return count;
+}
+
+BlobFilesystem::BlobFilesystem(BlobStore::Ptr store, const Manifest& manifest)
+  : Filesystem(),
+    m_store (store)
+{
+  std::map<std::string, std::set<std::string> > children;
+  children["/"];
+
+  for (auto i = manifest.cbegin(); i != manifest.cend(); i++) {
+    std::string path (normalizePath (i->first));
+    if (path == "/")
+      continue;
+    Node& node = m_nodes[path];
+    node.hash = i->second;
+    node.directory = false;
+    node.size = -1;
+
+    // Every parent of a file is a directory
+    while (path != "/") {
+      size_t sep = path.rfind ('/');
+      std::string parent (sep == 0 ? "/" : path.substr (0, sep));
+      children[parent].insert (path.substr (sep + 1));
+      path = parent;
+    }
+  }
+
+  for (auto i = children.cbegin(); i != children.cend(); i++) {
+    Node& node = m_nodes[i->first];
+    node.hash.clear();
+    node.directory = true;
+    node.size = 0;
+  }
+
+  uint64_t inode = 1;
+  for (auto i = m_nodes.begin(); i != m_nodes.end(); i++)
+    i->second.inode = inode++;
+
+  // Directory entries carry the same inode numbers that stat() reports
+  for (auto i = children.cbegin(); i != children.cend(); i++) {
+    std::string prefix (i->first == "/" ? i->first : i->first + "/");
+    Node& node = m_nodes[i->first];
+    for (auto name = i->second.cbegin(); name != i->second.cend(); name++) {
+      const Node& child = m_nodes[prefix + *name];
+      DirentCursor::Entry entry = {
+        *name,
+        child.inode,
+        child.directory ? DirentBuilder::Directory : DirentBuilder::Regular
+      };
+      node.children.push_back (entry);
+    }
+  }
+}
+
+BlobFilesystem::OpenFile*
+BlobFilesystem::getOpenFile(int fd)
+{
+  if (fd < 0 || static_cast<size_t>(fd) >= m_openFiles.size() || !m_openFiles[fd].used)
+    return nullptr;
+  return &m_openFiles[fd];
+}
+
+const BlobFilesystem::Node*
+BlobFilesystem::find(const char* path) const
+{
+  auto node = m_nodes.find (normalizePath (path));
+  if (node == m_nodes.end())
+    return nullptr;
+  return &node->second;
+}
+
+int
+BlobFilesystem::fillStat(const Node* node, struct stat* buf)
+{
+  memset (buf, 0, sizeof (*buf));
+  if (node->directory) {
+    buf->st_mode = S_IFDIR | 0555;
+    buf->st_nlink = 2;
+    buf->st_size = 4096;
+  } else {
+    if (node->size < 0)
+      node->size = m_store->size (node->hash);
+    if (node->size < 0)
+      return -EIO;
+    buf->st_mode = S_IFREG | 0444;
+    buf->st_nlink = 1;
+    buf->st_size = node->size;
+  }
+  buf->st_ino = node->inode;
+  buf->st_blksize = 4096;
+  buf->st_blocks = (buf->st_size + 511) / 512;
+  return 0;
+}
+
+int
+BlobFilesystem::open(const char* name, int flags, int mode)
+{
+  if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)))
+    return -EROFS;
+
+  const Node* node = find (name);
+  if (!node)
+    return -ENOENT;
+  if ((flags & O_DIRECTORY) && !node->directory)
+    return -ENOTDIR;
+
+  Blob::Ptr blob;
+  if (!node->directory) {
+    blob = m_store->get (node->hash);
+    if (!blob)
+      return -EIO;
+    node->size = blob->size();
+  }
+
+  int fd;
+  if (!m_freeFDs.empty()) {
+    fd = m_freeFDs.back();
+    m_freeFDs.pop_back();
+  } else {
+    fd = m_openFiles.size();
+    m_openFiles.push_back (OpenFile());
+  }
+
+  OpenFile& file = m_openFiles[fd];
+  file.node = node;
+  file.blob = blob;
+  file.offset = 0;
+  file.cursor = DirentCursor();
+  file.used = true;
+  return fd;
+}
+
+ssize_t
+BlobFilesystem::readInPlace(int fd, size_t count, const void** data)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (file->node->directory)
+    return -EISDIR;
+
+  if (static_cast<size_t>(file->offset) >= file->blob->size())
+    return 0;
+
+  size_t len = std::min (count, file->blob->size() - file->offset);
+  *data = file->blob->data() + file->offset;
+  file->offset += len;
+  return len;
+}
+
+ssize_t
+BlobFilesystem::read(int fd, void* buf, size_t count)
+{
+  const void* data;
+  ssize_t len = readInPlace (fd, count, &data);
+  if (len > 0)
+    memcpy (buf, data, len);
+  return len;
+}
+
+int
+BlobFilesystem::close(int fd)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  file->used = false;
+  file->blob.reset();
+  m_freeFDs.push_back (fd);
+  return 0;
+}
+
+int
+BlobFilesystem::fstat(int fd, struct stat* buf)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  return fillStat (file->node, buf);
+}
+
+int
+BlobFilesystem::readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (!file->node->directory)
+    return -ENOTDIR;
+
+  if (!file->cursor.loaded())
+    file->cursor.load (file->node->children);
+  return file->cursor.read (dirs, count, format);
+}
+
+int
+BlobFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent);
+}
+
+int
+BlobFilesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent64);
+}
+
+off_t
+BlobFilesystem::lseek(int fd, off_t offset, int whence)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  if (file->node->directory) {
+    if (whence != SEEK_SET || offset < 0)
+      return -EINVAL;
+    return file->cursor.seek (offset);
+  }
+
+  off_t newOffset;
+  switch (whence) {
+    case SEEK_SET:
+      newOffset = seekOffset (0, offset);
+      break;
+    case SEEK_CUR:
+      newOffset = seekOffset (file->offset, offset);
+      break;
+    case SEEK_END:
+      newOffset = seekOffset (file->blob->size(), offset);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if (newOffset < 0)
+    return newOffset;
+  file->offset = newOffset;
+  return newOffset;
+}
+
+ssize_t
+BlobFilesystem::write(int fd, void* buf, size_t count)
+{
+  // Files are only ever opened read-only
+  return -EBADF;
+}
+
+int
+BlobFilesystem::access(const char* name, int mode)
+{
+  const Node* node = find (name);
+  if (!node)
+    return -ENOENT;
+  if (mode & W_OK)
+    return -EROFS;
+  if ((mode & X_OK) && !node->directory)
+    return -EACCES;
+  return 0;
+}
+
+int
+BlobFilesystem::stat(const char* path, struct stat* buf)
+{
+  const Node* node = find (path);
+  if (!node)
+    return -ENOENT;
+  return fillStat (node, buf);
+}
+
+int
+BlobFilesystem::lstat(const char* path, struct stat* buf)
+{
+  return stat (path, buf);
+}
+
+ssize_t
+BlobFilesystem::readlink(const char* path, char* buf, size_t bufsize)
+{
+  if (!find (path))
+    return -ENOENT;
+  return -EINVAL;
+}
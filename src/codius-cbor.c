@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "codius-cbor.h"
+
+enum {
+  CBOR_UINT = 0,
+  CBOR_NEGINT = 1,
+  CBOR_BYTES = 2,
+  CBOR_TEXT = 3,
+  CBOR_ARRAY = 4,
+  CBOR_MAP = 5,
+  CBOR_TAG = 6,
+  CBOR_SIMPLE = 7
+};
+
+enum {
+  CBOR_FALSE = 20,
+  CBOR_TRUE = 21,
+  CBOR_NULL = 22,
+  CBOR_UNDEFINED = 23,
+  CBOR_HALF = 25,
+  CBOR_FLOAT = 26,
+  CBOR_DOUBLE = 27
+};
+
+/* Largest magnitude that a double holds exactly as an integer */
+static const double max_exact_integer = 9007199254740992.0;
+
+static int
+reserve (codius_cbor_buf_t* buf, size_t extra)
+{
+  size_t cap;
+  char* data;
+
+  if (buf->cap - buf->len >= extra)
+    return 0;
+
+  cap = buf->cap ? buf->cap : 64;
+  while (cap - buf->len < extra)
+    cap *= 2;
+
+  data = realloc (buf->data, cap);
+  if (!data)
+    return -1;
+
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+static int
+write_head (codius_cbor_buf_t* buf, int major, uint64_t value)
+{
+  unsigned char* out;
+  int bytes;
+  int info;
+  int i;
+
+  if (value < 24) {
+    bytes = 0;
+    info = value;
+  } else if (value <= 0xff) {
+    bytes = 1;
+    info = 24;
+  } else if (value <= 0xffff) {
+    bytes = 2;
+    info = 25;
+  } else if (value <= 0xffffffff) {
+    bytes = 4;
+    info = 26;
+  } else {
+    bytes = 8;
+    info = 27;
+  }
+
+  if (reserve (buf, 1 + bytes) < 0)
+    return -1;
+
+  out = (unsigned char*)buf->data + buf->len;
+  out[0] = major << 5 | info;
+  for (i = 0; i < bytes; i++)
+    out[1 + i] = value >> (8 * (bytes - 1 - i));
+  buf->len += 1 + bytes;
+  return 0;
+}
+
+static int
+write_text (codius_cbor_buf_t* buf, const char* str, size_t len)
+{
+  if (write_head (buf, CBOR_TEXT, len) < 0 || reserve (buf, len) < 0)
+    return -1;
+  memcpy (buf->data + buf->len, str, len);
+  buf->len += len;
+  return 0;
+}
+
+static void
+put_be (unsigned char* out, uint64_t value, int bytes)
+{
+  int i;
+  for (i = 0; i < bytes; i++)
+    out[i] = value >> (8 * (bytes - 1 - i));
+}
+
+static int
+write_number (codius_cbor_buf_t* buf, double number)
+{
+  union {
+    double d;
+    uint64_t u;
+  } bits;
+
+  if (number == floor (number) && fabs (number) < max_exact_integer &&
+      !(number == 0 && signbit (number))) {
+    if (number >= 0)
+      return write_head (buf, CBOR_UINT, (uint64_t)number);
+    return write_head (buf, CBOR_NEGINT, (uint64_t)(-1 - number));
+  }
+
+  if (reserve (buf, 9) < 0)
+    return -1;
+
+  bits.d = number;
+  buf->data[buf->len] = CBOR_SIMPLE << 5 | CBOR_DOUBLE;
+  put_be ((unsigned char*)buf->data + buf->len + 1, bits.u, 8);
+  buf->len += 9;
+  return 0;
+}
+
+static int
+write_simple (codius_cbor_buf_t* buf, int value)
+{
+  return write_head (buf, CBOR_SIMPLE, value);
+}
+
+int
+codius_cbor_encode (codius_cbor_buf_t* buf, const JsonNode* node)
+{
+  const JsonNode* child;
+  size_t count = 0;
+
+  switch (node->tag) {
+    case JSON_NULL:
+      return write_simple (buf, CBOR_NULL);
+    case JSON_BOOL:
+      return write_simple (buf, node->bool_ ? CBOR_TRUE : CBOR_FALSE);
+    case JSON_STRING:
+      return write_text (buf, node->string_, strlen (node->string_));
+    case JSON_NUMBER:
+      return write_number (buf, node->number_);
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+      for (child = node->children.head; child; child = child->next)
+        count++;
+
+      if (write_head (buf, node->tag == JSON_ARRAY ? CBOR_ARRAY : CBOR_MAP, count) < 0)
+        return -1;
+
+      for (child = node->children.head; child; child = child->next) {
+        if (node->tag == JSON_OBJECT &&
+            write_text (buf, child->key, strlen (child->key)) < 0)
+          return -1;
+        if (codius_cbor_encode (buf, child) < 0)
+          return -1;
+      }
+      return 0;
+  }
+
+  return -1;
+}
+
+int
+codius_cbor_append (codius_cbor_buf_t* buf, const void* data, size_t len)
+{
+  if (reserve (buf, len) < 0)
+    return -1;
+  memcpy (buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+int
+codius_cbor_encode_uint (codius_cbor_buf_t* buf, unsigned long long value)
+{
+  return write_head (buf, CBOR_UINT, value);
+}
+
+int
+codius_cbor_encode_array (codius_cbor_buf_t* buf, size_t count)
+{
+  return write_head (buf, CBOR_ARRAY, count);
+}
+
+int
+codius_cbor_encode_string (codius_cbor_buf_t* buf, const char* str)
+{
+  return write_text (buf, str, strlen (str));
+}
+
+typedef struct {
+  const unsigned char* data;
+  size_t len;
+  size_t pos;
+} reader_t;
+
+static int
+read_head (reader_t* r, int* major, uint64_t* value)
+{
+  int info;
+  int bytes;
+  int i;
+
+  if (r->pos >= r->len)
+    return -1;
+
+  *major = r->data[r->pos] >> 5;
+  info = r->data[r->pos] & 0x1f;
+  r->pos++;
+
+  if (info < 24) {
+    *value = info;
+    return 0;
+  }
+
+  /* Indefinite lengths and reserved values are not supported */
+  if (info > 27)
+    return -1;
+
+  bytes = 1 << (info - 24);
+  if (r->len - r->pos < (size_t)bytes)
+    return -1;
+
+  *value = 0;
+  for (i = 0; i < bytes; i++)
+    *value = *value << 8 | r->data[r->pos++];
+  return 0;
+}
+
+/* Checks that @p str is well-formed UTF-8 without embedded NULs */
+static int
+valid_utf8 (const unsigned char* str, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned char c = str[i];
+    uint32_t cp;
+    size_t extra;
+    size_t j;
+
+    if (c == 0)
+      return 0;
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+
+    if ((c & 0xe0) == 0xc0) {
+      extra = 1;
+      cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+      extra = 2;
+      cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+      extra = 3;
+      cp = c & 0x07;
+    } else {
+      return 0;
+    }
+
+    if (len - i <= extra)
+      return 0;
+    for (j = 1; j <= extra; j++) {
+      if ((str[i + j] & 0xc0) != 0x80)
+        return 0;
+      cp = cp << 6 | (str[i + j] & 0x3f);
+    }
+
+    /* Reject overlong forms, surrogates and values past U+10FFFF */
+    if ((extra == 1 && cp < 0x80) || (extra == 2 && cp < 0x800) ||
+        (extra == 3 && cp < 0x10000) || (cp >= 0xd800 && cp <= 0xdfff) ||
+        cp > 0x10ffff)
+      return 0;
+    i += extra + 1;
+  }
+
+  return 1;
+}
+
+/* Points @p str at a text string in the input, which is not NUL-terminated */
+static int
+read_text (reader_t* r, const char** str, size_t* len)
+{
+  int major;
+  uint64_t value;
+
+  if (read_head (r, &major, &value) < 0 || major != CBOR_TEXT)
+    return -1;
+  if (value > r->len - r->pos || !valid_utf8 (r->data + r->pos, value))
+    return -1;
+
+  *str = (const char*)r->data + r->pos;
+  *len = value;
+  r->pos += value;
+  return 0;
+}
+
+static double
+half_to_double (uint16_t half)
+{
+  int exponent = (half >> 10) & 0x1f;
+  int mantissa = half & 0x3ff;
+  double value;
+
+  if (exponent == 0)
+    value = ldexp (mantissa, -24);
+  else if (exponent == 31)
+    value = mantissa ? NAN : INFINITY;
+  else
+    value = ldexp (mantissa + 1024, exponent - 25);
+
+  return (half & 0x8000) ? -value : value;
+}
+
+/* JSON has no representation for NaN or the infinities */
+static JsonNode*
+mkfloat (JsonArena* arena, double value)
+{
+  return isfinite (value) ? json_mknumber_in (arena, value) : json_mknull_in (arena);
+}
+
+static JsonNode*
+read_item (reader_t* r, JsonArena* arena, int depth)
+{
+  JsonNode* node;
+  JsonNode* child;
+  const char* str;
+  size_t len;
+  size_t start = r->pos;
+  uint64_t value;
+  uint64_t i;
+  int major;
+
+  if (depth > CODIUS_CBOR_MAX_DEPTH || read_head (r, &major, &value) < 0)
+    return NULL;
+
+  switch (major) {
+    case CBOR_UINT:
+      return json_mknumber_in (arena, (double)value);
+    case CBOR_NEGINT:
+      return json_mknumber_in (arena, -1.0 - (double)value);
+    case CBOR_TEXT:
+      r->pos = start;
+      if (read_text (r, &str, &len) < 0)
+        return NULL;
+      return json_mkstring_in (arena, str, len);
+    case CBOR_ARRAY:
+    case CBOR_MAP:
+      /* Every item takes at least one byte, which bounds the allocation */
+      if (value > r->len - r->pos)
+        return NULL;
+
+      node = major == CBOR_ARRAY ? json_mkarray_in (arena) : json_mkobject_in (arena);
+      for (i = 0; i < value; i++) {
+        if (major == CBOR_MAP && read_text (r, &str, &len) < 0)
+          goto fail;
+        child = read_item (r, arena, depth + 1);
+        if (!child)
+          goto fail;
+        if (major == CBOR_MAP)
+          json_append_member_n (node, str, len, child);
+        else
+          json_append_element (node, child);
+      }
+      return node;
+fail:
+      json_delete (node);
+      return NULL;
+    case CBOR_SIMPLE:
+      switch (r->data[start] & 0x1f) {
+        case CBOR_FALSE:
+          return json_mkbool_in (arena, false);
+        case CBOR_TRUE:
+          return json_mkbool_in (arena, true);
+        case CBOR_NULL:
+        case CBOR_UNDEFINED:
+          return json_mknull_in (arena);
+        case CBOR_HALF:
+          return mkfloat (arena, half_to_double (value));
+        case CBOR_FLOAT: {
+          union {
+            float f;
+            uint32_t u;
+          } bits;
+          bits.u = value;
+          return mkfloat (arena, bits.f);
+        }
+        case CBOR_DOUBLE: {
+          union {
+            double d;
+            uint64_t u;
+          } bits;
+          bits.u = value;
+          return mkfloat (arena, bits.d);
+        }
+      }
+      return NULL;
+  }
+
+  /* Byte strings and tags have no JSON equivalent */
+  return NULL;
+}
+
+JsonNode*
+codius_cbor_decode (const char* data, size_t len, size_t* consumed)
+{
+  return codius_cbor_decode_in (data, len, consumed, NULL);
+}
+
+JsonNode*
+codius_cbor_decode_in (const char* data, size_t len, size_t* consumed,
+                       JsonArena* arena)
+{
+  reader_t r;
+  JsonNode* node;
+
+  r.data = (const unsigned char*)data;
+  r.len = len;
+  r.pos = 0;
+
+  node = read_item (&r, arena, 0);
+  if (node && consumed)
+    *consumed = r.pos;
+  return node;
+}
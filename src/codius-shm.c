@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "codius-shm.h"
+
+#define CODIUS_SHM_MAGIC 0xC0D15A3Eu
+#define CACHE_LINE 64
+
+/*
+ * One direction of the channel. Positions count bytes and wrap at 2^32; the
+ * ring size is a power of two no larger than 2^30, so head - tail is always
+ * the number of bytes in use. Each record is a 32-bit length followed by the
+ * message, padded to 8 bytes.
+ */
+typedef struct {
+  uint32_t head;
+  /* Set by the consumer before it sleeps on its doorbell */
+  uint32_t consumer_waiting;
+  char pad0[CACHE_LINE - 2 * sizeof (uint32_t)];
+  uint32_t tail;
+  /* Set by the producer before it sleeps waiting for space */
+  uint32_t producer_waiting;
+  char pad1[CACHE_LINE - 2 * sizeof (uint32_t)];
+} ring_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t ring_size;
+  char pad[CACHE_LINE - 2 * sizeof (uint32_t)];
+  ring_t requests;
+  ring_t results;
+  /* Request data, then result data */
+} shm_layout_t;
+
+struct codius_shm_s {
+  codius_shm_side_t side;
+  shm_layout_t* layout;
+  size_t map_size;
+  int memfd;
+  int host_doorbell;
+  int guest_doorbell;
+
+  ring_t* out;
+  char* out_data;
+  ring_t* in;
+  char* in_data;
+  uint32_t mask;
+
+  /* Last message received, NUL-terminated */
+  char* msg;
+  size_t msg_cap;
+
+  /* Records waiting for room in the outgoing ring */
+  char* backlog;
+  size_t backlog_len;
+  size_t backlog_cap;
+
+  void* context;
+  void (*context_free)(void*);
+};
+
+static uint32_t
+load_acquire (uint32_t* p)
+{
+  return __atomic_load_n (p, __ATOMIC_ACQUIRE);
+}
+
+static void
+store_release (uint32_t* p, uint32_t value)
+{
+  __atomic_store_n (p, value, __ATOMIC_RELEASE);
+}
+
+static uint32_t
+record_size (size_t len)
+{
+  return (sizeof (uint32_t) + len + 7) & ~7u;
+}
+
+static int
+own_doorbell (codius_shm_t* shm)
+{
+  return shm->side == CODIUS_SHM_HOST ? shm->host_doorbell : shm->guest_doorbell;
+}
+
+static int
+peer_doorbell (codius_shm_t* shm)
+{
+  return shm->side == CODIUS_SHM_HOST ? shm->guest_doorbell : shm->host_doorbell;
+}
+
+static void
+ring_doorbell (int fd)
+{
+  uint64_t one = 1;
+  ssize_t ret;
+
+  do {
+    ret = write (fd, &one, sizeof (one));
+  } while (ret == -1 && errno == EINTR);
+}
+
+void
+codius_shm_clear_doorbell (codius_shm_t* shm)
+{
+  uint64_t count;
+  ssize_t ret;
+
+  do {
+    ret = read (own_doorbell (shm), &count, sizeof (count));
+  } while (ret == -1 && errno == EINTR);
+}
+
+static void
+wait_doorbell (codius_shm_t* shm)
+{
+  struct pollfd pfd;
+
+  pfd.fd = own_doorbell (shm);
+  pfd.events = POLLIN;
+  while (poll (&pfd, 1, -1) == -1 && errno == EINTR)
+    ;
+  codius_shm_clear_doorbell (shm);
+}
+
+/*
+ * Announces that this side is about to sleep on @p flag, then checks once
+ * more that there really is nothing to do. The fence orders the flag store
+ * before the re-check, pairing with the fence in the peer's publish path, so
+ * either the peer sees the flag or we see the peer's update.
+ */
+static int
+arm (uint32_t* flag, int (*ready)(codius_shm_t*), codius_shm_t* shm)
+{
+  __atomic_store_n (flag, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (ready (shm)) {
+    __atomic_store_n (flag, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+int
+codius_shm_arm (codius_shm_t* shm)
+{
+  return arm (&shm->in->consumer_waiting, codius_shm_readable, shm);
+}
+
+static void
+wake_if_waiting (codius_shm_t* shm, uint32_t* flag)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (flag, __ATOMIC_RELAXED)) {
+    __atomic_store_n (flag, 0, __ATOMIC_RELAXED);
+    ring_doorbell (peer_doorbell (shm));
+  }
+}
+
+static void
+copy_in (codius_shm_t* shm, uint32_t pos, const void* src, size_t len)
+{
+  uint32_t off = pos & shm->mask;
+  size_t first = shm->mask + 1 - off;
+
+  if (first > len)
+    first = len;
+  memcpy (shm->out_data + off, src, first);
+  memcpy (shm->out_data, (const char*)src + first, len - first);
+}
+
+static void
+copy_out (codius_shm_t* shm, uint32_t pos, void* dst, size_t len)
+{
+  uint32_t off = pos & shm->mask;
+  size_t first = shm->mask + 1 - off;
+
+  if (first > len)
+    first = len;
+  memcpy (dst, shm->in_data + off, first);
+  memcpy ((char*)dst + first, shm->in_data, len - first);
+}
+
+static size_t
+max_message (codius_shm_t* shm)
+{
+  return (shm->mask + 1) / 4;
+}
+
+static int
+has_space_for (codius_shm_t* shm, uint32_t rec)
+{
+  uint32_t head = shm->out->head;
+  uint32_t tail = load_acquire (&shm->out->tail);
+  return shm->mask + 1 - (head - tail) >= rec;
+}
+
+/* Room for the largest message, which is what a blocked producer waits for */
+static int
+has_space (codius_shm_t* shm)
+{
+  return has_space_for (shm, record_size (max_message (shm)));
+}
+
+int
+codius_shm_readable (codius_shm_t* shm)
+{
+  return load_acquire (&shm->in->head) != shm->in->tail;
+}
+
+/* Copies one record into the ring if it fits. Returns 0 if it did not fit. */
+static int
+try_push (codius_shm_t* shm, const void* data, size_t len)
+{
+  uint32_t rec = record_size (len);
+  uint32_t head = shm->out->head;
+  uint32_t len32 = len;
+
+  if (!has_space_for (shm, rec))
+    return 0;
+
+  copy_in (shm, head, &len32, sizeof (len32));
+  copy_in (shm, head + sizeof (len32), data, len);
+  store_release (&shm->out->head, head + rec);
+  wake_if_waiting (shm, &shm->out->consumer_waiting);
+  return 1;
+}
+
+int
+codius_shm_arm_send (codius_shm_t* shm)
+{
+  return arm (&shm->out->producer_waiting, has_space, shm);
+}
+
+int
+codius_shm_send (codius_shm_t* shm, const void* data, size_t len, int block)
+{
+  if (len > max_message (shm)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  while (!try_push (shm, data, len)) {
+    if (!block) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (arm (&shm->out->producer_waiting, has_space, shm))
+      wait_doorbell (shm);
+  }
+
+  return 0;
+}
+
+int
+codius_shm_send_queued (codius_shm_t* shm, const void* data, size_t len)
+{
+  uint32_t len32 = len;
+  size_t need;
+
+  if (len > max_message (shm)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (!shm->backlog_len && try_push (shm, data, len))
+    return 0;
+
+  // A peer that stops draining the ring must not grow the backlog forever
+  need = shm->backlog_len + sizeof (len32) + len;
+  if (need > (size_t)shm->mask + 1) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  if (need > shm->backlog_cap) {
+    size_t cap = shm->backlog_cap ? shm->backlog_cap : 4096;
+    char* backlog;
+
+    while (cap < need)
+      cap *= 2;
+    backlog = realloc (shm->backlog, cap);
+    if (!backlog)
+      return -1;
+    shm->backlog = backlog;
+    shm->backlog_cap = cap;
+  }
+
+  memcpy (shm->backlog + shm->backlog_len, &len32, sizeof (len32));
+  memcpy (shm->backlog + shm->backlog_len + sizeof (len32), data, len);
+  shm->backlog_len = need;
+
+  codius_shm_flush (shm);
+  return 0;
+}
+
+size_t
+codius_shm_flush (codius_shm_t* shm)
+{
+  size_t pos = 0;
+
+  for (;;) {
+    while (pos < shm->backlog_len) {
+      uint32_t len32;
+
+      memcpy (&len32, shm->backlog + pos, sizeof (len32));
+      if (!try_push (shm, shm->backlog + pos + sizeof (len32), len32))
+        break;
+      pos += sizeof (len32) + len32;
+    }
+
+    // Ask the consumer to ring us once it has made room, unless it just has
+    if (pos == shm->backlog_len ||
+        arm (&shm->out->producer_waiting, has_space, shm))
+      break;
+  }
+
+  if (pos > 0) {
+    memmove (shm->backlog, shm->backlog + pos, shm->backlog_len - pos);
+    shm->backlog_len -= pos;
+  }
+  return shm->backlog_len;
+}
+
+char*
+codius_shm_recv (codius_shm_t* shm, size_t* len, int block)
+{
+  uint32_t tail = shm->in->tail;
+  uint32_t len32;
+
+  while (!codius_shm_readable (shm)) {
+    // Have the producer ring us when the next message arrives
+    if (!codius_shm_arm (shm))
+      break;
+    if (!block) {
+      errno = EAGAIN;
+      return NULL;
+    }
+    wait_doorbell (shm);
+  }
+
+  copy_out (shm, tail, &len32, sizeof (len32));
+  if (len32 > max_message (shm)) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  if (len32 + 1 > shm->msg_cap) {
+    size_t cap = shm->msg_cap ? shm->msg_cap : 4096;
+    char* msg;
+
+    while (cap < len32 + 1)
+      cap *= 2;
+    msg = realloc (shm->msg, cap);
+    if (!msg)
+      return NULL;
+    shm->msg = msg;
+    shm->msg_cap = cap;
+  }
+
+  copy_out (shm, tail + sizeof (len32), shm->msg, len32);
+  shm->msg[len32] = 0;
+  store_release (&shm->in->tail, tail + record_size (len32));
+  wake_if_waiting (shm, &shm->in->producer_waiting);
+
+  *len = len32;
+  return shm->msg;
+}
+
+static size_t
+round_up_pow2 (size_t size)
+{
+  size_t ret = 4096;
+  while (ret < size)
+    ret *= 2;
+  return ret;
+}
+
+static codius_shm_t*
+map_channel (codius_shm_side_t side, int memfd, int host_doorbell,
+             int guest_doorbell, uint32_t ring_size)
+{
+  codius_shm_t* shm;
+  size_t map_size = sizeof (shm_layout_t) + 2 * (size_t)ring_size;
+  char* base;
+
+  base = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  shm = calloc (1, sizeof (*shm));
+  if (!shm) {
+    munmap (base, map_size);
+    return NULL;
+  }
+
+  shm->side = side;
+  shm->layout = (shm_layout_t*)base;
+  shm->map_size = map_size;
+  shm->memfd = memfd;
+  shm->host_doorbell = host_doorbell;
+  shm->guest_doorbell = guest_doorbell;
+  shm->mask = ring_size - 1;
+
+  if (side == CODIUS_SHM_HOST) {
+    shm->in = &shm->layout->requests;
+    shm->in_data = base + sizeof (shm_layout_t);
+    shm->out = &shm->layout->results;
+    shm->out_data = base + sizeof (shm_layout_t) + ring_size;
+  } else {
+    shm->out = &shm->layout->requests;
+    shm->out_data = base + sizeof (shm_layout_t);
+    shm->in = &shm->layout->results;
+    shm->in_data = base + sizeof (shm_layout_t) + ring_size;
+  }
+
+  return shm;
+}
+
+codius_shm_t*
+codius_shm_create (size_t ring_size)
+{
+  codius_shm_t* shm;
+  shm_layout_t* layout;
+  int memfd;
+  int host_doorbell = -1;
+  int guest_doorbell = -1;
+
+  if (ring_size > (1u << 30)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  ring_size = round_up_pow2 (ring_size);
+
+  memfd = syscall (SYS_memfd_create, "codius-ipc", MFD_CLOEXEC);
+  if (memfd < 0)
+    return NULL;
+
+  if (ftruncate (memfd, sizeof (shm_layout_t) + 2 * ring_size) < 0)
+    goto fail;
+
+  host_doorbell = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  guest_doorbell = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (host_doorbell < 0 || guest_doorbell < 0)
+    goto fail;
+
+  shm = map_channel (CODIUS_SHM_HOST, memfd, host_doorbell, guest_doorbell, ring_size);
+  if (!shm)
+    goto fail;
+
+  // The host starts out idle, waiting for requests
+  layout = shm->layout;
+  layout->ring_size = ring_size;
+  layout->requests.consumer_waiting = 1;
+  __atomic_store_n (&layout->magic, CODIUS_SHM_MAGIC, __ATOMIC_RELEASE);
+  return shm;
+
+fail:
+  close (memfd);
+  if (host_doorbell >= 0)
+    close (host_doorbell);
+  if (guest_doorbell >= 0)
+    close (guest_doorbell);
+  return NULL;
+}
+
+codius_shm_t*
+codius_shm_attach (codius_shm_side_t side, int memfd, int host_doorbell,
+                   int guest_doorbell)
+{
+  shm_layout_t* layout;
+  struct stat st;
+  uint32_t ring_size;
+
+  if (fstat (memfd, &st) < 0)
+    return NULL;
+  if (st.st_size < (off_t)sizeof (*layout))
+    goto invalid;
+
+  // Only mmap() is needed here, which the sandbox allows
+  layout = mmap (NULL, sizeof (*layout), PROT_READ, MAP_SHARED, memfd, 0);
+  if (layout == MAP_FAILED)
+    return NULL;
+  ring_size = layout->ring_size;
+  if (__atomic_load_n (&layout->magic, __ATOMIC_ACQUIRE) != CODIUS_SHM_MAGIC)
+    ring_size = 0;
+  munmap (layout, sizeof (*layout));
+
+  if (ring_size < 4096 || ring_size > (1u << 30) ||
+      (ring_size & (ring_size - 1)) ||
+      st.st_size < (off_t)(sizeof (shm_layout_t) + 2 * (size_t)ring_size))
+    goto invalid;
+
+  return map_channel (side, memfd, host_doorbell, guest_doorbell, ring_size);
+
+invalid:
+  errno = EINVAL;
+  return NULL;
+}
+
+void
+codius_shm_free (codius_shm_t* shm)
+{
+  if (!shm)
+    return;
+
+  munmap (shm->layout, shm->map_size);
+  close (shm->memfd);
+  close (shm->host_doorbell);
+  close (shm->guest_doorbell);
+  free (shm->msg);
+  free (shm->backlog);
+  if (shm->context_free)
+    shm->context_free (shm->context);
+  free (shm);
+}
+
+void
+codius_shm_set_context (codius_shm_t* shm, void* context,
+                        void (*free_fn)(void*))
+{
+  if (shm->context_free)
+    shm->context_free (shm->context);
+  shm->context = context;
+  shm->context_free = free_fn;
+}
+
+void*
+codius_shm_context (codius_shm_t* shm)
+{
+  return shm->context;
+}
+
+int
+codius_shm_memfd (codius_shm_t* shm)
+{
+  return shm->memfd;
+}
+
+int
+codius_shm_host_doorbell (codius_shm_t* shm)
+{
+  return shm->host_doorbell;
+}
+
+int
+codius_shm_guest_doorbell (codius_shm_t* shm)
+{
+  return shm->guest_doorbell;
+}
+
+int
+codius_shm_doorbell (codius_shm_t* shm)
+{
+  return own_doorbell (shm);
+}
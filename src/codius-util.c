@@ -4,14 +4,174 @@
 #include <signal.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "codius-util.h"
+#include "codius-cbor.h"
+#include "codius-shm.h"
 
-char*
-codius_request_to_string (codius_request_t* request)
+#define CODIUS_MAX_INTERNED_NAMES 256
+
+static codius_encoding_t default_encoding = CODIUS_ENCODING_JSON;
+static char* interned_names[CODIUS_MAX_INTERNED_NAMES];
+static int interned_count = 0;
+
+void
+codius_set_encoding (codius_encoding_t encoding)
+{
+  default_encoding = encoding;
+}
+
+int
+codius_intern_name (const char* name)
+{
+  int i;
+
+  for (i = 0; i < interned_count; i++) {
+    if (strcmp (interned_names[i], name) == 0)
+      return i;
+  }
+
+  if (interned_count == CODIUS_MAX_INTERNED_NAMES)
+    return -1;
+
+  interned_names[interned_count] = strdup (name);
+  return interned_count++;
+}
+
+static int
+lookup_interned_name (const char* name)
+{
+  int i;
+
+  for (i = 0; i < interned_count; i++) {
+    if (strcmp (interned_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Interned names as known to one connection. A sender spells a name out as
+ * [id, name] the first time it uses it on a connection and sends the bare ID
+ * after that, so the receiver learns every ID from the connection itself and
+ * the two sides never have to register names in the same order.
+ */
+typedef struct {
+  /* Names the peer has defined, by ID */
+  char* received[CODIUS_MAX_INTERNED_NAMES];
+  /* Bit set of the IDs already defined to the peer */
+  unsigned char sent[CODIUS_MAX_INTERNED_NAMES / 8];
+} name_table_t;
+
+/* IDs a frame defines, which count as sent once the frame is */
+typedef struct {
+  int ids[2];
+  int count;
+} name_defs_t;
+
+static void
+name_table_free (void* data)
+{
+  name_table_t* table = data;
+  int i;
+
+  if (!table)
+    return;
+
+  for (i = 0; i < CODIUS_MAX_INTERNED_NAMES; i++)
+    free (table->received[i]);
+  free (table);
+}
+
+static int
+name_sent (name_table_t* table, int id)
+{
+  return __atomic_load_n (&table->sent[id / 8], __ATOMIC_ACQUIRE) & (1 << (id % 8));
+}
+
+static void
+mark_names_sent (name_table_t* table, const name_defs_t* defs)
+{
+  int i;
+
+  for (i = 0; table && i < defs->count; i++)
+    __sync_fetch_and_or (&table->sent[defs->ids[i] / 8], 1 << (defs->ids[i] % 8));
+}
+
+static int
+encode_name (codius_cbor_buf_t* buf, const char* name, name_table_t* table,
+             name_defs_t* defs)
+{
+  int id = table ? lookup_interned_name (name) : -1;
+
+  if (id < 0)
+    return codius_cbor_encode_string (buf, name);
+
+  if (name_sent (table, id))
+    return codius_cbor_encode_uint (buf, id);
+
+  defs->ids[defs->count++] = id;
+  if (codius_cbor_encode_array (buf, 2) < 0 ||
+      codius_cbor_encode_uint (buf, id) < 0)
+    return -1;
+  return codius_cbor_encode_string (buf, name);
+}
+
+static int
+decode_name_id (const JsonNode* node)
+{
+  if (node->tag == JSON_NUMBER && node->number_ >= 0 &&
+      node->number_ < CODIUS_MAX_INTERNED_NAMES &&
+      node->number_ == (int)node->number_)
+    return (int)node->number_;
+  return -1;
+}
+
+/*
+ * Names arrive as strings, as the [id, name] that defines an ID, or as an ID
+ * that was defined earlier on the same connection
+ */
+static char*
+decode_name (const JsonNode* node, name_table_t* table)
+{
+  const JsonNode* name;
+  char* copy;
+  int id;
+
+  if (node->tag == JSON_STRING)
+    return strdup (node->string_);
+
+  if (!table)
+    return NULL;
+
+  if (node->tag == JSON_ARRAY) {
+    node = json_first_child (node);
+    name = node ? node->next : NULL;
+    if (!name || name->next || name->tag != JSON_STRING)
+      return NULL;
+
+    id = decode_name_id (node);
+    if (id < 0 || !(copy = strdup (name->string_)))
+      return NULL;
+    free (table->received[id]);
+    table->received[id] = copy;
+    return strdup (copy);
+  }
+
+  id = decode_name_id (node);
+  if (id < 0 || !table->received[id])
+    return NULL;
+  return strdup (table->received[id]);
+}
+
+/* Appends the JSON object {api, method, arguments} for @p request to @p buf */
+static void
+request_to_json (codius_request_t* request, codius_cbor_buf_t* buf)
 {
   JsonNode* req;
-  char *buf;
 
   assert (request);
   assert (request->api_name);
@@ -26,96 +186,730 @@ codius_request_to_string (codius_request_t* request)
   else
     json_append_member (req, "arguments", json_mknull());
 
-  buf = json_encode (req);
+  buf->len = json_encode_append (req, &buf->data, &buf->cap, buf->len);
+
+  // The arguments still belong to the request
+  if (request->data)
+    json_remove_from_parent (request->data);
   json_delete (req);
+}
+
+/* Requests are sent as the CBOR array [api, method, arguments] */
+static int
+request_to_cbor (codius_request_t* request, codius_cbor_buf_t* buf,
+                 name_table_t* names, name_defs_t* defs)
+{
+  JsonNode null_node;
+
+  memset (&null_node, 0, sizeof (null_node));
+  null_node.tag = JSON_NULL;
+
+  if (codius_cbor_encode_array (buf, 3) < 0 ||
+      encode_name (buf, request->api_name, names, defs) < 0 ||
+      encode_name (buf, request->method_name, names, defs) < 0)
+    return -1;
+
+  return codius_cbor_encode (buf, request->data ? request->data : &null_node);
+}
+
+static codius_request_t*
+request_from_cbor (const char* buf, size_t size, name_table_t* names)
+{
+  JsonArena* arena = json_arena_new ();
+  codius_request_t* ret = NULL;
+  JsonNode* req;
+  JsonNode* api;
+  JsonNode* method;
+  JsonNode* args;
+  char* api_name = NULL;
+  char* method_name = NULL;
+  size_t consumed;
+
+  req = codius_cbor_decode_in (buf, size, &consumed, arena);
+  if (!req) {
+    json_arena_free (arena);
+    return NULL;
+  }
+
+  if (consumed != size || req->tag != JSON_ARRAY)
+    goto out;
+
+  api = json_first_child (req);
+  method = api ? api->next : NULL;
+  args = method ? method->next : NULL;
+  if (!args || args->next)
+    goto out;
+
+  api_name = decode_name (api, names);
+  method_name = decode_name (method, names);
+  if (!api_name || !method_name)
+    goto out;
+
+  ret = codius_request_new (api_name, method_name);
+  if (args->tag != JSON_NULL) {
+    json_remove_from_parent (args);
+    ret->data = args;
+  }
+  ret->_arena = arena;
+  arena = NULL;
+
+out:
+  json_arena_free (arena);
+  free (api_name);
+  free (method_name);
+  return ret;
+}
+
+/* Waits until a non-blocking descriptor is ready for @p events */
+static int
+wait_fd (int fd, short events)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+    return -1;
+  return 0;
+}
+
+/*
+ * Writes every byte of @p iov, resuming after short writes. A non-blocking
+ * descriptor is waited on, so replies are never sent in part.
+ */
+static int
+write_all (int fd, struct iovec* iov, int iovcnt)
+{
+  ssize_t written;
+
+  while (iovcnt > 0) {
+    written = writev (fd, iov, iovcnt);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd (fd, POLLOUT) == 0)
+        continue;
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+static void
+fill_header (codius_rpc_header_t* rpc_header, codius_encoding_t encoding,
+             unsigned long id, size_t size)
+{
+  rpc_header->magic_bytes = encoding == CODIUS_ENCODING_CBOR ?
+    CODIUS_MAGIC_BYTES_CBOR : CODIUS_MAGIC_BYTES;
+  rpc_header->callback_id = id;
+  rpc_header->size = size;
+}
+
+/*
+ * Writes a whole frame with a single write, so the peer never sees half of
+ * it. Frees the frame.
+ */
+static int
+write_frame (int fd, codius_cbor_buf_t* frame)
+{
+  struct iovec iov;
+  int ret;
+
+  iov.iov_base = frame->data;
+  iov.iov_len = frame->len;
+  ret = write_all (fd, &iov, 1);
+  free (frame->data);
+
+  if (ret < 0) {
+    perror("write()");
+    printf("Error writing to fd %d\n", fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Appends a complete frame for @p result to @p out: the header is reserved,
+ * the body encoded right after it, then the header filled in.
+ */
+static int
+append_result_frame (codius_cbor_buf_t* out, codius_result_t* result)
+{
+  codius_rpc_header_t rpc_header;
+  size_t header_pos = out->len;
+  size_t body_size;
+
+  memset (&rpc_header, 0, sizeof (rpc_header));
+  if (codius_cbor_append (out, &rpc_header, sizeof (rpc_header)) < 0)
+    return -1;
+
+  // A result without data has an empty body
+  if (result->_encoding == CODIUS_ENCODING_CBOR) {
+    if (result->data && codius_cbor_encode (out, result->data) < 0)
+      goto fail;
+  } else if (result->data) {
+    out->len = json_encode_append (result->data, &out->data, &out->cap, out->len);
+  }
+
+  body_size = out->len - header_pos - sizeof (rpc_header);
+  fill_header (&rpc_header, result->_encoding, result->_id, body_size);
+  memcpy (out->data + header_pos, &rpc_header, sizeof (rpc_header));
+  return 0;
+
+fail:
+  out->len = header_pos;
+  return -1;
+}
+
+/*
+ * Appends a complete frame for @p request to @p out. Names the frame defines
+ * to the peer are added to @p defs.
+ */
+static int
+append_request_frame (codius_cbor_buf_t* out, codius_request_t* request,
+                      name_table_t* names, name_defs_t* defs)
+{
+  codius_rpc_header_t rpc_header;
+  size_t header_pos = out->len;
+  size_t body_size;
+
+  memset (&rpc_header, 0, sizeof (rpc_header));
+  if (codius_cbor_append (out, &rpc_header, sizeof (rpc_header)) < 0)
+    return -1;
+
+  if (request->encoding == CODIUS_ENCODING_CBOR) {
+    if (request_to_cbor (request, out, names, defs) < 0)
+      goto fail;
+  } else {
+    request_to_json (request, out);
+  }
+
+  body_size = out->len - header_pos - sizeof (rpc_header);
+  fill_header (&rpc_header, request->encoding, request->_id, body_size);
+  memcpy (out->data + header_pos, &rpc_header, sizeof (rpc_header));
+  return 0;
+
+fail:
+  out->len = header_pos;
+  return -1;
+}
+
+/*
+ * Receive buffer for one descriptor. Bytes in [start, end) have been read but
+ * not consumed yet, and may hold several frames.
+ */
+typedef struct {
+  char* data;
+  size_t start;
+  size_t end;
+  size_t cap;
+  /* Byte overwritten to NUL-terminate the last frame handed out */
+  size_t saved_pos;
+  char saved;
+  int has_saved;
+} frame_buf_t;
+
+/* Buffers larger than this are released once they are drained */
+#define CODIUS_FRAME_BUF_RETAIN (1024 * 1024)
+#define CODIUS_FRAME_BUF_MIN 4096
+/* JSON results larger than CODIUS_MAX_MESSAGE_SIZE are parsed in chunks of this size */
+#define CODIUS_STREAM_CHUNK (64 * 1024)
+
+/*
+ * Receive buffer, queued replies and interned names of one descriptor. Bytes
+ * [out_sent, out.len) of @p out are queued replies that have not been written
+ * yet. Every state gets a new @p serial, so requests can tell whether their
+ * descriptor has been forgotten since they were read.
+ */
+typedef struct {
+  frame_buf_t in;
+  codius_cbor_buf_t out;
+  size_t out_sent;
+  name_table_t* names;
+  unsigned long serial;
+} fd_state_t;
+
+static fd_state_t** fd_states = NULL;
+static int fd_state_count = 0;
+static int fd_states_lock = 0;
+static unsigned long next_fd_serial = 1;
+
+static void
+lock_fd_states ()
+{
+  while (__sync_lock_test_and_set (&fd_states_lock, 1))
+    ;
+}
+
+static void
+unlock_fd_states ()
+{
+  __sync_lock_release (&fd_states_lock);
+}
+
+static fd_state_t*
+fd_state_for (int fd)
+{
+  fd_state_t* state = NULL;
+
+  if (fd < 0)
+    return NULL;
+
+  lock_fd_states ();
+  if (fd >= fd_state_count) {
+    int count = fd_state_count ? fd_state_count : 16;
+    fd_state_t** states;
+
+    while (count <= fd)
+      count *= 2;
+    states = realloc (fd_states, count * sizeof (*states));
+    if (!states)
+      goto out;
+    memset (states + fd_state_count, 0, (count - fd_state_count) * sizeof (*states));
+    fd_states = states;
+    fd_state_count = count;
+  }
+
+  if (!fd_states[fd]) {
+    fd_states[fd] = calloc (1, sizeof (fd_state_t));
+    if (fd_states[fd])
+      fd_states[fd]->serial = next_fd_serial++;
+  }
+  state = fd_states[fd];
+
+out:
+  unlock_fd_states ();
+  return state;
+}
+
+/* Like fd_state_for(), but never creates the state */
+static fd_state_t*
+fd_state_find (int fd)
+{
+  fd_state_t* state = NULL;
+
+  lock_fd_states ();
+  if (fd >= 0 && fd < fd_state_count)
+    state = fd_states[fd];
+  unlock_fd_states ();
+  return state;
+}
+
+static frame_buf_t*
+frame_buf_for (int fd)
+{
+  fd_state_t* state = fd_state_for (fd);
+  return state ? &state->in : NULL;
+}
+
+static name_table_t*
+name_table_for (int fd)
+{
+  fd_state_t* state = fd_state_for (fd);
+  name_table_t* table;
+
+  if (!state)
+    return NULL;
+
+  if (!__atomic_load_n (&state->names, __ATOMIC_ACQUIRE)) {
+    table = calloc (1, sizeof (*table));
+    if (table && !__sync_bool_compare_and_swap (&state->names, NULL, table))
+      free (table);
+  }
+  return state->names;
+}
+
+static name_table_t*
+shm_name_table_for (codius_shm_t* shm)
+{
+  name_table_t* table = codius_shm_context (shm);
+
+  if (!table) {
+    table = calloc (1, sizeof (*table));
+    if (table)
+      codius_shm_set_context (shm, table, name_table_free);
+  }
+  return table;
+}
+
+static void
+restore_saved (frame_buf_t* fb)
+{
+  if (fb->has_saved) {
+    fb->data[fb->saved_pos] = fb->saved;
+    fb->has_saved = 0;
+  }
+}
+
+static int
+frame_buf_reserve (frame_buf_t* fb, size_t size)
+{
+  size_t cap;
+  char* data;
+
+  // Move unconsumed bytes to the front before growing
+  if (fb->start) {
+    memmove (fb->data, fb->data + fb->start, fb->end - fb->start);
+    fb->end -= fb->start;
+    fb->start = 0;
+  }
+
+  if (fb->cap >= size)
+    return 0;
+
+  cap = fb->cap ? fb->cap : CODIUS_FRAME_BUF_MIN;
+  while (cap < size)
+    cap *= 2;
+
+  data = realloc (fb->data, cap);
+  if (!data)
+    return -1;
+  fb->data = data;
+  fb->cap = cap;
+  return 0;
+}
+
+/*
+ * Reads whatever is available, blocking only while the buffer is empty. On a
+ * non-blocking descriptor this fails with EAGAIN instead, and the bytes read
+ * so far stay buffered for the next call.
+ */
+static int
+frame_buf_fill (int fd, frame_buf_t* fb, size_t want)
+{
+  ssize_t bytes_read;
+
+  if (frame_buf_reserve (fb, want) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  do {
+    bytes_read = read (fd, fb->data + fb->end, fb->cap - fb->end);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  if (bytes_read == 0)
+    errno = ECONNRESET;
+  if (bytes_read <= 0)
+    return -1;
+
+  fb->end += bytes_read;
+  return 0;
+}
+
+/* Reports a failed read, unless the descriptor merely had nothing yet */
+static void
+report_read_error (int fd)
+{
+  int saved_errno = errno;
+
+  if (saved_errno != EAGAIN && saved_errno != EWOULDBLOCK)
+    fprintf (stderr, "Error reading from fd %d: %s\n", fd, strerror (saved_errno));
+  errno = saved_errno;
+}
+
+static int
+parse_magic (unsigned long magic, codius_encoding_t* encoding)
+{
+  if (magic == CODIUS_MAGIC_BYTES)
+    *encoding = CODIUS_ENCODING_JSON;
+  else if (magic == CODIUS_MAGIC_BYTES_CBOR)
+    *encoding = CODIUS_ENCODING_CBOR;
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * Makes sure the header of the next frame has been read and checks it against
+ * @p max_size. The header is left in the buffer.
+ */
+static int
+read_header (int fd, frame_buf_t* fb, codius_rpc_header_t* rpc_header,
+             codius_encoding_t* encoding, size_t max_size)
+{
+  restore_saved (fb);
+  if (fb->start == fb->end && fb->cap > CODIUS_FRAME_BUF_RETAIN) {
+    free (fb->data);
+    memset (fb, 0, sizeof (*fb));
+  }
+
+  while (fb->end - fb->start < sizeof (*rpc_header)) {
+    if (frame_buf_fill (fd, fb, fb->end - fb->start + sizeof (*rpc_header)) < 0) {
+      report_read_error (fd);
+      return -1;
+    }
+  }
+
+  memcpy (rpc_header, fb->data + fb->start, sizeof (*rpc_header));
+
+  if (parse_magic (rpc_header->magic_bytes, encoding) < 0) {
+    printf("Error reading from fd %d\n", fd);
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (rpc_header->size > max_size) {
+    printf("Message too large from fd %d\n", fd);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Reads the rest of a frame whose header read_header() accepted, looping over
+ * short reads. The body is NUL-terminated so JSON can be parsed in place, and
+ * stays valid until the next frame is read from @p fd. Returns NULL on
+ * failure, or with errno EAGAIN if a non-blocking @p fd has no more bytes
+ * yet; the frame then stays buffered from its header on.
+ */
+static char*
+read_body (int fd, frame_buf_t* fb, const codius_rpc_header_t* rpc_header)
+{
+  size_t frame_size;
+  char* body;
+
+  // One extra byte leaves room for the terminating NUL
+  frame_size = sizeof (*rpc_header) + rpc_header->size;
+  while (fb->end - fb->start < frame_size) {
+    if (frame_buf_fill (fd, fb, frame_size + 1) < 0) {
+      report_read_error (fd);
+      return NULL;
+    }
+  }
+  if (frame_buf_reserve (fb, fb->end + 1) < 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  body = fb->data + fb->start + sizeof (*rpc_header);
+  fb->start += frame_size;
+
+  fb->saved_pos = fb->start;
+  fb->saved = fb->data[fb->start];
+  fb->has_saved = 1;
+  fb->data[fb->start] = 0;
+
+  if (fb->start == fb->end) {
+    fb->start = 0;
+    fb->end = 0;
+  }
+
+  return body;
+}
+
+/* Reads one frame. Returns its body, or NULL on failure. */
+static char*
+read_message (int fd, codius_rpc_header_t* rpc_header, codius_encoding_t* encoding,
+              size_t max_size)
+{
+  frame_buf_t* fb = frame_buf_for (fd);
+
+  if (!fb || read_header (fd, fb, rpc_header, encoding, max_size) < 0)
+    return NULL;
+
+  return read_body (fd, fb, rpc_header);
+}
+
+/*
+ * Parses a large JSON body while it arrives instead of buffering all of it
+ * first, so only about CODIUS_STREAM_CHUNK bytes are held besides the tree.
+ * The whole body is always consumed, even if it fails to parse. Returns -1
+ * if reading fails; @p out is NULL if the body was not valid JSON. The tree
+ * is allocated from @p arena.
+ */
+static int
+read_json_streaming (int fd, frame_buf_t* fb, const codius_rpc_header_t* rpc_header,
+                     JsonArena* arena, JsonNode** out)
+{
+  JsonParser* parser = json_parser_new_tree_in (arena);
+  size_t remaining = rpc_header->size;
+  int ok = 1;
+
+  fb->start += sizeof (*rpc_header);
+
+  while (remaining) {
+    size_t available;
+
+    if (fb->start == fb->end) {
+      fb->start = 0;
+      fb->end = 0;
+      if (frame_buf_fill (fd, fb, CODIUS_STREAM_CHUNK) < 0) {
+        // Part of the body is parsed already, so the rest cannot wait
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd (fd, POLLIN) == 0)
+          continue;
+        report_read_error (fd);
+        json_parser_free (parser);
+        return -1;
+      }
+    }
+
+    available = fb->end - fb->start;
+    if (available > remaining)
+      available = remaining;
+
+    if (ok)
+      ok = json_parser_feed (parser, fb->data + fb->start, available);
+    fb->start += available;
+    remaining -= available;
+  }
+
+  if (fb->start == fb->end) {
+    fb->start = 0;
+    fb->end = 0;
+  }
+
+  *out = ok && json_parser_finish (parser) ? json_parser_take_root (parser) : NULL;
+  json_parser_free (parser);
+  return 0;
+}
+
+int
+codius_has_buffered_message (int fd)
+{
+  frame_buf_t* fb = frame_buf_for (fd);
+  codius_rpc_header_t rpc_header;
+  size_t available;
+
+  if (!fb)
+    return 0;
+
+  available = fb->end - fb->start;
+  if (available < sizeof (rpc_header))
+    return 0;
+
+  restore_saved (fb);
+  memcpy (&rpc_header, fb->data + fb->start, sizeof (rpc_header));
+  return available - sizeof (rpc_header) >= rpc_header.size;
+}
+
+void
+codius_forget_fd (int fd)
+{
+  fd_state_t* state = NULL;
+
+  lock_fd_states ();
+  if (fd >= 0 && fd < fd_state_count) {
+    state = fd_states[fd];
+    fd_states[fd] = NULL;
+  }
+  unlock_fd_states ();
+
+  if (state) {
+    free (state->in.data);
+    free (state->out.data);
+    name_table_free (state->names);
+    free (state);
+  }
+}
+
+char*
+codius_request_to_string (codius_request_t* request)
+{
+  codius_cbor_buf_t buf = {NULL, 0, 0};
+
+  request_to_json (request, &buf);
+  return buf.data;
+}
+
+int
+codius_write_request (const int fd, codius_request_t* request)
+{
+  codius_cbor_buf_t frame = {NULL, 0, 0};
+  name_defs_t defs = {{0, 0}, 0};
+  name_table_t* names = NULL;
+
+  assert (request->api_name);
+  assert (request->method_name);
+
+  if (request->encoding == CODIUS_ENCODING_CBOR)
+    names = name_table_for (fd);
+
+  if (append_request_frame (&frame, request, names, &defs) < 0) {
+    free (frame.data);
+    return -1;
+  }
+
+  if (write_frame (fd, &frame) < 0)
+    return -1;
 
-  return buf;
+  mark_names_sent (names, &defs);
+  return 0;
 }
 
-int
-codius_write_request (const int fd, codius_request_t* request)
+static codius_request_t*
+request_from_body (const codius_rpc_header_t* rpc_header,
+                   codius_encoding_t encoding, const char* buf,
+                   name_table_t* names)
 {
-  char* buf;
-  codius_rpc_header_t rpc_header;
-  int ret = 0;
-  
-  buf = codius_request_to_string (request);
-  rpc_header.magic_bytes = CODIUS_MAGIC_BYTES;
-  rpc_header.callback_id = request->_id;
-  rpc_header.size = strlen (buf);
-  
-  if (-1==write(fd, &rpc_header, sizeof(rpc_header)) ||
-      -1==write(fd, buf, rpc_header.size)) {
-    perror("write()");
-    printf("Error writing to fd %d\n", fd);
-    ret = -1;
+  codius_request_t* request;
+
+  if (encoding == CODIUS_ENCODING_CBOR)
+    request = request_from_cbor (buf, rpc_header->size, names);
+  else
+    request = codius_request_from_string (buf);
+
+  if (request) {
+    request->_id = rpc_header->callback_id;
+    request->encoding = encoding;
   }
 
-  free (buf);
-  return ret;
+  return request;
 }
 
 codius_request_t*
 codius_read_request(int fd)
 {
-  ssize_t bytes_read;
   codius_rpc_header_t rpc_header;
-  codius_request_t* request = NULL;
+  codius_request_t* request;
+  fd_state_t* state;
+  codius_encoding_t encoding;
   char* buf;
 
-  bytes_read = read(fd, &rpc_header, sizeof(rpc_header));
-
-  if (bytes_read==-1 || rpc_header.magic_bytes!=CODIUS_MAGIC_BYTES) {
-    printf("Error reading from fd %d\n", fd);
+  buf = read_message (fd, &rpc_header, &encoding, CODIUS_MAX_REQUEST_SIZE);
+  if (!buf)
     return NULL;
-  }
-  
-  if (rpc_header.size > CODIUS_MAX_RESPONSE_SIZE) {
-    printf("Message too large from fd %d\n", fd);
-    abort();
-  }
 
-  buf = malloc (rpc_header.size+1);
-  bytes_read = read(fd, buf, rpc_header.size);
-  buf[rpc_header.size] = 0;
-
-  if (bytes_read==-1) {
-    perror("read()");
-    printf("Error reading from fd %d\n", fd);
-    goto out;
+  request = request_from_body (&rpc_header, encoding, buf,
+                               encoding == CODIUS_ENCODING_CBOR ?
+                               name_table_for (fd) : NULL);
+  if (!request) {
+    errno = EPROTO;
+    return NULL;
   }
 
-  request = codius_request_from_string (buf);
-
-  request->_id = rpc_header.callback_id;
+  state = fd_state_for (fd);
   request->_fd = fd;
+  request->_fd_serial = state ? state->serial : 0;
 
-out:
-  free (buf);
   return request;
 }
 
 int
 codius_write_result (int fd, codius_result_t* result)
 {
-  char* buf;
-  codius_rpc_header_t rpc_header;
-  int ret = 0;
-
-  buf = codius_result_to_string (result);
-  rpc_header.magic_bytes = CODIUS_MAGIC_BYTES;
-  rpc_header.callback_id = result->_id;
-  rpc_header.size = strlen (buf);
+  codius_cbor_buf_t frame = {NULL, 0, 0};
 
-  if (-1==write(fd, &rpc_header, sizeof(rpc_header)) ||
-      -1==write(fd, buf, rpc_header.size)) {
-    perror("write()");
-    printf("Error writing to fd %d\n", fd);
-    ret = -1;
+  if (append_result_frame (&frame, result) < 0) {
+    free (frame.data);
+    return -1;
   }
 
-  free (buf);
-  return ret;
+  return write_frame (fd, &frame);
 }
 
 char*
@@ -129,41 +923,59 @@ codius_result_to_string (codius_result_t* result)
   return strdup ("");
 }
 
+static codius_result_t*
+result_from_body (const codius_rpc_header_t* rpc_header,
+                  codius_encoding_t encoding, const char* buf)
+{
+  codius_result_t* result;
+
+  if (encoding == CODIUS_ENCODING_CBOR) {
+    result = codius_result_new ();
+    if (rpc_header->size) {
+      result->_arena = json_arena_new ();
+      result->data = codius_cbor_decode_in (buf, rpc_header->size, NULL,
+                                            result->_arena);
+    }
+  } else {
+    result = codius_result_from_string (buf);
+  }
+
+  result->_id = rpc_header->callback_id;
+  result->_encoding = encoding;
+
+  return result;
+}
+
 codius_result_t*
 codius_read_result (const int fd)
 {
-  ssize_t bytes_read;
   codius_rpc_header_t rpc_header;
-  codius_result_t* result = NULL;
-  char* buf = NULL;
-
-  bytes_read = read(fd, &rpc_header, sizeof(rpc_header));
+  codius_encoding_t encoding;
+  codius_result_t* result;
+  frame_buf_t* fb;
+  char* buf;
 
-  if (bytes_read==-1 || rpc_header.magic_bytes!=CODIUS_MAGIC_BYTES) {
-    printf("Error reading from fd %d\n", fd);
+  fb = frame_buf_for (fd);
+  if (!fb || read_header (fd, fb, &rpc_header, &encoding, CODIUS_MAX_RESPONSE_SIZE) < 0)
     return NULL;
-  }
-  
-  if (rpc_header.size > CODIUS_MAX_RESPONSE_SIZE) {
-    printf("Message too large from fd %d\n", fd);
-    abort();
-  }
 
-  buf = malloc (rpc_header.size);
-  bytes_read = read(fd, buf, rpc_header.size);
-
-  if (bytes_read==-1) {
-    perror("read()");
-    printf("Error reading from fd %d\n", fd);
-    goto out;
+  if (encoding == CODIUS_ENCODING_JSON && rpc_header.size > CODIUS_MAX_MESSAGE_SIZE) {
+    result = codius_result_new ();
+    result->_arena = json_arena_new ();
+    if (read_json_streaming (fd, fb, &rpc_header, result->_arena, &result->data) < 0) {
+      codius_result_free (result);
+      return NULL;
+    }
+    result->_id = rpc_header.callback_id;
+    result->_encoding = encoding;
+    return result;
   }
 
-  result = codius_result_from_string (buf);
-  result->_id = rpc_header.callback_id;
+  buf = read_body (fd, fb, &rpc_header);
+  if (!buf)
+    return NULL;
 
-out:
-  free (buf);
-  return result;
+  return result_from_body (&rpc_header, encoding, buf);
 }
 
 /* Make synchronous function call outside the sandbox.
@@ -190,11 +1002,25 @@ void
 codius_result_free (codius_result_t* result)
 {
   if (result) {
-    json_delete (result->data);
+    // A tree that was read in lives in the arena, and goes away with it
+    if (result->data && !result->data->in_arena)
+      json_delete (result->data);
+    json_arena_free (result->_arena);
     free (result);
   }
 }
 
+JsonNode*
+codius_result_take_data (codius_result_t* result, JsonArena** arena)
+{
+  JsonNode* data = result->data;
+
+  *arena = result->_arena;
+  result->data = NULL;
+  result->_arena = NULL;
+  return data;
+}
+
 static int next_request_id = 0;
 
 codius_request_t*
@@ -204,6 +1030,7 @@ codius_request_new (const char* api_name, const char* method_name)
   memset (ret, 0, sizeof (*ret));
   ret->api_name = strdup (api_name);
   ret->method_name = strdup (method_name);
+  ret->encoding = default_encoding;
   //FIXME: gcc-4.8 lacks stdatomic.h, so we're stuck with gcc builtins :(
   //see also: https://gcc.gnu.org/bugzilla/show_bug.cgi?id=58016
   ret->_id = __sync_fetch_and_add (&next_request_id, 1);
@@ -215,32 +1042,54 @@ codius_request_free (codius_request_t* request)
 {
   free (request->api_name);
   free (request->method_name);
+  json_arena_free (request->_arena);
   free (request);
 }
 
+JsonNode*
+codius_request_take_data (codius_request_t* request, JsonArena** arena)
+{
+  JsonNode* data = request->data;
+
+  *arena = request->_arena;
+  request->data = NULL;
+  request->_arena = NULL;
+  return data;
+}
+
 codius_request_t*
 codius_request_from_string (const char* buf)
 {
+  JsonArena* arena = json_arena_new ();
   codius_request_t* ret;
   JsonNode* req;
+  JsonNode* api;
+  JsonNode* method;
   JsonNode* child;
   char* api_name;
   char* method_name;
 
-  req = json_decode (buf);
-
-  child = json_find_member (req, "api");
-  api_name = strdup (child->string_);
-  child = json_find_member (req, "method");
-  method_name = strdup (child->string_);
+  req = json_decode_in (buf, arena);
+  api = json_find_member (req, "api");
+  method = json_find_member (req, "method");
   child = json_find_member (req, "arguments");
 
+  // Requests come from the guest, so anything may be missing
+  if (!api || api->tag != JSON_STRING ||
+      !method || method->tag != JSON_STRING || !child) {
+    json_arena_free (arena);
+    return NULL;
+  }
+
+  api_name = strdup (api->string_);
+  method_name = strdup (method->string_);
   ret = codius_request_new (api_name, method_name);
 
-  if (child->tag != JSON_NULL)
+  if (child->tag != JSON_NULL) {
+    json_remove_from_parent (child);
     ret->data = child;
-
-  json_delete (req);
+  }
+  ret->_arena = arena;
 
   free (api_name);
   free (method_name);
@@ -253,13 +1102,553 @@ codius_result_t* codius_result_from_string (const char* buf)
   codius_result_t* ret;
 
   ret = codius_result_new ();
-  ret->data = json_decode (buf);
+  ret->_arena = json_arena_new ();
+  ret->data = json_decode_in (buf, ret->_arena);
 
   return ret;
 }
 
 int codius_send_reply (codius_request_t* request, codius_result_t* result)
 {
+  codius_cbor_buf_t frame = {NULL, 0, 0};
+  int ret;
+
+  result->_id = request->_id;
+  result->_encoding = request->encoding;
+
+  if (!request->_shm) {
+    // Goes through the queue, so a full non-blocking socket never blocks
+    if (codius_queue_reply (request, result) < 0)
+      return -1;
+    return codius_flush_replies (request->_fd);
+  }
+
+  // The ring batches by itself, and the guest is only woken if it sleeps
+  ret = append_result_frame (&frame, result);
+  if (ret == 0)
+    ret = codius_shm_send_queued (request->_shm, frame.data, frame.len);
+  free (frame.data);
+  return ret;
+}
+
+int
+codius_queue_reply (codius_request_t* request, codius_result_t* result)
+{
+  fd_state_t* state;
+  size_t old_len;
+
+  if (request->_shm)
+    return codius_send_reply (request, result);
+
+  // A forgotten descriptor may since have been reused by another channel
+  state = fd_state_find (request->_fd);
+  if (!state || state->serial != request->_fd_serial) {
+    errno = EBADF;
+    return -1;
+  }
+
+  // Reclaim the part that has been written once it is most of the buffer
+  if (state->out_sent && state->out_sent >= state->out.len / 2) {
+    memmove (state->out.data, state->out.data + state->out_sent,
+             state->out.len - state->out_sent);
+    state->out.len -= state->out_sent;
+    state->out_sent = 0;
+  }
+
   result->_id = request->_id;
-  return codius_write_result (request->_fd, result);
+  result->_encoding = request->encoding;
+  old_len = state->out.len;
+  if (append_result_frame (&state->out, result) < 0)
+    return -1;
+
+  if (old_len > state->out_sent &&
+      state->out.len - state->out_sent > CODIUS_MAX_REPLY_BACKLOG) {
+    state->out.len = old_len;
+    errno = ENOBUFS;
+    return -1;
+  }
+  return 0;
+}
+
+int
+codius_flush_replies (int fd)
+{
+  fd_state_t* state = fd_state_find (fd);
+  ssize_t written;
+  int err = 0;
+
+  if (!state)
+    return 0;
+
+  while (state->out_sent < state->out.len) {
+    written = write (fd, state->out.data + state->out_sent,
+                     state->out.len - state->out_sent);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      // The rest goes out once the descriptor is writable again
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+
+      err = errno;
+      perror("write()");
+      printf("Error writing to fd %d\n", fd);
+      break;
+    }
+    state->out_sent += written;
+  }
+
+  // Everything was written, or nothing queued can be delivered any more
+  state->out.len = 0;
+  state->out_sent = 0;
+  if (state->out.cap > CODIUS_FRAME_BUF_RETAIN) {
+    free (state->out.data);
+    memset (&state->out, 0, sizeof (state->out));
+  }
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+size_t
+codius_reply_backlog (int fd)
+{
+  fd_state_t* state = fd_state_find (fd);
+
+  return state ? state->out.len - state->out_sent : 0;
+}
+
+int
+codius_flush_all_replies ()
+{
+  int ret = 0;
+  int count;
+  int fd;
+
+  lock_fd_states ();
+  count = fd_state_count;
+  unlock_fd_states ();
+
+  for (fd = 0; fd < count; fd++) {
+    fd_state_t* state;
+
+    lock_fd_states ();
+    state = fd_states[fd];
+    unlock_fd_states ();
+
+    if (state && state->out.len && codius_flush_replies (fd) < 0)
+      ret = -1;
+  }
+
+  return ret;
+}
+
+/*
+ * Shared memory rings carry the same frames as a descriptor, one frame per
+ * ring message.
+ */
+static char*
+shm_read_message (codius_shm_t* shm, int block, codius_rpc_header_t* rpc_header,
+                  codius_encoding_t* encoding)
+{
+  size_t len;
+  char* msg;
+
+  msg = codius_shm_recv (shm, &len, block);
+  if (!msg)
+    return NULL;
+
+  if (len < sizeof (*rpc_header)) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  memcpy (rpc_header, msg, sizeof (*rpc_header));
+  if (parse_magic (rpc_header->magic_bytes, encoding) < 0 ||
+      rpc_header->size != len - sizeof (*rpc_header)) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  return msg + sizeof (*rpc_header);
+}
+
+static int
+shm_write_request (codius_shm_t* shm, codius_request_t* request, int block)
+{
+  codius_cbor_buf_t frame = {NULL, 0, 0};
+  name_defs_t defs = {{0, 0}, 0};
+  name_table_t* names = shm_name_table_for (shm);
+  int ret;
+
+  ret = append_request_frame (&frame, request, names, &defs);
+  if (ret == 0)
+    ret = codius_shm_send (shm, frame.data, frame.len, block);
+  if (ret == 0)
+    mark_names_sent (names, &defs);
+  free (frame.data);
+  return ret;
+}
+
+int
+codius_shm_write_request (codius_shm_t* shm, codius_request_t* request)
+{
+  return shm_write_request (shm, request, 1);
+}
+
+codius_request_t*
+codius_shm_read_request (codius_shm_t* shm)
+{
+  codius_rpc_header_t rpc_header;
+  codius_request_t* request;
+  codius_encoding_t encoding;
+  char* buf;
+
+  // New requests wait until the guest has taken the replies still queued
+  if (codius_shm_flush (shm)) {
+    errno = EAGAIN;
+    return NULL;
+  }
+
+  buf = shm_read_message (shm, 0, &rpc_header, &encoding);
+  if (!buf)
+    return NULL;
+
+  request = request_from_body (&rpc_header, encoding, buf,
+                               shm_name_table_for (shm));
+  if (!request) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  request->_fd = -1;
+  request->_shm = shm;
+  return request;
+}
+
+codius_result_t*
+codius_shm_read_result (codius_shm_t* shm, int block)
+{
+  codius_rpc_header_t rpc_header;
+  codius_encoding_t encoding;
+  char* buf;
+
+  buf = shm_read_message (shm, block, &rpc_header, &encoding);
+  if (!buf)
+    return NULL;
+
+  return result_from_body (&rpc_header, encoding, buf);
+}
+
+/*
+ * Requests in flight are kept in an open-addressed table keyed by request
+ * ID, with linear probing and backward-shift deletion.
+ */
+typedef struct {
+  unsigned long id;
+  codius_callback_t callback;
+  void* user_data;
+  /* Set once the result of a request without a callback has arrived */
+  codius_result_t* result;
+  int used;
+} pending_call_t;
+
+struct codius_client_s {
+  int fd;
+  /* Set when the client talks over shared memory instead of fd */
+  codius_shm_t* shm;
+  pending_call_t* calls;
+  size_t capacity;
+  size_t count;
+};
+
+static size_t
+pending_slot (codius_client_t* client, unsigned long id)
+{
+  return (id * 0x9E3779B97F4A7C15ULL) & (client->capacity - 1);
+}
+
+static pending_call_t*
+pending_find (codius_client_t* client, unsigned long id)
+{
+  size_t i;
+
+  if (!client->capacity)
+    return NULL;
+
+  for (i = pending_slot (client, id); client->calls[i].used; i = (i + 1) & (client->capacity - 1)) {
+    if (client->calls[i].id == id)
+      return &client->calls[i];
+  }
+  return NULL;
+}
+
+static pending_call_t*
+pending_insert (codius_client_t* client, unsigned long id)
+{
+  pending_call_t* call;
+  size_t i;
+
+  // Keep the load factor at or below one half
+  if ((client->count + 1) * 2 > client->capacity) {
+    pending_call_t* old = client->calls;
+    size_t old_capacity = client->capacity;
+    size_t capacity = old_capacity ? old_capacity * 2 : 16;
+    pending_call_t* calls = calloc (capacity, sizeof (*calls));
+
+    if (!calls)
+      return NULL;
+
+    client->calls = calls;
+    client->capacity = capacity;
+    client->count = 0;
+    for (i = 0; i < old_capacity; i++) {
+      if (old[i].used)
+        *pending_insert (client, old[i].id) = old[i];
+    }
+    free (old);
+  }
+
+  for (i = pending_slot (client, id); client->calls[i].used; i = (i + 1) & (client->capacity - 1))
+    ;
+
+  call = &client->calls[i];
+  memset (call, 0, sizeof (*call));
+  call->id = id;
+  call->used = 1;
+  client->count++;
+  return call;
+}
+
+static void
+pending_remove (codius_client_t* client, pending_call_t* call)
+{
+  size_t mask = client->capacity - 1;
+  size_t hole = call - client->calls;
+  size_t i = hole;
+
+  // Shift later members of the probe run back so lookups never stop early
+  for (;;) {
+    size_t home;
+
+    i = (i + 1) & mask;
+    if (!client->calls[i].used)
+      break;
+
+    home = pending_slot (client, client->calls[i].id);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      client->calls[hole] = client->calls[i];
+      hole = i;
+    }
+  }
+
+  client->calls[hole].used = 0;
+  client->count--;
+}
+
+codius_client_t*
+codius_client_new (int fd)
+{
+  codius_client_t* client = calloc (1, sizeof (*client));
+  if (client)
+    client->fd = fd;
+  return client;
+}
+
+codius_client_t*
+codius_client_new_shm (codius_shm_t* shm)
+{
+  codius_client_t* client = calloc (1, sizeof (*client));
+  if (client) {
+    client->fd = codius_shm_doorbell (shm);
+    client->shm = shm;
+  }
+  return client;
+}
+
+void
+codius_client_free (codius_client_t* client)
+{
+  size_t i;
+
+  if (!client)
+    return;
+
+  for (i = 0; i < client->capacity; i++) {
+    if (client->calls[i].used)
+      codius_result_free (client->calls[i].result);
+  }
+  free (client->calls);
+  free (client);
+}
+
+/*
+ * The host takes no new requests while its replies wait for room, so results
+ * are dispatched while waiting for room to send
+ */
+static int
+client_send_shm (codius_client_t* client, codius_request_t* request)
+{
+  for (;;) {
+    if (shm_write_request (client->shm, request, 0) == 0)
+      return 0;
+    if (errno != EAGAIN || codius_client_dispatch (client, 0) < 0)
+      return -1;
+
+    if (codius_shm_arm_send (client->shm)) {
+      if (wait_fd (client->fd, POLLIN) < 0)
+        return -1;
+      codius_shm_clear_doorbell (client->shm);
+    }
+  }
+}
+
+int
+codius_client_submit (codius_client_t* client, codius_request_t* request,
+                      codius_callback_t callback, void* user_data)
+{
+  pending_call_t* call;
+  int ret;
+
+  if (pending_find (client, request->_id))
+    return -1;
+
+  call = pending_insert (client, request->_id);
+  if (!call)
+    return -1;
+  call->callback = callback;
+  call->user_data = user_data;
+
+  if (client->shm)
+    ret = client_send_shm (client, request);
+  else
+    ret = codius_write_request (client->fd, request);
+
+  if (ret != 0) {
+    // Callbacks run while sending may have moved the call
+    call = pending_find (client, request->_id);
+    if (call)
+      pending_remove (client, call);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Reads one result and hands it to its request. Returns 1 if a request completed. */
+static int
+client_read_one (codius_client_t* client)
+{
+  codius_result_t* result;
+  pending_call_t* call;
+  codius_callback_t callback;
+  void* user_data;
+
+  if (client->shm)
+    result = codius_shm_read_result (client->shm, 1);
+  else
+    result = codius_read_result (client->fd);
+  if (!result)
+    return -1;
+
+  call = pending_find (client, result->_id);
+  if (!call || call->result) {
+    // Not ours, or a duplicate: drop it rather than confuse a later request
+    codius_result_free (result);
+    return 0;
+  }
+
+  if (!call->callback) {
+    call->result = result;
+    return 1;
+  }
+
+  callback = call->callback;
+  user_data = call->user_data;
+  pending_remove (client, call);
+  callback (result, user_data);
+  return 1;
+}
+
+static int
+client_readable (codius_client_t* client, int timeout)
+{
+  struct pollfd pfd;
+  int ret;
+
+  for (;;) {
+    if (client->shm) {
+      // Arming also makes the doorbell signal once a result arrives
+      if (!codius_shm_arm (client->shm))
+        return 1;
+    } else if (codius_has_buffered_message (client->fd)) {
+      return 1;
+    }
+
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+    do {
+      ret = poll (&pfd, 1, timeout);
+    } while (ret == -1 && errno == EINTR);
+
+    if (!client->shm || ret <= 0)
+      return ret;
+    codius_shm_clear_doorbell (client->shm);
+  }
+}
+
+int
+codius_client_dispatch (codius_client_t* client, int block)
+{
+  int completed = 0;
+  int ret;
+
+  for (;;) {
+    ret = client_readable (client, block && !completed ? -1 : 0);
+    if (ret < 0)
+      return -1;
+    if (ret == 0)
+      return completed;
+
+    ret = client_read_one (client);
+    if (ret < 0)
+      return completed ? completed : -1;
+    completed += ret;
+  }
+}
+
+codius_result_t*
+codius_client_wait (codius_client_t* client, unsigned long id)
+{
+  pending_call_t* call;
+  codius_result_t* result;
+
+  for (;;) {
+    call = pending_find (client, id);
+    if (!call || call->callback)
+      return NULL;
+
+    if (call->result) {
+      result = call->result;
+      pending_remove (client, call);
+      return result;
+    }
+
+    if (client_read_one (client) < 0)
+      return NULL;
+  }
+}
+
+int
+codius_client_fd (codius_client_t* client)
+{
+  return client->fd;
+}
+
+size_t
+codius_client_pending (codius_client_t* client)
+{
+  return client->count;
 }
@@ -2,36 +2,125 @@
 
 #include <memory.h>
 #include <dirent.h>
-#include <iostream>
+#include <errno.h>
+#include <stddef.h>
 
-DirentBuilder::DirentBuilder(int startIdx)
-  : m_idx (startIdx),
-    m_inode (256)
+DirentBuilder::DirentBuilder(void* buf, size_t size, Format format)
+  : m_buf (static_cast<char*>(buf)),
+    m_capacity (size),
+    m_size (0),
+    m_count (0),
+    m_format (format)
 {}
 
-void
-DirentBuilder::append(const std::string& name, DirentType type) {
-  unsigned short reclen = 24;
-  unsigned short min_reclen;
+size_t
+DirentBuilder::recordLength(size_t nameLen, Format format)
+{
+  size_t len;
+  // struct linux_dirent keeps d_type in the last byte of the record, after the
+  // name's terminating null. linux_dirent64 has it ahead of the name.
+  if (format == Dirent64)
+    len = offsetof (linux_dirent64, d_name) + nameLen + 1;
+  else
+    len = offsetof (linux_dirent, d_name) + nameLen + 2;
+  return (len + 7) & ~static_cast<size_t>(7);
+}
+
+bool
+DirentBuilder::append(const char* name, size_t nameLen, uint64_t inode, int64_t offset, DirentType type)
+{
+  size_t reclen = recordLength (nameLen, m_format);
+  if (reclen > m_capacity - m_size)
+    return false;
 
-  min_reclen = sizeof (((linux_dirent*)0)->d_ino) + sizeof (((linux_dirent*)0)->d_off) + sizeof (((linux_dirent*)0)->d_reclen) + name.size() + 2;
-  while (reclen < min_reclen) {
-    reclen += 8;
+  char* rec = m_buf + m_size;
+  if (m_format == Dirent64) {
+    linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(rec);
+    ent->d_ino = inode;
+    ent->d_off = offset;
+    ent->d_reclen = reclen;
+    ent->d_type = type;
+    memcpy (ent->d_name, name, nameLen);
+    memset (ent->d_name + nameLen, 0, reclen - offsetof (linux_dirent64, d_name) - nameLen);
+  } else {
+    linux_dirent* ent = reinterpret_cast<linux_dirent*>(rec);
+    ent->d_ino = inode;
+    ent->d_off = offset;
+    ent->d_reclen = reclen;
+    memcpy (ent->d_name, name, nameLen);
+    memset (ent->d_name + nameLen, 0, reclen - offsetof (linux_dirent, d_name) - nameLen);
+    rec[reclen - 1] = type;
   }
-  off_t start = m_buf.size();
-  m_buf.resize (start + reclen);
-  memset (&m_buf.data()[start], 0, reclen);
-  linux_dirent* ent = reinterpret_cast<linux_dirent*>(&m_buf.data()[start]);
-  ent->d_ino = m_inode++;
-  ent->d_off = m_idx++;
-  ent->d_reclen = reclen;
-  memcpy (ent->d_name, name.c_str(), name.size());
-  m_buf.data()[start + min_reclen - 2] = 0;
-  m_buf.data()[start + reclen - 1] = type;
+
+  m_size += reclen;
+  m_count++;
+  return true;
+}
+
+bool
+DirentBuilder::append(const std::string& name, uint64_t inode, int64_t offset, DirentType type)
+{
+  return append (name.c_str(), name.size(), inode, offset, type);
 }
 
-std::vector<char>
-DirentBuilder::data() const {
-  return m_buf;
+size_t
+DirentBuilder::size() const
+{
+  return m_size;
 }
 
+size_t
+DirentBuilder::count() const
+{
+  return m_count;
+}
+
+DirentCursor::DirentCursor()
+  : m_loaded (false),
+    m_next (0)
+{}
+
+void
+DirentCursor::load(const std::vector<Entry>& entries)
+{
+  m_entries = entries;
+  m_loaded = true;
+  m_next = 0;
+}
+
+bool
+DirentCursor::loaded() const
+{
+  return m_loaded;
+}
+
+int
+DirentCursor::read(void* buf, unsigned int count, DirentBuilder::Format format)
+{
+  DirentBuilder builder (buf, count, format);
+  size_t i;
+
+  for (i = m_next; i < m_entries.size(); i++) {
+    const Entry& entry = m_entries[i];
+    if (!builder.append (entry.name, entry.inode, i + 1, entry.type))
+      break;
+  }
+
+  if (builder.count() == 0 && m_next < m_entries.size())
+    return -EINVAL;
+
+  m_next = i;
+  return builder.size();
+}
+
+off_t
+DirentCursor::seek(off_t offset)
+{
+  if (offset <= 0) {
+    m_loaded = false;
+    m_next = 0;
+    return 0;
+  }
+  m_next = offset;
+  return offset;
+}
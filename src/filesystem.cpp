@@ -0,0 +1,231 @@
+#include "filesystem.h"
+#include <errno.h>
+#include <limits>
+#include <vector>
+
+std::string
+Filesystem::normalizePath(const std::string& path)
+{
+  std::vector<std::string> components;
+  size_t start = 0;
+
+  while (start <= path.size()) {
+    size_t end = path.find ('/', start);
+    if (end == std::string::npos)
+      end = path.size();
+    std::string component (path, start, end - start);
+    if (component == "..") {
+      if (!components.empty())
+        components.pop_back();
+    } else if (!component.empty() && component != ".") {
+      components.push_back (component);
+    }
+    start = end + 1;
+  }
+
+  std::string ret;
+  for (auto i = components.cbegin(); i != components.cend(); i++)
+    ret += "/" + *i;
+  if (ret.empty())
+    ret = "/";
+  return ret;
+}
+
+/**
+ * @p base is never negative, so only a positive @p offset can overflow
+ */
+off_t
+Filesystem::seekOffset(off_t base, off_t offset)
+{
+  if (offset < 0)
+    return base + offset < 0 ? -EINVAL : base + offset;
+  if (base > std::numeric_limits<off_t>::max() - offset)
+    return -EOVERFLOW;
+  return base + offset;
+}
+
+int
+Filesystem::open(const char* name, int flags, int mode)
+{
+  return -ENOSYS;
+}
+
+ssize_t
+Filesystem::read(int fd, void* buf, size_t count)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::close(int fd)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::fstat(int fd, struct stat* buf)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
+{
+  return -ENOSYS;
+}
+
+off_t
+Filesystem::lseek(int fd, off_t offset, int whence)
+{
+  return -ENOSYS;
+}
+
+ssize_t
+Filesystem::write(int fd, void* buf, size_t count)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::access(const char* name, int mode)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::stat(const char* path, struct stat* buf)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::lstat(const char* path, struct stat* buf)
+{
+  return -ENOSYS;
+}
+
+ssize_t
+Filesystem::readlink(const char* path, char* buf, size_t bufsize)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::unlink(const char* path)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::mkdir(const char* path, int mode)
+{
+  return -ENOSYS;
+}
+
+int
+Filesystem::rmdir(const char* path)
+{
+  return -ENOSYS;
+}
+
+ssize_t
+Filesystem::readInPlace(int fd, size_t count, const void** data)
+{
+  return -ENOSYS;
+}
+
+void
+Filesystem::openAsync(const char* name, int flags, int mode, Completion done)
+{
+  done (open (name, flags, mode));
+}
+
+void
+Filesystem::readAsync(int fd, void* buf, size_t count, Completion done)
+{
+  done (read (fd, buf, count));
+}
+
+void
+Filesystem::closeAsync(int fd, Completion done)
+{
+  done (close (fd));
+}
+
+void
+Filesystem::fstatAsync(int fd, struct stat* buf, Completion done)
+{
+  done (fstat (fd, buf));
+}
+
+void
+Filesystem::getdentsAsync(int fd, struct linux_dirent* dirs, unsigned int count, Completion done)
+{
+  done (getdents (fd, dirs, count));
+}
+
+void
+Filesystem::getdents64Async(int fd, struct linux_dirent64* dirs, unsigned int count, Completion done)
+{
+  done (getdents64 (fd, dirs, count));
+}
+
+void
+Filesystem::lseekAsync(int fd, off_t offset, int whence, Completion done)
+{
+  done (lseek (fd, offset, whence));
+}
+
+void
+Filesystem::writeAsync(int fd, void* buf, size_t count, Completion done)
+{
+  done (write (fd, buf, count));
+}
+
+void
+Filesystem::accessAsync(const char* name, int mode, Completion done)
+{
+  done (access (name, mode));
+}
+
+void
+Filesystem::statAsync(const char* path, struct stat* buf, Completion done)
+{
+  done (stat (path, buf));
+}
+
+void
+Filesystem::lstatAsync(const char* path, struct stat* buf, Completion done)
+{
+  done (lstat (path, buf));
+}
+
+void
+Filesystem::readlinkAsync(const char* path, char* buf, size_t bufsize, Completion done)
+{
+  done (readlink (path, buf, bufsize));
+}
+
+void
+Filesystem::unlinkAsync(const char* path, Completion done)
+{
+  done (unlink (path));
+}
+
+void
+Filesystem::mkdirAsync(const char* path, int mode, Completion done)
+{
+  done (mkdir (path, mode));
+}
+
+void
+Filesystem::rmdirAsync(const char* path, Completion done)
+{
+  done (rmdir (path));
+}
@@ -0,0 +1,653 @@
+#include "image-filesystem.h"
+
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static const char imageMagic[8] = {'C', 'O', 'D', 'I', 'U', 'S', 'I', 'M'};
+static const uint32_t imageVersion = 1;
+static const uint32_t emptySlot = 0xffffffff;
+static const int maxSymlinkDepth = 8;
+
+/**
+ * FNV-1a, as used for the path hash table
+ */
+static uint64_t
+hashPath(const char* path, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(path[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+FilesystemImage::FilesystemImage(const char* base, size_t size)
+  : m_base (base),
+    m_size (size),
+    m_header (reinterpret_cast<const ImageHeader*>(base))
+{
+}
+
+FilesystemImage::~FilesystemImage()
+{
+  munmap (const_cast<char*>(m_base), m_size);
+}
+
+FilesystemImage::Ptr
+FilesystemImage::open(const std::string& path)
+{
+  static std::map<std::string, std::weak_ptr<const FilesystemImage> > s_images;
+
+  auto cached = s_images.find (path);
+  if (cached != s_images.end()) {
+    Ptr image = cached->second.lock();
+    if (image)
+      return image;
+  }
+
+  int fd = ::open (path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat sbuf;
+  if (::fstat (fd, &sbuf) < 0 || static_cast<size_t>(sbuf.st_size) < sizeof (ImageHeader)) {
+    ::close (fd);
+    return nullptr;
+  }
+
+  void* base = mmap (NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close (fd);
+  if (base == MAP_FAILED)
+    return nullptr;
+
+  Ptr image (new FilesystemImage (static_cast<const char*>(base), sbuf.st_size));
+  if (!image->validate())
+    return nullptr;
+
+  s_images[path] = image;
+  return image;
+}
+
+/**
+ * Checks that the header and tables lie within the mapping. Offsets inside the
+ * tables are checked as they are used.
+ */
+bool
+FilesystemImage::validate() const
+{
+  const ImageHeader* h = m_header;
+  if (memcmp (h->magic, imageMagic, sizeof (imageMagic)) != 0 || h->version != imageVersion)
+    return false;
+  if (h->inodeCount == 0 || h->hashSlots == 0 || (h->hashSlots & (h->hashSlots - 1)) != 0)
+    return false;
+
+  struct {
+    uint64_t offset;
+    uint64_t length;
+  } tables[] = {
+    {h->inodeTable, static_cast<uint64_t>(h->inodeCount) * sizeof (ImageInode)},
+    {h->entryTable, static_cast<uint64_t>(h->entryCount) * sizeof (ImageEntry)},
+    {h->hashTable, static_cast<uint64_t>(h->hashSlots) * sizeof (ImageHashSlot)},
+    {h->stringTable, h->stringTableSize}
+  };
+  for (size_t i = 0; i < sizeof (tables) / sizeof (tables[0]); i++) {
+    if (tables[i].offset % 8 != 0 || tables[i].offset > m_size || tables[i].length > m_size - tables[i].offset)
+      return false;
+  }
+  return true;
+}
+
+int
+FilesystemImage::lookup(const std::string& path) const
+{
+  const ImageHashSlot* slots = reinterpret_cast<const ImageHashSlot*>(m_base + m_header->hashTable);
+  uint32_t mask = m_header->hashSlots - 1;
+  uint64_t hash = hashPath (path.c_str(), path.size());
+
+  for (uint32_t i = 0; i <= mask; i++) {
+    const ImageHashSlot& slot = slots[(hash + i) & mask];
+    if (slot.inode == emptySlot)
+      break;
+    if (slot.hash == hash && slot.pathLength == path.size()) {
+      const char* slotPath = string (slot.pathOffset, slot.pathLength);
+      if (!slotPath || memcmp (slotPath, path.c_str(), path.size()) != 0)
+        continue;
+      if (!inode (slot.inode))
+        return -EIO;
+      return slot.inode;
+    }
+  }
+  return -ENOENT;
+}
+
+const ImageInode*
+FilesystemImage::inode(uint32_t idx) const
+{
+  if (idx >= m_header->inodeCount)
+    return nullptr;
+  return reinterpret_cast<const ImageInode*>(m_base + m_header->inodeTable) + idx;
+}
+
+const ImageEntry*
+FilesystemImage::entries(const ImageInode* dir) const
+{
+  if (dir->offset > m_header->entryCount || dir->entryCount > m_header->entryCount - dir->offset)
+    return nullptr;
+  return reinterpret_cast<const ImageEntry*>(m_base + m_header->entryTable) + dir->offset;
+}
+
+const char*
+FilesystemImage::string(uint64_t offset, uint64_t length) const
+{
+  if (offset > m_header->stringTableSize || length > m_header->stringTableSize - offset)
+    return nullptr;
+  return m_base + m_header->stringTable + offset;
+}
+
+const char*
+FilesystemImage::data(const ImageInode* file) const
+{
+  if (file->offset > m_size || file->size > m_size - file->offset)
+    return nullptr;
+  return m_base + file->offset;
+}
+
+static uint64_t
+alignUp(uint64_t offset)
+{
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+bool
+FilesystemImage::pack(const std::string& root, const std::string& imagePath)
+{
+  struct HostFile {
+    std::string path;
+    uint32_t inode;
+  };
+
+  std::vector<ImageInode> inodes;
+  std::vector<ImageEntry> entries;
+  std::vector<std::pair<std::string, uint32_t> > paths;
+  std::vector<HostFile> files;
+  std::string strings;
+  std::deque<std::pair<std::string, uint32_t> > dirs;
+  struct stat sbuf;
+
+  if (::lstat (root.c_str(), &sbuf) < 0)
+    return false;
+  if (!S_ISDIR (sbuf.st_mode)) {
+    errno = ENOTDIR;
+    return false;
+  }
+
+  ImageInode rootInode = {sbuf.st_mode, 0, 0, 0, sbuf.st_mtime};
+  inodes.push_back (rootInode);
+  paths.push_back (std::make_pair (std::string ("/"), 0));
+  dirs.push_back (std::make_pair (std::string (), 0));
+
+  // Breadth first, so that each directory's entries end up contiguous
+  while (!dirs.empty()) {
+    std::string dirPath = dirs.front().first;
+    uint32_t dirInode = dirs.front().second;
+    std::vector<std::string> names;
+    dirs.pop_front();
+
+    DIR* dirp = opendir ((root + dirPath).c_str());
+    if (!dirp)
+      return false;
+    struct dirent* dp;
+    while ((dp = readdir (dirp)) != NULL) {
+      if (strcmp (dp->d_name, ".") != 0 && strcmp (dp->d_name, "..") != 0)
+        names.push_back (dp->d_name);
+    }
+    closedir (dirp);
+    std::sort (names.begin(), names.end());
+
+    inodes[dirInode].offset = entries.size();
+    inodes[dirInode].entryCount = names.size();
+
+    for (auto i = names.cbegin(); i != names.cend(); i++) {
+      std::string path = dirPath + "/" + *i;
+      std::string hostPath = root + path;
+      uint32_t idx = inodes.size();
+
+      if (::lstat (hostPath.c_str(), &sbuf) < 0)
+        return false;
+
+      ImageInode node = {sbuf.st_mode, 0, 0, 0, sbuf.st_mtime};
+      if (S_ISDIR (sbuf.st_mode)) {
+        dirs.push_back (std::make_pair (path, idx));
+      } else if (S_ISREG (sbuf.st_mode)) {
+        node.size = sbuf.st_size;
+        HostFile file = {hostPath, idx};
+        files.push_back (file);
+      } else if (S_ISLNK (sbuf.st_mode)) {
+        std::vector<char> target (sbuf.st_size + 1);
+        ssize_t len = ::readlink (hostPath.c_str(), target.data(), target.size());
+        if (len < 0)
+          return false;
+        node.offset = strings.size();
+        node.size = len;
+        strings.append (target.data(), len);
+      } else {
+        // Devices, sockets and fifos have no place in a contract image
+        continue;
+      }
+
+      ImageEntry entry = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(i->size()), idx, 0};
+      strings += *i;
+      inodes.push_back (node);
+      entries.push_back (entry);
+      paths.push_back (std::make_pair (path, idx));
+    }
+    // Skipped entries shrink the directory
+    inodes[dirInode].entryCount = entries.size() - inodes[dirInode].offset;
+  }
+
+  uint32_t hashSlots = 8;
+  while (hashSlots < paths.size() * 2)
+    hashSlots <<= 1;
+  ImageHashSlot empty = {0, 0, 0, emptySlot, 0};
+  std::vector<ImageHashSlot> slots (hashSlots, empty);
+  for (auto i = paths.cbegin(); i != paths.cend(); i++) {
+    uint64_t hash = hashPath (i->first.c_str(), i->first.size());
+    uint32_t idx = hash & (hashSlots - 1);
+    while (slots[idx].inode != emptySlot)
+      idx = (idx + 1) & (hashSlots - 1);
+    slots[idx].hash = hash;
+    slots[idx].pathOffset = strings.size();
+    slots[idx].pathLength = i->first.size();
+    slots[idx].inode = i->second;
+    strings += i->first;
+  }
+
+  ImageHeader header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, imageMagic, sizeof (imageMagic));
+  header.version = imageVersion;
+  header.inodeCount = inodes.size();
+  header.entryCount = entries.size();
+  header.hashSlots = hashSlots;
+  header.inodeTable = alignUp (sizeof (header));
+  header.entryTable = alignUp (header.inodeTable + inodes.size() * sizeof (ImageInode));
+  header.hashTable = alignUp (header.entryTable + entries.size() * sizeof (ImageEntry));
+  header.stringTable = alignUp (header.hashTable + slots.size() * sizeof (ImageHashSlot));
+  header.stringTableSize = strings.size();
+
+  uint64_t dataOffset = alignUp (header.stringTable + strings.size());
+  for (auto i = files.cbegin(); i != files.cend(); i++) {
+    inodes[i->inode].offset = dataOffset;
+    dataOffset = alignUp (dataOffset + inodes[i->inode].size);
+  }
+
+  FILE* out = fopen (imagePath.c_str(), "wb");
+  if (!out)
+    return false;
+
+  bool ok = true;
+  auto put = [&] (uint64_t offset, const void* buf, size_t len) {
+    if (ok && (fseeko (out, offset, SEEK_SET) < 0 || fwrite (buf, 1, len, out) != len))
+      ok = false;
+  };
+
+  put (0, &header, sizeof (header));
+  put (header.inodeTable, inodes.data(), inodes.size() * sizeof (ImageInode));
+  put (header.entryTable, entries.data(), entries.size() * sizeof (ImageEntry));
+  put (header.hashTable, slots.data(), slots.size() * sizeof (ImageHashSlot));
+  put (header.stringTable, strings.data(), strings.size());
+
+  std::vector<char> buf (65536);
+  for (auto i = files.cbegin(); ok && i != files.cend(); i++) {
+    const ImageInode& node = inodes[i->inode];
+    int fd = ::open (i->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      ok = false;
+      break;
+    }
+    for (uint64_t copied = 0; ok && copied < node.size;) {
+      ssize_t len = ::read (fd, buf.data(), std::min (static_cast<uint64_t>(buf.size()), node.size - copied));
+      if (len <= 0) {
+        if (len == 0)
+          errno = EIO;
+        ok = false;
+        break;
+      }
+      put (node.offset + copied, buf.data(), len);
+      copied += len;
+    }
+    ::close (fd);
+  }
+
+  if (fclose (out) != 0)
+    ok = false;
+  return ok;
+}
+
+ImageFilesystem::ImageFilesystem(FilesystemImage::Ptr image)
+  : Filesystem(),
+    m_image (image)
+{
+}
+
+ImageFilesystem::OpenFile*
+ImageFilesystem::getOpenFile(int fd)
+{
+  if (fd < 0 || static_cast<size_t>(fd) >= m_openFiles.size() || !m_openFiles[fd].used)
+    return nullptr;
+  return &m_openFiles[fd];
+}
+
+/**
+ * Walks @p path one component at a time, so symlinks are followed wherever
+ * they appear and not only as the last component. The last component is only
+ * followed if @p follow is set. At most maxSymlinkDepth links are followed in
+ * total.
+ *
+ * @return Index of the inode, or a negative error number
+ */
+int
+ImageFilesystem::resolve(const char* path, bool follow) const
+{
+  std::string current ("/");
+  std::string rest (normalizePath (path));
+  int links = 0;
+  int idx = m_image->lookup (current);
+
+  while (idx >= 0) {
+    size_t start = rest.find_first_not_of ('/');
+    if (start == std::string::npos)
+      break;
+    size_t end = rest.find ('/', start);
+    std::string name (rest, start, end == std::string::npos ? std::string::npos : end - start);
+    rest = end == std::string::npos ? std::string() : rest.substr (end);
+
+    if (name == ".")
+      continue;
+    if (name == "..") {
+      size_t sep = current.rfind ('/');
+      current = sep == 0 ? "/" : current.substr (0, sep);
+      idx = m_image->lookup (current);
+      continue;
+    }
+
+    if (!S_ISDIR (m_image->inode (idx)->mode))
+      return -ENOTDIR;
+    std::string next (current == "/" ? "/" + name : current + "/" + name);
+    idx = m_image->lookup (next);
+    if (idx < 0)
+      return idx;
+
+    const ImageInode* node = m_image->inode (idx);
+    bool last = rest.find_first_not_of ('/') == std::string::npos;
+    if (!S_ISLNK (node->mode) || (last && !follow)) {
+      current = next;
+      continue;
+    }
+
+    if (++links > maxSymlinkDepth)
+      return -ELOOP;
+    const char* target = m_image->string (node->offset, node->size);
+    if (!target || node->size == 0)
+      return -EIO;
+
+    // The target is resolved from the directory holding the link
+    std::string targetPath (target, node->size);
+    if (targetPath[0] == '/')
+      current = "/";
+    rest = "/" + targetPath + rest;
+    idx = m_image->lookup (current);
+  }
+  return idx;
+}
+
+void
+ImageFilesystem::fillStat(uint32_t idx, struct stat* buf) const
+{
+  const ImageInode* node = m_image->inode (idx);
+  memset (buf, 0, sizeof (*buf));
+  buf->st_ino = idx + 1;
+  buf->st_mode = node->mode;
+  buf->st_nlink = S_ISDIR (node->mode) ? 2 : 1;
+  buf->st_size = S_ISDIR (node->mode) ? 4096 : node->size;
+  buf->st_blksize = 4096;
+  buf->st_blocks = (buf->st_size + 511) / 512;
+  buf->st_atime = node->mtime;
+  buf->st_mtime = node->mtime;
+  buf->st_ctime = node->mtime;
+}
+
+int
+ImageFilesystem::open(const char* name, int flags, int mode)
+{
+  if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)))
+    return -EROFS;
+
+  int idx = resolve (name, !(flags & O_NOFOLLOW));
+  if (idx < 0)
+    return idx;
+
+  const ImageInode* node = m_image->inode (idx);
+  if ((flags & O_DIRECTORY) && !S_ISDIR (node->mode))
+    return -ENOTDIR;
+  if (S_ISLNK (node->mode))
+    return -ELOOP;
+  if (S_ISREG (node->mode) && !m_image->data (node))
+    return -EIO;
+
+  int fd;
+  if (!m_freeFDs.empty()) {
+    fd = m_freeFDs.back();
+    m_freeFDs.pop_back();
+  } else {
+    fd = m_openFiles.size();
+    m_openFiles.push_back (OpenFile());
+  }
+
+  OpenFile& file = m_openFiles[fd];
+  file.inode = idx;
+  file.offset = 0;
+  file.used = true;
+  return fd;
+}
+
+ssize_t
+ImageFilesystem::readInPlace(int fd, size_t count, const void** data)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  const ImageInode* node = m_image->inode (file->inode);
+  if (S_ISDIR (node->mode))
+    return -EISDIR;
+
+  if (static_cast<uint64_t>(file->offset) >= node->size)
+    return 0;
+
+  size_t len = std::min (static_cast<uint64_t>(count), node->size - file->offset);
+  *data = m_image->data (node) + file->offset;
+  file->offset += len;
+  return len;
+}
+
+ssize_t
+ImageFilesystem::read(int fd, void* buf, size_t count)
+{
+  const void* data;
+  ssize_t len = readInPlace (fd, count, &data);
+  if (len > 0)
+    memcpy (buf, data, len);
+  return len;
+}
+
+int
+ImageFilesystem::close(int fd)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  file->used = false;
+  m_freeFDs.push_back (fd);
+  return 0;
+}
+
+int
+ImageFilesystem::fstat(int fd, struct stat* buf)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  fillStat (file->inode, buf);
+  return 0;
+}
+
+/**
+ * The offset of an open directory is the index of its next entry
+ */
+int
+ImageFilesystem::readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  const ImageInode* dir = m_image->inode (file->inode);
+  if (!S_ISDIR (dir->mode))
+    return -ENOTDIR;
+
+  const ImageEntry* entries = m_image->entries (dir);
+  if (!entries)
+    return -EIO;
+
+  DirentBuilder builder (dirs, count, format);
+  while (static_cast<uint64_t>(file->offset) < dir->entryCount) {
+    const ImageEntry& entry = entries[file->offset];
+    const char* name = m_image->string (entry.nameOffset, entry.nameLength);
+    const ImageInode* node = m_image->inode (entry.inode);
+    if (!name || !node)
+      return -EIO;
+    if (!builder.append (name, entry.nameLength, entry.inode + 1, file->offset + 1,
+                         static_cast<DirentBuilder::DirentType>(IFTODT (node->mode))))
+      break;
+    file->offset++;
+  }
+
+  if (builder.count() == 0 && static_cast<uint64_t>(file->offset) < dir->entryCount)
+    return -EINVAL;
+  return builder.size();
+}
+
+int
+ImageFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent);
+}
+
+int
+ImageFilesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent64);
+}
+
+off_t
+ImageFilesystem::lseek(int fd, off_t offset, int whence)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  const ImageInode* node = m_image->inode (file->inode);
+  off_t end = S_ISDIR (node->mode) ? node->entryCount : node->size;
+  off_t newOffset;
+
+  switch (whence) {
+    case SEEK_SET:
+      newOffset = seekOffset (0, offset);
+      break;
+    case SEEK_CUR:
+      newOffset = seekOffset (file->offset, offset);
+      break;
+    case SEEK_END:
+      newOffset = seekOffset (end, offset);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if (newOffset < 0)
+    return newOffset;
+  file->offset = newOffset;
+  return newOffset;
+}
+
+ssize_t
+ImageFilesystem::write(int fd, void* buf, size_t count)
+{
+  if (!getOpenFile (fd))
+    return -EBADF;
+  // Files are only ever opened read-only
+  return -EBADF;
+}
+
+int
+ImageFilesystem::access(const char* name, int mode)
+{
+  int idx = resolve (name, true);
+  if (idx < 0)
+    return idx;
+  if (mode & W_OK)
+    return -EROFS;
+  if ((mode & X_OK) && !(m_image->inode (idx)->mode & 0111))
+    return -EACCES;
+  return 0;
+}
+
+int
+ImageFilesystem::stat(const char* path, struct stat* buf)
+{
+  int idx = resolve (path, true);
+  if (idx < 0)
+    return idx;
+  fillStat (idx, buf);
+  return 0;
+}
+
+int
+ImageFilesystem::lstat(const char* path, struct stat* buf)
+{
+  int idx = resolve (path, false);
+  if (idx < 0)
+    return idx;
+  fillStat (idx, buf);
+  return 0;
+}
+
+ssize_t
+ImageFilesystem::readlink(const char* path, char* buf, size_t bufsize)
+{
+  int idx = resolve (path, false);
+  if (idx < 0)
+    return idx;
+
+  const ImageInode* node = m_image->inode (idx);
+  if (!S_ISLNK (node->mode))
+    return -EINVAL;
+
+  const char* target = m_image->string (node->offset, node->size);
+  if (!target)
+    return -EIO;
+  size_t len = std::min (static_cast<uint64_t>(bufsize), node->size);
+  memcpy (buf, target, len);
+  return len;
+}
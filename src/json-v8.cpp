@@ -0,0 +1,149 @@
+#include "json-v8.h"
+#include <cmath>
+#include <string>
+
+using namespace v8;
+
+Handle<Value>
+JsonV8::toValue(const JsonNode* node)
+{
+  return toValue (node, 0);
+}
+
+Handle<Value>
+JsonV8::toValue(const JsonNode* node, int depth)
+{
+  HandleScope scope;
+
+  if (!node)
+    return scope.Close (Undefined());
+  if (depth >= maxDepth && (node->tag == JSON_ARRAY || node->tag == JSON_OBJECT))
+    return Handle<Value>();
+
+  switch (node->tag) {
+    case JSON_NULL:
+      return scope.Close (Null());
+    case JSON_BOOL:
+      return scope.Close (Boolean::New (node->bool_));
+    case JSON_STRING:
+      return scope.Close (String::New (node->string_));
+    case JSON_NUMBER:
+      return scope.Close (Number::New (node->number_));
+    case JSON_ARRAY: {
+      uint32_t length = 0;
+      for (const JsonNode* child = node->children.head; child; child = child->next)
+        length++;
+
+      Handle<Array> array = Array::New (length);
+      uint32_t idx = 0;
+      for (const JsonNode* child = node->children.head; child; child = child->next) {
+        Handle<Value> value = toValue (child, depth + 1);
+        if (value.IsEmpty())
+          return Handle<Value>();
+        array->Set (idx++, value);
+      }
+      return scope.Close (array);
+    }
+    case JSON_OBJECT: {
+      Handle<Object> object = Object::New();
+      for (const JsonNode* child = node->children.head; child; child = child->next) {
+        Handle<Value> value = toValue (child, depth + 1);
+        if (value.IsEmpty())
+          return Handle<Value>();
+        object->Set (String::New (child->key), value);
+      }
+      return scope.Close (object);
+    }
+  }
+
+  return scope.Close (Undefined());
+}
+
+JsonNode*
+JsonV8::fromValue(Handle<Value> value)
+{
+  JsonNode* node = nullptr;
+  fromValue (value, 0, &node);
+  return node;
+}
+
+bool
+JsonV8::fromValue(Handle<Value> value, JsonNode** node)
+{
+  return fromValue (value, 0, node);
+}
+
+/**
+ * Converts @p value into @p node, leaving it null for values that
+ * JSON.stringify() skips
+ *
+ * @return false if the value cannot be converted
+ */
+bool
+JsonV8::fromValue(Handle<Value> value, int depth, JsonNode** node)
+{
+  HandleScope scope;
+
+  *node = nullptr;
+  if (value.IsEmpty())
+    return false;
+  if (value->IsUndefined() || value->IsFunction())
+    return true;
+
+  if (value->IsNull()) {
+    *node = json_mknull();
+  } else if (value->IsBoolean()) {
+    *node = json_mkbool (value->BooleanValue());
+  } else if (value->IsNumber() || value->IsNumberObject()) {
+    double number = value->NumberValue();
+    *node = std::isfinite (number) ? json_mknumber (number) : json_mknull();
+  } else if (value->IsString() || value->IsStringObject()) {
+    *node = json_mkstring (*String::Utf8Value (value));
+  } else if (value->IsBooleanObject()) {
+    *node = json_mkbool (BooleanObject::Cast (*value)->BooleanValue());
+  }
+  if (*node)
+    return true;
+
+  if (depth >= maxDepth)
+    return false;
+
+  Handle<Object> object = value->ToObject();
+  Handle<Value> toJSON = object->Get (String::NewSymbol ("toJSON"));
+  if (toJSON.IsEmpty())
+    return false;
+  if (toJSON->IsFunction())
+    return fromValue (Handle<Function>::Cast (toJSON)->Call (object, 0, nullptr), depth + 1, node);
+
+  if (value->IsArray()) {
+    Handle<Array> array = Handle<Array>::Cast (value);
+    JsonNode* result = json_mkarray();
+    uint32_t length = array->Length();
+    for (uint32_t i = 0; i < length; i++) {
+      JsonNode* child;
+      if (!fromValue (array->Get (i), depth + 1, &child)) {
+        json_delete (result);
+        return false;
+      }
+      json_append_element (result, child ? child : json_mknull());
+    }
+    *node = result;
+    return true;
+  }
+
+  JsonNode* result = json_mkobject();
+  Handle<Array> keys = object->GetOwnPropertyNames();
+  uint32_t length = keys->Length();
+  for (uint32_t i = 0; i < length; i++) {
+    Handle<Value> key = keys->Get (i);
+    JsonNode* child;
+    if (!fromValue (object->Get (key), depth + 1, &child)) {
+      json_delete (result);
+      return false;
+    }
+    if (child)
+      json_append_member (result, *String::Utf8Value (key), child);
+  }
+  *node = result;
+  return true;
+}
@@ -21,14 +21,46 @@
   THE SOFTWARE.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* strtod_l */
+#endif
+
 #include "json.h"
+#include "json-ryu-tables.h"
 
 #include <assert.h>
+#include <float.h>
+#include <locale.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__) && !defined(JSON_NO_SIMD)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#include <immintrin.h>
+#define JSON_AVX2 1
+#endif
+#endif
+
+/*
+ * The vector scanners read whole aligned blocks, which may extend past the
+ * terminating NUL but never into another page.
+ */
+#ifdef __has_feature
+#define JSON_HAS_FEATURE(x) __has_feature(x)
+#else
+#define JSON_HAS_FEATURE(x) 0
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || JSON_HAS_FEATURE(address_sanitizer)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE_ADDRESS
+#endif
+
 #define out_of_memory() do {                    \
 		fprintf(stderr, "Out of memory.\n");    \
 		exit(EXIT_FAILURE);                     \
@@ -53,13 +85,35 @@ typedef struct
 	char *start;
 } SB;
 
-static void sb_init(SB *sb)
+static void sb_init_size(SB *sb, size_t size)
 {
-	sb->start = (char*) malloc(17);
+	if (size < 16)
+		size = 16;
+	sb->start = (char*) malloc(size + 1);
 	if (sb->start == NULL)
 		out_of_memory();
 	sb->cur = sb->start;
-	sb->end = sb->start + 16;
+	sb->end = sb->start + size;
+}
+
+static void sb_init(SB *sb)
+{
+	sb_init_size(sb, 16);
+}
+
+/* Continues a malloc'd buffer of @cap bytes whose first @len bytes are used. */
+static void sb_adopt(SB *sb, char *buf, size_t cap, size_t len)
+{
+	/* Like sb_init(), keep room for at least 16 bytes and a terminator */
+	if (buf == NULL || cap < len + 17) {
+		cap = len + 17;
+		buf = (char*) realloc(buf, cap);
+		if (buf == NULL)
+			out_of_memory();
+	}
+	sb->start = buf;
+	sb->cur = buf + len;
+	sb->end = buf + cap - 1;
 }
 
 /* sb and need may be evaluated multiple times. */
@@ -114,6 +168,547 @@ static void sb_free(SB *sb)
 	free(sb->start);
 }
 
+/* Arena */
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock
+{
+	ArenaBlock *next;
+	void *align_;
+};
+
+struct JsonArena
+{
+	ArenaBlock *blocks;
+	char *cur;
+	char *end;
+	size_t next_size;
+	
+	/* Recently seen object keys, by hash (NULL until the first key) */
+	char **keys;
+};
+
+/* The first block is allocated along with the arena itself. */
+#define ARENA_FIRST_BLOCK 1024
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN 8
+
+/*
+ * Keys of up to ARENA_KEY_MAX bytes are shared between the objects of an
+ * arena, through a direct-mapped cache of ARENA_KEY_SLOTS keys.
+ */
+#define ARENA_KEY_MAX 32
+#define ARENA_KEY_SLOTS 64
+
+JsonArena *json_arena_new(void)
+{
+	JsonArena *arena = (JsonArena*) malloc(sizeof(JsonArena) + ARENA_FIRST_BLOCK);
+	if (arena == NULL)
+		out_of_memory();
+	arena->blocks = NULL;
+	arena->cur = (char*) (arena + 1);
+	arena->end = arena->cur + ARENA_FIRST_BLOCK;
+	arena->next_size = 4 * ARENA_FIRST_BLOCK;
+	arena->keys = NULL;
+	return arena;
+}
+
+void json_arena_free(JsonArena *arena)
+{
+	ArenaBlock *block, *next;
+	
+	if (arena == NULL)
+		return;
+	
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+/* Hands out @size bytes with no alignment, as strings need none. */
+static char *arena_alloc_bytes(JsonArena *arena, size_t size)
+{
+	char *ret;
+	
+	if ((size_t) (arena->end - arena->cur) < size) {
+		size_t block_size = arena->next_size;
+		ArenaBlock *block;
+		
+		/* Blocks grow geometrically; oversized requests get a block of their own. */
+		if (block_size < size)
+			block_size = size;
+		else if (arena->next_size < ARENA_MAX_BLOCK)
+			arena->next_size *= 2;
+		
+		block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + block_size);
+		if (block == NULL)
+			out_of_memory();
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->cur = (char*) (block + 1);
+		arena->end = arena->cur + block_size;
+	}
+	
+	ret = arena->cur;
+	arena->cur += size;
+	return ret;
+}
+
+static void *arena_alloc(JsonArena *arena, size_t size)
+{
+	size_t pad = -(uintptr_t) arena->cur & (ARENA_ALIGN - 1);
+	
+	if ((size_t) (arena->end - arena->cur) >= pad)
+		arena->cur += pad;
+	return arena_alloc_bytes(arena, size);
+}
+
+/* Shrinks the last allocation, @ptr, to @size bytes. */
+static void arena_trim(JsonArena *arena, char *ptr, size_t size)
+{
+	if (ptr != NULL && ptr + size <= arena->cur)
+		arena->cur = ptr + size;
+}
+
+/* Copies a string into @arena, or onto the heap if @arena is NULL. */
+static char *arena_strndup(JsonArena *arena, const char *s, size_t len)
+{
+	char *ret = arena != NULL ? arena_alloc_bytes(arena, len + 1) : (char*) malloc(len + 1);
+	if (ret == NULL)
+		out_of_memory();
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static char **arena_key_slot(JsonArena *arena, const char *key, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+	
+	if (arena->keys == NULL) {
+		arena->keys = (char**) arena_alloc(arena, ARENA_KEY_SLOTS * sizeof(char*));
+		memset(arena->keys, 0, ARENA_KEY_SLOTS * sizeof(char*));
+	}
+	
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+	return &arena->keys[hash & (ARENA_KEY_SLOTS - 1)];
+}
+
+/*
+ * Returns an earlier copy of @key if the arena has one, giving @key's memory
+ * back. @key must be the last allocation from @arena.
+ */
+static char *arena_share_key(JsonArena *arena, char *key)
+{
+	size_t len = strlen(key);
+	char **slot;
+	
+	if (len > ARENA_KEY_MAX)
+		return key;
+	
+	slot = arena_key_slot(arena, key, len);
+	if (*slot != NULL && strcmp(*slot, key) == 0) {
+		arena_trim(arena, key, 0);
+		return *slot;
+	}
+	*slot = key;
+	return key;
+}
+
+/* Copies a key into @arena, or reuses an earlier copy. */
+static char *arena_key_ndup(JsonArena *arena, const char *key, size_t len)
+{
+	char **slot;
+	
+	if (arena == NULL || len > ARENA_KEY_MAX)
+		return arena_strndup(arena, key, len);
+	
+	slot = arena_key_slot(arena, key, len);
+	if (*slot == NULL || strncmp(*slot, key, len) != 0 || (*slot)[len] != '\0')
+		*slot = arena_strndup(arena, key, len);
+	return *slot;
+}
+
+/* Member index */
+
+/*
+ * Objects get a hash index from their keys to their members once a lookup has
+ * to walk past this many members. Smaller objects are searched linearly.
+ */
+#define INDEX_MIN_MEMBERS 16
+
+typedef struct
+{
+	uint32_t hash;
+	JsonNode *node; /* NULL if the slot is empty */
+} IndexSlot;
+
+/*
+ * Open addressing with linear probing, kept at most half full. With duplicate
+ * keys, only the first member in list order is indexed.
+ *
+ * Objects in an arena get one up front, without slots, to find their arena.
+ */
+struct JsonIndex
+{
+	JsonArena *arena; /* NULL for the heap */
+	size_t mask;
+	size_t count;
+	bool duplicates;
+	IndexSlot *slots; /* NULL until the object gets large */
+};
+
+/* FNV-1a */
+static uint32_t hash_key(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	
+	for (; *key != '\0'; key++)
+		hash = (hash ^ (unsigned char) *key) * 16777619u;
+	return hash;
+}
+
+/* Returns the slot holding @key, or the empty slot where it would go. */
+static IndexSlot *index_slot(JsonIndex *index, const char *key, uint32_t hash)
+{
+	size_t i;
+	
+	for (i = hash & index->mask;; i = (i + 1) & index->mask) {
+		IndexSlot *slot = &index->slots[i];
+		if (slot->node == NULL ||
+		    (slot->hash == hash && strcmp(slot->node->key, key) == 0))
+			return slot;
+	}
+}
+
+/* @first is true if @node comes before any other member with its key. */
+static void index_insert(JsonIndex *index, JsonNode *node, bool first)
+{
+	uint32_t hash = hash_key(node->key);
+	IndexSlot *slot = index_slot(index, node->key, hash);
+	
+	if (slot->node != NULL) {
+		index->duplicates = true;
+		if (first)
+			slot->node = node;
+		return;
+	}
+	
+	slot->hash = hash;
+	slot->node = node;
+	index->count++;
+}
+
+/* Returns the index of @object if it has been built, or NULL. */
+static JsonIndex *object_index(const JsonNode *object)
+{
+	JsonIndex *index = object->children.index;
+	
+	return index != NULL && index->slots != NULL ? index : NULL;
+}
+
+/* Returns the arena holding @object and its keys, or NULL for the heap. */
+static JsonArena *object_arena(const JsonNode *object)
+{
+	return object->children.index != NULL ? object->children.index->arena : NULL;
+}
+
+/* Only for heap objects; an arena's indexes go away with the arena. */
+static void index_free(JsonNode *object)
+{
+	if (object->children.index != NULL) {
+		free(object->children.index->slots);
+		free(object->children.index);
+		object->children.index = NULL;
+	}
+}
+
+static void index_build(JsonNode *object)
+{
+	JsonIndex *index = object->children.index;
+	JsonNode *member;
+	size_t capacity = 2 * INDEX_MIN_MEMBERS;
+	size_t count = 0;
+	size_t size;
+	
+	json_foreach(member, object)
+		count++;
+	while (capacity < 2 * count)
+		capacity *= 2;
+	
+	if (index == NULL) {
+		index = (JsonIndex*) calloc(1, sizeof(JsonIndex));
+		if (index == NULL)
+			out_of_memory();
+		object->children.index = index;
+	} else if (index->arena == NULL) {
+		free(index->slots);
+	}
+	
+	size = capacity * sizeof(IndexSlot);
+	index->slots = index->arena != NULL ? (IndexSlot*) arena_alloc(index->arena, size)
+	                                    : (IndexSlot*) malloc(size);
+	if (index->slots == NULL)
+		out_of_memory();
+	memset(index->slots, 0, size);
+	index->mask = capacity - 1;
+	index->count = 0;
+	index->duplicates = false;
+	
+	json_foreach(member, object)
+		index_insert(index, member, false);
+}
+
+/* Called after @node has been linked into @object. */
+static void index_add(JsonNode *object, JsonNode *node, bool first)
+{
+	JsonIndex *index = object_index(object);
+	
+	if (index == NULL)
+		return;
+	if (2 * (index->count + 1) > index->mask + 1)
+		index_build(object);
+	else
+		index_insert(index, node, first);
+}
+
+/* Called before @node is unlinked from @object. */
+static void index_remove(JsonNode *object, JsonNode *node)
+{
+	JsonIndex *index = object_index(object);
+	IndexSlot *slot;
+	JsonNode *next;
+	size_t hole, i, ideal;
+	
+	if (index == NULL)
+		return;
+	
+	slot = index_slot(index, node->key, hash_key(node->key));
+	if (slot->node != node)
+		return;
+	
+	/* Shift back the entries that probed past the slot being emptied */
+	hole = i = slot - index->slots;
+	for (;;) {
+		i = (i + 1) & index->mask;
+		if (index->slots[i].node == NULL)
+			break;
+		ideal = index->slots[i].hash & index->mask;
+		if (hole <= i ? (hole < ideal && ideal <= i) : (hole < ideal || ideal <= i))
+			continue;
+		index->slots[hole] = index->slots[i];
+		hole = i;
+	}
+	index->slots[hole].node = NULL;
+	index->count--;
+	
+	/* The next member with the same key, if any, takes its place */
+	if (index->duplicates) {
+		for (next = node->next; next != NULL; next = next->next) {
+			if (strcmp(next->key, node->key) == 0) {
+				index_insert(index, next, true);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Scanning
+ *
+ * Whitespace, and string contents that need no escaping, decoding or UTF-8
+ * validation, are skipped in runs of 16 or 32 bytes where SSE2 or AVX2 is
+ * available. AVX2 is picked at startup if the CPU has it.
+ */
+
+typedef enum {
+	SPAN_SPACE,   /* JSON whitespace */
+	SPAN_PLAIN,   /* ASCII copied as is by both parser and emitter */
+	SPAN_ASCII,   /* ASCII other than NUL */
+	SPAN_LITERAL, /* anything but '"', '\\' and NUL */
+} SpanClass;
+
+static bool span_member(SpanClass cls, unsigned char c)
+{
+	switch (cls) {
+		case SPAN_SPACE:
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+		case SPAN_PLAIN:
+			return c >= 0x20 && c <= 0x7F && c != '"' && c != '\\';
+		case SPAN_ASCII:
+			return c >= 0x01 && c <= 0x7F;
+		default:
+			return c != '"' && c != '\\' && c != '\0';
+	}
+}
+
+#ifndef JSON_SSE2
+/* Length of the run of @cls at @s, which always stops at the NUL. */
+static size_t span_scalar(const char *s, SpanClass cls)
+{
+	const char *p = s;
+	while (span_member(cls, *p))
+		p++;
+	return p - s;
+}
+#endif
+
+/* Finds the first '"' or '\\' in [s, end), or returns @end. */
+static const char *find_special_scalar(const char *s, const char *end)
+{
+	while (s < end && *s != '"' && *s != '\\')
+		s++;
+	return s;
+}
+
+#ifdef JSON_SSE2
+
+/* Bit i is set if byte i ends a run of @cls. */
+static inline unsigned stop_mask_sse2(__m128i x, SpanClass cls)
+{
+	__m128i in;
+	
+	switch (cls) {
+		case SPAN_SPACE:
+			in = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+			                               _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+			                  _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+			                               _mm_cmpeq_epi8(x, _mm_set1_epi8('\r'))));
+			break;
+		case SPAN_PLAIN:
+			/* Signed comparison: 0x20..0x7F */
+			in = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+			                                   _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+			                      _mm_cmpgt_epi8(x, _mm_set1_epi8(0x1F)));
+			break;
+		case SPAN_ASCII:
+			in = _mm_cmpgt_epi8(x, _mm_setzero_si128());
+			break;
+		default:
+			return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+				_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+				_mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+				_mm_cmpeq_epi8(x, _mm_setzero_si128())));
+	}
+	return ~_mm_movemask_epi8(in) & 0xFFFF;
+}
+
+NO_SANITIZE_ADDRESS
+static size_t span_sse2(const char *s, SpanClass cls)
+{
+	const char *p = (const char*) ((uintptr_t) s & ~(uintptr_t) 15);
+	unsigned mask = stop_mask_sse2(_mm_load_si128((const __m128i*) p), cls);
+	
+	/* Ignore the bytes of the first block that come before @s */
+	mask &= ~0u << (s - p);
+	while (mask == 0) {
+		p += 16;
+		mask = stop_mask_sse2(_mm_load_si128((const __m128i*) p), cls);
+	}
+	return p + __builtin_ctz(mask) - s;
+}
+
+static const char *find_special_sse2(const char *s, const char *end)
+{
+	for (; end - s >= 16; s += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) s);
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+			_mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+		if (mask != 0)
+			return s + __builtin_ctz(mask);
+	}
+	return find_special_scalar(s, end);
+}
+
+#endif /* JSON_SSE2 */
+
+#ifdef JSON_AVX2
+
+__attribute__((target("avx2")))
+static inline unsigned stop_mask_avx2(__m256i x, SpanClass cls)
+{
+	__m256i in;
+	
+	switch (cls) {
+		case SPAN_SPACE:
+			in = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+			                                     _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))),
+			                     _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')),
+			                                     _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r'))));
+			break;
+		case SPAN_PLAIN:
+			in = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+			                                         _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+			                         _mm256_cmpgt_epi8(x, _mm256_set1_epi8(0x1F)));
+			break;
+		case SPAN_ASCII:
+			in = _mm256_cmpgt_epi8(x, _mm256_setzero_si256());
+			break;
+		default:
+			return _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+				_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+				_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+				_mm256_cmpeq_epi8(x, _mm256_setzero_si256())));
+	}
+	return ~_mm256_movemask_epi8(in);
+}
+
+NO_SANITIZE_ADDRESS __attribute__((target("avx2")))
+static size_t span_avx2(const char *s, SpanClass cls)
+{
+	const char *p = (const char*) ((uintptr_t) s & ~(uintptr_t) 31);
+	unsigned mask = stop_mask_avx2(_mm256_load_si256((const __m256i*) p), cls);
+	
+	mask &= ~0u << (s - p);
+	while (mask == 0) {
+		p += 32;
+		mask = stop_mask_avx2(_mm256_load_si256((const __m256i*) p), cls);
+	}
+	return p + __builtin_ctz(mask) - s;
+}
+
+__attribute__((target("avx2")))
+static const char *find_special_avx2(const char *s, const char *end)
+{
+	for (; end - s >= 32; s += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) s);
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+			_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))));
+		if (mask != 0)
+			return s + __builtin_ctz(mask);
+	}
+	return find_special_sse2(s, end);
+}
+
+#endif /* JSON_AVX2 */
+
+#ifdef JSON_SSE2
+static size_t (*span)(const char *s, SpanClass cls) = span_sse2;
+static const char *(*find_special)(const char *s, const char *end) = find_special_sse2;
+#else
+static size_t (*span)(const char *s, SpanClass cls) = span_scalar;
+static const char *(*find_special)(const char *s, const char *end) = find_special_scalar;
+#endif
+
+#ifdef JSON_AVX2
+__attribute__((constructor))
+static void pick_scanners(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		span = span_avx2;
+		find_special = find_special_avx2;
+	}
+}
+#endif
+
 /*
  * Unicode helper functions
  *
@@ -207,13 +802,16 @@ static bool utf8_validate(const char *s)
 {
 	int len;
 	
-	for (; *s != 0; s += len) {
+	for (;;) {
+		s += span(s, SPAN_ASCII);
+		if (*s == 0)
+			return true;
+		
 		len = utf8_validate_cz(s);
 		if (len == 0)
 			return false;
+		s += len;
 	}
-	
-	return true;
 }
 
 /*
@@ -328,11 +926,11 @@ static void to_surrogate_pair(uchar_t unicode, uint16_t *uc, uint16_t *lc)
 #define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
+static bool parse_value     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_string    (const char **sp, char            **out, JsonArena *arena);
 static bool parse_number    (const char **sp, double           *out);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
+static bool parse_array     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_object    (const char **sp, JsonNode        **out, JsonArena *arena);
 static bool parse_hex16     (const char **sp, uint16_t         *out);
 
 static bool expect_literal  (const char **sp, const char *str);
@@ -349,22 +947,27 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 
 static int write_hex16(char *out, uint16_t val);
 
-static JsonNode *mknode(JsonTag tag);
+static JsonNode *mknode(JsonArena *arena, JsonTag tag);
+static JsonNode *mkstring(JsonArena *arena, char *s);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
 
 /* Assertion-friendly validity checks */
 static bool tag_is_valid(unsigned int tag);
-static bool number_is_valid(const char *num);
 
 JsonNode *json_decode(const char *json)
+{
+	return json_decode_in(json, NULL);
+}
+
+JsonNode *json_decode_in(const char *json, JsonArena *arena)
 {
 	const char *s = json;
 	JsonNode *ret;
 	
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
+	if (!parse_value(&s, &ret, arena))
 		return NULL;
 	
 	skip_space(&s);
@@ -381,6 +984,31 @@ char *json_encode(const JsonNode *node)
 	return json_stringify(node, NULL);
 }
 
+char *json_encode_n(const JsonNode *node, size_t size_hint, size_t *len)
+{
+	SB sb;
+	sb_init_size(&sb, size_hint);
+	
+	emit_value(&sb, node);
+	
+	if (len != NULL)
+		*len = sb.cur - sb.start;
+	return sb_finish(&sb);
+}
+
+size_t json_encode_append(const JsonNode *node, char **buf, size_t *cap, size_t len)
+{
+	SB sb;
+	sb_adopt(&sb, *buf, *cap, len);
+	
+	emit_value(&sb, node);
+	
+	*sb.cur = 0;
+	*buf = sb.start;
+	*cap = sb.end - sb.start + 1;
+	return sb.cur - sb.start;
+}
+
 char *json_encode_string(const char *str)
 {
 	SB sb;
@@ -409,40 +1037,506 @@ void json_delete(JsonNode *node)
 	if (node != NULL) {
 		json_remove_from_parent(node);
 		
+		/* Freed along with the rest of its arena */
+		if (node->in_arena)
+			return;
+		
 		switch (node->tag) {
 			case JSON_STRING:
 				free(node->string_);
 				break;
-			case JSON_ARRAY:
-			case JSON_OBJECT:
-			{
-				JsonNode *child, *next;
-				for (child = node->children.head; child != NULL; child = next) {
-					next = child->next;
-					json_delete(child);
+			case JSON_OBJECT:
+				index_free(node);
+				/* fallthrough */
+			case JSON_ARRAY:
+			{
+				JsonNode *child, *next;
+				for (child = node->children.head; child != NULL; child = next) {
+					next = child->next;
+					json_delete(child);
+				}
+				break;
+			}
+			default:;
+		}
+		
+		free(node);
+	}
+}
+
+bool json_validate(const char *json)
+{
+	const char *s = json;
+	
+	skip_space(&s);
+	if (!parse_value(&s, NULL, NULL))
+		return false;
+	
+	skip_space(&s);
+	if (*s != 0)
+		return false;
+	
+	return true;
+}
+
+/*** Streaming decoding ***/
+
+typedef enum {
+	PS_VALUE,          /* a value */
+	PS_VALUE_OR_END,   /* a value or ']', just after '[' */
+	PS_KEY,            /* a key, after ',' in an object */
+	PS_KEY_OR_END,     /* a key or '}', just after '{' */
+	PS_COLON,
+	PS_COMMA_OR_END,   /* ',' or the end of the innermost container */
+	PS_DONE,           /* only whitespace may follow */
+	PS_ERROR
+} ParserState;
+
+typedef enum {
+	TOK_NONE,
+	TOK_STRING,
+	TOK_KEY,
+	TOK_NUMBER,
+	TOK_LITERAL
+} ParserToken;
+
+struct JsonParser
+{
+	const JsonCallbacks *callbacks;
+	void *ctx;
+	
+	ParserState state;
+	int depth;
+	/* JSON_ARRAY or JSON_OBJECT for each open container */
+	unsigned char stack[JSON_PARSER_MAX_DEPTH];
+	
+	/* Token being parsed, buffered raw until its last byte arrives */
+	ParserToken token;
+	bool escaped;
+	SB buf;
+	
+	/* Tree being built, when there are no callbacks */
+	JsonArena *arena;
+	JsonNode *root;
+	JsonNode *nodes[JSON_PARSER_MAX_DEPTH];
+	char *key;
+};
+
+JsonParser *json_parser_new(const JsonCallbacks *callbacks, void *ctx)
+{
+	JsonParser *p = (JsonParser*) calloc(1, sizeof(JsonParser));
+	if (p == NULL)
+		out_of_memory();
+	p->callbacks = callbacks;
+	p->ctx = ctx;
+	p->state = PS_VALUE;
+	sb_init(&p->buf);
+	return p;
+}
+
+JsonParser *json_parser_new_tree(void)
+{
+	return json_parser_new(NULL, NULL);
+}
+
+JsonParser *json_parser_new_tree_in(JsonArena *arena)
+{
+	JsonParser *p = json_parser_new(NULL, NULL);
+	p->arena = arena;
+	return p;
+}
+
+void json_parser_free(JsonParser *p)
+{
+	if (p != NULL) {
+		json_delete(p->root);
+		if (p->arena == NULL)
+			free(p->key);
+		sb_free(&p->buf);
+		free(p);
+	}
+}
+
+JsonNode *json_parser_take_root(JsonParser *p)
+{
+	JsonNode *ret;
+	
+	if (p->state != PS_DONE)
+		return NULL;
+	
+	ret = p->root;
+	p->root = NULL;
+	return ret;
+}
+
+/* Hangs a new node under the innermost container, or makes it the root. */
+static void tree_attach(JsonParser *p, JsonNode *node)
+{
+	if (p->depth == 0) {
+		p->root = node;
+	} else if (p->stack[p->depth - 1] == JSON_OBJECT) {
+		append_member(p->nodes[p->depth - 1], p->key, node);
+		p->key = NULL;
+	} else {
+		append_node(p->nodes[p->depth - 1], node);
+	}
+}
+
+static void value_done(JsonParser *p)
+{
+	p->state = p->depth > 0 ? PS_COMMA_OR_END : PS_DONE;
+}
+
+/*
+ * Hangs a scalar in the tree, or hands it to the callbacks without allocating
+ * a node for it. @value lives on the caller's stack; its string, if any, is
+ * taken over.
+ */
+static bool report_scalar(JsonParser *p, const JsonNode *value)
+{
+	const JsonCallbacks *cb = p->callbacks;
+	bool ok = true;
+	
+	if (cb == NULL) {
+		JsonNode *node;
+		
+		switch (value->tag) {
+			case JSON_NULL:
+				node = json_mknull_in(p->arena);
+				break;
+			case JSON_BOOL:
+				node = json_mkbool_in(p->arena, value->bool_);
+				break;
+			case JSON_NUMBER:
+				node = json_mknumber_in(p->arena, value->number_);
+				break;
+			default:
+				node = mkstring(p->arena, value->string_);
+				break;
+		}
+		tree_attach(p, node);
+		value_done(p);
+		return true;
+	}
+	
+	switch (value->tag) {
+		case JSON_NULL:
+			ok = cb->null_value == NULL || cb->null_value(p->ctx);
+			break;
+		case JSON_BOOL:
+			ok = cb->bool_value == NULL || cb->bool_value(p->ctx, value->bool_);
+			break;
+		case JSON_NUMBER:
+			ok = cb->number_value == NULL || cb->number_value(p->ctx, value->number_);
+			break;
+		case JSON_STRING:
+			ok = cb->string_value == NULL ||
+			     cb->string_value(p->ctx, value->string_, strlen(value->string_));
+			free(value->string_);
+			break;
+		default:
+			assert(false);
+	}
+	
+	value_done(p);
+	return ok;
+}
+
+/* Takes ownership of @key. */
+static bool report_key(JsonParser *p, char *key)
+{
+	const JsonCallbacks *cb = p->callbacks;
+	bool ok = true;
+	
+	if (cb == NULL) {
+		p->key = p->arena != NULL ? arena_share_key(p->arena, key) : key;
+	} else {
+		ok = cb->object_key == NULL || cb->object_key(p->ctx, key, strlen(key));
+		free(key);
+	}
+	
+	p->state = PS_COLON;
+	return ok;
+}
+
+static bool report_start(JsonParser *p, JsonTag tag)
+{
+	const JsonCallbacks *cb = p->callbacks;
+	bool ok = true;
+	
+	if (p->depth >= JSON_PARSER_MAX_DEPTH)
+		return false;
+	
+	if (cb == NULL) {
+		JsonNode *node = tag == JSON_ARRAY ? json_mkarray_in(p->arena)
+		                                   : json_mkobject_in(p->arena);
+		tree_attach(p, node);
+		p->nodes[p->depth] = node;
+	} else if (tag == JSON_ARRAY) {
+		ok = cb->start_array == NULL || cb->start_array(p->ctx);
+	} else {
+		ok = cb->start_object == NULL || cb->start_object(p->ctx);
+	}
+	
+	p->stack[p->depth++] = tag;
+	p->state = tag == JSON_ARRAY ? PS_VALUE_OR_END : PS_KEY_OR_END;
+	return ok;
+}
+
+static bool report_end(JsonParser *p, JsonTag tag)
+{
+	const JsonCallbacks *cb = p->callbacks;
+	bool ok = true;
+	
+	if (p->depth == 0 || p->stack[p->depth - 1] != tag)
+		return false;
+	p->depth--;
+	
+	if (cb != NULL) {
+		if (tag == JSON_ARRAY)
+			ok = cb->end_array == NULL || cb->end_array(p->ctx);
+		else
+			ok = cb->end_object == NULL || cb->end_object(p->ctx);
+	}
+	
+	value_done(p);
+	return ok;
+}
+
+/*
+ * Parses a complete token of @len bytes at @tok. Numbers and literals must be
+ * null-terminated; strings need only be followed by their closing quote.
+ */
+static bool finish_token(JsonParser *p, ParserToken token, const char *tok, size_t len)
+{
+	const char *s = tok;
+	JsonNode value;
+	
+	switch (token) {
+		case TOK_STRING:
+		case TOK_KEY: {
+			char *str;
+			if (!parse_string(&s, &str, p->arena))
+				return false;
+			if (s != tok + len) {
+				if (p->arena == NULL)
+					free(str);
+				return false;
+			}
+			if (token == TOK_KEY)
+				return report_key(p, str);
+			value.tag = JSON_STRING;
+			value.string_ = str;
+			return report_scalar(p, &value);
+		}
+		
+		case TOK_NUMBER:
+			value.tag = JSON_NUMBER;
+			if (!parse_number(&s, &value.number_) || *s != '\0')
+				return false;
+			return report_scalar(p, &value);
+		
+		case TOK_LITERAL:
+			value.tag = JSON_BOOL;
+			if (strcmp(tok, "null") == 0)
+				value.tag = JSON_NULL;
+			else if (strcmp(tok, "true") == 0)
+				value.bool_ = true;
+			else if (strcmp(tok, "false") == 0)
+				value.bool_ = false;
+			else
+				return false;
+			return report_scalar(p, &value);
+		
+		default:
+			return false;
+	}
+}
+
+static bool finish_buffered_token(JsonParser *p)
+{
+	ParserToken token = p->token;
+	size_t len = p->buf.cur - p->buf.start;
+	
+	*p->buf.cur = '\0';
+	p->token = TOK_NONE;
+	p->buf.cur = p->buf.start;
+	return finish_token(p, token, p->buf.start, len);
+}
+
+/*
+ * Finds the quote that ends a string, starting just inside it.
+ * @escaped carries a trailing backslash over to the next piece of input.
+ */
+static const char *scan_string(const char *s, const char *end, bool *escaped)
+{
+	for (; s < end; s++) {
+		if (*escaped)
+			*escaped = false;
+		else if ((s = find_special(s, end)) == end)
+			break;
+		else if (*s == '\\')
+			*escaped = true;
+		else
+			return s;
+	}
+	return NULL;
+}
+
+static bool is_token_char(ParserToken token, char c)
+{
+	if (token == TOK_NUMBER)
+		return is_digit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+	return c >= 'a' && c <= 'z';
+}
+
+/*
+ * Continues the token in progress. Returns how far input was consumed, or
+ * NULL on error.
+ */
+static const char *continue_token(JsonParser *p, const char *s, const char *end)
+{
+	const char *start = s;
+	
+	if (p->token == TOK_STRING || p->token == TOK_KEY) {
+		const char *quote = scan_string(s, end, &p->escaped);
+		s = quote != NULL ? quote + 1 : end;
+		sb_put(&p->buf, start, s - start);
+		if (quote == NULL)
+			return end;
+	} else {
+		while (s < end && is_token_char(p->token, *s))
+			s++;
+		sb_put(&p->buf, start, s - start);
+		if (s == end)
+			return end;
+	}
+	
+	return finish_buffered_token(p) ? s : NULL;
+}
+
+/* Starts a string, parsing it in place if it ends within this input. */
+static const char *start_string(JsonParser *p, ParserToken token, const char *s, const char *end)
+{
+	bool escaped = false;
+	const char *quote = scan_string(s + 1, end, &escaped);
+	
+	if (quote != NULL)
+		return finish_token(p, token, s, quote + 1 - s) ? quote + 1 : NULL;
+	
+	p->token = token;
+	p->escaped = escaped;
+	sb_put(&p->buf, s, end - s);
+	return end;
+}
+
+bool json_parser_feed(JsonParser *p, const char *data, size_t len)
+{
+	const char *s = data;
+	const char *end = data + len;
+	
+	while (s < end && p->state != PS_ERROR) {
+		char c;
+		
+		if (p->token != TOK_NONE) {
+			s = continue_token(p, s, end);
+			if (s == NULL)
+				goto failed;
+			continue;
+		}
+		
+		c = *s;
+		if (is_space(c)) {
+			s++;
+			continue;
+		}
+		
+		switch (p->state) {
+			case PS_VALUE_OR_END:
+				if (c == ']') {
+					if (!report_end(p, JSON_ARRAY))
+						goto failed;
+					s++;
+					break;
+				}
+				/* fallthrough */
+			case PS_VALUE:
+				if (c == '[' || c == '{') {
+					if (!report_start(p, c == '[' ? JSON_ARRAY : JSON_OBJECT))
+						goto failed;
+					s++;
+				} else if (c == '"') {
+					s = start_string(p, TOK_STRING, s, end);
+					if (s == NULL)
+						goto failed;
+				} else if (c == '-' || is_digit(c)) {
+					p->token = TOK_NUMBER;
+				} else if (c >= 'a' && c <= 'z') {
+					p->token = TOK_LITERAL;
+				} else {
+					goto failed;
+				}
+				break;
+			
+			case PS_KEY_OR_END:
+				if (c == '}') {
+					if (!report_end(p, JSON_OBJECT))
+						goto failed;
+					s++;
+					break;
 				}
+				/* fallthrough */
+			case PS_KEY:
+				if (c != '"')
+					goto failed;
+				s = start_string(p, TOK_KEY, s, end);
+				if (s == NULL)
+					goto failed;
 				break;
-			}
-			default:;
+			
+			case PS_COLON:
+				if (c != ':')
+					goto failed;
+				p->state = PS_VALUE;
+				s++;
+				break;
+			
+			case PS_COMMA_OR_END:
+				if (c == ',') {
+					p->state = p->stack[p->depth - 1] == JSON_OBJECT ? PS_KEY : PS_VALUE;
+				} else if (c == ']' || c == '}') {
+					if (!report_end(p, c == ']' ? JSON_ARRAY : JSON_OBJECT))
+						goto failed;
+				} else {
+					goto failed;
+				}
+				s++;
+				break;
+			
+			default:
+				goto failed;
 		}
-		
-		free(node);
 	}
+	
+	return p->state != PS_ERROR;
+
+failed:
+	p->state = PS_ERROR;
+	return false;
 }
 
-bool json_validate(const char *json)
+bool json_parser_finish(JsonParser *p)
 {
-	const char *s = json;
-	
-	skip_space(&s);
-	if (!parse_value(&s, NULL))
+	if (p->state == PS_ERROR)
 		return false;
 	
-	skip_space(&s);
-	if (*s != 0)
-		return false;
+	/* A number or literal at the very end has nothing after it to end it. */
+	if (p->token == TOK_NUMBER || p->token == TOK_LITERAL) {
+		if (!finish_buffered_token(p))
+			p->state = PS_ERROR;
+	}
 	
-	return true;
+	return p->token == TOK_NONE && p->state == PS_DONE;
 }
 
 JsonNode *json_find_element(JsonNode *array, int index)
@@ -465,15 +1559,25 @@ JsonNode *json_find_element(JsonNode *array, int index)
 JsonNode *json_find_member(JsonNode *object, const char *name)
 {
 	JsonNode *member;
+	size_t walked = 0;
 	
 	if (object == NULL || object->tag != JSON_OBJECT)
 		return NULL;
 	
-	json_foreach(member, object)
+	if (object_index(object) != NULL)
+		return index_slot(object->children.index, name, hash_key(name))->node;
+	
+	json_foreach(member, object) {
 		if (strcmp(member->key, name) == 0)
-			return member;
+			break;
+		walked++;
+	}
 	
-	return NULL;
+	/* Lookups this slow are worth indexing for */
+	if (walked >= INDEX_MIN_MEMBERS)
+		index_build(object);
+	
+	return member;
 }
 
 JsonNode *json_first_child(const JsonNode *node)
@@ -483,54 +1587,100 @@ JsonNode *json_first_child(const JsonNode *node)
 	return NULL;
 }
 
-static JsonNode *mknode(JsonTag tag)
+static JsonNode *mknode(JsonArena *arena, JsonTag tag)
 {
-	JsonNode *ret = (JsonNode*) calloc(1, sizeof(JsonNode));
-	if (ret == NULL)
-		out_of_memory();
+	JsonNode *ret;
+	
+	if (arena != NULL) {
+		ret = (JsonNode*) arena_alloc(arena, sizeof(JsonNode));
+		memset(ret, 0, sizeof(JsonNode));
+		ret->in_arena = true;
+	} else {
+		ret = (JsonNode*) calloc(1, sizeof(JsonNode));
+		if (ret == NULL)
+			out_of_memory();
+	}
 	ret->tag = tag;
 	return ret;
 }
 
+/* @s must come from @arena, or from malloc if @arena is NULL. */
+static JsonNode *mkstring(JsonArena *arena, char *s)
+{
+	JsonNode *ret = mknode(arena, JSON_STRING);
+	ret->string_ = s;
+	return ret;
+}
+
 JsonNode *json_mknull(void)
 {
-	return mknode(JSON_NULL);
+	return mknode(NULL, JSON_NULL);
 }
 
 JsonNode *json_mkbool(bool b)
 {
-	JsonNode *ret = mknode(JSON_BOOL);
-	ret->bool_ = b;
-	return ret;
+	return json_mkbool_in(NULL, b);
 }
 
-static JsonNode *mkstring(char *s)
+JsonNode *json_mkstring(const char *s)
 {
-	JsonNode *ret = mknode(JSON_STRING);
-	ret->string_ = s;
+	return mkstring(NULL, json_strdup(s));
+}
+
+JsonNode *json_mknumber(double n)
+{
+	return json_mknumber_in(NULL, n);
+}
+
+JsonNode *json_mkarray(void)
+{
+	return mknode(NULL, JSON_ARRAY);
+}
+
+JsonNode *json_mkobject(void)
+{
+	return mknode(NULL, JSON_OBJECT);
+}
+
+JsonNode *json_mknull_in(JsonArena *arena)
+{
+	return mknode(arena, JSON_NULL);
+}
+
+JsonNode *json_mkbool_in(JsonArena *arena, bool b)
+{
+	JsonNode *ret = mknode(arena, JSON_BOOL);
+	ret->bool_ = b;
 	return ret;
 }
 
-JsonNode *json_mkstring(const char *s)
+JsonNode *json_mkstring_in(JsonArena *arena, const char *s, size_t len)
 {
-	return mkstring(json_strdup(s));
+	return mkstring(arena, arena_strndup(arena, s, len));
 }
 
-JsonNode *json_mknumber(double n)
+JsonNode *json_mknumber_in(JsonArena *arena, double n)
 {
-	JsonNode *node = mknode(JSON_NUMBER);
+	JsonNode *node = mknode(arena, JSON_NUMBER);
 	node->number_ = n;
 	return node;
 }
 
-JsonNode *json_mkarray(void)
+JsonNode *json_mkarray_in(JsonArena *arena)
 {
-	return mknode(JSON_ARRAY);
+	return mknode(arena, JSON_ARRAY);
 }
 
-JsonNode *json_mkobject(void)
+JsonNode *json_mkobject_in(JsonArena *arena)
 {
-	return mknode(JSON_OBJECT);
+	JsonNode *ret = mknode(arena, JSON_OBJECT);
+	
+	if (arena != NULL) {
+		ret->children.index = (JsonIndex*) arena_alloc(arena, sizeof(JsonIndex));
+		memset(ret->children.index, 0, sizeof(JsonIndex));
+		ret->children.index->arena = arena;
+	}
+	return ret;
 }
 
 static void append_node(JsonNode *parent, JsonNode *child)
@@ -563,6 +1713,7 @@ static void append_member(JsonNode *object, char *key, JsonNode *value)
 {
 	value->key = key;
 	append_node(object, value);
+	index_add(object, value, false);
 }
 
 void json_append_element(JsonNode *array, JsonNode *element)
@@ -582,11 +1733,16 @@ void json_prepend_element(JsonNode *array, JsonNode *element)
 }
 
 void json_append_member(JsonNode *object, const char *key, JsonNode *value)
+{
+	json_append_member_n(object, key, strlen(key), value);
+}
+
+void json_append_member_n(JsonNode *object, const char *key, size_t len, JsonNode *value)
 {
 	assert(object->tag == JSON_OBJECT);
 	assert(value->parent == NULL);
 	
-	append_member(object, json_strdup(key), value);
+	append_member(object, arena_key_ndup(object_arena(object), key, len), value);
 }
 
 void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
@@ -594,8 +1750,9 @@ void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
 	assert(object->tag == JSON_OBJECT);
 	assert(value->parent == NULL);
 	
-	value->key = json_strdup(key);
+	value->key = arena_key_ndup(object_arena(object), key, strlen(key));
 	prepend_node(object, value);
+	index_add(object, value, true);
 }
 
 void json_remove_from_parent(JsonNode *node)
@@ -603,6 +1760,9 @@ void json_remove_from_parent(JsonNode *node)
 	JsonNode *parent = node->parent;
 	
 	if (parent != NULL) {
+		if (parent->tag == JSON_OBJECT)
+			index_remove(parent, node);
+		
 		if (node->prev != NULL)
 			node->prev->next = node->next;
 		else
@@ -612,7 +1772,9 @@ void json_remove_from_parent(JsonNode *node)
 		else
 			parent->children.tail = node->prev;
 		
-		free(node->key);
+		/* Keys come from the arena of the object holding them */
+		if (!parent->in_arena)
+			free(node->key);
 		
 		node->parent = NULL;
 		node->prev = node->next = NULL;
@@ -620,7 +1782,7 @@ void json_remove_from_parent(JsonNode *node)
 	}
 }
 
-static bool parse_value(const char **sp, JsonNode **out)
+static bool parse_value(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
 	
@@ -628,7 +1790,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'n':
 			if (expect_literal(&s, "null")) {
 				if (out)
-					*out = json_mknull();
+					*out = json_mknull_in(arena);
 				*sp = s;
 				return true;
 			}
@@ -637,7 +1799,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'f':
 			if (expect_literal(&s, "false")) {
 				if (out)
-					*out = json_mkbool(false);
+					*out = json_mkbool_in(arena, false);
 				*sp = s;
 				return true;
 			}
@@ -646,7 +1808,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 't':
 			if (expect_literal(&s, "true")) {
 				if (out)
-					*out = json_mkbool(true);
+					*out = json_mkbool_in(arena, true);
 				*sp = s;
 				return true;
 			}
@@ -654,9 +1816,9 @@ static bool parse_value(const char **sp, JsonNode **out)
 		
 		case '"': {
 			char *str;
-			if (parse_string(&s, out ? &str : NULL)) {
+			if (parse_string(&s, out ? &str : NULL, arena)) {
 				if (out)
-					*out = mkstring(str);
+					*out = mkstring(arena, str);
 				*sp = s;
 				return true;
 			}
@@ -664,14 +1826,14 @@ static bool parse_value(const char **sp, JsonNode **out)
 		}
 		
 		case '[':
-			if (parse_array(&s, out)) {
+			if (parse_array(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
 			return false;
 		
 		case '{':
-			if (parse_object(&s, out)) {
+			if (parse_object(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
@@ -681,7 +1843,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 			double num;
 			if (parse_number(&s, out ? &num : NULL)) {
 				if (out)
-					*out = json_mknumber(num);
+					*out = json_mknumber_in(arena, num);
 				*sp = s;
 				return true;
 			}
@@ -690,10 +1852,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 	}
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+static bool parse_array(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkarray() : NULL;
+	JsonNode *ret = out ? json_mkarray_in(arena) : NULL;
 	JsonNode *element;
 	
 	if (*s++ != '[')
@@ -706,7 +1868,7 @@ static bool parse_array(const char **sp, JsonNode **out)
 	}
 	
 	for (;;) {
-		if (!parse_value(&s, out ? &element : NULL))
+		if (!parse_value(&s, out ? &element : NULL, arena))
 			goto failure;
 		skip_space(&s);
 		
@@ -734,10 +1896,10 @@ failure:
 	return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+static bool parse_object(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkobject() : NULL;
+	JsonNode *ret = out ? json_mkobject_in(arena) : NULL;
 	char *key;
 	JsonNode *value;
 	
@@ -751,15 +1913,17 @@ static bool parse_object(const char **sp, JsonNode **out)
 	}
 	
 	for (;;) {
-		if (!parse_string(&s, out ? &key : NULL))
+		if (!parse_string(&s, out ? &key : NULL, arena))
 			goto failure;
+		if (out && arena != NULL)
+			key = arena_share_key(arena, key);
 		skip_space(&s);
 		
 		if (*s++ != ':')
 			goto failure_free_key;
 		skip_space(&s);
 		
-		if (!parse_value(&s, out ? &value : NULL))
+		if (!parse_value(&s, out ? &value : NULL, arena))
 			goto failure_free_key;
 		skip_space(&s);
 		
@@ -783,36 +1947,70 @@ success:
 	return true;
 
 failure_free_key:
-	if (out)
+	if (out && arena == NULL)
 		free(key);
 failure:
 	json_delete(ret);
 	return false;
 }
 
-bool parse_string(const char **sp, char **out)
+/*
+ * Returns the length of the string literal at @s, quotes included, or 0 if it
+ * is not terminated. Decoding never makes a string longer, so this also
+ * bounds the space its decoded form and terminator need.
+ */
+static size_t string_literal_length(const char *s)
+{
+	const char *start = s++;
+	
+	for (;; s++) {
+		s += span(s, SPAN_LITERAL);
+		if (*s == '"')
+			return s + 1 - start;
+		if (*s == '\\')
+			s++;
+		if (*s == '\0')
+			return 0;
+	}
+}
+
+bool parse_string(const char **sp, char **out, JsonArena *arena)
 {
 	const char *s = *sp;
-	SB sb;
-  sb.start = NULL;
-  sb.end = NULL;
 	char throwaway_buffer[4];
 		/* enough space for a UTF-8 character */
+	char *str = NULL;
 	char *b;
 	
 	if (*s++ != '"')
 		return false;
 	
 	if (out) {
-		sb_init(&sb);
-		sb_need(&sb, 4);
-		b = sb.cur;
+		size_t bound = string_literal_length(*sp);
+		if (bound == 0)
+			return false;
+		str = arena != NULL ? arena_alloc_bytes(arena, bound) : (char*) malloc(bound);
+		if (str == NULL)
+			out_of_memory();
+		b = str;
 	} else {
 		b = throwaway_buffer;
 	}
 	
 	while (*s != '"') {
-		unsigned char c = *s++;
+		unsigned char c = *s;
+		
+		/* Copy a run of characters that need no decoding. */
+		if (span_member(SPAN_PLAIN, c)) {
+			size_t run = span(s, SPAN_PLAIN);
+			if (out) {
+				memcpy(b, s, run);
+				b += run;
+			}
+			s += run;
+			continue;
+		}
+		s++;
 		
 		/* Parse next character, and write it to b. */
 		if (c == '\\') {
@@ -882,29 +2080,397 @@ bool parse_string(const char **sp, char **out)
 				*b++ = *s++;
 		}
 		
-		/*
-		 * Update sb to know about the new bytes,
-		 * and set up b to write another character.
-		 */
-		if (out) {
-			sb.cur = b;
-			sb_need(&sb, 4);
-			b = sb.cur;
-		} else {
+		/* Set up b to write another character. */
+		if (!out)
 			b = throwaway_buffer;
-		}
 	}
 	s++;
 	
-	if (out)
-		*out = sb_finish(&sb);
+	if (out) {
+		*b++ = '\0';
+		if (arena != NULL)
+			arena_trim(arena, str, b - str);
+		*out = str;
+	}
 	*sp = s;
 	return true;
 
 failed:
-	if (out)
-		sb_free(&sb);
+	if (arena != NULL)
+		arena_trim(arena, str, 0);
+	else
+		free(str);
+	return false;
+}
+
+/*
+ * Numbers
+ *
+ * Doubles are written in the shortest form that reads back as the same value,
+ * found with Ryu, and in the layout of JavaScript's Number#toString. Integers
+ * up to 2^53, which is most of what goes over IPC, skip all of that.
+ *
+ * Numbers that fit in 19 significant digits and scale by at most 10^22 are
+ * read exactly with one multiplication or division (Clinger's fast path).
+ * Others go to strtod_l() in the C locale, so a program's locale never
+ * changes how JSON is read.
+ */
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Writes @value in decimal, returning the number of digits. */
+static int write_uint64(char *out, uint64_t value)
+{
+	char buf[20];
+	char *p = buf + sizeof(buf);
+	int len;
+	
+	while (value >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + (value % 100) * 2, 2);
+		value /= 100;
+	}
+	if (value >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + value * 2, 2);
+	} else {
+		*--p = '0' + value;
+	}
+	
+	len = buf + sizeof(buf) - p;
+	memcpy(out, p, len);
+	return len;
+}
+
+/* ceil(log2(5^e)), or 1 for e = 0 */
+static int32_t pow5_bits(int32_t e)
+{
+	return (int32_t) (((uint32_t) e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) */
+static uint32_t log10_pow2(int32_t e)
+{
+	return ((uint32_t) e * 78913) >> 18;
+}
+
+/* floor(log10(5^e)) */
+static uint32_t log10_pow5(int32_t e)
+{
+	return ((uint32_t) e * 732923) >> 20;
+}
+
+static bool multiple_of_pow5(uint64_t value, uint32_t p)
+{
+	uint32_t count = 0;
+	
+	while (value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+	return count >= p;
+}
+
+static bool multiple_of_pow2(uint64_t value, uint32_t p)
+{
+	return (value & ((UINT64_C(1) << p) - 1)) == 0;
+}
+
+#ifndef __SIZEOF_INT128__
+/* Full 128-bit product of @a and @b */
+static uint64_t umul128(uint64_t a, uint64_t b, uint64_t *high)
+{
+	uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+	uint64_t b00 = a_lo * b_lo, b01 = a_lo * b_hi, b10 = a_hi * b_lo, b11 = a_hi * b_hi;
+	uint64_t mid = (b00 >> 32) + (uint32_t) b10 + (uint32_t) b01;
+	
+	*high = b11 + (b10 >> 32) + (b01 >> 32) + (mid >> 32);
+	return (mid << 32) | (uint32_t) b00;
+}
+#endif
+
+/* (@m * @mul) >> @j, where @mul is a 128-bit table entry and 64 < @j < 128 */
+static uint64_t mul_shift(uint64_t m, const uint64_t *mul, int32_t j)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 b0 = (unsigned __int128) m * mul[0];
+	unsigned __int128 b2 = (unsigned __int128) m * mul[1];
+	return (uint64_t) (((b0 >> 64) + b2) >> (j - 64));
+#else
+	uint64_t high0, high1, sum;
+	uint64_t low1 = umul128(m, mul[1], &high1);
+	
+	umul128(m, mul[0], &high0);
+	sum = high0 + low1;
+	if (sum < high0)
+		high1++;
+	j -= 64;
+	return (high1 << (64 - j)) | (sum >> j);
+#endif
+}
+
+/*
+ * Finds the shortest @digits * 10^@exponent that reads back as the double
+ * with these bits, the one closest to it if there are several. From Ryu's
+ * d2d().
+ */
+static void shortest_decimal(uint64_t ieee_mantissa, uint32_t ieee_exponent,
+                             uint64_t *digits, int32_t *exponent)
+{
+	int32_t e2;
+	uint64_t m2;
+	bool even;
+	uint64_t mv;
+	uint32_t mm_shift;
+	uint64_t vr, vp, vm;
+	int32_t e10;
+	bool vm_trailing_zeros = false;
+	bool vr_trailing_zeros = false;
+	int32_t removed = 0;
+	uint8_t last_removed = 0;
+	uint64_t output;
+	
+	if (ieee_exponent == 0) {
+		e2 = 1 - 1023 - 52 - 2;
+		m2 = ieee_mantissa;
+	} else {
+		e2 = (int32_t) ieee_exponent - 1023 - 52 - 2;
+		m2 = (UINT64_C(1) << 52) | ieee_mantissa;
+	}
+	even = (m2 & 1) == 0;
+	
+	/* The halfway points to the neighbouring doubles are (mv - 1 - mm_shift) and (mv + 2) */
+	mv = 4 * m2;
+	mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+	
+	/* Scale the value and both halfway points to decimal */
+	if (e2 >= 0) {
+		uint32_t q = log10_pow2(e2) - (e2 > 3);
+		int32_t k = JSON_POW5_INV_BITCOUNT + pow5_bits(q) - 1;
+		int32_t i = -e2 + (int32_t) q + k;
+		
+		e10 = q;
+		vr = mul_shift(4 * m2, json_pow5_inv_split[q], i);
+		vp = mul_shift(4 * m2 + 2, json_pow5_inv_split[q], i);
+		vm = mul_shift(4 * m2 - 1 - mm_shift, json_pow5_inv_split[q], i);
+		
+		if (q <= 21) {
+			/* Only one of mv, mv + 2 and mv - 1 - mm_shift can be a multiple of 5 */
+			if (mv % 5 == 0)
+				vr_trailing_zeros = multiple_of_pow5(mv, q);
+			else if (even)
+				vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+			else
+				vp -= multiple_of_pow5(mv + 2, q);
+		}
+	} else {
+		uint32_t q = log10_pow5(-e2) - (-e2 > 1);
+		int32_t i = -e2 - (int32_t) q;
+		int32_t k = pow5_bits(i) - JSON_POW5_BITCOUNT;
+		int32_t j = (int32_t) q - k;
+		
+		e10 = (int32_t) q + e2;
+		vr = mul_shift(4 * m2, json_pow5_split[i], j);
+		vp = mul_shift(4 * m2 + 2, json_pow5_split[i], j);
+		vm = mul_shift(4 * m2 - 1 - mm_shift, json_pow5_split[i], j);
+		
+		if (q <= 1) {
+			/* mv has at least q trailing zeros, as do both halfway points */
+			vr_trailing_zeros = true;
+			if (even)
+				vm_trailing_zeros = mm_shift == 1;
+			else
+				vp--;
+		} else if (q < 63) {
+			vr_trailing_zeros = multiple_of_pow2(mv, q);
+		}
+	}
+	
+	/* Drop digits while the result stays strictly between the halfway points */
+	if (vm_trailing_zeros || vr_trailing_zeros) {
+		while (vp / 10 > vm / 10) {
+			vm_trailing_zeros &= vm % 10 == 0;
+			vr_trailing_zeros &= last_removed == 0;
+			last_removed = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		if (vm_trailing_zeros) {
+			while (vm % 10 == 0) {
+				vr_trailing_zeros &= last_removed == 0;
+				last_removed = vr % 10;
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				removed++;
+			}
+		}
+		/* Exactly halfway rounds to even */
+		if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+			last_removed = 4;
+		output = vr + ((vr == vm && (!even || !vm_trailing_zeros)) || last_removed >= 5);
+	} else {
+		while (vp / 10 > vm / 10) {
+			last_removed = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		output = vr + (vr == vm || last_removed >= 5);
+	}
+	
+	*digits = output;
+	*exponent = e10 + removed;
+}
+
+/* Writes @digits * 10^@exponent the way JavaScript would. */
+static int write_decimal(char *out, uint64_t digits, int32_t exponent)
+{
+	char buf[20];
+	int k, n, len;
+	
+	while (digits % 10 == 0) {
+		digits /= 10;
+		exponent++;
+	}
+	k = write_uint64(buf, digits);
+	n = k + exponent; /* position of the decimal point */
+	
+	if (k <= n && n <= 21) {
+		memcpy(out, buf, k);
+		memset(out + k, '0', n - k);
+		return n;
+	}
+	if (0 < n && n <= 21) {
+		memcpy(out, buf, n);
+		out[n] = '.';
+		memcpy(out + n + 1, buf + n, k - n);
+		return k + 1;
+	}
+	if (-6 < n && n <= 0) {
+		out[0] = '0';
+		out[1] = '.';
+		memset(out + 2, '0', -n);
+		memcpy(out + 2 - n, buf, k);
+		return 2 - n + k;
+	}
+	
+	out[0] = buf[0];
+	len = 1;
+	if (k > 1) {
+		out[1] = '.';
+		memcpy(out + 2, buf + 1, k - 1);
+		len = k + 1;
+	}
+	out[len++] = 'e';
+	out[len++] = n - 1 < 0 ? '-' : '+';
+	return len + write_uint64(out + len, n - 1 < 0 ? 1 - n : n - 1);
+}
+
+/* Longest output of write_number(): "-0.000001" followed by 17 digits */
+#define NUMBER_MAX_LENGTH 32
+
+/* Writes @num as JSON, or null if it is not finite. Returns the length. */
+static int write_number(char *out, double num)
+{
+	union {
+		double d;
+		uint64_t u;
+	} bits;
+	uint64_t mantissa;
+	uint32_t exponent;
+	uint64_t digits;
+	int32_t exp10;
+	char *b = out;
+	
+	bits.d = num;
+	mantissa = bits.u & ((UINT64_C(1) << 52) - 1);
+	exponent = (bits.u >> 52) & 0x7FF;
+	
+	/* JSON has no way to write NaN or the infinities */
+	if (exponent == 0x7FF) {
+		memcpy(out, "null", 4);
+		return 4;
+	}
+	
+	if (bits.u >> 63) {
+		*b++ = '-';
+		num = -num;
+	}
+	if (exponent == 0 && mantissa == 0) {
+		*b++ = '0';
+		return b - out;
+	}
+	
+	if (num <= 9007199254740992.0 && num == (double) (uint64_t) num)
+		return (b - out) + write_uint64(b, (uint64_t) num);
+	
+	shortest_decimal(mantissa, exponent, &digits, &exp10);
+	return (b - out) + write_decimal(b, digits, exp10);
+}
+
+#if FLT_EVAL_METHOD == 0
+static const double exact_pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#endif
+
+/*
+ * Computes @mantissa * 10^@exponent exactly rounded, if both it and the power
+ * of ten are exact doubles. Not with x87 arithmetic, which rounds twice.
+ */
+static bool decimal_to_double(uint64_t mantissa, int exponent, double *out)
+{
+#if FLT_EVAL_METHOD == 0
+	if (mantissa > (UINT64_C(1) << 53))
+		return false;
+	if (mantissa == 0) {
+		*out = 0;
+		return true;
+	}
+	
+	if (exponent < 0) {
+		if (exponent < -22)
+			return false;
+		*out = (double) mantissa / exact_pow10[-exponent];
+		return true;
+	}
+	
+	/* Move surplus powers of ten into the mantissa while it stays exact */
+	for (; exponent > 22; exponent--) {
+		mantissa *= 10;
+		if (mantissa > (UINT64_C(1) << 53))
+			return false;
+	}
+	*out = (double) mantissa * exact_pow10[exponent];
+	return true;
+#else
 	return false;
+#endif
+}
+
+static locale_t c_locale;
+
+__attribute__((constructor))
+static void make_c_locale(void)
+{
+	c_locale = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+}
+
+/* strtod(), always with '.' as the decimal point */
+static double strtod_c(const char *s)
+{
+	if (c_locale == (locale_t) 0)
+		return strtod(s, NULL);
+	return strtod_l(s, NULL, c_locale);
 }
 
 /*
@@ -920,6 +2486,24 @@ failed:
 bool parse_number(const char **sp, double *out)
 {
 	const char *s = *sp;
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	int exp_value = 0;
+	bool exp_negative = false;
+	bool exact = true;
+	double num;
+	
+	/* Up to 19 significant digits fit in mantissa */
+	#define take_digit(c) do {                                  \
+			if (digits < 19) {                                  \
+				mantissa = mantissa * 10 + ((c) - '0');         \
+				if (mantissa != 0)                              \
+					digits++;                                   \
+			} else {                                            \
+				exact = false;                                  \
+			}                                                   \
+		} while (0)
 
 	/* '-'? */
 	if (*s == '-')
@@ -932,6 +2516,7 @@ bool parse_number(const char **sp, double *out)
 		if (!is_digit(*s))
 			return false;
 		do {
+			take_digit(*s);
 			s++;
 		} while (is_digit(*s));
 	}
@@ -942,6 +2527,8 @@ bool parse_number(const char **sp, double *out)
 		if (!is_digit(*s))
 			return false;
 		do {
+			take_digit(*s);
+			exponent--;
 			s++;
 		} while (is_digit(*s));
 	}
@@ -950,16 +2537,26 @@ bool parse_number(const char **sp, double *out)
 	if (*s == 'E' || *s == 'e') {
 		s++;
 		if (*s == '+' || *s == '-')
-			s++;
+			exp_negative = *s++ == '-';
 		if (!is_digit(*s))
 			return false;
 		do {
+			/* Anything this large is out of range either way */
+			if (exp_value < 100000)
+				exp_value = exp_value * 10 + (*s - '0');
 			s++;
 		} while (is_digit(*s));
 	}
+	
+	#undef take_digit
 
-	if (out)
-		*out = strtod(*sp, NULL);
+	if (out) {
+		exponent += exp_negative ? -exp_value : exp_value;
+		if (exact && decimal_to_double(mantissa, exponent, &num))
+			*out = **sp == '-' ? -num : num;
+		else
+			*out = strtod_c(*sp);
+	}
 
 	*sp = s;
 	return true;
@@ -968,8 +2565,8 @@ bool parse_number(const char **sp, double *out)
 static void skip_space(const char **sp)
 {
 	const char *s = *sp;
-	while (is_space(*s))
-		s++;
+	if (is_space(*s))
+		s += span(s, SPAN_SPACE);
 	*sp = s;
 }
 
@@ -1122,7 +2719,20 @@ void emit_string(SB *out, const char *str)
 	
 	*b++ = '"';
 	while (*s != 0) {
-		unsigned char c = *s++;
+		unsigned char c = *s;
+		
+		/* Copy a run of characters that need no escaping. */
+		if (span_member(SPAN_PLAIN, c)) {
+			size_t run = span(s, SPAN_PLAIN);
+			out->cur = b;
+			sb_need(out, (int) run + 14);
+			b = out->cur;
+			memcpy(b, s, run);
+			b += run;
+			s += run;
+			continue;
+		}
+		s++;
 		
 		/* Encode the next character, and write it to b. */
 		switch (c) {
@@ -1226,19 +2836,8 @@ void emit_string(SB *out, const char *str)
 
 static void emit_number(SB *out, double num)
 {
-	/*
-	 * This isn't exactly how JavaScript renders numbers,
-	 * but it should produce valid JSON for reasonable numbers
-	 * preserve precision well enough, and avoid some oddities
-	 * like 0.3 -> 0.299999999999999988898 .
-	 */
-	char buf[64];
-	sprintf(buf, "%.16g", num);
-	
-	if (number_is_valid(buf))
-		sb_puts(out, buf);
-	else
-		sb_puts(out, "null");
+	sb_need(out, NUMBER_MAX_LENGTH);
+	out->cur += write_number(out->cur, num);
 }
 
 static bool tag_is_valid(unsigned int tag)
@@ -1246,10 +2845,6 @@ static bool tag_is_valid(unsigned int tag)
 	return (/* tag >= JSON_NULL && */ tag <= JSON_OBJECT);
 }
 
-static bool number_is_valid(const char *num)
-{
-	return (parse_number(&num, NULL) && *num == '\0');
-}
 
 static bool expect_literal(const char **sp, const char *str)
 {
@@ -1367,6 +2962,12 @@ bool json_check(const JsonNode *node, char errmsg[256])
 					problem("Array element's key is not NULL");
 				if (node->tag == JSON_OBJECT && child->key == NULL)
 					problem("Object member's key is NULL");
+				if (node->tag == JSON_OBJECT && object_index(node) != NULL) {
+					JsonNode *found = index_slot(node->children.index, child->key,
+					                             hash_key(child->key))->node;
+					if (found == NULL || strcmp(found->key, child->key) != 0)
+						problem("Object member is missing from the index");
+				}
 				
 				if (!json_check(child, errmsg))
 					return false;
@@ -1,80 +1,366 @@
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <vector>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "native-filesystem.h"
+#include "open-how.h"
+
+/**
+ * Converts a libc-style result (-1 and errno) into a syscall-style one
+ */
+template<typename T> static T
+syscallResult(T ret)
+{
+  if (ret < 0)
+    return -errno;
+  return ret;
+}
+
+/**
+ * Filesystem-relative form of @p name: normalized, without the leading "/",
+ * and "." for the root itself
+ */
+static std::string
+relativePath(const char* name)
+{
+  std::string path (Filesystem::normalizePath (name));
+  return path == "/" ? std::string (".") : path.substr (1);
+}
+
+NativeFilesystem::NativeFilesystem(const std::string& root)
+  : Filesystem()
+  , m_root (root)
+  , m_rootFD (::open (root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC))
+{
+}
+
+DirectoryFD::~DirectoryFD()
+{
+  ::close (m_fd);
+}
+
+NativeFilesystem::~NativeFilesystem()
+{
+  invalidateDirectories();
+  if (m_rootFD >= 0)
+    ::close (m_rootFD);
+}
+
+/**
+ * Opens @p path relative to @p dirFD without leaving it. Kernels without
+ * openat2() fall back to openWalk().
+ */
+int
+NativeFilesystem::openBeneath(int dirFD, const std::string& path, int flags, int mode)
+{
+  static bool s_haveOpenat2 = true;
+
+  if (dirFD < 0)
+    return -ENOENT;
+
+  if (s_haveOpenat2) {
+    OpenHow how = {static_cast<uint64_t>(flags | O_CLOEXEC), 0, resolveBeneath | resolveNoMagicLinks};
+    if (flags & O_CREAT)
+      how.mode = mode & 07777;
+    int fd = syscall (SYS_openat2, dirFD, path.c_str(), &how, sizeof (how));
+    if (fd >= 0 || errno != ENOSYS)
+      return syscallResult (fd);
+    s_haveOpenat2 = false;
+  }
+  return openWalk (dirFD, path, flags, mode);
+}
+
+/**
+ * Opens @p path relative to @p dirFD one component at a time, never following
+ * a symlink in the kernel. Symlinks are resolved here instead, and as with
+ * RESOLVE_BENEATH, an absolute target or a ".." above @p dirFD fails with
+ * EXDEV.
+ */
+int
+NativeFilesystem::openWalk(int dirFD, const std::string& path, int flags, int mode)
+{
+  std::vector<int> dirs;
+  std::string rest (path);
+  int links = 0;
+  int ret;
+
+  for (;;) {
+    int top = dirs.empty() ? dirFD : dirs.back();
+    size_t start = rest.find_first_not_of ('/');
+    if (start == std::string::npos) {
+      ret = syscallResult (::openat (top, ".", flags | O_CLOEXEC, mode));
+      break;
+    }
+    size_t end = rest.find ('/', start);
+    std::string name (rest, start, end == std::string::npos ? end : end - start);
+    rest = end == std::string::npos ? std::string() : rest.substr (end);
+    bool last = rest.find_first_not_of ('/') == std::string::npos;
+
+    if (name == ".")
+      continue;
+    if (name == "..") {
+      if (dirs.empty()) {
+        ret = -EXDEV;
+        break;
+      }
+      ::close (dirs.back());
+      dirs.pop_back();
+      continue;
+    }
+
+    struct stat sbuf;
+    bool isLink = ::fstatat (top, name.c_str(), &sbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK (sbuf.st_mode);
+    bool noFollow = (flags & O_NOFOLLOW) || (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL);
+    if (isLink && !(last && noFollow)) {
+      char target[PATH_MAX];
+      ssize_t len = ::readlinkat (top, name.c_str(), target, sizeof (target));
+      if (++links > maxSymlinks) {
+        ret = -ELOOP;
+        break;
+      } else if (len < 0) {
+        ret = -errno;
+        break;
+      } else if (static_cast<size_t>(len) == sizeof (target)) {
+        ret = -ENAMETOOLONG;
+        break;
+      } else if (len == 0 || target[0] == '/') {
+        ret = -EXDEV;
+        break;
+      }
+      rest = std::string (target, len) + rest;
+      continue;
+    }
+
+    // O_NOFOLLOW catches a symlink swapped in since the check above
+    if (last) {
+      ret = syscallResult (::openat (top, name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, mode));
+      break;
+    }
+    int fd = ::openat (top, name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      ret = -errno;
+      break;
+    }
+    dirs.push_back (fd);
+  }
+
+  for (auto i = dirs.cbegin(); i != dirs.cend(); i++)
+    ::close (*i);
+  return ret;
+}
+
+/**
+ * Returns a cached descriptor for the directory holding @p name, which must
+ * not be closed by the caller
+ *
+ * @param name Path to look up
+ * @param leaf Set to the last component of @p name
+ * @param hold If set, receives a reference that keeps the descriptor open
+ * after it leaves the cache. It stays empty for the root, which is open for as
+ * long as the filesystem.
+ * @return Directory descriptor, or a negative error number
+ */
+int
+NativeFilesystem::lookupParent(const char* name, std::string& leaf, DirectoryFD::Ptr* hold)
+{
+  std::string path (relativePath (name));
+  size_t sep = path.rfind ('/');
+  if (sep == std::string::npos) {
+    leaf = path;
+    return m_rootFD >= 0 ? m_rootFD : -ENOENT;
+  }
+
+  leaf = path.substr (sep + 1);
+  std::string dir (path, 0, sep);
+  auto cached = m_dirFDs.find (dir);
+  if (cached != m_dirFDs.end()) {
+    m_dirLRU.splice (m_dirLRU.begin(), m_dirLRU, cached->second.lru);
+    if (hold)
+      *hold = cached->second.dir;
+    return cached->second.dir->fd();
+  }
+
+  int fd = openBeneath (m_rootFD, dir, O_PATH | O_DIRECTORY, 0);
+  if (fd < 0)
+    return fd;
+  if (m_dirFDs.size() >= maxCachedDirs) {
+    m_dirFDs.erase (m_dirLRU.back());
+    m_dirLRU.pop_back();
+  }
+  m_dirLRU.push_front (dir);
+  CachedDir entry = {std::make_shared<DirectoryFD> (fd), m_dirLRU.begin()};
+  m_dirFDs[dir] = entry;
+  if (hold)
+    *hold = entry.dir;
+  return fd;
+}
+
+/**
+ * Empties the directory cache. Symlinks let one directory be cached under
+ * several paths, so any change to the tree may leave a stale descriptor
+ * under a path that looks unrelated. Descriptors still held by a lookup in
+ * flight are closed once it lets go of them.
+ */
+void
+NativeFilesystem::invalidateDirectories()
+{
+  m_dirFDs.clear();
+  m_dirLRU.clear();
+}
+
+/**
+ * Opens @p name starting from its parent directory. A symlink in the last
+ * component that points elsewhere in the tree cannot be resolved beneath the
+ * parent, so the lookup is then retried from the root.
+ */
+int
+NativeFilesystem::openPath(const char* name, int flags, int mode)
+{
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+
+  int fd = openBeneath (dirFD, leaf, flags, mode);
+  if (fd == -EXDEV && dirFD != m_rootFD)
+    fd = openBeneath (m_rootFD, relativePath (name), flags, mode);
+  return fd;
+}
 
 int
 NativeFilesystem::open(const char* name, int flags, int mode)
 {
-  std::string newName (name);
-  newName = m_root + "/" + newName;
-  return ::open (newName.c_str(), flags, mode);
+  return openPath (name, flags, mode);
 }
 
 int
 NativeFilesystem::close(int fd)
 {
-  return ::close (fd);
+  return syscallResult (::close (fd));
 }
 
 ssize_t
 NativeFilesystem::read(int fd, void* buf, size_t count)
 {
-  return ::read (fd, buf, count);
+  return syscallResult (::read (fd, buf, count));
 }
 
 int
 NativeFilesystem::fstat(int fd, struct stat* buf)
 {
-  return ::fstat (fd, buf);
+  return syscallResult (::fstat (fd, buf));
 }
 
 int
 NativeFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
 {
-  return ::syscall (SYS_getdents, fd, dirs, count);
+  return syscallResult (::syscall (SYS_getdents, fd, dirs, count));
 }
 
-off_t
-NativeFilesystem::lseek(int fd, off_t offset, int whence)
+int
+NativeFilesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
 {
-  return ::lseek (fd, offset, whence);
+  return syscallResult (::syscall (SYS_getdents64, fd, dirs, count));
 }
 
-NativeFilesystem::NativeFilesystem(const std::string& root)
-  : Filesystem()
-  , m_root (root)
+off_t
+NativeFilesystem::lseek(int fd, off_t offset, int whence)
 {
+  return syscallResult (::lseek (fd, offset, whence));
 }
 
 ssize_t
 NativeFilesystem::write(int fd, void* buf, size_t count)
 {
-  return ::write (fd, buf, count);
+  return syscallResult (::write (fd, buf, count));
 }
 
 int
 NativeFilesystem::access(const char* name, int mode)
 {
-  return ::access (name, mode);
+  int fd = openPath (name, O_PATH, 0);
+  if (fd < 0)
+    return fd;
+
+  // Check the file that was resolved beneath the root, not the name again
+  char procPath[64];
+  snprintf (procPath, sizeof (procPath), "/proc/self/fd/%d", fd);
+  int ret = syscallResult (::faccessat (AT_FDCWD, procPath, mode, 0));
+  ::close (fd);
+  return ret;
 }
 
 int
 NativeFilesystem::stat(const char* name, struct stat* buf)
 {
-  return ::stat (name, buf);
+  int fd = openPath (name, O_PATH, 0);
+  if (fd < 0)
+    return fd;
+  int ret = syscallResult (::fstat (fd, buf));
+  ::close (fd);
+  return ret;
 }
 
 int
 NativeFilesystem::lstat(const char* name, struct stat* buf)
 {
-  return ::lstat (name, buf);
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+  return syscallResult (::fstatat (dirFD, leaf.c_str(), buf, AT_SYMLINK_NOFOLLOW));
 }
 
 ssize_t
 NativeFilesystem::readlink(const char* name, char* buf, size_t bufsize)
 {
-  return ::readlink (name, buf, bufsize);
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+  return syscallResult (::readlinkat (dirFD, leaf.c_str(), buf, bufsize));
+}
+
+int
+NativeFilesystem::unlink(const char* name)
+{
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+  int ret = syscallResult (::unlinkat (dirFD, leaf.c_str(), 0));
+  if (ret == 0)
+    invalidateDirectories();
+  return ret;
+}
+
+int
+NativeFilesystem::mkdir(const char* name, int mode)
+{
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+  int ret = syscallResult (::mkdirat (dirFD, leaf.c_str(), mode));
+  if (ret == 0)
+    invalidateDirectories();
+  return ret;
+}
+
+int
+NativeFilesystem::rmdir(const char* name)
+{
+  std::string leaf;
+  int dirFD = lookupParent (name, leaf);
+  if (dirFD < 0)
+    return dirFD;
+  int ret = syscallResult (::unlinkat (dirFD, leaf.c_str(), AT_REMOVEDIR));
+  if (ret == 0)
+    invalidateDirectories();
+  return ret;
 }
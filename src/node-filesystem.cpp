@@ -1,52 +1,205 @@
 #include "node-filesystem.h"
 #include "node-sandbox.h"
-#include <future>
+#include <node_buffer.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <memory.h>
+#include <fcntl.h>
 
 using namespace v8;
 
-CodiusNodeFilesystem::CodiusNodeFilesystem(NodeSandbox* sbox)
-  : Filesystem(),
-    m_sbox (sbox) {}
+/**
+ * Buffers handed to JS own their memory. JS may hold on to them after
+ * finishVFS(), when the sandbox's memory they were filled from or are copied
+ * into has already been released or reused.
+ */
+static Persistent<Object>
+newBuffer(size_t count)
+{
+  return Persistent<Object>::New (node::Buffer::New (count)->handle_);
+}
+
+static Handle<Object>
+copyBuffer(const void* buf, size_t count)
+{
+  return node::Buffer::New (static_cast<const char*>(buf), count)->handle_;
+}
+
+/**
+ * Converts a number from JS into @p out. NaN, infinities and anything outside
+ * the range of @p T are rejected, since converting them is undefined.
+ */
+template<typename T> static bool
+fromDouble(double value, T* out)
+{
+  double limit = std::ldexp (1.0, std::numeric_limits<T>::digits);
+  double lowest = std::numeric_limits<T>::is_signed ? -limit : 0;
+  if (!std::isfinite (value) || value < lowest || value >= limit)
+    return false;
+  *out = static_cast<T>(value);
+  return true;
+}
 
-CodiusNodeFilesystem::VFSResult
-CodiusNodeFilesystem::doVFS(const std::string& name, Handle<Value> argv[], int argc)
+static bool
+setTime(struct timespec* ts, double seconds)
 {
-  uv_loop_t*  loop = uv_default_loop ();
-  Handle<Value> result;
-  NodeSandbox::VFSFuture ret = m_sbox->doVFS (name, argv, argc);
+  if (!std::isfinite (seconds))
+    return false;
+  double whole = std::floor (seconds);
+  if (!fromDouble (whole, &ts->tv_sec))
+    return false;
+  ts->tv_nsec = std::min ((seconds - whole) * 1e9, 999999999.0);
+  return true;
+}
 
-  while (ret.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
-    uv_run (loop, UV_RUN_ONCE);
+static bool
+statFromFields(const double* fields, struct stat* buf)
+{
+  memset (buf, 0, sizeof (*buf));
+  return fromDouble (fields[CodiusNodeFilesystem::StatDev], &buf->st_dev) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatIno], &buf->st_ino) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatMode], &buf->st_mode) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatNlink], &buf->st_nlink) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatUid], &buf->st_uid) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatGid], &buf->st_gid) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatRdev], &buf->st_rdev) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatSize], &buf->st_size) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatBlksize], &buf->st_blksize) &&
+         fromDouble (fields[CodiusNodeFilesystem::StatBlocks], &buf->st_blocks) &&
+         setTime (&buf->st_atim, fields[CodiusNodeFilesystem::StatAtime]) &&
+         setTime (&buf->st_mtim, fields[CodiusNodeFilesystem::StatMtime]) &&
+         setTime (&buf->st_ctim, fields[CodiusNodeFilesystem::StatCtime]);
+}
 
-  result = ret.get();
+/**
+ * Decodes a stat result from JS. A Float64Array is read straight out of its
+ * backing store; anything else, or a field that does not fit its type, is
+ * rejected.
+ *
+ * @return 0 on success, or a negative error number
+ */
+static int
+decodeStat(Handle<Value> result, struct stat* buf)
+{
+  if (result.IsEmpty() || !result->IsObject())
+    return -EIO;
 
-  if (result->IsObject()) {
-    Handle<Object> resultObj = result->ToObject();
-    int err = resultObj->Get (String::NewSymbol ("error"))->ToInt32()->Value();
-    Handle<Value> resultValue = resultObj->Get (String::NewSymbol ("result"));
+  Handle<Object> array = result->ToObject();
+  if (!array->HasIndexedPropertiesInExternalArrayData() ||
+      array->GetIndexedPropertiesExternalArrayDataType() != kExternalDoubleArray ||
+      array->GetIndexedPropertiesExternalArrayDataLength() < CodiusNodeFilesystem::StatFieldCount)
+    return -EIO;
 
-    VFSResult r  = {
-      .errnum = err,
-      .result = resultValue
-    };
+  if (!statFromFields (static_cast<const double*>(array->GetIndexedPropertiesExternalArrayData()), buf))
+    return -EIO;
+  return 0;
+}
 
-    return r;
+/**
+ * Entries that JS lists by name alone are numbered from here
+ */
+static const uint64_t firstPlaceholderInode = 256;
+
+/**
+ * Decodes one getdents entry from JS: either a name, or an object with the
+ * name and the same inode number that stat reports for it
+ */
+static bool
+decodeDirent(Handle<Value> value, uint32_t index, DirentCursor::Entry* entry)
+{
+  Handle<Value> name = value;
+  entry->inode = firstPlaceholderInode + index;
+  entry->type = DirentBuilder::Unknown;
+
+  if (value->IsObject() && !value->IsString()) {
+    Handle<Object> obj = value->ToObject();
+    Handle<Value> ino = obj->Get (String::NewSymbol ("ino"));
+    name = obj->Get (String::NewSymbol ("name"));
+    if (!ino->IsNumber())
+      return false;
+    double inode = ino->NumberValue();
+    if (!std::isfinite (inode) || inode < 0 || inode > 9007199254740992.0)
+      return false;
+    entry->inode = inode;
   }
 
-  ThrowException(Exception::TypeError(String::New("Expected a VFS call return type")));
+  if (!name->IsString())
+    return false;
+  Handle<String> str = name->ToString();
+  std::vector<char> buf (str->Utf8Length()+1);
+  str->WriteUtf8 (buf.data(), buf.size());
+  entry->name = std::string (buf.data());
+  return true;
+}
 
-  VFSResult r = {
-    .errnum = ENOSYS,
-    .result = Undefined()
-  };
+CodiusNodeFilesystem::CodiusNodeFilesystem(NodeSandbox* sbox)
+  : Filesystem(),
+    m_sbox (sbox) {}
 
-  return r;
+CodiusNodeFilesystem::OpenFile*
+CodiusNodeFilesystem::getOpenFile(int fd)
+{
+  if (fd < 0 || static_cast<size_t>(fd) >= m_files.size() || !m_files[fd].used)
+    return nullptr;
+  return &m_files[fd];
+}
+
+/**
+ * Runs @p next once the size of @p fd is known, asking JS for it first if
+ * needed. @p next receives 0, or a negative error number.
+ */
+void
+CodiusNodeFilesystem::withSize(int fd, std::function<void(int)> next)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file) {
+    next (-EBADF);
+    return;
+  }
+  if (file->size >= 0) {
+    next (0);
+    return;
+  }
+
+  std::shared_ptr<struct stat> sbuf (new struct stat);
+  fstatAsync (fd, sbuf.get(), [sbuf, next] (ssize_t ret) {
+    next (ret);
+  });
+}
+
+void
+CodiusNodeFilesystem::doVFS(const std::string& name, Handle<Value> argv[], int argc, VFSCallback callback)
+{
+  m_sbox->doVFS (name, argv, argc, [callback] (Handle<Value> result) {
+    if (result->IsObject()) {
+      Handle<Object> resultObj = result->ToObject();
+      int err = resultObj->Get (String::NewSymbol ("error"))->ToInt32()->Value();
+      Handle<Value> resultValue = resultObj->Get (String::NewSymbol ("result"));
+
+      VFSResult r  = {
+        .errnum = err,
+        .result = resultValue
+      };
+
+      callback (r);
+      return;
+    }
+
+    ThrowException(Exception::TypeError(String::New("Expected a VFS call return type")));
+
+    VFSResult r = {
+      .errnum = ENOSYS,
+      .result = Undefined()
+    };
+
+    callback (r);
+  });
 }
 
-int
-CodiusNodeFilesystem::open(const char* name, int flags, int mode)
+void
+CodiusNodeFilesystem::openAsync(const char* name, int flags, int mode, Completion done)
 {
   Handle<Value> argv[] = {
     String::New (name),
@@ -54,213 +207,340 @@ CodiusNodeFilesystem::open(const char* name, int flags, int mode)
     Int32::New (mode)
   };
 
-  VFSResult ret = doVFS(std::string ("open"), argv, 3);
-
-  if (ret.errnum) {
-    return -ret.errnum;
-  }
-
-  m_offsets.insert (std::make_pair(ret.result->ToInt32()->Value(), 0));
-  return ret.result->ToInt32()->Value();
+  doVFS (std::string ("open"), argv, 3, [this, flags, done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
+
+    // Descriptors index m_files, so a huge one must not size it
+    int fd = ret.result->ToInt32()->Value();
+    if (fd < 0 || fd >= maxFDs) {
+      done (-EIO);
+      return;
+    }
+    if (static_cast<size_t>(fd) >= m_files.size())
+      m_files.resize (fd + 1);
+
+    OpenFile& file = m_files[fd];
+    file.offset = 0;
+    file.size = -1;
+    file.flags = flags;
+    file.directory = false;
+    file.cursor = DirentCursor();
+    file.used = true;
+    done (fd);
+  });
 }
 
-ssize_t
-CodiusNodeFilesystem::read(int fd, void* buf, size_t count)
+void
+CodiusNodeFilesystem::readAsync(int fd, void* buf, size_t count, Completion done)
 {
+  OpenFile* file = getOpenFile (fd);
+  if (!file) {
+    done (-EBADF);
+    return;
+  }
+
+  // JS fills a buffer of its own, which is copied out once it completes
+  Persistent<Object> buffer = newBuffer (count);
   Handle<Value> argv[] = {
     Int32::New (fd),
-    Int32::New (count),
-    Int32::New (m_offsets[fd])
+    buffer,
+    Number::New (file->offset)
   };
 
-  VFSResult ret = doVFS (std::string ("read"), argv, 3);
-
-  if (ret.errnum)
-    return -ret.errnum;
-
-  ret.result->ToString()->WriteUtf8 (static_cast<char*>(buf), count, NULL, String::NO_NULL_TERMINATION);
-
-  m_offsets[fd] = m_offsets[fd] + ret.result->ToString()->Utf8Length();
-  return ret.result->ToString()->Utf8Length();
+  doVFS (std::string ("read"), argv, 3, [this, fd, buf, count, buffer, done] (const VFSResult& ret) mutable {
+    int64_t readCount = ret.errnum ? 0 : ret.result->IntegerValue();
+    if (!ret.errnum && readCount >= 0 && static_cast<size_t>(readCount) <= count)
+      memcpy (buf, node::Buffer::Data (buffer), readCount);
+    buffer.Dispose();
+
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
+    if (readCount < 0 || static_cast<size_t>(readCount) > count) {
+      done (-EIO);
+      return;
+    }
+
+    OpenFile* file = getOpenFile (fd);
+    if (file)
+      file->offset += readCount;
+    done (readCount);
+  });
 }
 
-int
-CodiusNodeFilesystem::close(int fd)
+void
+CodiusNodeFilesystem::closeAsync(int fd, Completion done)
 {
   Handle<Value> argv[] = {
     Int32::New (fd)
   };
 
-  m_offsets.erase (fd);
+  OpenFile* file = getOpenFile (fd);
+  if (file) {
+    file->used = false;
+    file->cursor = DirentCursor();
+  }
 
-  return -doVFS (std::string ("close"), argv, 1).errnum;
+  doVFS (std::string ("close"), argv, 1, [done] (const VFSResult& ret) {
+    done (-ret.errnum);
+  });
 }
 
-int
-CodiusNodeFilesystem::fstat(int fd, struct stat* buf)
+void
+CodiusNodeFilesystem::statCall(const char* op, Handle<Value> arg, struct stat* buf, Completion done)
 {
   Handle<Value> argv[] = {
-    Int32::New (fd)
+    arg
   };
-  VFSResult ret = doVFS (std::string ("fstat"), argv, 1);
-
-  if (ret.errnum) 
-    return -ret.errnum;
-
-  Handle<Object> statObj = ret.result->ToObject();
-  buf->st_dev = statObj->Get(String::NewSymbol("dev"))->ToInt32()->Value();
-  buf->st_ino = statObj->Get(String::NewSymbol("ino"))->ToInt32()->Value();
-  buf->st_mode = statObj->Get(String::NewSymbol("mode"))->ToInt32()->Value();
-  buf->st_nlink = statObj->Get(String::NewSymbol("nlink"))->ToInt32()->Value();
-  buf->st_uid = statObj->Get(String::NewSymbol("uid"))->ToInt32()->Value();
-  buf->st_gid = statObj->Get(String::NewSymbol("gid"))->ToInt32()->Value();
-  buf->st_rdev = statObj->Get(String::NewSymbol("rdev"))->ToInt32()->Value();
-  buf->st_size = statObj->Get(String::NewSymbol("size"))->ToInt32()->Value();
-  buf->st_blksize = statObj->Get(String::NewSymbol("blksize"))->ToInt32()->Value();
-  buf->st_blocks = statObj->Get(String::NewSymbol("blocks"))->ToInt32()->Value();
 
-  return 0;
+  doVFS (std::string (op), argv, 1, [buf, done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
+
+    done (decodeStat (ret.result, buf));
+  });
+}
+
+void
+CodiusNodeFilesystem::fstatAsync(int fd, struct stat* buf, Completion done)
+{
+  statCall ("fstat", Int32::New (fd), buf, [this, fd, buf, done] (ssize_t ret) {
+    OpenFile* file = getOpenFile (fd);
+    if (ret == 0 && file)
+      file->size = buf->st_size;
+    done (ret);
+  });
 }
 
-off_t
-CodiusNodeFilesystem::lseek(int fd, off_t offset, int whence)
+/**
+ * Offsets are kept natively, so only SEEK_END, SEEK_DATA and SEEK_HOLE on a
+ * file whose size is not cached yet need a round trip to JS. JS files have no
+ * holes, so all data runs up to an implicit hole at the end.
+ */
+void
+CodiusNodeFilesystem::lseekAsync(int fd, off_t offset, int whence, Completion done)
 {
-  switch (whence) {
-    case SEEK_SET:
-      m_offsets[fd] = offset;
-      break;
-    case SEEK_CUR:
-      m_offsets[fd] += offset;
-      break;
-    default:
-      return -ENOSYS;
+  OpenFile* file = getOpenFile (fd);
+  if (!file) {
+    done (-EBADF);
+    return;
   }
-  return 0;
+
+  if (file->directory) {
+    if (whence != SEEK_SET || offset < 0)
+      done (-EINVAL);
+    else
+      done (file->cursor.seek (offset));
+    return;
+  }
+
+  if (whence == SEEK_SET || whence == SEEK_CUR) {
+    off_t newOffset = seekOffset (whence == SEEK_SET ? 0 : file->offset, offset);
+    if (newOffset >= 0)
+      file->offset = newOffset;
+    done (newOffset);
+    return;
+  }
+
+  if (whence != SEEK_END && whence != SEEK_DATA && whence != SEEK_HOLE) {
+    done (-EINVAL);
+    return;
+  }
+
+  withSize (fd, [this, fd, offset, whence, done] (int err) {
+    OpenFile* file = getOpenFile (fd);
+    if (err < 0 || !file) {
+      done (err < 0 ? err : -EBADF);
+      return;
+    }
+
+    off_t newOffset;
+    if (whence == SEEK_END) {
+      newOffset = seekOffset (file->size, offset);
+      if (newOffset < 0) {
+        done (newOffset);
+        return;
+      }
+    } else if (offset < 0 || offset >= file->size) {
+      done (-ENXIO);
+      return;
+    } else {
+      newOffset = whence == SEEK_DATA ? offset : file->size;
+    }
+
+    file->offset = newOffset;
+    done (newOffset);
+  });
 }
 
-int
-CodiusNodeFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+void
+CodiusNodeFilesystem::getdentsAsync(int fd, struct linux_dirent* dirs, unsigned int count, Completion done)
 {
+  readDirectory (fd, dirs, count, DirentBuilder::Dirent, done);
+}
+
+void
+CodiusNodeFilesystem::getdents64Async(int fd, struct linux_dirent64* dirs, unsigned int count, Completion done)
+{
+  readDirectory (fd, dirs, count, DirentBuilder::Dirent64, done);
+}
+
+/**
+ * The listing is only fetched from JS on the first call for each open
+ * directory, or after a rewind; later calls are served from the cursor.
+ */
+void
+CodiusNodeFilesystem::readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format, Completion done)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file) {
+    done (-EBADF);
+    return;
+  }
+
+  file->directory = true;
+  if (file->cursor.loaded()) {
+    done (file->cursor.read (dirs, count, format));
+    return;
+  }
+
   Handle<Value> argv[] = {
     Int32::New (fd)
   };
-  VFSResult ret = doVFS(std::string ("getdents"), argv, 1);
-  if (ret.errnum)
-    return -ret.errnum;
-
-  DirentBuilder builder;
-
-  Handle<Array> fileList = Handle<Array>::Cast (ret.result);
-  for (uint32_t i = 0; i < fileList->Length(); i++) {
-    Handle<String> filename = fileList->Get(i)->ToString();
-    std::vector<char> buf (filename->Utf8Length()+1);
-    filename->WriteUtf8 (buf.data(), buf.size());
-    builder.append (std::string (buf.data()));
-  }
-  std::vector<char> buf;
-  buf = builder.data();
-  memcpy (dirs, buf.data(), buf.size());
-  return buf.size();
+
+  doVFS(std::string ("getdents"), argv, 1, [this, fd, dirs, count, format, done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
+
+    OpenFile* file = getOpenFile (fd);
+    if (!file) {
+      done (-EBADF);
+      return;
+    }
+
+    if (ret.result.IsEmpty() || !ret.result->IsArray()) {
+      done (-EIO);
+      return;
+    }
+
+    std::vector<DirentCursor::Entry> entries;
+    Handle<Array> fileList = Handle<Array>::Cast (ret.result);
+    for (uint32_t i = 0; i < fileList->Length(); i++) {
+      DirentCursor::Entry entry;
+      if (!decodeDirent (fileList->Get (i), i, &entry)) {
+        done (-EIO);
+        return;
+      }
+      entries.push_back (entry);
+    }
+    file->cursor.load (entries);
+    done (file->cursor.read (dirs, count, format));
+  });
 }
 
-ssize_t
-CodiusNodeFilesystem::write(int fd, void* buf, size_t count)
+void
+CodiusNodeFilesystem::writeAsync(int fd, void* buf, size_t count, Completion done)
 {
+  OpenFile* file = getOpenFile (fd);
+  if (!file) {
+    done (-EBADF);
+    return;
+  }
+
+  // Appends go to the end of the file, so its size is needed first
+  if ((file->flags & O_APPEND) && file->size < 0) {
+    withSize (fd, [this, fd, buf, count, done] (int err) {
+      if (err < 0)
+        done (err);
+      else
+        writeAsync (fd, buf, count, done);
+    });
+    return;
+  }
+
+  if (file->flags & O_APPEND)
+    file->offset = file->size;
+
   Handle<Value> argv[] = {
     Int32::New (fd),
-    String::New ((char*)buf, count)
+    copyBuffer (buf, count),
+    Number::New (file->offset)
   };
 
-  VFSResult ret = doVFS (std::string ("write"), argv, 2);
-
-  if (ret.errnum)
-    return -ret.errnum;
-
-  return ret.result->ToInt32()->Value();
+  doVFS (std::string ("write"), argv, 3, [this, fd, count, done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
+
+    int64_t written = ret.result->IntegerValue();
+    if (written < 0 || static_cast<size_t>(written) > count) {
+      done (-EIO);
+      return;
+    }
+
+    OpenFile* file = getOpenFile (fd);
+    if (file) {
+      file->offset += written;
+      if (file->size >= 0)
+        file->size = std::max (file->size, file->offset);
+    }
+    done (written);
+  });
 }
 
-ssize_t
-CodiusNodeFilesystem::readlink (const char* path, char* buf, size_t bufsize)
+void
+CodiusNodeFilesystem::readlinkAsync(const char* path, char* buf, size_t bufsize, Completion done)
 {
   Handle<Value> argv[] = {
     String::New (path)
   };
 
-  VFSResult ret = doVFS (std::string ("readlink"), argv, 1);
-
-  if (ret.errnum)
-    return -ret.errnum;
+  doVFS (std::string ("readlink"), argv, 1, [buf, bufsize, done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
 
-  ret.result->ToString()->WriteUtf8 (buf, bufsize);
-  return ret.result->ToString()->Utf8Length();
+    ret.result->ToString()->WriteUtf8 (buf, bufsize);
+    done (ret.result->ToString()->Utf8Length());
+  });
 }
 
-int
-CodiusNodeFilesystem::access (const char* name, int mode)
+void
+CodiusNodeFilesystem::accessAsync(const char* name, int mode, Completion done)
 {
   Handle<Value> argv[] = {
     String::New (name),
     Int32::New (mode)
   };
 
-  VFSResult ret = doVFS (std::string ("access"), argv, 2);
-
-  if (ret.errnum)
-    return -ret.errnum;
+  doVFS (std::string ("access"), argv, 2, [done] (const VFSResult& ret) {
+    if (ret.errnum) {
+      done (-ret.errnum);
+      return;
+    }
 
-  return ret.result->ToInt32()->Value();
+    done (ret.result->ToInt32()->Value());
+  });
 }
 
-int
-CodiusNodeFilesystem::stat (const char* name, struct stat* buf)
+void
+CodiusNodeFilesystem::statAsync(const char* name, struct stat* buf, Completion done)
 {
-  Handle<Value> argv[] = {
-    String::New (name)
-  };
-
-  VFSResult ret = doVFS (std::string ("stat"), argv, 1);
-
-  if (ret.errnum) 
-    return -ret.errnum;
-
-  Handle<Object> statObj = ret.result->ToObject();
-  buf->st_dev = statObj->Get(String::NewSymbol("dev"))->ToInt32()->Value();
-  buf->st_ino = statObj->Get(String::NewSymbol("ino"))->ToInt32()->Value();
-  buf->st_mode = statObj->Get(String::NewSymbol("mode"))->ToInt32()->Value();
-  buf->st_nlink = statObj->Get(String::NewSymbol("nlink"))->ToInt32()->Value();
-  buf->st_uid = statObj->Get(String::NewSymbol("uid"))->ToInt32()->Value();
-  buf->st_gid = statObj->Get(String::NewSymbol("gid"))->ToInt32()->Value();
-  buf->st_rdev = statObj->Get(String::NewSymbol("rdev"))->ToInt32()->Value();
-  buf->st_size = statObj->Get(String::NewSymbol("size"))->ToInt32()->Value();
-  buf->st_blksize = statObj->Get(String::NewSymbol("blksize"))->ToInt32()->Value();
-  buf->st_blocks = statObj->Get(String::NewSymbol("blocks"))->ToInt32()->Value();
-
-  return 0;
+  statCall ("stat", String::New (name), buf, done);
 }
 
-int
-CodiusNodeFilesystem::lstat (const char* name, struct stat* buf)
+void
+CodiusNodeFilesystem::lstatAsync(const char* name, struct stat* buf, Completion done)
 {
-  Handle<Value> argv[] = {
-    String::New (name)
-  };
-
-  VFSResult ret = doVFS (std::string ("lstat"), argv, 1);
-
-  if (ret.errnum) 
-    return -ret.errnum;
-
-  Handle<Object> statObj = ret.result->ToObject();
-  buf->st_dev = statObj->Get(String::NewSymbol("dev"))->ToInt32()->Value();
-  buf->st_ino = statObj->Get(String::NewSymbol("ino"))->ToInt32()->Value();
-  buf->st_mode = statObj->Get(String::NewSymbol("mode"))->ToInt32()->Value();
-  buf->st_nlink = statObj->Get(String::NewSymbol("nlink"))->ToInt32()->Value();
-  buf->st_uid = statObj->Get(String::NewSymbol("uid"))->ToInt32()->Value();
-  buf->st_gid = statObj->Get(String::NewSymbol("gid"))->ToInt32()->Value();
-  buf->st_rdev = statObj->Get(String::NewSymbol("rdev"))->ToInt32()->Value();
-  buf->st_size = statObj->Get(String::NewSymbol("size"))->ToInt32()->Value();
-  buf->st_blksize = statObj->Get(String::NewSymbol("blksize"))->ToInt32()->Value();
-  buf->st_blocks = statObj->Get(String::NewSymbol("blocks"))->ToInt32()->Value();
-
-  return 0;
+  statCall ("lstat", String::New (name), buf, done);
 }
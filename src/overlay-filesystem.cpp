@@ -0,0 +1,588 @@
+#include "overlay-filesystem.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Keeps upper inode numbers clear of the ones the lower layer hands out
+static const uint64_t firstUpperInode = 1ull << 40;
+
+OverlayFilesystem::OverlayFilesystem(std::shared_ptr<Filesystem> lower, size_t quota)
+  : Filesystem(),
+    m_lower (lower),
+    m_nextInode (firstUpperInode),
+    m_quota (quota),
+    m_used (0)
+{
+}
+
+OverlayFilesystem::OpenFile*
+OverlayFilesystem::getOpenFile(int fd)
+{
+  if (fd < 0 || static_cast<size_t>(fd) >= m_openFiles.size() || !m_openFiles[fd].used)
+    return nullptr;
+  return &m_openFiles[fd];
+}
+
+/**
+ * Returns true if the lower layer's copy of @p path has been deleted, or
+ * sits below an opaque directory
+ */
+bool
+OverlayFilesystem::isHidden(const std::string& path) const
+{
+  if (m_whiteouts.count (path))
+    return true;
+
+  std::string parent (path);
+  while (parent != "/") {
+    size_t sep = parent.rfind ('/');
+    parent = sep == 0 ? "/" : parent.substr (0, sep);
+    if (m_whiteouts.count (parent))
+      return true;
+    std::shared_ptr<UpperNode> node = findUpper (parent);
+    if (node && node->opaque)
+      return true;
+  }
+  return false;
+}
+
+std::shared_ptr<OverlayFilesystem::UpperNode>
+OverlayFilesystem::findUpper(const std::string& path) const
+{
+  auto node = m_upper.find (path);
+  if (node == m_upper.end())
+    return nullptr;
+  return node->second;
+}
+
+int
+OverlayFilesystem::lowerStat(const std::string& path, struct stat* buf, bool follow) const
+{
+  if (isHidden (path))
+    return -ENOENT;
+  if (follow)
+    return m_lower->stat (path.c_str(), buf);
+  return m_lower->lstat (path.c_str(), buf);
+}
+
+int
+OverlayFilesystem::mergedStat(const std::string& path, struct stat* buf, bool follow) const
+{
+  std::shared_ptr<UpperNode> node = findUpper (path);
+  if (node) {
+    fillStat (*node, buf);
+    return 0;
+  }
+  return lowerStat (path, buf, follow);
+}
+
+int
+OverlayFilesystem::checkParent(const std::string& path) const
+{
+  struct stat sbuf;
+  size_t sep = path.rfind ('/');
+  int ret = mergedStat (sep == 0 ? "/" : path.substr (0, sep), &sbuf, true);
+  if (ret < 0)
+    return ret;
+  if (!S_ISDIR (sbuf.st_mode))
+    return -ENOTDIR;
+  return 0;
+}
+
+std::shared_ptr<OverlayFilesystem::UpperNode>
+OverlayFilesystem::makeUpper(const std::string& path, int mode)
+{
+  std::shared_ptr<UpperNode> node (new UpperNode);
+  node->inode = m_nextInode++;
+  node->mode = mode;
+  node->mtime = time (NULL);
+  // A directory that replaces a deleted one must not show its old entries
+  bool replaced = m_whiteouts.erase (path) > 0;
+  node->opaque = S_ISDIR (mode) && replaced;
+  m_upper[path] = node;
+  return node;
+}
+
+/**
+ * Drops a reference to an upper node, and gives its data back to the quota
+ * if it was the last one
+ */
+void
+OverlayFilesystem::release(std::shared_ptr<UpperNode>& node)
+{
+  if (node && node.use_count() == 1)
+    m_used -= node->data.size();
+  node.reset();
+}
+
+/**
+ * Moves a file that was opened from the lower layer into the upper layer. This
+ * happens on its first write, so files that are only read are never copied.
+ */
+int
+OverlayFilesystem::copyUp(OpenFile& file)
+{
+  std::shared_ptr<UpperNode> node (findUpper (file.path));
+  off_t offset = m_lower->lseek (file.lowerFD, 0, SEEK_CUR);
+  if (offset < 0)
+    return offset;
+
+  if (!node) {
+    struct stat sbuf;
+    int ret = m_lower->fstat (file.lowerFD, &sbuf);
+    if (ret < 0)
+      return ret;
+    if (static_cast<size_t>(sbuf.st_size) > m_quota - m_used)
+      return -ENOSPC;
+
+    // Read through the open descriptor, so a file deleted since it was
+    // opened still gets its own contents
+    off_t pos = m_lower->lseek (file.lowerFD, 0, SEEK_SET);
+    if (pos < 0)
+      return pos;
+    std::vector<char> data;
+    data.reserve (sbuf.st_size);
+    char buf[65536];
+    ssize_t len;
+    while ((len = m_lower->read (file.lowerFD, buf, sizeof (buf))) > 0)
+      data.insert (data.end(), buf, buf + len);
+    if (len < 0)
+      return len;
+    if (data.size() > m_quota - m_used)
+      return -ENOSPC;
+
+    int mode = sbuf.st_mode & (S_IFMT | 07777);
+    if (isHidden (file.path)) {
+      node = std::make_shared<UpperNode>();
+      node->inode = m_nextInode++;
+      node->mode = mode;
+      node->opaque = false;
+    } else {
+      node = makeUpper (file.path, mode);
+    }
+    node->mtime = sbuf.st_mtime;
+    node->data.swap (data);
+    m_used += node->data.size();
+  }
+
+  m_lower->close (file.lowerFD);
+  file.lowerFD = -1;
+  file.upper = node;
+  file.offset = offset;
+  return 0;
+}
+
+/**
+ * Merges the entries of both layers, minus deleted ones. An upper entry
+ * replaces a lower one of the same name, as it does for stat().
+ */
+int
+OverlayFilesystem::listDirectory(const std::string& path, std::vector<DirentCursor::Entry>& entries) const
+{
+  std::map<std::string, DirentCursor::Entry> merged;
+  std::string prefix (path == "/" ? path : path + "/");
+
+  if (!isHidden (path)) {
+    int fd = m_lower->open (path.c_str(), O_RDONLY | O_DIRECTORY, 0);
+    if (fd >= 0) {
+      char buf[4096];
+      int len;
+      while ((len = m_lower->getdents64 (fd, reinterpret_cast<struct linux_dirent64*>(buf), sizeof (buf))) > 0) {
+        for (int pos = 0; pos < len;) {
+          struct linux_dirent64* ent = reinterpret_cast<struct linux_dirent64*>(buf + pos);
+          std::string name (ent->d_name);
+          if (name != "." && name != ".." && !m_whiteouts.count (prefix + name)) {
+            DirentCursor::Entry entry = {
+              name,
+              ent->d_ino,
+              static_cast<DirentBuilder::DirentType>(ent->d_type)
+            };
+            merged[name] = entry;
+          }
+          pos += ent->d_reclen;
+        }
+      }
+      m_lower->close (fd);
+      if (len < 0)
+        return len;
+    }
+  }
+
+  for (auto i = m_upper.lower_bound (prefix); i != m_upper.end(); i++) {
+    if (i->first.compare (0, prefix.size(), prefix) != 0)
+      break;
+    std::string name (i->first, prefix.size());
+    if (!name.empty() && name.find ('/') == std::string::npos) {
+      DirentCursor::Entry entry = {
+        name,
+        i->second->inode,
+        static_cast<DirentBuilder::DirentType>(IFTODT (i->second->mode))
+      };
+      merged[name] = entry;
+    }
+  }
+
+  entries.clear();
+  for (auto i = merged.cbegin(); i != merged.cend(); i++)
+    entries.push_back (i->second);
+  return 0;
+}
+
+void
+OverlayFilesystem::fillStat(const UpperNode& node, struct stat* buf) const
+{
+  memset (buf, 0, sizeof (*buf));
+  buf->st_ino = node.inode;
+  buf->st_mode = node.mode;
+  buf->st_nlink = S_ISDIR (node.mode) ? 2 : 1;
+  buf->st_size = S_ISDIR (node.mode) ? 4096 : node.data.size();
+  buf->st_blksize = 4096;
+  buf->st_blocks = (buf->st_size + 511) / 512;
+  buf->st_atime = node.mtime;
+  buf->st_mtime = node.mtime;
+  buf->st_ctime = node.mtime;
+}
+
+int
+OverlayFilesystem::open(const char* name, int flags, int mode)
+{
+  std::string path (normalizePath (name));
+  bool writing = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC);
+  std::shared_ptr<UpperNode> upper (findUpper (path));
+  int lowerFD = -1;
+  struct stat sbuf;
+  int ret;
+
+  if (upper) {
+    if ((flags & O_CREAT) && (flags & O_EXCL))
+      return -EEXIST;
+    if (S_ISDIR (upper->mode) && writing)
+      return -EISDIR;
+    if ((flags & O_DIRECTORY) && !S_ISDIR (upper->mode))
+      return -ENOTDIR;
+  } else if ((ret = lowerStat (path, &sbuf, true)) == -ENOENT) {
+    if (!(flags & O_CREAT))
+      return -ENOENT;
+    if ((ret = checkParent (path)) < 0)
+      return ret;
+    upper = makeUpper (path, S_IFREG | (mode & 07777));
+  } else if (ret < 0) {
+    return ret;
+  } else {
+    if ((flags & O_CREAT) && (flags & O_EXCL))
+      return -EEXIST;
+    if (S_ISDIR (sbuf.st_mode)) {
+      if (writing)
+        return -EISDIR;
+    } else if (flags & O_DIRECTORY) {
+      return -ENOTDIR;
+    } else if (flags & O_TRUNC) {
+      // Nothing of the lower file survives, so there is nothing to copy
+      upper = makeUpper (path, sbuf.st_mode & (S_IFMT | 07777));
+    } else {
+      // Writable files are copied up on their first write
+      lowerFD = m_lower->open (path.c_str(), (flags & ~(O_ACCMODE | O_CREAT | O_EXCL | O_APPEND)) | O_RDONLY, 0);
+      if (lowerFD < 0)
+        return lowerFD;
+    }
+  }
+
+  if (upper && S_ISREG (upper->mode) && (flags & O_TRUNC)) {
+    m_used -= upper->data.size();
+    upper->data.clear();
+  }
+
+  int fd;
+  if (!m_freeFDs.empty()) {
+    fd = m_freeFDs.back();
+    m_freeFDs.pop_back();
+  } else {
+    fd = m_openFiles.size();
+    m_openFiles.push_back (OpenFile());
+  }
+
+  OpenFile& file = m_openFiles[fd];
+  file.path = path;
+  file.upper = upper;
+  file.lowerFD = lowerFD;
+  file.flags = flags;
+  file.offset = 0;
+  file.cursor = DirentCursor();
+  file.used = true;
+  return fd;
+}
+
+ssize_t
+OverlayFilesystem::readInPlace(int fd, size_t count, const void** data)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file || (file->flags & O_ACCMODE) == O_WRONLY)
+    return -EBADF;
+  if (file->lowerFD >= 0)
+    return m_lower->readInPlace (file->lowerFD, count, data);
+  if (!file->upper || S_ISDIR (file->upper->mode))
+    return -EISDIR;
+
+  const std::vector<char>& contents = file->upper->data;
+  if (static_cast<size_t>(file->offset) >= contents.size())
+    return 0;
+
+  size_t len = std::min (count, contents.size() - file->offset);
+  *data = contents.data() + file->offset;
+  file->offset += len;
+  return len;
+}
+
+ssize_t
+OverlayFilesystem::read(int fd, void* buf, size_t count)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (file && file->lowerFD >= 0 && (file->flags & O_ACCMODE) != O_WRONLY)
+    return m_lower->read (file->lowerFD, buf, count);
+
+  const void* data;
+  ssize_t len = readInPlace (fd, count, &data);
+  if (len > 0)
+    memcpy (buf, data, len);
+  return len;
+}
+
+ssize_t
+OverlayFilesystem::write(int fd, void* buf, size_t count)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file || (file->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+  if (file->lowerFD >= 0) {
+    int ret = copyUp (*file);
+    if (ret < 0)
+      return ret;
+  }
+  if (!file->upper)
+    return -EBADF;
+  if (S_ISDIR (file->upper->mode))
+    return -EISDIR;
+
+  std::vector<char>& contents = file->upper->data;
+  if (file->flags & O_APPEND)
+    file->offset = contents.size();
+  size_t end = file->offset + count;
+  if (contents.size() < end) {
+    if (end - contents.size() > m_quota - m_used)
+      return -ENOSPC;
+    m_used += end - contents.size();
+    contents.resize (end);
+  }
+  memcpy (contents.data() + file->offset, buf, count);
+  file->offset += count;
+  file->upper->mtime = time (NULL);
+  return count;
+}
+
+int
+OverlayFilesystem::close(int fd)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (file->lowerFD >= 0)
+    m_lower->close (file->lowerFD);
+  release (file->upper);
+  file->cursor = DirentCursor();
+  file->used = false;
+  m_freeFDs.push_back (fd);
+  return 0;
+}
+
+int
+OverlayFilesystem::fstat(int fd, struct stat* buf)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (file->lowerFD >= 0)
+    return m_lower->fstat (file->lowerFD, buf);
+  if (file->upper) {
+    fillStat (*file->upper, buf);
+    return 0;
+  }
+  return mergedStat (file->path, buf, true);
+}
+
+int
+OverlayFilesystem::readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (file->lowerFD >= 0 || (file->upper && !S_ISDIR (file->upper->mode)))
+    return -ENOTDIR;
+
+  if (!file->cursor.loaded()) {
+    std::vector<DirentCursor::Entry> entries;
+    int ret = listDirectory (file->path, entries);
+    if (ret < 0)
+      return ret;
+    file->cursor.load (entries);
+  }
+  return file->cursor.read (dirs, count, format);
+}
+
+int
+OverlayFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent);
+}
+
+int
+OverlayFilesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent64);
+}
+
+off_t
+OverlayFilesystem::lseek(int fd, off_t offset, int whence)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (file->lowerFD >= 0)
+    return m_lower->lseek (file->lowerFD, offset, whence);
+
+  if (!file->upper || S_ISDIR (file->upper->mode)) {
+    if (whence != SEEK_SET || offset < 0)
+      return -EINVAL;
+    return file->cursor.seek (offset);
+  }
+
+  off_t newOffset;
+  switch (whence) {
+    case SEEK_SET:
+      newOffset = seekOffset (0, offset);
+      break;
+    case SEEK_CUR:
+      newOffset = seekOffset (file->offset, offset);
+      break;
+    case SEEK_END:
+      newOffset = seekOffset (file->upper->data.size(), offset);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if (newOffset < 0)
+    return newOffset;
+  file->offset = newOffset;
+  return newOffset;
+}
+
+int
+OverlayFilesystem::access(const char* name, int mode)
+{
+  std::string path (normalizePath (name));
+  std::shared_ptr<UpperNode> upper (findUpper (path));
+  if (upper) {
+    if ((mode & X_OK) && !(upper->mode & 0111))
+      return -EACCES;
+    return 0;
+  }
+  if (isHidden (path))
+    return -ENOENT;
+  // Lower files become writable by being copied up
+  return m_lower->access (path.c_str(), mode & ~W_OK);
+}
+
+int
+OverlayFilesystem::stat(const char* path, struct stat* buf)
+{
+  return mergedStat (normalizePath (path), buf, true);
+}
+
+int
+OverlayFilesystem::lstat(const char* path, struct stat* buf)
+{
+  return mergedStat (normalizePath (path), buf, false);
+}
+
+ssize_t
+OverlayFilesystem::readlink(const char* name, char* buf, size_t bufsize)
+{
+  std::string path (normalizePath (name));
+  if (findUpper (path))
+    return -EINVAL;
+  if (isHidden (path))
+    return -ENOENT;
+  return m_lower->readlink (path.c_str(), buf, bufsize);
+}
+
+int
+OverlayFilesystem::unlink(const char* name)
+{
+  std::string path (normalizePath (name));
+  struct stat sbuf;
+  int ret = mergedStat (path, &sbuf, false);
+  if (ret < 0)
+    return ret;
+  if (S_ISDIR (sbuf.st_mode))
+    return -EISDIR;
+
+  std::shared_ptr<UpperNode> node (findUpper (path));
+  m_upper.erase (path);
+  release (node);
+  if (lowerStat (path, &sbuf, false) == 0)
+    m_whiteouts.insert (path);
+  return 0;
+}
+
+int
+OverlayFilesystem::mkdir(const char* name, int mode)
+{
+  std::string path (normalizePath (name));
+  struct stat sbuf;
+  if (mergedStat (path, &sbuf, false) == 0)
+    return -EEXIST;
+  int ret = checkParent (path);
+  if (ret < 0)
+    return ret;
+  makeUpper (path, S_IFDIR | (mode & 07777));
+  return 0;
+}
+
+int
+OverlayFilesystem::rmdir(const char* name)
+{
+  std::string path (normalizePath (name));
+  struct stat sbuf;
+  int ret = mergedStat (path, &sbuf, false);
+  if (ret < 0)
+    return ret;
+  if (!S_ISDIR (sbuf.st_mode))
+    return -ENOTDIR;
+  if (path == "/")
+    return -EBUSY;
+
+  std::vector<DirentCursor::Entry> entries;
+  ret = listDirectory (path, entries);
+  if (ret < 0)
+    return ret;
+  if (!entries.empty())
+    return -ENOTEMPTY;
+
+  std::shared_ptr<UpperNode> node (findUpper (path));
+  m_upper.erase (path);
+  release (node);
+  if (lowerStat (path, &sbuf, false) == 0)
+    m_whiteouts.insert (path);
+  return 0;
+}
+
+size_t
+OverlayFilesystem::upperSize() const
+{
+  return m_used;
+}
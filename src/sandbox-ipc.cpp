@@ -1,19 +1,36 @@
 #include "sandbox-ipc.h"
+#include "codius-util.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 
 SandboxIPC::SandboxIPC(int _dupAs)
-  : dupAs (_dupAs)
+  : dupAs (_dupAs),
+    m_events (0)
 {
   int ipc_fds[2];
   socketpair (AF_UNIX, SOCK_STREAM, 0, ipc_fds);
   child = ipc_fds[IPC_CHILD_IDX];
   parent = ipc_fds[IPC_PARENT_IDX];
+
+  // A guest that sends half a frame must not stall the event loop; the rest
+  // is read when the socket polls readable again
+  fcntl (parent, F_SETFL, fcntl (parent, F_GETFL) | O_NONBLOCK);
 }
 
+SandboxIPC::SandboxIPC(int _dupAs, int _parent, int _child)
+  : parent (_parent),
+    child (_child),
+    dupAs (_dupAs),
+    m_events (0)
+{}
+
 SandboxIPC::~SandboxIPC()
 {
   stopPoll();
-  close (child);
+  codius_forget_fd (parent);
+  if (child >= 0)
+    close (child);
   close (parent);
 }
 
@@ -25,6 +42,30 @@ SandboxIPC::dup()
   return true;
 }
 
+std::vector<int>
+SandboxIPC::childFDs() const
+{
+  return std::vector<int> (1, dupAs);
+}
+
+codius_request_t*
+SandboxIPC::readRequest()
+{
+  return codius_read_request (parent);
+}
+
+bool
+SandboxIPC::hasBufferedRequest()
+{
+  return codius_has_buffered_message (parent);
+}
+
+bool
+SandboxIPC::owns(const codius_request_t* request) const
+{
+  return !request->_shm && request->_fd == parent;
+}
+
 void
 CallbackIPC::setCallback(SandboxIPCCallback cb, void* user_data)
 {
@@ -36,11 +77,18 @@ CallbackIPC::CallbackIPC(int dupAs)
   : SandboxIPC (dupAs)
 {}
 
+CallbackIPC::CallbackIPC(int dupAs, int parent, int child)
+  : SandboxIPC (dupAs, parent, child)
+{}
+
 void
 SandboxIPC::cb_forward(uv_poll_t* req, int status, int events)
 {
   SandboxIPC* self = static_cast<SandboxIPC*>(req->data);
-  self->onReadReady();
+  if (events & UV_WRITABLE)
+    self->flushReplies();
+  if (status < 0 || (events & UV_READABLE))
+    self->onReadReady();
 }
 
 void
@@ -54,15 +102,151 @@ SandboxIPC::startPoll(uv_loop_t* loop)
 {
   uv_poll_init_socket (loop, &poll, parent);
   poll.data = this;
-  if (uv_poll_start (&poll, UV_READABLE, SandboxIPC::cb_forward) < 0)
+  m_events = UV_READABLE;
+  if (codius_reply_backlog (parent))
+    m_events |= UV_WRITABLE;
+  if (uv_poll_start (&poll, m_events, SandboxIPC::cb_forward) < 0) {
+    m_events = 0;
     return false;
+  }
   return true;
 }
 
 bool
 SandboxIPC::stopPoll()
 {
+  m_events = 0;
   if (uv_poll_stop (&poll) < 0)
     return false;
   return true;
 }
+
+/**
+ * Only polls for writability while replies are waiting, since an idle socket
+ * is always writable
+ */
+void
+SandboxIPC::watchWritable(bool writable)
+{
+  int events = UV_READABLE | (writable ? UV_WRITABLE : 0);
+
+  // A stopped or disconnected channel stays that way
+  if (!m_events || events == m_events)
+    return;
+  m_events = events;
+  uv_poll_start (&poll, m_events, SandboxIPC::cb_forward);
+}
+
+void
+SandboxIPC::replyQueued()
+{
+  watchWritable (true);
+}
+
+void
+SandboxIPC::flushReplies()
+{
+  codius_flush_replies (parent);
+  watchWritable (codius_reply_backlog (parent) > 0);
+}
+
+void
+SandboxIPC::disconnect()
+{
+  stopPoll();
+  shutdown (parent, SHUT_RDWR);
+}
+
+ShmIPC::ShmIPC(codius_shm_t* shm, int dupAs, int doorbell)
+  : CallbackIPC (dupAs, doorbell, -1),
+    m_shm (shm)
+{}
+
+ShmIPC::~ShmIPC()
+{
+  // Stop polling before the doorbell goes away with the channel
+  stopPoll();
+  codius_shm_free (m_shm);
+}
+
+std::unique_ptr<ShmIPC>
+ShmIPC::create(int dupAs)
+{
+  codius_shm_t* shm = codius_shm_create (CODIUS_SHM_DEFAULT_RING_SIZE);
+  int doorbell;
+
+  if (!shm)
+    return ShmIPC::Ptr();
+
+  // The doorbell stays owned by the channel, so the base class gets its own copy
+  doorbell = fcntl (codius_shm_host_doorbell (shm), F_DUPFD_CLOEXEC, 0);
+  if (doorbell < 0) {
+    codius_shm_free (shm);
+    return ShmIPC::Ptr();
+  }
+
+  return ShmIPC::Ptr (new ShmIPC (shm, dupAs, doorbell));
+}
+
+bool
+ShmIPC::dup()
+{
+  if (dup2 (codius_shm_memfd (m_shm), dupAs) != dupAs)
+    return false;
+  if (dup2 (codius_shm_host_doorbell (m_shm), dupAs + 1) != dupAs + 1)
+    return false;
+  if (dup2 (codius_shm_guest_doorbell (m_shm), dupAs + 2) != dupAs + 2)
+    return false;
+  return true;
+}
+
+std::vector<int>
+ShmIPC::childFDs() const
+{
+  std::vector<int> fds;
+  fds.push_back (dupAs);
+  fds.push_back (dupAs + 1);
+  fds.push_back (dupAs + 2);
+  return fds;
+}
+
+void
+ShmIPC::disconnect()
+{
+  // The guest has no way to notice; its calls simply go unanswered
+  stopPoll();
+}
+
+void
+ShmIPC::replyQueued()
+{
+  // Replies go straight into the shared ring; there is no socket to poll
+}
+
+codius_request_t*
+ShmIPC::readRequest()
+{
+  return codius_shm_read_request (m_shm);
+}
+
+bool
+ShmIPC::hasBufferedRequest()
+{
+  // Arms the doorbell when the ring is empty, so the next request wakes us
+  return !codius_shm_arm (m_shm);
+}
+
+bool
+ShmIPC::owns(const codius_request_t* request) const
+{
+  return request->_shm == m_shm;
+}
+
+void
+ShmIPC::onReadReady()
+{
+  // The guest also rings when it has made room for queued replies
+  codius_shm_clear_doorbell (m_shm);
+  codius_shm_flush (m_shm);
+  CallbackIPC::onReadReady();
+}
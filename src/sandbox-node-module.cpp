@@ -4,6 +4,8 @@
 
 #include "vfs.h"
 #include "node-filesystem.h"
+#include "tmp-filesystem.h"
+#include "json-v8.h"
 #include <node.h>
 #include <vector>
 #include <v8.h>
@@ -13,8 +15,6 @@
 #include <error.h>
 #include <sys/un.h>
 
-#include <future>
-
 using namespace v8;
 
 //static void handle_stdio_read (SandboxIPC& ipc, void* user_data);
@@ -58,6 +58,18 @@ NodeSandbox::NodeSandbox(SandboxWrapper* _wrap)
   getVFS().mountFilesystem (std::string("/"), std::shared_ptr<Filesystem>(new CodiusNodeFilesystem (this)));
 }
 
+/**
+ * Cookies that JS still holds are invalidated, so a finishVFS() or
+ * finishIPC() that arrives late is rejected instead of reaching a filesystem
+ * or channel that is gone.
+ */
+NodeSandbox::~NodeSandbox()
+{
+  m_vfsCallbacks.clear();
+  for (codius_request_t* request : m_ipcRequests.clear())
+    codius_request_free (request);
+}
+
 std::vector<char>
 NodeSandbox::mapFilename(std::vector<char> fname)
 {
@@ -132,65 +144,59 @@ NodeSandbox::handleSyscall(const SyscallCall &call)
   return ret;
 };
 
-static Handle<Value> fromJsonNode(JsonNode* node) {
-  char* buf;
-  Handle<Context> context = Context::GetCurrent();
-  Handle<Object> global = context->Global();
-  Handle<Object> JSON = global->Get(String::New ("JSON"))->ToObject();
-  Handle<Function> JSON_parse = Handle<Function>::Cast(JSON->Get(String::New("parse")));
-
-  buf = json_encode (node);
-  Handle<Value> argv[1] = {
-    String::New (buf)
-  };
-  Handle<Value> parsedObj = JSON_parse->Call(JSON, 1, argv);
-  free (buf);
-
-  return parsedObj;
-}
-
-static JsonNode* toJsonNode(Handle<Value> object) {
-  std::vector<char> buf;
-  Handle<Context> context = Context::GetCurrent();
-  Handle<Object> global = context->Global();
-  Handle<Object> JSON = global->Get(String::New ("JSON"))->ToObject();
-  Handle<Function> JSON_stringify = Handle<Function>::Cast(JSON->Get(String::New("stringify")));
-  Handle<Value> argv[1] = {
-    object
-  };
-  Handle<String> ret = JSON_stringify->Call(JSON, 1, argv)->ToString();
-
-  buf.resize (ret->Utf8Length());
-  ret->WriteUtf8 (buf.data());
-  return json_decode (buf.data());
-}
-
-NodeSandbox::VFSFuture
-NodeSandbox::doVFS(const std::string& name, Handle<Value> argv[], int argc) {
+void
+NodeSandbox::doVFS(const std::string& name, Handle<Value> argv[], int argc, VFSCallback callback) {
   Handle<Value> new_argv[argc+2];
-  //FIXME: This needs deleted at some point in the future
-  VFSPromise* callbackPromise = new VFSPromise();
-  new_argv[0] = External::Wrap(callbackPromise);
+  new_argv[0] = Number::New (m_vfsCallbacks.acquire (callback));
   new_argv[1] = String::New (name.c_str());
   for(int i = 0; i < argc; i++)
     new_argv[i+2] = argv[i];
   node::MakeCallback (wrap->nodeThis, "onVFS", argc+2, new_argv);
-  return callbackPromise->get_future();
+}
+
+/**
+ * Fails @p request without involving JS, and frees it
+ */
+void
+NodeSandbox::replyError(codius_request_t* request, const char* message)
+{
+  codius_result_t* result = codius_result_new ();
+  result->success = 0;
+  result->data = json_mkstring (message);
+  queueReply (request, result);
+  codius_result_free (result);
+  codius_request_free (request);
 }
 
 void
 NodeSandbox::handleIPC(codius_request_t* request)
 {
-  Handle<Value> requestArgs = fromJsonNode (request->data);
+  Handle<Value> requestArgs = JsonV8::toValue (request->data);
+  if (requestArgs.IsEmpty()) {
+    replyError (request, "Request is nested too deeply");
+    return;
+  }
   Handle<Value> argv[4] = {
     String::New(request->api_name),
     String::New(request->method_name),
     requestArgs,
-    External::Wrap(request)
+    Number::New (m_ipcRequests.acquire (request))
   };
   node::MakeCallback (wrap->nodeThis, "onIPC", 4, argv)->ToObject();
 };
 
+/**
+ * Requests JS has yet to finish would be answered through a channel that is
+ * freed, so their cookies are invalidated
+ */
+void
+NodeSandbox::handleIPCClosed(SandboxIPC& ipc)
+{
+  auto owned = [&ipc] (const codius_request_t* request) {return ipc.owns (request);};
+  for (codius_request_t* request : m_ipcRequests.releaseIf (owned))
+    codius_request_free (request);
+}
+
 void
 NodeSandbox::handleExit(int status)
 {
@@ -232,38 +238,77 @@ Persistent<Function> NodeSandbox::s_constructor;
 Handle<Value>
 NodeSandbox::node_finish_vfs (const Arguments& args)
 {
-  Handle<Value> cookie = args[0];
-  VFSPromise* p = static_cast<VFSPromise* > (External::Unwrap (cookie));
-  p->set_value (Persistent<Value>::New(args[1]));
-  return Undefined();
+  HandleScope scope;
+  SandboxWrapper* wrap = node::ObjectWrap::Unwrap<SandboxWrapper>(args.This());
+  VFSCallback callback;
+  if (!wrap->sbox->m_vfsCallbacks.release (args[0]->IntegerValue(), callback)) {
+    ThrowException(Exception::TypeError(String::New("Unknown or stale VFS cookie")));
+    return scope.Close (Undefined());
+  }
+  callback (args[1]);
+  return scope.Close (Undefined());
 }
 
 Handle<Value>
 NodeSandbox::node_finish_ipc (const Arguments& args)
 {
-  Handle<Value> cookie = args[0];
+  SandboxWrapper* wrap = node::ObjectWrap::Unwrap<SandboxWrapper>(args.This());
+  codius_request_t* request;
+  if (!wrap->sbox->m_ipcRequests.release (args[0]->IntegerValue(), request)) {
+    ThrowException(Exception::TypeError(String::New("Unknown or stale IPC cookie")));
+    return Undefined();
+  }
   Handle<Object> callbackRet = args[1]->ToObject();
   codius_result_t* result = codius_result_new ();
-  codius_request_t* request = static_cast<codius_request_t*>(External::Unwrap(cookie));
   if (!callbackRet.IsEmpty()) {
     Handle<Boolean> callbackSuccess = callbackRet->Get(String::NewSymbol ("success"))->ToBoolean();
     Handle<Value> callbackResult = callbackRet->Get(String::NewSymbol ("result"));
-    JsonNode* ret = toJsonNode (callbackResult);
-    if (callbackSuccess->Value())
-      result->success = 1;
-    else
+    JsonNode* ret;
+    if (!JsonV8::fromValue (callbackResult, &ret)) {
+      // The sandbox still gets a reply, so it is not left waiting
       result->success = 0;
-    result->data = ret;
+      result->data = json_mkstring ("Result has no JSON representation");
+      ThrowException(Exception::TypeError(String::New("IPC result has no JSON representation")));
+    } else {
+      if (callbackSuccess->Value())
+        result->success = 1;
+      else
+        result->success = 0;
+      result->data = ret;
+    }
   } else {
     result->success = 0;
     ThrowException(Exception::TypeError(String::New("Expected an IPC call return type")));
   }
-  codius_send_reply (request, result);
+  wrap->sbox->queueReply (request, result);
   codius_result_free (result);
   codius_request_free (request);
   return Undefined();
 }
 
+#ifdef CODIUS_TEST_HOOKS
+/**
+ * Converts a value the way IPC replies and requests are, for the tests
+ */
+Handle<Value>
+NodeSandbox::node_json_round_trip(const Arguments& args)
+{
+  HandleScope scope;
+  JsonNode* node;
+  if (!JsonV8::fromValue (args[0], &node)) {
+    ThrowException(Exception::TypeError(String::New("Value has no JSON representation")));
+    return Undefined();
+  }
+  Handle<Value> value = JsonV8::toValue (node);
+  json_delete (node);
+  if (value.IsEmpty()) {
+    ThrowException(Exception::TypeError(String::New("Value is nested too deeply")));
+    return Undefined();
+  }
+  return scope.Close (value);
+}
+#endif
+
 Handle<Value>
 NodeSandbox::node_kill(const Arguments& args)
 {
@@ -339,6 +384,16 @@ NodeSandbox::node_spawn(const Arguments& args)
               goto err_env;
             }
           }
+          if (options->HasRealNamedProperty(String::NewSymbol("tmp"))) {
+            // Size of a private, in-memory /tmp for the sandbox
+            Local<Value> tmpOption = options->Get(String::NewSymbol("tmp"));
+            if (!tmpOption->IsNumber() || !(tmpOption->NumberValue() >= 1 && tmpOption->NumberValue() <= SIZE_MAX))
+              goto err_tmp;
+            size_t quota = static_cast<size_t>(tmpOption->NumberValue());
+            wrap->sbox->getVFS().mountFilesystem (std::string("/tmp/"), std::shared_ptr<Filesystem>(new TmpFilesystem (quota)));
+          }
+          if (options->Get(String::NewSymbol("shm"))->BooleanValue())
+            wrap->sbox->enableSharedMemoryIPC();
         } else {
           goto err_options;
         }
@@ -355,6 +410,10 @@ err_env:
   ThrowException(Exception::TypeError(String::New("'env' option must be a map of string:string")));
   goto out;
 
+err_tmp:
+  ThrowException(Exception::TypeError(String::New("'tmp' option must be a size in bytes")));
+  goto out;
+
 err_options:
   ThrowException(Exception::TypeError(String::New("Last argument must be an options structure.")));
   goto out;
@@ -423,6 +482,9 @@ NodeSandbox::Init(Handle<Object> exports)
   node::SetPrototypeMethod(tpl, "finishVFS", node_finish_vfs);
   s_constructor = Persistent<Function>::New(tpl->GetFunction());
   exports->Set(String::NewSymbol("Sandbox"), s_constructor);
+#ifdef CODIUS_TEST_HOOKS
+  exports->Set(String::NewSymbol("_jsonRoundTrip"), FunctionTemplate::New(node_json_round_trip)->GetFunction());
+#endif
 
   Local<FunctionTemplate> channelTpl = FunctionTemplate::New(node_new);
   channelTpl->SetClassName (String::NewSymbol ("Channel"));
@@ -434,4 +496,8 @@ init(Handle<Object> exports) {
   NodeSandbox::Init(exports);
 }
 
+#ifdef CODIUS_TEST_HOOKS
+NODE_MODULE (node_codius_sandbox_test, init);
+#else
 NODE_MODULE (node_codius_sandbox, init);
+#endif
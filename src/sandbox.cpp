@@ -12,6 +12,7 @@
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <seccomp.h>
 #include <sched.h>
@@ -47,7 +48,8 @@ class SandboxPrivate {
         pid(0),
         entered_main(false),
         scratchAddr(0),
-        vfs(new VFS(d)) {}
+        vfs(new VFS(d)),
+        shmIPC(false) {}
     Sandbox* d;
     std::vector<std::unique_ptr<SandboxIPC> > ipcSockets;
     pid_t pid;
@@ -55,10 +57,11 @@ class SandboxPrivate {
     bool entered_main;
     Sandbox::Address scratchAddr;
     Sandbox::Address nextScratchSegment;
-    void handleSeccompEvent(pid_t pid);
+    bool handleSeccompEvent(pid_t pid);
     void handleExecEvent(pid_t pid);
     std::vector<int> openFiles;
     std::unique_ptr<VFS> vfs;
+    bool shmIPC;
 };
 
 bool
@@ -111,6 +114,33 @@ Sandbox::addIPC(std::unique_ptr<SandboxIPC>&& ipc)
   m_p->ipcSockets.push_back (std::move(ipc));
 }
 
+int
+Sandbox::queueReply(codius_request_t* request, codius_result_t* result)
+{
+  for (auto i = m_p->ipcSockets.begin(); i != m_p->ipcSockets.end(); i++) {
+    SandboxIPC& ipc = **i;
+    if (!ipc.owns (request))
+      continue;
+
+    if (codius_queue_reply (request, result) < 0) {
+      error (0, errno, "Closing IPC channel #%d", ipc.dupAs);
+      ipc.disconnect();
+      return -1;
+    }
+    ipc.replyQueued();
+    return 0;
+  }
+
+  errno = EBADF;
+  return -1;
+}
+
+void
+Sandbox::enableSharedMemoryIPC()
+{
+  m_p->shmIPC = true;
+}
+
 Sandbox::Sandbox()
   : m_p(new SandboxPrivate(this))
 {
@@ -138,6 +168,15 @@ void Sandbox::spawn(char **argv, std::map<std::string, std::string>& envp)
   ipcSocket->setCallback (handle_ipc_read, wrap);
   addIPC (std::move (ipcSocket));
 
+  // Guests that attach to fds 4-6 get the faster shared memory channel
+  if (priv->shmIPC) {
+    ShmIPC::Ptr shmSocket (ShmIPC::create (4));
+    if (shmSocket) {
+      shmSocket->setCallback (handle_ipc_read, wrap);
+      addIPC (std::move (shmSocket));
+    }
+  }
+
   priv->pid = fork();
 
   if (priv->pid) {
@@ -159,7 +198,8 @@ Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
       error (EXIT_FAILURE, errno, "Could not bind IPC channel across #%d", (*i)->dupAs);
     }
 
-    permittedFDs.push_back ((*i)->dupAs);
+    std::vector<int> fds ((*i)->childFDs());
+    permittedFDs.insert (permittedFDs.end(), fds.begin(), fds.end());
   }
 
   DIR* dirp = opendir ("/proc/self/fd/");
@@ -222,6 +262,9 @@ Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
   seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (lstat), 0);
   seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (getcwd), 0);
   seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (readlink), 0);
+  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (unlink), 0);
+  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (mkdir), 0);
+  seccomp_rule_add (ctx, SCMP_ACT_TRACE (0), SCMP_SYS (rmdir), 0);
 
 #define VFS_FILTER(x) seccomp_rule_add (ctx, \
                                         SCMP_ACT_TRACE (0), \
@@ -345,9 +388,8 @@ Sandbox::execChild(char** argv, std::map<std::string, std::string>& envp)
 Sandbox::Word
 Sandbox::peekData(pid_t pid, Address addr)
 {
-  Word w = ptrace (PTRACE_PEEKDATA, pid, addr, NULL);
-  assert (errno == 0);
-  return w;
+  // Guest addresses are untrusted; callers check errno rather than abort.
+  return ptrace (PTRACE_PEEKDATA, pid, addr, NULL);
 }
 
 bool
@@ -393,20 +435,9 @@ Sandbox::copyString (pid_t pid, Address addr, size_t maxLength, char* buf)
   return true;
 }
 
-void
-SandboxPrivate::handleSeccompEvent(pid_t pid)
+static void
+loadCall(const struct user_regs_struct& regs, Sandbox::SyscallCall& call)
 {
-  struct user_regs_struct regs;
-  
-  if (!entered_main)
-    return;
-  memset (&regs, 0, sizeof (regs));
-  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0) {
-    error (EXIT_FAILURE, errno, "Failed to fetch registers");
-  }
-
-  Sandbox::SyscallCall call (pid);
-
 #ifdef __i386__
   call.id = regs.orig_eax;
   call.args[0] = regs.ebx;
@@ -424,11 +455,11 @@ SandboxPrivate::handleSeccompEvent(pid_t pid)
   call.args[4] = regs.r8;
   call.args[5] = regs.r9;
 #endif
+}
 
-  d->resetScratch();
-  call = Sandbox::SyscallCall (d->handleSyscall (call));
-  call = Sandbox::SyscallCall (vfs->handleSyscall (call));
-
+static void
+storeCall(struct user_regs_struct& regs, const Sandbox::SyscallCall& call)
+{
 #ifdef __i386__
   regs.orig_eax = call.id;
   regs.ebx = call.args[0];
@@ -448,10 +479,57 @@ SandboxPrivate::handleSeccompEvent(pid_t pid)
   regs.r9 = call.args[5];
   regs.rax = call.returnVal;
 #endif
+}
+
+/**
+ * Returns false if the call was deferred, in which case the thread must stay
+ * stopped until Sandbox::resumeSyscall() is called.
+ */
+bool
+SandboxPrivate::handleSeccompEvent(pid_t pid)
+{
+  struct user_regs_struct regs;
+  
+  if (!entered_main)
+    return true;
+  memset (&regs, 0, sizeof (regs));
+  if (ptrace (PTRACE_GETREGS, pid, 0, &regs) < 0) {
+    error (EXIT_FAILURE, errno, "Failed to fetch registers");
+  }
+
+  Sandbox::SyscallCall call (pid);
+  loadCall (regs, call);
+
+  d->resetScratch();
+  call = Sandbox::SyscallCall (d->handleSyscall (call));
+  call = Sandbox::SyscallCall (vfs->handleSyscall (call));
+
+  if (call.deferred)
+    return false;
+
+  storeCall (regs, call);
 
   if (ptrace (PTRACE_SETREGS, pid, 0, &regs) < 0) {
     error (EXIT_FAILURE, errno, "Failed to set registers");
   }
+  return true;
+}
+
+void
+Sandbox::resumeSyscall(const SyscallCall& call)
+{
+  struct user_regs_struct regs;
+
+  memset (&regs, 0, sizeof (regs));
+  // The thread may have been killed while it was parked
+  if (ptrace (PTRACE_GETREGS, call.pid, 0, &regs) < 0)
+    return;
+
+  storeCall (regs, call);
+
+  if (ptrace (PTRACE_SETREGS, call.pid, 0, &regs) < 0)
+    return;
+  ptrace (PTRACE_CONT, call.pid, 0, 0);
 }
 
 pid_t
@@ -464,8 +542,12 @@ void
 Sandbox::releaseChild(int signal)
 {
   SandboxPrivate *priv = m_p;
+  if (!priv->pid)
+    return;
   ptrace (PTRACE_SETOPTIONS, priv->pid, 0, 0);
   uv_signal_stop (&priv->signal);
+  for (auto i = priv->ipcSockets.begin(); i != priv->ipcSockets.end(); i++)
+    handleIPCClosed (**i);
   priv->ipcSockets.clear();
   ptrace (PTRACE_DETACH, m_p->pid, 0, signal);
 }
@@ -506,6 +588,16 @@ Sandbox::resetScratch()
 bool
 Sandbox::writeData (pid_t pid, Address addr, size_t length, const char* buf)
 {
+  struct iovec local = {const_cast<char*>(buf), length};
+  struct iovec remote = {reinterpret_cast<void*>(addr), length};
+
+  // Copy everything with a single syscall where possible. process_vm_writev()
+  // honours page protections, so fall back to poking words for anything it
+  // cannot reach.
+  if (process_vm_writev (pid, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(length))
+    return true;
+  errno = 0;
+
   size_t i;
   for (i = 0; length - i > sizeof (Word); i += sizeof (Word)) {
     Word d;
@@ -514,6 +606,8 @@ Sandbox::writeData (pid_t pid, Address addr, size_t length, const char* buf)
     }
     pokeData (pid, addr + i, d);
   }
+  if (errno)
+    return false;
   if (i != length) {
     Word d = peekData (pid, addr + i);
     for (size_t j = 0; j < sizeof (Word) && i + j < length; j++) {
@@ -544,8 +638,8 @@ handle_trap(uv_signal_t *handle, int signum)
       if (WSTOPSIG (status) == SIGTRAP) {
         int s = ((status >> 8) & ~SIGTRAP) >> 8;
         if (s == PTRACE_EVENT_SECCOMP) {
-          priv->handleSeccompEvent(pid);
-          ptrace (PTRACE_CONT, pid, 0, 0);
+          if (priv->handleSeccompEvent(pid))
+            ptrace (PTRACE_CONT, pid, 0, 0);
         } else if (s == PTRACE_EVENT_EXIT) {
           if (pid == priv->pid) {
             ptrace (PTRACE_GETEVENTMSG, pid, 0, &status);
@@ -599,11 +693,25 @@ handle_ipc_read (SandboxIPC& ipc, void* data)
   SandboxWrap* wrap = static_cast<SandboxWrap*>(data);
   SandboxPrivate* priv = wrap->priv;
 
-  request = codius_read_request (ipc.parent);
-  if (request == NULL)
-    error(EXIT_FAILURE, errno, "couldnt read IPC header");
+  // One read may have brought in several requests, and poll will not report
+  // the ones left in the buffer
+  do {
+    errno = 0;
+    request = ipc.readRequest();
+    if (request == NULL) {
+      // A doorbell may ring with nothing to read, e.g. when ring space frees
+      // up, and a socket may hold only part of a request so far
+      if (errno == EAGAIN)
+        break;
+
+      // The guest sent something unreadable; only its channel pays for that
+      error (0, errno ? errno : EPROTO, "Closing IPC channel #%d", ipc.dupAs);
+      ipc.disconnect();
+      break;
+    }
 
-  priv->d->handleIPC(request);
+    priv->d->handleIPC(request);
+  } while (ipc.hasBufferedRequest());
 }
 
 void
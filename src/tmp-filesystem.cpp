@@ -0,0 +1,603 @@
+#include "tmp-filesystem.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <memory.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * Entry names are allocated in a few size classes, so freed ones can be reused
+ */
+static const size_t nameClasses[] = {16, 32, 64, NAME_MAX + 1};
+static const size_t nameClassCount = sizeof (nameClasses) / sizeof (nameClasses[0]);
+
+/**
+ * Backs reads of holes in readInPlace()
+ */
+static const char zeroChunk[TmpFilesystem::chunkSize] = {0};
+
+TmpFilesystem::TmpFilesystem(size_t quota)
+  : Filesystem(),
+    m_arena (std::min (static_cast<size_t>(65536), quota), quota),
+    m_root (nullptr),
+    m_freeInodes (nullptr),
+    m_freeEntries (nameClassCount),
+    m_freeChunks (nullptr),
+    m_nextIno (1)
+{
+  m_root = allocInode (S_IFDIR | 0777);
+  // The root can never be removed
+  m_root->links = 1;
+}
+
+TmpFilesystem::OpenFile*
+TmpFilesystem::getOpenFile(int fd)
+{
+  if (fd < 0 || static_cast<size_t>(fd) >= m_openFiles.size() || !m_openFiles[fd].used)
+    return nullptr;
+  return &m_openFiles[fd];
+}
+
+TmpFilesystem::Inode*
+TmpFilesystem::allocInode(uint32_t mode)
+{
+  Inode* node = m_freeInodes;
+  if (node)
+    m_freeInodes = node->nextFree;
+  else if (!(node = m_arena.create<Inode>()))
+    return nullptr;
+
+  // Recycled inodes keep their (emptied) chunk table
+  char** chunks = node->chunks;
+  size_t chunkCapacity = node->chunkCapacity;
+  memset (node, 0, sizeof (*node));
+  node->chunks = chunks;
+  node->chunkCapacity = chunkCapacity;
+  node->ino = m_nextIno++;
+  node->mode = mode;
+  node->mtime = time (NULL);
+  return node;
+}
+
+void
+TmpFilesystem::releaseInode(Inode* node)
+{
+  truncate (node, 0);
+  node->nextFree = m_freeInodes;
+  m_freeInodes = node;
+}
+
+TmpFilesystem::Entry*
+TmpFilesystem::allocEntry(const std::string& name)
+{
+  size_t cls = 0;
+  while (nameClasses[cls] <= name.size())
+    cls++;
+
+  Entry* entry = m_freeEntries[cls];
+  if (entry) {
+    m_freeEntries[cls] = entry->next;
+  } else {
+    char* nameBuf = static_cast<char*>(m_arena.allocate (nameClasses[cls], 1));
+    if (!nameBuf || !(entry = m_arena.create<Entry>()))
+      return nullptr;
+    entry->name = nameBuf;
+    entry->nameCapacity = nameClasses[cls];
+  }
+
+  memcpy (entry->name, name.c_str(), name.size() + 1);
+  entry->nameLength = name.size();
+  entry->next = nullptr;
+  entry->inode = nullptr;
+  return entry;
+}
+
+void
+TmpFilesystem::releaseEntry(Entry* entry)
+{
+  size_t cls = 0;
+  while (nameClasses[cls] < entry->nameCapacity)
+    cls++;
+  entry->next = m_freeEntries[cls];
+  m_freeEntries[cls] = entry;
+}
+
+char*
+TmpFilesystem::allocChunk()
+{
+  char* chunk = m_freeChunks;
+  if (chunk)
+    m_freeChunks = *reinterpret_cast<char**>(chunk);
+  else if (!(chunk = static_cast<char*>(m_arena.allocate (chunkSize))))
+    return nullptr;
+  memset (chunk, 0, chunkSize);
+  return chunk;
+}
+
+/**
+ * Frees the chunks past @p size and clears the tail of the last one, so that
+ * growing the file again reads back zeroes
+ */
+void
+TmpFilesystem::truncate(Inode* node, uint64_t size)
+{
+  size_t keep = (size + chunkSize - 1) / chunkSize;
+  for (size_t i = keep; i < node->chunkCapacity; i++) {
+    if (node->chunks[i]) {
+      *reinterpret_cast<char**>(node->chunks[i]) = m_freeChunks;
+      m_freeChunks = node->chunks[i];
+      node->chunks[i] = nullptr;
+    }
+  }
+  if (size % chunkSize && keep <= node->chunkCapacity && node->chunks[keep - 1])
+    memset (node->chunks[keep - 1] + size % chunkSize, 0, chunkSize - size % chunkSize);
+  node->size = size;
+}
+
+TmpFilesystem::Entry*
+TmpFilesystem::findEntry(Inode* dir, const std::string& name, Entry*** link)
+{
+  Entry** prev = &dir->entries;
+  for (Entry* entry = dir->entries; entry; entry = entry->next) {
+    if (entry->nameLength == name.size() && memcmp (entry->name, name.c_str(), name.size()) == 0) {
+      if (link)
+        *link = prev;
+      return entry;
+    }
+    prev = &entry->next;
+  }
+  return nullptr;
+}
+
+/**
+ * Walks @p path down from the root
+ *
+ * @param parent Set to the directory holding the last component, or null for
+ * the root itself
+ * @param node Set to the inode of the last component, or null if it does not
+ * exist
+ * @param name Set to the last component
+ * @return 0 on success, or a negative error number if a parent is missing
+ */
+int
+TmpFilesystem::resolve(const char* path, Inode** parent, Inode** node, std::string* name)
+{
+  std::string normalized (normalizePath (path));
+  Inode* dir = m_root;
+  size_t start = 1;
+
+  *parent = nullptr;
+  *node = m_root;
+  name->clear();
+
+  while (start < normalized.size()) {
+    size_t end = normalized.find ('/', start);
+    if (end == std::string::npos)
+      end = normalized.size();
+    if (!S_ISDIR ((*node)->mode))
+      return -ENOTDIR;
+
+    dir = *node;
+    name->assign (normalized, start, end - start);
+    if (name->size() > NAME_MAX)
+      return -ENAMETOOLONG;
+    Entry* entry = findEntry (dir, *name, nullptr);
+    *parent = dir;
+    *node = entry ? entry->inode : nullptr;
+    if (!entry && end < normalized.size())
+      return -ENOENT;
+    start = end + 1;
+  }
+  return 0;
+}
+
+/**
+ * Creates a new inode named @p name in @p dir
+ */
+int
+TmpFilesystem::link(Inode* dir, const std::string& name, uint32_t mode, Inode** node)
+{
+  Entry* entry = allocEntry (name);
+  if (!entry)
+    return -ENOSPC;
+  *node = allocInode (mode);
+  if (!*node) {
+    releaseEntry (entry);
+    return -ENOSPC;
+  }
+
+  (*node)->links = 1;
+  (*node)->parent = dir;
+  entry->inode = *node;
+
+  // Append, so that listings come out in creation order
+  Entry** tail = &dir->entries;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = entry;
+  dir->mtime = time (NULL);
+  return 0;
+}
+
+void
+TmpFilesystem::fillStat(const Inode* node, struct stat* buf) const
+{
+  size_t chunks = 0;
+  for (size_t i = 0; i < node->chunkCapacity; i++) {
+    if (node->chunks[i])
+      chunks++;
+  }
+
+  memset (buf, 0, sizeof (*buf));
+  buf->st_ino = node->ino;
+  buf->st_mode = node->mode;
+  buf->st_nlink = S_ISDIR (node->mode) ? 2 : node->links;
+  buf->st_size = S_ISDIR (node->mode) ? chunkSize : node->size;
+  buf->st_blksize = chunkSize;
+  buf->st_blocks = chunks * (chunkSize / 512);
+  buf->st_atime = node->mtime;
+  buf->st_mtime = node->mtime;
+  buf->st_ctime = node->mtime;
+}
+
+int
+TmpFilesystem::open(const char* name, int flags, int mode)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  bool writing = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC);
+  int ret = resolve (name, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+
+  if (!node) {
+    if (!(flags & O_CREAT))
+      return -ENOENT;
+    if ((ret = link (parent, leaf, S_IFREG | (mode & 07777), &node)) < 0)
+      return ret;
+  } else {
+    if ((flags & O_CREAT) && (flags & O_EXCL))
+      return -EEXIST;
+    if (S_ISDIR (node->mode) && writing)
+      return -EISDIR;
+    if ((flags & O_DIRECTORY) && !S_ISDIR (node->mode))
+      return -ENOTDIR;
+    if ((flags & O_TRUNC) && writing) {
+      truncate (node, 0);
+      node->mtime = time (NULL);
+    }
+  }
+
+  int fd;
+  if (!m_freeFDs.empty()) {
+    fd = m_freeFDs.back();
+    m_freeFDs.pop_back();
+  } else {
+    fd = m_openFiles.size();
+    m_openFiles.push_back (OpenFile());
+  }
+
+  OpenFile& file = m_openFiles[fd];
+  file.inode = node;
+  file.offset = 0;
+  file.flags = flags;
+  file.cursor = DirentCursor();
+  file.used = true;
+  node->openCount++;
+  return fd;
+}
+
+int
+TmpFilesystem::close(int fd)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  Inode* node = file->inode;
+  if (--node->openCount == 0 && node->links == 0)
+    releaseInode (node);
+  file->used = false;
+  file->cursor = DirentCursor();
+  m_freeFDs.push_back (fd);
+  return 0;
+}
+
+ssize_t
+TmpFilesystem::readInPlace(int fd, size_t count, const void** data)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file || (file->flags & O_ACCMODE) == O_WRONLY)
+    return -EBADF;
+
+  Inode* node = file->inode;
+  if (S_ISDIR (node->mode))
+    return -EISDIR;
+  if (static_cast<uint64_t>(file->offset) >= node->size)
+    return 0;
+
+  // Only the rest of the current chunk is contiguous
+  size_t idx = file->offset / chunkSize;
+  size_t offset = file->offset % chunkSize;
+  size_t len = std::min (static_cast<uint64_t>(std::min (count, chunkSize - offset)), node->size - file->offset);
+  const char* chunk = idx < node->chunkCapacity && node->chunks[idx] ? node->chunks[idx] : zeroChunk;
+  *data = chunk + offset;
+  file->offset += len;
+  return len;
+}
+
+ssize_t
+TmpFilesystem::read(int fd, void* buf, size_t count)
+{
+  char* out = static_cast<char*>(buf);
+  size_t total = 0;
+
+  while (total < count) {
+    const void* data;
+    ssize_t len = readInPlace (fd, count - total, &data);
+    if (len < 0)
+      return total > 0 ? static_cast<ssize_t>(total) : len;
+    if (len == 0)
+      break;
+    memcpy (out + total, data, len);
+    total += len;
+  }
+  return total;
+}
+
+ssize_t
+TmpFilesystem::write(int fd, void* buf, size_t count)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file || (file->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+
+  Inode* node = file->inode;
+  if (count == 0)
+    return 0;
+  if (file->flags & O_APPEND)
+    file->offset = node->size;
+  if (file->offset >= maxFileSize)
+    return -EFBIG;
+  count = std::min (count, static_cast<size_t>(maxFileSize - file->offset));
+
+  size_t lastChunk = (file->offset + count + chunkSize - 1) / chunkSize;
+  if (lastChunk > node->chunkCapacity) {
+    // Grow the chunk table geometrically; the old one stays in the arena
+    size_t capacity = std::max (lastChunk, node->chunkCapacity * 2);
+    char** chunks = static_cast<char**>(m_arena.allocate (capacity * sizeof (char*), alignof (char*)));
+    if (!chunks)
+      return -ENOSPC;
+    memset (chunks, 0, capacity * sizeof (char*));
+    if (node->chunkCapacity)
+      memcpy (chunks, node->chunks, node->chunkCapacity * sizeof (char*));
+    node->chunks = chunks;
+    node->chunkCapacity = capacity;
+  }
+
+  const char* in = static_cast<const char*>(buf);
+  size_t total = 0;
+  while (total < count) {
+    size_t idx = file->offset / chunkSize;
+    size_t offset = file->offset % chunkSize;
+    size_t len = std::min (count - total, chunkSize - offset);
+    if (!node->chunks[idx] && !(node->chunks[idx] = allocChunk()))
+      break;
+    memcpy (node->chunks[idx] + offset, in + total, len);
+    total += len;
+    file->offset += len;
+  }
+
+  if (total == 0 && count > 0)
+    return -ENOSPC;
+  node->size = std::max (node->size, static_cast<uint64_t>(file->offset));
+  node->mtime = time (NULL);
+  return total;
+}
+
+int
+TmpFilesystem::fstat(int fd, struct stat* buf)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  fillStat (file->inode, buf);
+  return 0;
+}
+
+int
+TmpFilesystem::readDirectory(int fd, void* dirs, unsigned int count, DirentBuilder::Format format)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+  if (!S_ISDIR (file->inode->mode))
+    return -ENOTDIR;
+
+  if (!file->cursor.loaded()) {
+    std::vector<DirentCursor::Entry> entries;
+    for (Entry* entry = file->inode->entries; entry; entry = entry->next) {
+      DirentCursor::Entry ent = {
+        std::string (entry->name, entry->nameLength),
+        entry->inode->ino,
+        static_cast<DirentBuilder::DirentType>(IFTODT (entry->inode->mode))
+      };
+      entries.push_back (ent);
+    }
+    file->cursor.load (entries);
+  }
+  return file->cursor.read (dirs, count, format);
+}
+
+int
+TmpFilesystem::getdents(int fd, struct linux_dirent* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent);
+}
+
+int
+TmpFilesystem::getdents64(int fd, struct linux_dirent64* dirs, unsigned int count)
+{
+  return readDirectory (fd, dirs, count, DirentBuilder::Dirent64);
+}
+
+off_t
+TmpFilesystem::lseek(int fd, off_t offset, int whence)
+{
+  OpenFile* file = getOpenFile (fd);
+  if (!file)
+    return -EBADF;
+
+  if (S_ISDIR (file->inode->mode)) {
+    if (whence != SEEK_SET || offset < 0)
+      return -EINVAL;
+    return file->cursor.seek (offset);
+  }
+
+  off_t newOffset;
+  switch (whence) {
+    case SEEK_SET:
+      newOffset = seekOffset (0, offset);
+      break;
+    case SEEK_CUR:
+      newOffset = seekOffset (file->offset, offset);
+      break;
+    case SEEK_END:
+      newOffset = seekOffset (file->inode->size, offset);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if (newOffset < 0)
+    return newOffset;
+  if (newOffset > maxFileSize)
+    return -EINVAL;
+  file->offset = newOffset;
+  return newOffset;
+}
+
+int
+TmpFilesystem::access(const char* name, int mode)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  int ret = resolve (name, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+  if (!node)
+    return -ENOENT;
+  if ((mode & X_OK) && !(node->mode & 0111))
+    return -EACCES;
+  return 0;
+}
+
+int
+TmpFilesystem::stat(const char* path, struct stat* buf)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  int ret = resolve (path, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+  if (!node)
+    return -ENOENT;
+  fillStat (node, buf);
+  return 0;
+}
+
+int
+TmpFilesystem::lstat(const char* path, struct stat* buf)
+{
+  // There are no symlinks
+  return stat (path, buf);
+}
+
+ssize_t
+TmpFilesystem::readlink(const char* path, char* buf, size_t bufsize)
+{
+  struct stat sbuf;
+  int ret = stat (path, &sbuf);
+  return ret < 0 ? ret : -EINVAL;
+}
+
+int
+TmpFilesystem::unlink(const char* path)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  int ret = resolve (path, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+  if (!node)
+    return -ENOENT;
+  if (S_ISDIR (node->mode))
+    return -EISDIR;
+
+  Entry** link;
+  Entry* entry = findEntry (parent, leaf, &link);
+  *link = entry->next;
+  releaseEntry (entry);
+  parent->mtime = time (NULL);
+
+  // Open descriptors keep the data around until they are closed
+  if (--node->links == 0 && node->openCount == 0)
+    releaseInode (node);
+  return 0;
+}
+
+int
+TmpFilesystem::mkdir(const char* path, int mode)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  int ret = resolve (path, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+  if (node)
+    return -EEXIST;
+  return link (parent, leaf, S_IFDIR | (mode & 07777), &node);
+}
+
+int
+TmpFilesystem::rmdir(const char* path)
+{
+  Inode* parent;
+  Inode* node;
+  std::string leaf;
+  int ret = resolve (path, &parent, &node, &leaf);
+  if (ret < 0)
+    return ret;
+  if (!node)
+    return -ENOENT;
+  if (!S_ISDIR (node->mode))
+    return -ENOTDIR;
+  if (!parent)
+    return -EBUSY;
+  if (node->entries)
+    return -ENOTEMPTY;
+
+  Entry** link;
+  Entry* entry = findEntry (parent, leaf, &link);
+  *link = entry->next;
+  releaseEntry (entry);
+  parent->mtime = time (NULL);
+
+  if (--node->links == 0 && node->openCount == 0)
+    releaseInode (node);
+  return 0;
+}
+
+size_t
+TmpFilesystem::used() const
+{
+  return m_arena.reserved();
+}
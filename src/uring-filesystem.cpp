@@ -0,0 +1,458 @@
+#include "uring-filesystem.h"
+#include "open-how.h"
+
+#include <algorithm>
+#include <memory>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#endif
+
+/**
+ * Arguments of an open or stat that must stay valid until the kernel has
+ * picked them up
+ */
+struct PathRequest {
+  std::string path;
+  OpenHow how;
+  struct statx stx;
+  /** Keeps a cached directory descriptor open until the call completes */
+  DirectoryFD::Ptr dir;
+};
+
+static void
+statFromStatx(const struct statx& stx, struct stat* buf)
+{
+  memset (buf, 0, sizeof (*buf));
+  buf->st_dev = makedev (stx.stx_dev_major, stx.stx_dev_minor);
+  buf->st_ino = stx.stx_ino;
+  buf->st_mode = stx.stx_mode;
+  buf->st_nlink = stx.stx_nlink;
+  buf->st_uid = stx.stx_uid;
+  buf->st_gid = stx.stx_gid;
+  buf->st_rdev = makedev (stx.stx_rdev_major, stx.stx_rdev_minor);
+  buf->st_size = stx.stx_size;
+  buf->st_blksize = stx.stx_blksize;
+  buf->st_blocks = stx.stx_blocks;
+  buf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+  buf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+  buf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  buf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  buf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  buf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+
+UringFilesystem::UringFilesystem(const std::string& root, unsigned int entries)
+  : NativeFilesystem (root),
+    m_ringFD (-1),
+    m_entries (0),
+    m_sqRing (MAP_FAILED),
+    m_sqRingSize (0),
+    m_cqRing (MAP_FAILED),
+    m_cqRingSize (0),
+    m_sqes (nullptr),
+    m_sqesSize (0),
+    m_poll (nullptr)
+{
+  struct io_uring_params params;
+  memset (&params, 0, sizeof (params));
+
+  int fd = syscall (SYS_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return;
+
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+  m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    m_sqRingSize = m_cqRingSize = std::max (m_sqRingSize, m_cqRingSize);
+  m_sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  m_sqRing = mmap (NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    m_cqRing = m_sqRing;
+  else
+    m_cqRing = mmap (NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap (NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  // These opcodes all arrived together in 5.6; older rings are of no use
+  if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || sqes == MAP_FAILED ||
+      !(params.features & IORING_FEAT_RW_CUR_POS)) {
+    if (sqes != MAP_FAILED)
+      munmap (sqes, m_sqesSize);
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+      munmap (m_cqRing, m_cqRingSize);
+    if (m_sqRing != MAP_FAILED)
+      munmap (m_sqRing, m_sqRingSize);
+    m_sqRing = m_cqRing = MAP_FAILED;
+    ::close (fd);
+    return;
+  }
+
+  char* sq = static_cast<char*>(m_sqRing);
+  char* cq = static_cast<char*>(m_cqRing);
+  m_sqHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+  m_sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+  m_sqMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+  m_sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+  m_cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+  m_cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+  m_cqMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+  m_entries = params.sq_entries;
+  m_ringFD = fd;
+}
+
+UringFilesystem::~UringFilesystem()
+{
+  stopPoll();
+  if (m_ringFD < 0)
+    return;
+
+  // Completions still in flight reference memory owned by their callers,
+  // so wait for them before tearing the ring down
+  while (m_pending.size() > 0) {
+    syscall (SYS_io_uring_enter, m_ringFD, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    reap();
+  }
+
+  munmap (m_sqes, m_sqesSize);
+  if (m_cqRing != m_sqRing)
+    munmap (m_cqRing, m_cqRingSize);
+  munmap (m_sqRing, m_sqRingSize);
+  ::close (m_ringFD);
+}
+
+bool
+UringFilesystem::isAsync() const
+{
+  return m_ringFD >= 0;
+}
+
+int
+UringFilesystem::ringFD() const
+{
+  return m_ringFD;
+}
+
+size_t
+UringFilesystem::pending() const
+{
+  return m_pending.size();
+}
+
+void
+UringFilesystem::cb_poll(uv_poll_t* req, int status, int events)
+{
+  UringFilesystem* self = static_cast<UringFilesystem*>(req->data);
+  self->reap();
+}
+
+void
+UringFilesystem::cb_close(uv_handle_t* handle)
+{
+  delete reinterpret_cast<uv_poll_t*>(handle);
+}
+
+bool
+UringFilesystem::startPoll(uv_loop_t* loop)
+{
+  if (m_ringFD < 0)
+    return false;
+  if (m_poll)
+    return true;
+
+  // The handle outlives us until the loop has closed it
+  m_poll = new uv_poll_t;
+  if (uv_poll_init (loop, m_poll, m_ringFD) < 0) {
+    delete m_poll;
+    m_poll = nullptr;
+    return false;
+  }
+  m_poll->data = this;
+  if (uv_poll_start (m_poll, UV_READABLE, UringFilesystem::cb_poll) < 0) {
+    stopPoll();
+    return false;
+  }
+  updateRef();
+  return true;
+}
+
+bool
+UringFilesystem::stopPoll()
+{
+  if (!m_poll)
+    return true;
+  int ret = uv_poll_stop (m_poll);
+  uv_close (reinterpret_cast<uv_handle_t*>(m_poll), UringFilesystem::cb_close);
+  m_poll = nullptr;
+  return ret >= 0;
+}
+
+/**
+ * Holds a reference on the loop only while calls are in flight, so an idle
+ * filesystem does not keep the process running
+ */
+void
+UringFilesystem::updateRef()
+{
+  if (!m_poll)
+    return;
+  if (m_pending.size() > 0)
+    uv_ref (reinterpret_cast<uv_handle_t*>(m_poll));
+  else
+    uv_unref (reinterpret_cast<uv_handle_t*>(m_poll));
+}
+
+struct io_uring_sqe*
+UringFilesystem::getSqe()
+{
+  unsigned int tail = *m_sqTail;
+  if (tail - __atomic_load_n (m_sqHead, __ATOMIC_ACQUIRE) >= m_entries)
+    return nullptr;
+
+  unsigned int idx = tail & *m_sqMask;
+  struct io_uring_sqe* sqe = &m_sqes[idx];
+  memset (sqe, 0, sizeof (*sqe));
+  m_sqArray[idx] = idx;
+  return sqe;
+}
+
+/**
+ * Queues @p sqe, which must have come from getSqe(), and hands it to the
+ * kernel
+ */
+void
+UringFilesystem::submit(struct io_uring_sqe* sqe, Completion done)
+{
+  if (!m_poll)
+    startPoll (uv_default_loop());
+
+  sqe->user_data = m_pending.acquire (done);
+  __atomic_store_n (m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+
+  int ret = syscall (SYS_io_uring_enter, m_ringFD, 1, 0, 0, NULL, 0);
+  if (ret < 0) {
+    // The kernel never saw it; take it back and fail the call
+    int err = errno;
+    __atomic_store_n (m_sqTail, *m_sqTail - 1, __ATOMIC_RELEASE);
+    Completion failed;
+    m_pending.release (sqe->user_data, failed);
+    updateRef();
+    failed (-err);
+    return;
+  }
+  updateRef();
+}
+
+size_t
+UringFilesystem::reap()
+{
+  size_t count = 0;
+  if (m_ringFD < 0)
+    return count;
+
+  unsigned int head = *m_cqHead;
+  while (head != __atomic_load_n (m_cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &m_cqes[head & *m_cqMask];
+    uint64_t token = cqe->user_data;
+    int32_t res = cqe->res;
+    __atomic_store_n (m_cqHead, ++head, __ATOMIC_RELEASE);
+
+    // Completions may submit follow-up calls, so the slot is freed first
+    Completion done;
+    if (m_pending.release (token, done)) {
+      done (res);
+      count++;
+    }
+    head = *m_cqHead;
+  }
+  updateRef();
+  return count;
+}
+
+void
+UringFilesystem::openAsync(const char* name, int flags, int mode, Completion done)
+{
+  std::string leaf;
+  DirectoryFD::Ptr dir;
+  int dirFD;
+  if (m_ringFD < 0 || (dirFD = lookupParent (name, leaf, &dir)) < 0) {
+    NativeFilesystem::openAsync (name, flags, mode, done);
+    return;
+  }
+
+  std::string path (normalizePath (name));
+  openBeneathAsync (dir, dirFD, leaf, flags, mode, [this, path, dirFD, flags, mode, done] (ssize_t ret) {
+    // As in NativeFilesystem::openPath, retry links that leave the parent
+    if (ret == -EXDEV && dirFD != m_rootFD)
+      openBeneathAsync (nullptr, m_rootFD, path == "/" ? "." : path.substr (1), flags, mode, done);
+    else
+      done (ret);
+  });
+}
+
+/**
+ * Submits an openat2() of @p path beneath @p dirFD. @p dir, if set, holds
+ * @p dirFD open until the kernel is done with it.
+ */
+void
+UringFilesystem::openBeneathAsync(DirectoryFD::Ptr dir, int dirFD, const std::string& path, int flags, int mode, Completion done)
+{
+  struct io_uring_sqe* sqe = getSqe();
+  if (!sqe) {
+    // The queue is full, so block rather than fail
+    done (openBeneath (dirFD, path, flags, mode));
+    return;
+  }
+
+  std::shared_ptr<PathRequest> req (new PathRequest);
+  req->path = path;
+  req->how.flags = flags | O_CLOEXEC;
+  req->how.mode = (flags & O_CREAT) ? (mode & 07777) : 0;
+  req->how.resolve = resolveBeneath | resolveNoMagicLinks;
+  req->dir = dir;
+
+  sqe->opcode = IORING_OP_OPENAT2;
+  sqe->fd = dirFD;
+  sqe->addr = reinterpret_cast<uint64_t>(req->path.c_str());
+  sqe->len = sizeof (req->how);
+  sqe->off = reinterpret_cast<uint64_t>(&req->how);
+  submit (sqe, [req, done] (ssize_t ret) {
+    done (ret);
+  });
+}
+
+void
+UringFilesystem::readAsync(int fd, void* buf, size_t count, Completion done)
+{
+  struct io_uring_sqe* sqe = m_ringFD >= 0 ? getSqe() : nullptr;
+  if (!sqe) {
+    NativeFilesystem::readAsync (fd, buf, count, done);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = count;
+  // Read from, and advance, the file position
+  sqe->off = static_cast<uint64_t>(-1);
+  submit (sqe, done);
+}
+
+void
+UringFilesystem::writeAsync(int fd, void* buf, size_t count, Completion done)
+{
+  struct io_uring_sqe* sqe = m_ringFD >= 0 ? getSqe() : nullptr;
+  if (!sqe) {
+    NativeFilesystem::writeAsync (fd, buf, count, done);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = count;
+  sqe->off = static_cast<uint64_t>(-1);
+  submit (sqe, done);
+}
+
+void
+UringFilesystem::closeAsync(int fd, Completion done)
+{
+  struct io_uring_sqe* sqe = m_ringFD >= 0 ? getSqe() : nullptr;
+  if (!sqe) {
+    NativeFilesystem::closeAsync (fd, done);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  submit (sqe, done);
+}
+
+void
+UringFilesystem::statxAsync(DirectoryFD::Ptr dir, int dirFD, const std::string& path, int flags, struct stat* buf, Completion done)
+{
+  struct io_uring_sqe* sqe = getSqe();
+  if (!sqe) {
+    // The queue is full, so block rather than fail
+    done (::fstatat (dirFD, path.c_str(), buf, flags) < 0 ? -errno : 0);
+    return;
+  }
+
+  std::shared_ptr<PathRequest> req (new PathRequest);
+  req->path = path;
+  req->dir = dir;
+
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirFD;
+  sqe->addr = reinterpret_cast<uint64_t>(req->path.c_str());
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = reinterpret_cast<uint64_t>(&req->stx);
+  sqe->statx_flags = flags;
+  submit (sqe, [req, buf, done] (ssize_t ret) {
+    if (ret == 0)
+      statFromStatx (req->stx, buf);
+    done (ret);
+  });
+}
+
+void
+UringFilesystem::fstatAsync(int fd, struct stat* buf, Completion done)
+{
+  if (m_ringFD < 0) {
+    NativeFilesystem::fstatAsync (fd, buf, done);
+    return;
+  }
+  statxAsync (nullptr, fd, std::string(), AT_EMPTY_PATH, buf, done);
+}
+
+/**
+ * Opens an O_PATH descriptor beneath the root, then stats it, so that
+ * symlinks are resolved with the same confinement as open()
+ */
+void
+UringFilesystem::statAsync(const char* path, struct stat* buf, Completion done)
+{
+  if (m_ringFD < 0) {
+    NativeFilesystem::statAsync (path, buf, done);
+    return;
+  }
+
+  openAsync (path, O_PATH, 0, [this, buf, done] (ssize_t fd) {
+    if (fd < 0) {
+      done (fd);
+      return;
+    }
+    int pathFD = fd;
+    statxAsync (nullptr, pathFD, std::string(), AT_EMPTY_PATH, buf, [pathFD, done] (ssize_t ret) {
+      ::close (pathFD);
+      done (ret);
+    });
+  });
+}
+
+void
+UringFilesystem::lstatAsync(const char* path, struct stat* buf, Completion done)
+{
+  std::string leaf;
+  DirectoryFD::Ptr dir;
+  int dirFD;
+  if (m_ringFD < 0 || (dirFD = lookupParent (path, leaf, &dir)) < 0) {
+    NativeFilesystem::lstatAsync (path, buf, done);
+    return;
+  }
+  statxAsync (dir, dirFD, leaf, AT_SYMLINK_NOFOLLOW, buf, done);
+}
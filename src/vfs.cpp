@@ -16,7 +16,8 @@
 #include "dirent-builder.h"
 
 VFS::VFS(Sandbox* sandbox)
-  : m_sbox (sandbox)
+  : m_sbox (sandbox),
+    m_pending (new TokenPool<Filesystem::Completion>)
 {
   m_whitelist.push_back ("/lib64/tls/x86_64/libc.so.6");
   m_whitelist.push_back ("/lib64/tls/x86_64/libdl.so.2");
@@ -47,6 +48,25 @@ VFS::VFS(Sandbox* sandbox)
   m_whitelist.push_back ("/proc/self/exe");
 }
 
+VFS::~VFS()
+{
+  m_pending->clear();
+}
+
+Filesystem::Completion
+VFS::guard(Filesystem::Completion done)
+{
+  std::weak_ptr<TokenPool<Filesystem::Completion>> pending (m_pending);
+  TokenPool<Filesystem::Completion>::Token token = m_pending->acquire (done);
+
+  return [pending, token] (ssize_t ret) {
+    std::shared_ptr<TokenPool<Filesystem::Completion>> pool = pending.lock();
+    Filesystem::Completion done;
+    if (pool && pool->release (token, done))
+      done (ret);
+  };
+}
+
 void
 VFS::mountFilesystem(const std::string& path, std::shared_ptr<Filesystem> fs)
 {
@@ -68,36 +88,46 @@ VFS::getFile(int fd) const
   return m_openFiles.at(fd);
 }
 
-int
-File::close()
+void
+File::close(Filesystem::Completion done)
 {
-  if (m_localFD > 0) {
-    int ret = m_fs->close(m_localFD);
+  if (m_localFD >= 0) {
+    int fd = m_localFD;
     m_localFD = -1;
-    return ret;
+    m_fs->closeAsync (fd, done);
+  } else {
+    done (-EBADF);
   }
-  return -EBADF;
 }
 
 std::pair<std::string, std::shared_ptr<Filesystem> >
 VFS::getFilesystem(const std::string& path) const
 {
   std::string searchPath (path);
-  std::string longest_mount;
-  if (path[0] == '.')
+  if (path[0] == '.' && m_cwd)
     searchPath = m_cwd->path() + path;
+  auto mount = m_mountpoints.cend();
   for(auto i = m_mountpoints.cbegin(); i != m_mountpoints.cend(); i++) {
-    if (searchPath.compare(0, i->first.size(), i->first) == 0) {
-      std::string newPath (searchPath.substr (i->first.size()-1));
-      return std::make_pair (newPath, i->second);
+    // A mount at "/tmp/" also covers "/tmp" itself
+    bool matches = searchPath.compare(0, i->first.size(), i->first) == 0 ||
+                   searchPath.compare(0, std::string::npos, i->first, 0, i->first.size()-1) == 0;
+    if (matches) {
+      if (mount == m_mountpoints.cend() || i->first.size() > mount->first.size())
+        mount = i;
     }
   }
+  if (mount != m_mountpoints.cend()) {
+    if (searchPath.size() < mount->first.size())
+      return std::make_pair (std::string("/"), mount->second);
+    std::string newPath (searchPath.substr (mount->first.size()-1));
+    return std::make_pair (newPath, mount->second);
+  }
   return std::make_pair (std::string(), nullptr);
 }
 
 int File::s_nextFD = VFS::firstVirtualFD;
 
-File::File(int localFD, const std::string& path, std::shared_ptr<Filesystem>& fs)
+File::File(int localFD, const std::string& path, const std::shared_ptr<Filesystem>& fs)
   : m_localFD (localFD),
     m_path (path),
     m_fs (fs)
@@ -121,9 +151,13 @@ VFS::do_readlink (Sandbox::SyscallCall& call)
     call.id = -1;
     std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
     if (fs.second) {
-      std::vector<char> buf (call.args[2]);
-      call.returnVal = fs.second->readlink (fs.first.c_str(), buf.data(), buf.size());
-      m_sbox->writeData (call.pid, call.args[1], std::min(buf.size(), call.returnVal), buf.data());
+      std::shared_ptr<std::vector<char> > buf (new std::vector<char> (call.args[2]));
+      dispatch (call, [fs, buf] (Filesystem::Completion done) {
+        fs.second->readlinkAsync (fs.first.c_str(), buf->data(), buf->size(), holding (buf, done));
+      }, [this, buf] (Sandbox::SyscallCall& call, ssize_t len) {
+        if (len > 0)
+          m_sbox->writeData (call.pid, call.args[1], std::min (buf->size(), static_cast<size_t>(len)), buf->data());
+      });
     } else {
       call.returnVal = -ENOENT;
     }
@@ -138,6 +172,11 @@ VFS::do_openat (Sandbox::SyscallCall& call)
   if (fname[0] != '/') {
     std::string fdPath;
     if (call.args[0] == static_cast<unsigned long>(AT_FDCWD)) {
+      if (!m_cwd) {
+        call.id = -1;
+        call.returnVal = -ENOENT;
+        return;
+      }
       fdPath = m_cwd->path();
     } else if (isVirtualFD (call.args[0])) {
       File::Ptr file = getFile (call.args[0]);
@@ -152,11 +191,11 @@ VFS::do_openat (Sandbox::SyscallCall& call)
 
 File::~File ()
 {
-  close();
+  close ([] (ssize_t) {});
 }
 
 File::Ptr
-VFS::makeFile (int fd, const std::string& path, std::shared_ptr<Filesystem>& fs)
+VFS::makeFile (int fd, const std::string& path, const std::shared_ptr<Filesystem>& fs)
 {
   File::Ptr f(new File (fd, path, fs));
   m_openFiles.insert (std::make_pair (f->virtualFD(), f));
@@ -171,7 +210,10 @@ VFS::do_access (Sandbox::SyscallCall& call)
     call.id = -1;
     std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
     if (fs.second) {
-      call.returnVal = fs.second->access (fs.first.c_str(), call.args[1]);
+      int mode = call.args[1];
+      dispatch (call, [fs, mode] (Filesystem::Completion done) {
+        fs.second->accessAsync (fs.first.c_str(), mode, done);
+      }, Continuation());
     } else {
       call.returnVal = -ENOENT;
     }
@@ -185,13 +227,12 @@ VFS::openFile(Sandbox::SyscallCall& call, const std::string& fname, int flags, m
     call.id = -1;
     std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
     if (fs.second) {
-      int fd = fs.second->open (fs.first.c_str(), flags, mode);
-      if (fd) {
-        File::Ptr file (makeFile (fd, fname, fs.second));
-        call.returnVal = file->virtualFD();
-      } else {
-        call.returnVal = -errno;
-      }
+      dispatch (call, [fs, flags, mode] (Filesystem::Completion done) {
+        fs.second->openAsync (fs.first.c_str(), flags, mode, done);
+      }, [this, fname, fs] (Sandbox::SyscallCall& call, ssize_t fd) {
+        if (fd >= 0)
+          call.returnVal = makeFile (fd, fname, fs.second)->virtualFD();
+      });
     } else {
       call.returnVal = -ENOENT;
     }
@@ -230,18 +271,36 @@ VFS::do_close (Sandbox::SyscallCall& call)
     call.id = -1;
     File::Ptr fh = getFile (call.args[0]);
     if (fh) {
-      call.returnVal = fh->close ();
       m_openFiles.erase (fh->virtualFD());
+      dispatch (call, [fh] (Filesystem::Completion done) {
+        fh->close (done);
+      }, Continuation());
     } else {
       call.returnVal = -EBADF;
     }
   }
 }
 
+void
+File::read(void* buf, size_t count, Filesystem::Completion done)
+{
+  m_fs->readAsync (m_localFD, buf, count, done);
+}
+
 ssize_t
-File::read(void* buf, size_t count)
+File::readInPlace(size_t count, const void** data)
+{
+  return m_fs->readInPlace (m_localFD, count, data);
+}
+
+/**
+ * Moves a file back by @p count bytes after data it returned could not be
+ * copied into the sandbox, so the failed read() leaves the offset alone
+ */
+void
+VFS::unread(const File::Ptr& file, ssize_t count)
 {
-  return m_fs->read (m_localFD, buf, count);
+  file->lseek (-count, SEEK_CUR, [] (ssize_t) {});
 }
 
 void
@@ -250,25 +309,34 @@ VFS::do_read (Sandbox::SyscallCall& call)
   if (isVirtualFD (call.args[0])) {
     call.id = -1;
     File::Ptr file = getFile (call.args[0]);
-    std::vector<char> buf (call.args[2]);
-    if (file) {
-      ssize_t readCount = file->read (buf.data(), buf.size());
-      if (readCount >= 0) {
-        m_sbox->writeData (call.pid, call.args[1], readCount, buf.data());
-        call.returnVal = readCount;
-      } else {
-        call.returnVal = -errno;
+    const void* data;
+    ssize_t readCount;
+    if (file && (readCount = file->readInPlace (call.args[2], &data)) != -ENOSYS) {
+      if (readCount > 0 && !m_sbox->writeData (call.pid, call.args[1], readCount, static_cast<const char*>(data))) {
+        unread (file, readCount);
+        readCount = -EFAULT;
       }
+      call.returnVal = readCount;
+    } else if (file) {
+      std::shared_ptr<std::vector<char> > buf (new std::vector<char> (call.args[2]));
+      dispatch (call, [file, buf] (Filesystem::Completion done) {
+        file->read (buf->data(), buf->size(), holding (buf, done));
+      }, [this, file, buf] (Sandbox::SyscallCall& call, ssize_t readCount) {
+        if (readCount > 0 && !m_sbox->writeData (call.pid, call.args[1], readCount, buf->data())) {
+          unread (file, readCount);
+          call.returnVal = -EFAULT;
+        }
+      });
     } else {
       call.returnVal = -EBADF;
     }
   }
 }
 
-int
-File::fstat (struct stat* buf)
+void
+File::fstat (struct stat* buf, Filesystem::Completion done)
 {
-  return m_fs->fstat (m_localFD, buf);
+  m_fs->fstatAsync (m_localFD, buf, done);
 }
 
 void
@@ -278,20 +346,29 @@ VFS::do_fstat (Sandbox::SyscallCall& call)
     File::Ptr file = getFile (call.args[0]);
     call.id = -1;
     if (file) {
-      struct stat sbuf;
-      call.returnVal = file->fstat (&sbuf);
-      if (call.returnVal == 0)
-        m_sbox->writeData(call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
+      std::shared_ptr<struct stat> sbuf (new struct stat);
+      dispatch (call, [file, sbuf] (Filesystem::Completion done) {
+        file->fstat (sbuf.get(), holding (sbuf, done));
+      }, [this, sbuf] (Sandbox::SyscallCall& call, ssize_t ret) {
+        if (ret == 0)
+          m_sbox->writeData (call.pid, call.args[1], sizeof (*sbuf), (char*)sbuf.get());
+      });
     } else {
       call.returnVal = -EBADF;
     }
   }
 }
 
-int
-File::getdents(struct linux_dirent* dirs, unsigned int count)
+void
+File::getdents(struct linux_dirent* dirs, unsigned int count, Filesystem::Completion done)
+{
+  m_fs->getdentsAsync (m_localFD, dirs, count, done);
+}
+
+void
+File::getdents64(struct linux_dirent64* dirs, unsigned int count, Filesystem::Completion done)
 {
-  return m_fs->getdents (m_localFD, dirs, count);
+  m_fs->getdents64Async (m_localFD, dirs, count, done);
 }
 
 void
@@ -301,9 +378,13 @@ VFS::do_write (Sandbox::SyscallCall& call)
     File::Ptr file = getFile (call.args[0]);
     call.id = -1;
     if (file) {
-      std::vector<char> buf (call.args[2]);
-      m_sbox->copyData (call.pid, call.args[1], buf.size(), buf.data());
-      call.returnVal = file->write (buf.data(), buf.size());
+      std::shared_ptr<std::vector<char> > buf (new std::vector<char> (call.args[2]));
+      m_sbox->copyData (call.pid, call.args[1], buf->size(), buf->data());
+      dispatch (call, [file, buf] (Filesystem::Completion done) {
+        file->write (buf->data(), buf->size(), holding (buf, done));
+      }, Continuation());
+    } else {
+      call.returnVal = -EBADF;
     }
   }
 }
@@ -315,11 +396,35 @@ VFS::do_getdents (Sandbox::SyscallCall& call)
     File::Ptr file = getFile (call.args[0]);
     call.id = -1;
     if (file) {
-      std::vector<char> buf (call.args[2]);
-      struct linux_dirent* dirents = (struct linux_dirent*)buf.data();
-      call.returnVal = file->getdents (dirents, buf.size());
-      if ((int)call.returnVal > 0)
-        m_sbox->writeData(call.pid, call.args[1], call.returnVal, buf.data());
+      std::shared_ptr<std::vector<char> > buf (new std::vector<char> (call.args[2]));
+      dispatch (call, [file, buf] (Filesystem::Completion done) {
+        struct linux_dirent* dirents = (struct linux_dirent*)buf->data();
+        file->getdents (dirents, buf->size(), holding (buf, done));
+      }, [this, buf] (Sandbox::SyscallCall& call, ssize_t len) {
+        if (len > 0)
+          m_sbox->writeData (call.pid, call.args[1], len, buf->data());
+      });
+    } else {
+      call.returnVal = -EBADF;
+    }
+  }
+}
+
+void
+VFS::do_getdents64 (Sandbox::SyscallCall& call)
+{
+  if (isVirtualFD (call.args[0])) {
+    File::Ptr file = getFile (call.args[0]);
+    call.id = -1;
+    if (file) {
+      std::shared_ptr<std::vector<char> > buf (new std::vector<char> (call.args[2]));
+      dispatch (call, [file, buf] (Filesystem::Completion done) {
+        struct linux_dirent64* dirents = (struct linux_dirent64*)buf->data();
+        file->getdents64 (dirents, buf->size(), holding (buf, done));
+      }, [this, buf] (Sandbox::SyscallCall& call, ssize_t len) {
+        if (len > 0)
+          m_sbox->writeData (call.pid, call.args[1], len, buf->data());
+      });
     } else {
       call.returnVal = -EBADF;
     }
@@ -342,32 +447,67 @@ void
 VFS::do_chdir(Sandbox::SyscallCall& call)
 {
   std::string fname = getFilename (call.pid, call.args[0]);
-  call.returnVal = setCWD (fname);
+  dispatch (call, [this, fname] (Filesystem::Completion done) {
+    setCWD (fname, done);
+  }, Continuation());
 }
 
 std::string
 VFS::getCWD() const
 {
-  assert (m_cwd);
-  return m_cwd->path();
+  return m_cwd ? m_cwd->path() : std::string();
 }
 
-int
-VFS::setCWD(const std::string& fname)
+void
+VFS::setCWD(const std::string& fname, Filesystem::Completion done)
 {
   std::string trimmedFname (fname);
   if (trimmedFname[fname.length()-1] == '/')
     trimmedFname = std::string(fname.cbegin(), fname.cend()-1);
   std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (trimmedFname);
   if (fs.second) {
-    int fd = fs.second->open (fs.first.c_str(), O_DIRECTORY, 0);
-    m_cwd = File::Ptr (new File (fd, trimmedFname, fs.second));
-    return 0;
-  } else {
-    return -ENOENT;
+    fs.second->openAsync (fs.first.c_str(), O_DIRECTORY, 0, guard ([this, trimmedFname, fs, done] (ssize_t fd) {
+      if (fd >= 0)
+        m_cwd = File::Ptr (new File (fd, trimmedFname, fs.second));
+      if (done)
+        done (fd < 0 ? fd : 0);
+    }));
+  } else if (done) {
+    done (-ENOENT);
   }
 }
 
+void
+VFS::dispatch(Sandbox::SyscallCall& call, std::function<void(Filesystem::Completion)> op, Continuation finish)
+{
+  struct Pending {
+    Sandbox::SyscallCall call;
+    bool issuing;
+    bool finished;
+  };
+  std::shared_ptr<Pending> pending (new Pending);
+  pending->call = call;
+  pending->issuing = true;
+  pending->finished = false;
+
+  Sandbox* sbox = m_sbox;
+  op (guard ([pending, sbox, finish] (ssize_t ret) {
+    pending->call.returnVal = ret;
+    if (finish)
+      finish (pending->call, ret);
+    if (pending->issuing)
+      pending->finished = true;
+    else
+      sbox->resumeSyscall (pending->call);
+  }));
+  pending->issuing = false;
+
+  if (pending->finished)
+    call = pending->call;
+  else
+    call.deferred = true;
+}
+
 #define HANDLE_CALL(x) case SYS_##x: do_##x(ret);break;
 
 Sandbox::SyscallCall
@@ -380,6 +520,7 @@ VFS::handleSyscall(const Sandbox::SyscallCall& call)
     HANDLE_CALL (read);
     HANDLE_CALL (fstat);
     HANDLE_CALL (getdents);
+    HANDLE_CALL (getdents64);
     HANDLE_CALL (openat);
     HANDLE_CALL (lseek);
     HANDLE_CALL (write);
@@ -389,27 +530,39 @@ VFS::handleSyscall(const Sandbox::SyscallCall& call)
     HANDLE_CALL (lstat);
     HANDLE_CALL (getcwd);
     HANDLE_CALL (readlink);
+    HANDLE_CALL (unlink);
+    HANDLE_CALL (mkdir);
+    HANDLE_CALL (rmdir);
   }
   return ret;
 }
 
 #undef HANDLE_CALL
 
-off_t
-File::lseek(off_t offset, int whence)
+void
+File::lseek(off_t offset, int whence, Filesystem::Completion done)
 {
-  return m_fs->lseek(m_localFD, offset, whence);
+  m_fs->lseekAsync (m_localFD, offset, whence, done);
 }
 
-ssize_t
-File::write(void* buf, size_t count)
+void
+File::write(void* buf, size_t count, Filesystem::Completion done)
 {
-  return m_fs->write (m_localFD, buf, count);
+  m_fs->writeAsync (m_localFD, buf, count, done);
 }
 
+/**
+ * The cwd is only set once setCWD() has opened it, so a getcwd() that races
+ * with the first one fails instead of returning an empty path.
+ */
 void
 VFS::do_getcwd(Sandbox::SyscallCall& call)
 {
+  if (!m_cwd) {
+    call.returnVal = -ENOENT;
+    return;
+  }
+
   std::string cwd = getCWD();
   m_sbox->writeData (call.pid, call.args[0], std::min (call.args[1], cwd.length()), cwd.c_str());
   call.returnVal = cwd.length();
@@ -423,10 +576,13 @@ VFS::do_lstat(Sandbox::SyscallCall& call)
     call.id = -1;
     std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
     if (fs.second) {
-      struct stat sbuf;
-      call.returnVal = fs.second->lstat (fname.c_str(), &sbuf);
-      if (call.returnVal == 0)
-        m_sbox->writeData (call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
+      std::shared_ptr<struct stat> sbuf (new struct stat);
+      dispatch (call, [fs, sbuf] (Filesystem::Completion done) {
+        fs.second->lstatAsync (fs.first.c_str(), sbuf.get(), holding (sbuf, done));
+      }, [this, sbuf] (Sandbox::SyscallCall& call, ssize_t ret) {
+        if (ret == 0)
+          m_sbox->writeData (call.pid, call.args[1], sizeof (*sbuf), (char*)sbuf.get());
+      });
     } else {
       call.returnVal = -ENOENT;
     }
@@ -441,10 +597,13 @@ VFS::do_stat(Sandbox::SyscallCall& call)
     call.id = -1;
     std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
     if (fs.second) {
-      struct stat sbuf;
-      call.returnVal = fs.second->stat (fname.c_str(), &sbuf);
-      if (call.returnVal == 0)
-        m_sbox->writeData (call.pid, call.args[1], sizeof (sbuf), (char*)&sbuf);
+      std::shared_ptr<struct stat> sbuf (new struct stat);
+      dispatch (call, [fs, sbuf] (Filesystem::Completion done) {
+        fs.second->statAsync (fs.first.c_str(), sbuf.get(), holding (sbuf, done));
+      }, [this, sbuf] (Sandbox::SyscallCall& call, ssize_t ret) {
+        if (ret == 0)
+          m_sbox->writeData (call.pid, call.args[1], sizeof (*sbuf), (char*)sbuf.get());
+      });
     } else {
       call.returnVal = -ENOENT;
     }
@@ -458,7 +617,11 @@ VFS::do_lseek(Sandbox::SyscallCall& call)
     call.id = -1;
     File::Ptr file = getFile (call.args[0]);
     if (file) {
-      call.returnVal = file->lseek (call.args[1], call.args[2]);
+      off_t offset = call.args[1];
+      int whence = call.args[2];
+      dispatch (call, [file, offset, whence] (Filesystem::Completion done) {
+        file->lseek (offset, whence, done);
+      }, Continuation());
     } else {
       call.returnVal = -EBADF;
     }
@@ -475,3 +638,53 @@ VFS::isWhitelisted(const std::string& str)
   return false;
 }
 
+
+/**
+ * Calls that modify the tree are always emulated, even for whitelisted paths,
+ * so they never reach the host.
+ */
+void
+VFS::do_unlink(Sandbox::SyscallCall& call)
+{
+  std::string fname = getFilename (call.pid, call.args[0]);
+  call.id = -1;
+  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+  if (fs.second) {
+    dispatch (call, [fs] (Filesystem::Completion done) {
+      fs.second->unlinkAsync (fs.first.c_str(), done);
+    }, Continuation());
+  } else {
+    call.returnVal = -EROFS;
+  }
+}
+
+void
+VFS::do_mkdir(Sandbox::SyscallCall& call)
+{
+  std::string fname = getFilename (call.pid, call.args[0]);
+  call.id = -1;
+  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+  if (fs.second) {
+    int mode = call.args[1];
+    dispatch (call, [fs, mode] (Filesystem::Completion done) {
+      fs.second->mkdirAsync (fs.first.c_str(), mode, done);
+    }, Continuation());
+  } else {
+    call.returnVal = -EROFS;
+  }
+}
+
+void
+VFS::do_rmdir(Sandbox::SyscallCall& call)
+{
+  std::string fname = getFilename (call.pid, call.args[0]);
+  call.id = -1;
+  std::pair<std::string, std::shared_ptr<Filesystem> > fs = getFilesystem (fname);
+  if (fs.second) {
+    dispatch (call, [fs] (Filesystem::Completion done) {
+      fs.second->rmdirAsync (fs.first.c_str(), done);
+    }, Continuation());
+  } else {
+    call.returnVal = -EROFS;
+  }
+}
@@ -0,0 +1,189 @@
+#include "blob-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+class BlobFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (BlobFilesystemTest);
+  CPPUNIT_TEST (testRead);
+  CPPUNIT_TEST (testStat);
+  CPPUNIT_TEST (testGetdents);
+  CPPUNIT_TEST (testSharedBlobs);
+  CPPUNIT_TEST (testMissingBlob);
+  CPPUNIT_TEST (testInvalidHash);
+  CPPUNIT_TEST (testConcurrentPut);
+  CPPUNIT_TEST (testSeekOverflow);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::string root;
+  BlobStore::Ptr store;
+  BlobFilesystem::Manifest manifest;
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-blobs-XXXXXX";
+    root = mkdtemp (tmpl);
+    store = BlobStore::Ptr (new BlobStore (root));
+    CPPUNIT_ASSERT (store->put ("aa01", "module.exports = 1;\n", 20));
+    CPPUNIT_ASSERT (store->put ("bb02", "", 0));
+
+    manifest.clear();
+    manifest["/index.js"] = "aa01";
+    manifest["/node_modules/a/index.js"] = "aa01";
+    manifest["/node_modules/b/empty.js"] = "bb02";
+  }
+
+  void tearDown() {
+    store.reset();
+    std::string cmd = "rm -rf " + root;
+    CPPUNIT_ASSERT_EQUAL (0, system (cmd.c_str()));
+  }
+
+  void testRead() {
+    BlobFilesystem fs (store, manifest);
+    char buf[64];
+    int fd = fs.open ("/node_modules/a/index.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)20, fs.read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "module.exports = 1;\n", 20));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, fs.read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL ((off_t)7, fs.lseek (fd, 7, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)7, fs.read (fd, buf, 7));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "exports", 7));
+    CPPUNIT_ASSERT_EQUAL (0, fs.close (fd));
+
+    fd = fs.open ("/node_modules/b/empty.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, fs.read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (-EROFS, fs.open ("/index.js", O_WRONLY, 0));
+  }
+
+  void testStat() {
+    BlobFilesystem fs (store, manifest);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/index.js", &sbuf));
+    CPPUNIT_ASSERT (S_ISREG (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL ((off_t)20, sbuf.st_size);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, store->mapped());
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/node_modules/", &sbuf));
+    CPPUNIT_ASSERT (S_ISDIR (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.stat ("/node_modules/c", &sbuf));
+  }
+
+  void testGetdents() {
+    BlobFilesystem fs (store, manifest);
+    char buf[4096];
+    std::vector<std::string> names;
+    int fd = fs.open ("/node_modules", O_RDONLY | O_DIRECTORY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    int len = fs.getdents64 (fd, (struct linux_dirent64*)buf, sizeof (buf));
+    for (int pos = 0; pos < len;) {
+      linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf + pos);
+      struct stat sbuf;
+      names.push_back (ent->d_name);
+      CPPUNIT_ASSERT_EQUAL (0, fs.stat (("/node_modules/" + names.back()).c_str(), &sbuf));
+      CPPUNIT_ASSERT_EQUAL ((uint64_t)sbuf.st_ino, ent->d_ino);
+      CPPUNIT_ASSERT_EQUAL ((unsigned char)DT_DIR, ent->d_type);
+      pos += ent->d_reclen;
+    }
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, names.size());
+    CPPUNIT_ASSERT_EQUAL (std::string ("a"), names[0]);
+    CPPUNIT_ASSERT_EQUAL (std::string ("b"), names[1]);
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, fs.open ("/index.js", O_RDONLY | O_DIRECTORY, 0));
+  }
+
+  void testSharedBlobs() {
+    BlobFilesystem first (store, manifest);
+    BlobFilesystem second (store, manifest);
+    int fd1 = first.open ("/index.js", O_RDONLY, 0);
+    int fd2 = second.open ("/node_modules/a/index.js", O_RDONLY, 0);
+    const void* data1;
+    const void* data2;
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)20, first.readInPlace (fd1, 64, &data1));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)20, second.readInPlace (fd2, 64, &data2));
+    CPPUNIT_ASSERT (data1 == data2);
+    CPPUNIT_ASSERT_EQUAL ((size_t)1, store->mapped());
+
+    first.close (fd1);
+    second.close (fd2);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, store->mapped());
+  }
+
+  void testMissingBlob() {
+    manifest["/missing.js"] = "cc03";
+    BlobFilesystem fs (store, manifest);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (-EIO, fs.open ("/missing.js", O_RDONLY, 0));
+    CPPUNIT_ASSERT_EQUAL (-EIO, fs.stat ("/missing.js", &sbuf));
+  }
+
+  void testInvalidHash() {
+    CPPUNIT_ASSERT (!BlobStore::isValidHash ("../etc/passwd"));
+    CPPUNIT_ASSERT (!BlobStore::isValidHash (""));
+    CPPUNIT_ASSERT (!store->put ("AA01", "x", 1));
+    CPPUNIT_ASSERT (!store->get ("../aa01"));
+  }
+
+  void testSeekOverflow() {
+    BlobFilesystem fs (store, manifest);
+    const off_t max = std::numeric_limits<off_t>::max();
+    int fd = fs.open ("/index.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT_EQUAL (max, fs.lseek (fd, max, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs.lseek (fd, 1, SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs.lseek (fd, max, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, std::numeric_limits<off_t>::min(), SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, -21, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)0, fs.lseek (fd, -20, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL (0, fs.close (fd));
+  }
+
+  void testConcurrentPut() {
+    std::string data (1 << 20, 'x');
+    for (size_t i = 0; i < data.size(); i += 4096)
+      data[i] = 'a' + (i / 4096) % 26;
+
+    // Writers of the same hash must not truncate each other's output
+    pid_t children[4];
+    for (int i = 0; i < 4; i++) {
+      children[i] = fork();
+      CPPUNIT_ASSERT (children[i] >= 0);
+      if (children[i] == 0) {
+        BlobStore child (root);
+        _exit (child.put ("dd04", data.data(), data.size()) ? 0 : 1);
+      }
+    }
+    for (int i = 0; i < 4; i++) {
+      int status;
+      CPPUNIT_ASSERT_EQUAL (children[i], waitpid (children[i], &status, 0));
+      CPPUNIT_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+    }
+
+    Blob::Ptr blob = store->get ("dd04");
+    CPPUNIT_ASSERT (blob);
+    CPPUNIT_ASSERT_EQUAL (data.size(), blob->size());
+    CPPUNIT_ASSERT (memcmp (blob->data(), data.data(), data.size()) == 0);
+
+    // No temporary files are left behind
+    DIR* dir = opendir (root.c_str());
+    CPPUNIT_ASSERT (dir);
+    int entries = 0;
+    while (struct dirent* ent = readdir (dir)) {
+      if (ent->d_name[0] != '.') {
+        CPPUNIT_ASSERT (BlobStore::isValidHash (ent->d_name));
+        entries++;
+      }
+    }
+    closedir (dir);
+    CPPUNIT_ASSERT_EQUAL (3, entries);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (BlobFilesystemTest);
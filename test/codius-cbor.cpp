@@ -0,0 +1,124 @@
+#include "codius-cbor.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class CborTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (CborTest);
+  CPPUNIT_TEST (testRoundTrip);
+  CPPUNIT_TEST (testIntegers);
+  CPPUNIT_TEST (testFloats);
+  CPPUNIT_TEST (testMalformed);
+  CPPUNIT_TEST (testDepthLimit);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::string encode(const JsonNode* node) {
+    codius_cbor_buf_t buf = {NULL, 0, 0};
+    CPPUNIT_ASSERT_EQUAL (0, codius_cbor_encode (&buf, node));
+    std::string ret (buf.data, buf.len);
+    free (buf.data);
+    return ret;
+  }
+
+  JsonNode* decode(const std::string& data) {
+    size_t consumed = 0;
+    JsonNode* node = codius_cbor_decode (data.data(), data.size(), &consumed);
+    if (node)
+      CPPUNIT_ASSERT_EQUAL (data.size(), consumed);
+    return node;
+  }
+
+  std::string canonical(const std::string& json) {
+    JsonNode* node = json_decode (json.c_str());
+    char* text = json_encode (node);
+    std::string ret (text);
+    free (text);
+    json_delete (node);
+    return ret;
+  }
+
+public:
+  void testRoundTrip() {
+    const char* docs[] = {
+      "null",
+      "[true,false,null]",
+      "{\"a\":1,\"b\":[\"x\",{\"c\":-2.5}],\"\\u00e9\\u4e2d\":\"\\ud83d\\ude00\"}",
+      "[[],{},\"\"]"
+    };
+
+    for (const char* doc : docs) {
+      JsonNode* node = json_decode (doc);
+      JsonNode* decoded = decode (encode (node));
+      CPPUNIT_ASSERT (decoded);
+      char* text = json_encode (decoded);
+      CPPUNIT_ASSERT_EQUAL (canonical (doc), std::string (text));
+      free (text);
+      json_delete (decoded);
+      json_delete (node);
+    }
+  }
+
+  void testIntegers() {
+    JsonNode* node = json_mknumber (10);
+    CPPUNIT_ASSERT_EQUAL (std::string ("\x0a"), encode (node));
+    json_delete (node);
+
+    node = json_mknumber (-500);
+    CPPUNIT_ASSERT_EQUAL (std::string ("\x39\x01\xf3", 3), encode (node));
+    json_delete (node);
+
+    node = json_mknumber (4294967296.0);
+    CPPUNIT_ASSERT_EQUAL (std::string ("\x1b\x00\x00\x00\x01\x00\x00\x00\x00", 9), encode (node));
+    json_delete (node);
+  }
+
+  void testFloats() {
+    JsonNode* node = json_mknumber (1.5);
+    CPPUNIT_ASSERT_EQUAL (std::string ("\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00", 9), encode (node));
+    json_delete (node);
+
+    // Half and single precision are accepted on input
+    node = decode (std::string ("\xf9\x3e\x00", 3));
+    CPPUNIT_ASSERT_EQUAL (1.5, node->number_);
+    json_delete (node);
+    node = decode (std::string ("\xfa\x47\xc3\x50\x00", 5));
+    CPPUNIT_ASSERT_EQUAL (100000.0, node->number_);
+    json_delete (node);
+
+    // Infinity has no JSON form
+    node = decode (std::string ("\xf9\x7c\x00", 3));
+    CPPUNIT_ASSERT_EQUAL (JSON_NULL, node->tag);
+    json_delete (node);
+  }
+
+  void testMalformed() {
+    const std::string bad[] = {
+      std::string ("\x62\x61", 2),          // truncated text
+      std::string ("\x61\xff", 2),          // invalid UTF-8
+      std::string ("\x61\x00", 2),          // embedded NUL
+      std::string ("\x42\x61\x62", 3),      // byte string
+      std::string ("\xa1\x01\x02", 3),      // non-string key
+      std::string ("\x9f\x01\xff", 3),      // indefinite length
+      std::string ("\x9b\xff\xff\xff\xff\xff\xff\xff\xff", 9),
+      std::string ("\xc1\x00", 2)           // tag
+    };
+
+    for (const std::string& data : bad)
+      CPPUNIT_ASSERT (!codius_cbor_decode (data.data(), data.size(), NULL));
+  }
+
+  void testDepthLimit() {
+    std::string nested (CODIUS_CBOR_MAX_DEPTH, '\x81');
+    nested += '\xf6';
+    JsonNode* node = decode (nested);
+    CPPUNIT_ASSERT (node);
+    json_delete (node);
+
+    CPPUNIT_ASSERT (!decode ("\x81" + nested));
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (CborTest);
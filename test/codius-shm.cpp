@@ -0,0 +1,361 @@
+#include "codius-shm.h"
+#include "codius-util.h"
+#include "sandbox-ipc.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static codius_shm_t*
+attach_guest (codius_shm_t* host)
+{
+  return codius_shm_attach (CODIUS_SHM_GUEST,
+                            dup (codius_shm_memfd (host)),
+                            dup (codius_shm_host_doorbell (host)),
+                            dup (codius_shm_guest_doorbell (host)));
+}
+
+static void
+wait_doorbell (codius_shm_t* shm)
+{
+  struct pollfd pfd;
+  pfd.fd = codius_shm_doorbell (shm);
+  pfd.events = POLLIN;
+  poll (&pfd, 1, -1);
+  codius_shm_clear_doorbell (shm);
+}
+
+class ShmRingTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (ShmRingTest);
+  CPPUNIT_TEST (testSendRecv);
+  CPPUNIT_TEST (testWraparound);
+  CPPUNIT_TEST (testFullRing);
+  CPPUNIT_TEST (testOversized);
+  CPPUNIT_TEST (testDoorbell);
+  CPPUNIT_TEST (testQueuedSend);
+  CPPUNIT_TEST (testInvalidMemory);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void setUp() {
+    host = codius_shm_create (4096);
+    CPPUNIT_ASSERT (host);
+    guest = attach_guest (host);
+    CPPUNIT_ASSERT (guest);
+  }
+
+  void tearDown() {
+    codius_shm_free (guest);
+    codius_shm_free (host);
+  }
+
+  void testSendRecv() {
+    size_t len = 0;
+
+    CPPUNIT_ASSERT (!codius_shm_recv (host, &len, 0));
+    CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_send (guest, "hello", 5, 0));
+    CPPUNIT_ASSERT (codius_shm_readable (host));
+    char* msg = codius_shm_recv (host, &len, 0);
+    CPPUNIT_ASSERT (msg);
+    CPPUNIT_ASSERT_EQUAL ((size_t)5, len);
+    CPPUNIT_ASSERT_EQUAL (std::string ("hello"), std::string (msg));
+    CPPUNIT_ASSERT (!codius_shm_readable (host));
+  }
+
+  void testWraparound() {
+    // Odd sizes move the records across the end of the ring at every offset
+    for (int i = 0; i < 1000; i++) {
+      std::string data (1 + (i * 37) % 1000, 'a' + i % 26);
+      size_t len = 0;
+
+      CPPUNIT_ASSERT_EQUAL (0, codius_shm_send (guest, data.data(), data.size(), 0));
+      char* msg = codius_shm_recv (host, &len, 0);
+      CPPUNIT_ASSERT (msg);
+      CPPUNIT_ASSERT_EQUAL (data, std::string (msg, len));
+    }
+  }
+
+  void testFullRing() {
+    std::string data (1000, 'x');
+    int sent = 0;
+    size_t len;
+
+    while (codius_shm_send (guest, data.data(), data.size(), 0) == 0)
+      sent++;
+    CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+    CPPUNIT_ASSERT_EQUAL (4, sent);
+
+    for (int i = 0; i < sent; i++)
+      CPPUNIT_ASSERT (codius_shm_recv (host, &len, 0));
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_send (guest, data.data(), data.size(), 0));
+  }
+
+  void testOversized() {
+    std::string data (1025, 'x');
+    CPPUNIT_ASSERT_EQUAL (-1, codius_shm_send (guest, data.data(), data.size(), 1));
+    CPPUNIT_ASSERT_EQUAL (EMSGSIZE, errno);
+  }
+
+  void testDoorbell() {
+    struct pollfd pfd;
+    size_t len;
+
+    pfd.fd = codius_shm_doorbell (guest);
+    pfd.events = POLLIN;
+
+    // Nobody is waiting, so nothing is rung
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_send (host, "a", 1, 0));
+    CPPUNIT_ASSERT_EQUAL (0, poll (&pfd, 1, 0));
+    CPPUNIT_ASSERT (codius_shm_recv (guest, &len, 0));
+
+    // An empty receive arms the doorbell for the next message
+    CPPUNIT_ASSERT (!codius_shm_recv (guest, &len, 0));
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_send (host, "b", 1, 0));
+    CPPUNIT_ASSERT_EQUAL (1, poll (&pfd, 1, 0));
+    codius_shm_clear_doorbell (guest);
+    CPPUNIT_ASSERT (codius_shm_recv (guest, &len, 0));
+  }
+
+  // Queues past a full ring, but only up to the ring size
+  void testQueuedSend() {
+    std::string data (1000, 'q');
+    size_t len;
+    int sent = 0;
+
+    while (codius_shm_send_queued (host, data.data(), data.size()) == 0)
+      sent++;
+    CPPUNIT_ASSERT_EQUAL (ENOBUFS, errno);
+    CPPUNIT_ASSERT (sent > 4 && sent < 10);
+
+    int received = 0;
+    while (received < sent) {
+      if (!codius_shm_recv (guest, &len, 0)) {
+        wait_doorbell (host);
+        codius_shm_flush (host);
+        continue;
+      }
+      CPPUNIT_ASSERT_EQUAL (data.size(), len);
+      received++;
+    }
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, codius_shm_flush (host));
+  }
+
+  void testInvalidMemory() {
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL (0, pipe (fds));
+    CPPUNIT_ASSERT (!codius_shm_attach (CODIUS_SHM_GUEST, fds[0], -1, -1));
+    close (fds[0]);
+    close (fds[1]);
+  }
+
+private:
+  codius_shm_t* host;
+  codius_shm_t* guest;
+};
+
+class ShmIPCTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (ShmIPCTest);
+  CPPUNIT_TEST (testRequestReply);
+  CPPUNIT_TEST (testPipelinedClient);
+  CPPUNIT_TEST (testBackpressure);
+  CPPUNIT_TEST (testOwnedRequests);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  struct Host {
+    codius_shm_t* shm;
+    int count;
+  };
+
+  // Answers each request with its ID, like the host's event loop would
+  static void* hostThread(void* data) {
+    Host* host = static_cast<Host*> (data);
+    int served = 0;
+
+    while (served < host->count) {
+      codius_request_t* req = codius_shm_read_request (host->shm);
+      if (!req) {
+        CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+        wait_doorbell (host->shm);
+        codius_shm_flush (host->shm);
+        continue;
+      }
+
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mknumber (req->_id);
+      CPPUNIT_ASSERT_EQUAL (0, codius_queue_reply (req, result));
+      codius_result_free (result);
+      codius_request_free (req);
+      served++;
+    }
+
+    while (codius_shm_flush (host->shm))
+      wait_doorbell (host->shm);
+    return NULL;
+  }
+
+public:
+  void setUp() {
+    host = codius_shm_create (CODIUS_SHM_DEFAULT_RING_SIZE);
+    CPPUNIT_ASSERT (host);
+    guest = attach_guest (host);
+    CPPUNIT_ASSERT (guest);
+  }
+
+  void tearDown() {
+    codius_shm_free (guest);
+    codius_shm_free (host);
+  }
+
+  void testRequestReply() {
+    const char* orig = "[1,\"two\",{\"three\":3}]";
+    codius_request_t* req = codius_request_new ("test_api", "test_method");
+    req->data = json_decode (orig);
+
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_write_request (guest, req));
+    codius_request_t* sent_req = codius_shm_read_request (host);
+    CPPUNIT_ASSERT (sent_req);
+    CPPUNIT_ASSERT_EQUAL (req->_id, sent_req->_id);
+    CPPUNIT_ASSERT_EQUAL (std::string ("test_method"), std::string (sent_req->method_name));
+
+    char* sent = json_encode (sent_req->data);
+    CPPUNIT_ASSERT_EQUAL (std::string (orig), std::string (sent));
+    free (sent);
+
+    codius_result_t* result = codius_result_new ();
+    result->data = json_mknumber (42);
+    CPPUNIT_ASSERT_EQUAL (0, codius_send_reply (sent_req, result));
+
+    codius_result_t* sent_result = codius_shm_read_result (guest, 0);
+    CPPUNIT_ASSERT (sent_result);
+    CPPUNIT_ASSERT_EQUAL (req->_id, sent_result->_id);
+    CPPUNIT_ASSERT_EQUAL (42.0, sent_result->data->number_);
+
+    CPPUNIT_ASSERT (!codius_shm_read_result (guest, 0));
+    CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+
+    json_delete (req->data);
+    json_delete (sent_req->data);
+    codius_request_free (req);
+    codius_request_free (sent_req);
+    codius_result_free (result);
+    codius_result_free (sent_result);
+  }
+
+  struct Completion {
+    unsigned long id;
+    bool done;
+  };
+
+  static void onResult(codius_result_t* result, void* user_data) {
+    Completion* c = static_cast<Completion*> (user_data);
+    CPPUNIT_ASSERT (!c->done);
+    CPPUNIT_ASSERT_EQUAL ((double)c->id, result->data->number_);
+    c->done = true;
+    codius_result_free (result);
+  }
+
+  void testPipelinedClient() {
+    const int count = 5000;
+    Host h = {host, count};
+    std::vector<Completion> completions (count);
+    codius_client_t* client = codius_client_new_shm (guest);
+    int completed = 0;
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, ShmIPCTest::hostThread, &h);
+
+    // Enough requests to fill both rings, so both sides have to sleep
+    for (int i = 0; i < count; i++) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      completions[i].id = req->_id;
+      completions[i].done = false;
+      CPPUNIT_ASSERT_EQUAL (0, codius_client_submit (client, req, onResult, &completions[i]));
+      codius_request_free (req);
+      completed += codius_client_dispatch (client, 0);
+    }
+
+    while (completed < count) {
+      int ret = codius_client_dispatch (client, 1);
+      CPPUNIT_ASSERT (ret > 0);
+      completed += ret;
+    }
+    pthread_join (thread, NULL);
+
+    for (int i = 0; i < count; i++)
+      CPPUNIT_ASSERT (completions[i].done);
+    codius_client_free (client);
+  }
+
+  // While the guest leaves replies queued on the host, its requests wait
+  void testBackpressure() {
+    std::string payload (CODIUS_SHM_DEFAULT_RING_SIZE / 8, 'x');
+    int replies = 0;
+
+    for (;;) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      CPPUNIT_ASSERT_EQUAL (0, codius_shm_write_request (guest, req));
+      codius_request_free (req);
+
+      req = codius_shm_read_request (host);
+      if (!req) {
+        CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+        break;
+      }
+
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mkstring (payload.c_str());
+      CPPUNIT_ASSERT_EQUAL (0, codius_queue_reply (req, result));
+      codius_result_free (result);
+      codius_request_free (req);
+      replies++;
+    }
+    CPPUNIT_ASSERT (replies < 16);
+
+    for (int i = 0; i < replies; i++) {
+      codius_result_t* result = codius_shm_read_result (guest, 1);
+      CPPUNIT_ASSERT (result);
+      codius_result_free (result);
+      codius_shm_flush (host);
+    }
+
+    codius_request_t* req = codius_shm_read_request (host);
+    CPPUNIT_ASSERT (req);
+    codius_request_free (req);
+  }
+
+  // Requests are matched to the channel they have to be answered through
+  void testOwnedRequests() {
+    ShmIPC ipc (host, 4, dup (codius_shm_host_doorbell (host)));
+    host = NULL;
+    CallbackIPC socketIPC (3);
+
+    codius_request_t* req = codius_request_new ("test_api", "test_method");
+    CPPUNIT_ASSERT_EQUAL (0, codius_shm_write_request (guest, req));
+    codius_request_free (req);
+    req = ipc.readRequest();
+    CPPUNIT_ASSERT (req);
+    CPPUNIT_ASSERT (ipc.owns (req));
+    CPPUNIT_ASSERT (!socketIPC.owns (req));
+
+    req->_shm = NULL;
+    req->_fd = socketIPC.parent;
+    CPPUNIT_ASSERT (!ipc.owns (req));
+    CPPUNIT_ASSERT (socketIPC.owns (req));
+    codius_request_free (req);
+  }
+
+private:
+  codius_shm_t* host;
+  codius_shm_t* guest;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (ShmIPCTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (ShmRingTest);
@@ -0,0 +1,126 @@
+#include "dirent-builder.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <string.h>
+
+class DirentCursorTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (DirentCursorTest);
+  CPPUNIT_TEST (testSlices);
+  CPPUNIT_TEST (testSmallBuffer);
+  CPPUNIT_TEST (testSeek);
+  CPPUNIT_TEST (testDirent64);
+  CPPUNIT_TEST (testInodes);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::vector<std::string> names;
+  DirentCursor cursor;
+
+  std::vector<std::string> readAll(unsigned int count) {
+    std::vector<std::string> ret;
+    std::vector<char> buf (count);
+    int len;
+    while ((len = cursor.read (buf.data(), buf.size(), DirentBuilder::Dirent)) > 0) {
+      for (int pos = 0; pos < len;) {
+        linux_dirent* ent = reinterpret_cast<linux_dirent*>(&buf[pos]);
+        ret.push_back (std::string (ent->d_name));
+        pos += ent->d_reclen;
+      }
+    }
+    CPPUNIT_ASSERT_EQUAL (0, len);
+    return ret;
+  }
+
+public:
+  void setUp() {
+    names.clear();
+    for (int i = 0; i < 100; i++)
+      names.push_back ("file-" + std::to_string (i));
+    std::vector<DirentCursor::Entry> entries;
+    for (size_t i = 0; i < names.size(); i++) {
+      DirentCursor::Entry entry = {names[i], 1000 + i, i % 2 ? DirentBuilder::Directory : DirentBuilder::Regular};
+      entries.push_back (entry);
+    }
+    cursor = DirentCursor();
+    cursor.load (entries);
+  }
+
+  void testSlices() {
+    std::vector<std::string> ret = readAll (100);
+    CPPUNIT_ASSERT (ret == names);
+  }
+
+  void testSmallBuffer() {
+    char buf[8];
+    CPPUNIT_ASSERT_EQUAL (-EINVAL, cursor.read (buf, sizeof (buf), DirentBuilder::Dirent));
+  }
+
+  void testSeek() {
+    char buf[64];
+    int len = cursor.read (buf, sizeof (buf), DirentBuilder::Dirent);
+    CPPUNIT_ASSERT (len > 0);
+    linux_dirent* ent = reinterpret_cast<linux_dirent*>(buf);
+    cursor.seek (ent->d_off);
+    len = cursor.read (buf, sizeof (buf), DirentBuilder::Dirent);
+    CPPUNIT_ASSERT (len > 0);
+    CPPUNIT_ASSERT_EQUAL (std::string ("file-1"), std::string (ent->d_name));
+
+    cursor.seek (0);
+    CPPUNIT_ASSERT (!cursor.loaded());
+  }
+
+  void testDirent64() {
+    std::vector<char> buf (4096);
+    int len = cursor.read (buf.data(), buf.size(), DirentBuilder::Dirent64);
+    CPPUNIT_ASSERT (len > 0);
+    linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf.data());
+    CPPUNIT_ASSERT_EQUAL (std::string ("file-0"), std::string (ent->d_name));
+    CPPUNIT_ASSERT_EQUAL ((unsigned char)DT_REG, ent->d_type);
+    CPPUNIT_ASSERT_EQUAL ((int64_t)1, ent->d_off);
+  }
+
+  void testInodes() {
+    std::vector<char> buf (4096);
+    int len = cursor.read (buf.data(), buf.size(), DirentBuilder::Dirent64);
+    CPPUNIT_ASSERT (len > 0);
+    linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf.data());
+    ent = reinterpret_cast<linux_dirent64*>(buf.data() + ent->d_reclen);
+    CPPUNIT_ASSERT_EQUAL (std::string ("file-1"), std::string (ent->d_name));
+    CPPUNIT_ASSERT_EQUAL ((uint64_t)1001, ent->d_ino);
+    CPPUNIT_ASSERT_EQUAL ((unsigned char)DT_DIR, ent->d_type);
+  }
+};
+
+class DirentBuilderTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (DirentBuilderTest);
+  CPPUNIT_TEST (testRecordLength);
+  CPPUNIT_TEST (testFits);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testRecordLength() {
+    CPPUNIT_ASSERT_EQUAL ((size_t)24, DirentBuilder::recordLength (1, DirentBuilder::Dirent));
+    CPPUNIT_ASSERT_EQUAL ((size_t)24, DirentBuilder::recordLength (4, DirentBuilder::Dirent));
+    CPPUNIT_ASSERT_EQUAL ((size_t)32, DirentBuilder::recordLength (5, DirentBuilder::Dirent));
+    CPPUNIT_ASSERT_EQUAL ((size_t)24, DirentBuilder::recordLength (4, DirentBuilder::Dirent64));
+    CPPUNIT_ASSERT_EQUAL ((size_t)32, DirentBuilder::recordLength (5, DirentBuilder::Dirent64));
+  }
+
+  void testFits() {
+    char buf[60];
+    DirentBuilder builder (buf, sizeof (buf));
+    CPPUNIT_ASSERT (builder.append ("a", 1, 42, 1));
+    CPPUNIT_ASSERT (builder.append ("b", 2, 43, 2, DirentBuilder::Directory));
+    CPPUNIT_ASSERT (!builder.append ("c", 3, 44, 3));
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, builder.count());
+    CPPUNIT_ASSERT_EQUAL ((size_t)48, builder.size());
+
+    linux_dirent* ent = reinterpret_cast<linux_dirent*>(buf + 24);
+    CPPUNIT_ASSERT_EQUAL (43ul, ent->d_ino);
+    CPPUNIT_ASSERT_EQUAL ((char)DT_DIR, buf[47]);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (DirentCursorTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (DirentBuilderTest);
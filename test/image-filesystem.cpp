@@ -0,0 +1,150 @@
+#include "image-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+class ImageFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (ImageFilesystemTest);
+  CPPUNIT_TEST (testRead);
+  CPPUNIT_TEST (testStat);
+  CPPUNIT_TEST (testGetdents);
+  CPPUNIT_TEST (testSymlink);
+  CPPUNIT_TEST (testReadOnly);
+  CPPUNIT_TEST (testShared);
+  CPPUNIT_TEST (testSeekOverflow);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::string root;
+  std::string imagePath;
+  std::unique_ptr<ImageFilesystem> fs;
+
+  void writeFile(const std::string& path, const std::string& contents) {
+    FILE* fh = fopen ((root + path).c_str(), "w");
+    fwrite (contents.data(), 1, contents.size(), fh);
+    fclose (fh);
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-image-XXXXXX";
+    root = mkdtemp (tmpl);
+    mkdir ((root + "/lib").c_str(), 0755);
+    writeFile ("/index.js", "console.log('hello');\n");
+    writeFile ("/lib/a.js", std::string ("\0binary\xff", 8));
+    writeFile ("/lib/b.js", "");
+    symlink ("lib/a.js", (root + "/link.js").c_str());
+    symlink ("lib", (root + "/libdir").c_str());
+    symlink ("loop-b", (root + "/loop-a").c_str());
+    symlink ("loop-a", (root + "/loop-b").c_str());
+
+    imagePath = root + ".img";
+    CPPUNIT_ASSERT (FilesystemImage::pack (root, imagePath));
+    FilesystemImage::Ptr image = FilesystemImage::open (imagePath);
+    CPPUNIT_ASSERT (image);
+    fs = std::unique_ptr<ImageFilesystem> (new ImageFilesystem (image));
+  }
+
+  void tearDown() {
+    fs.reset();
+    std::string cmd = "rm -rf " + root + " " + imagePath;
+    CPPUNIT_ASSERT_EQUAL (0, system (cmd.c_str()));
+  }
+
+  void testRead() {
+    char buf[64];
+    int fd = fs->open ("/lib/a.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)3, fs->read (fd, buf, 3));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "\0bi", 3));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)5, fs->read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "nary\xff", 5));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, fs->read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL ((off_t)8, fs->lseek (fd, 0, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL (0, fs->close (fd));
+    CPPUNIT_ASSERT_EQUAL (-EBADF, fs->close (fd));
+  }
+
+  void testSeekOverflow() {
+    const off_t max = std::numeric_limits<off_t>::max();
+    int fd = fs->open ("/lib/a.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT_EQUAL (max, fs->lseek (fd, max, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs->lseek (fd, 1, SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs->lseek (fd, max, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs->lseek (fd, std::numeric_limits<off_t>::min(), SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs->lseek (fd, -9, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)0, fs->lseek (fd, -8, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL (0, fs->close (fd));
+  }
+
+  void testStat() {
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs->stat ("/index.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)22, sbuf.st_size);
+    CPPUNIT_ASSERT (S_ISREG (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (0, fs->stat ("/lib/../lib/", &sbuf));
+    CPPUNIT_ASSERT (S_ISDIR (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs->stat ("/missing.js", &sbuf));
+  }
+
+  void testGetdents() {
+    char buf[4096];
+    std::vector<std::string> names;
+    int fd = fs->open ("/", O_RDONLY | O_DIRECTORY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    int len = fs->getdents64 (fd, (struct linux_dirent64*)buf, sizeof (buf));
+    for (int pos = 0; pos < len;) {
+      linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf + pos);
+      names.push_back (ent->d_name);
+      pos += ent->d_reclen;
+    }
+    CPPUNIT_ASSERT_EQUAL ((size_t)6, names.size());
+    CPPUNIT_ASSERT_EQUAL (std::string ("index.js"), names[0]);
+    CPPUNIT_ASSERT_EQUAL (std::string ("lib"), names[1]);
+    CPPUNIT_ASSERT_EQUAL (std::string ("libdir"), names[2]);
+    CPPUNIT_ASSERT_EQUAL (std::string ("link.js"), names[3]);
+    CPPUNIT_ASSERT_EQUAL (0, fs->getdents64 (fd, (struct linux_dirent64*)buf, sizeof (buf)));
+  }
+
+  void testSymlink() {
+    char buf[64];
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)8, fs->readlink ("/link.js", buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "lib/a.js", 8));
+    CPPUNIT_ASSERT_EQUAL (0, fs->lstat ("/link.js", &sbuf));
+    CPPUNIT_ASSERT (S_ISLNK (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (0, fs->stat ("/link.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)8, sbuf.st_size);
+
+    // Links are followed in the middle of a path too
+    CPPUNIT_ASSERT_EQUAL (0, fs->stat ("/libdir/a.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)8, sbuf.st_size);
+    CPPUNIT_ASSERT_EQUAL (0, fs->lstat ("/libdir/../libdir/b.js", &sbuf));
+    CPPUNIT_ASSERT (S_ISREG (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, fs->stat ("/index.js/a.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL (-ELOOP, fs->stat ("/loop-a", &sbuf));
+    CPPUNIT_ASSERT_EQUAL (-ELOOP, fs->stat ("/loop-a/x", &sbuf));
+    CPPUNIT_ASSERT_EQUAL (0, fs->lstat ("/loop-a", &sbuf));
+  }
+
+  void testReadOnly() {
+    CPPUNIT_ASSERT_EQUAL (-EROFS, fs->open ("/index.js", O_RDWR, 0));
+    CPPUNIT_ASSERT_EQUAL (-EROFS, fs->open ("/new.js", O_WRONLY | O_CREAT, 0644));
+    CPPUNIT_ASSERT_EQUAL (-EROFS, fs->access ("/index.js", W_OK));
+    CPPUNIT_ASSERT_EQUAL (0, fs->access ("/index.js", R_OK));
+  }
+
+  void testShared() {
+    FilesystemImage::Ptr first = FilesystemImage::open (imagePath);
+    FilesystemImage::Ptr second = FilesystemImage::open (imagePath);
+    CPPUNIT_ASSERT (first.get() == second.get());
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (ImageFilesystemTest);
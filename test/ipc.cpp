@@ -2,8 +2,14 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <string.h>
+#include <string>
+#include <vector>
+#include <stdlib.h>
 
 #define FD_SEND 0
 #define FD_RECV 1
@@ -83,6 +89,7 @@ class IPCResultTest : public CppUnit::TestFixture {
   CPPUNIT_TEST_SUITE (IPCResultTest);
   CPPUNIT_TEST (testSendRecv);
   CPPUNIT_TEST (testDecodeEncode);
+  CPPUNIT_TEST (testTakeData);
   CPPUNIT_TEST_SUITE_END ();
 
 public:
@@ -110,6 +117,33 @@ public:
     codius_result_free (result);
   }
 
+  void testTakeData() {
+    codius_result_t* result = codius_result_new ();
+    result->data = json_decode ("{\"a\":[1,\"two\"],\"b\":{\"c\":null}}");
+    CPPUNIT_ASSERT_EQUAL (0, codius_write_result (test_fd[FD_SEND], result));
+    codius_result_t* sent_result = codius_read_result (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (sent_result);
+
+    JsonArena* arena;
+    JsonNode* data = codius_result_take_data (sent_result, &arena);
+    CPPUNIT_ASSERT (arena);
+    codius_result_free (sent_result);
+
+    char* sent = json_encode (data);
+    char* orig = json_encode (result->data);
+    CPPUNIT_ASSERT_EQUAL (std::string (orig), std::string (sent));
+    free (sent);
+    free (orig);
+    json_delete (data);
+    json_arena_free (arena);
+
+    // Heap data comes without an arena, and is freed with json_delete()
+    data = codius_result_take_data (result, &arena);
+    CPPUNIT_ASSERT (!arena);
+    codius_result_free (result);
+    json_delete (data);
+  }
+
   void setUp() {
     socketpair (AF_UNIX, SOCK_STREAM, 0, test_fd);
   }
@@ -176,6 +210,656 @@ private:
   int test_fd[2];
 };
 
+class IPCCborTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (IPCCborTest);
+  CPPUNIT_TEST (testRequestRoundTrip);
+  CPPUNIT_TEST (testReplyMatchesRequest);
+  CPPUNIT_TEST (testUnknownInternedName);
+  CPPUNIT_TEST (testNamesDefinedPerConnection);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  void writeRaw(int fd, const char* body, size_t size) {
+    codius_rpc_header_t header;
+    header.magic_bytes = CODIUS_MAGIC_BYTES_CBOR;
+    header.callback_id = 1;
+    header.size = size;
+    write (fd, &header, sizeof (header));
+    write (fd, body, size);
+  }
+
+public:
+  void testRequestRoundTrip() {
+    codius_intern_name ("test_api");
+
+    codius_request_t* req = codius_request_new ("test_api", "test_method");
+    req->encoding = CODIUS_ENCODING_CBOR;
+    req->data = json_decode ("{\"path\":\"/tmp\",\"flags\":[1,2.5]}");
+    CPPUNIT_ASSERT_EQUAL (0, codius_write_request (test_fd[FD_SEND], req));
+
+    codius_request_t* sent_req = codius_read_request (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (sent_req);
+    CPPUNIT_ASSERT_EQUAL (CODIUS_ENCODING_CBOR, sent_req->encoding);
+    CPPUNIT_ASSERT_EQUAL (std::string ("test_api"), std::string (sent_req->api_name));
+    CPPUNIT_ASSERT_EQUAL (std::string ("test_method"), std::string (sent_req->method_name));
+    CPPUNIT_ASSERT_EQUAL (req->_id, sent_req->_id);
+
+    // The data outlives the request it was read into
+    JsonArena* arena;
+    JsonNode* data = codius_request_take_data (sent_req, &arena);
+    CPPUNIT_ASSERT (arena);
+    CPPUNIT_ASSERT (!sent_req->data);
+    codius_request_free (sent_req);
+
+    char* sent = json_encode (data);
+    char* orig = json_encode (req->data);
+    CPPUNIT_ASSERT_EQUAL (std::string (orig), std::string (sent));
+    free (sent);
+    free (orig);
+
+    json_delete (data);
+    json_arena_free (arena);
+    json_delete (req->data);
+    codius_request_free (req);
+  }
+
+  void testReplyMatchesRequest() {
+    codius_encoding_t encodings[] = {CODIUS_ENCODING_JSON, CODIUS_ENCODING_CBOR};
+
+    for (codius_encoding_t encoding : encodings) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      req->encoding = encoding;
+      codius_write_request (test_fd[FD_SEND], req);
+      codius_request_t* sent_req = codius_read_request (test_fd[FD_RECV]);
+
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mknumber (42);
+      codius_send_reply (sent_req, result);
+
+      codius_result_t* sent_result = codius_read_result (test_fd[FD_SEND]);
+      CPPUNIT_ASSERT_EQUAL (encoding, sent_result->_encoding);
+      CPPUNIT_ASSERT_EQUAL (req->_id, sent_result->_id);
+      CPPUNIT_ASSERT_EQUAL (42.0, sent_result->data->number_);
+
+      codius_result_free (sent_result);
+      codius_result_free (result);
+      codius_request_free (sent_req);
+      codius_request_free (req);
+    }
+  }
+
+  void testUnknownInternedName() {
+    // [9999, "m", null] refers to a name that was never interned
+    const char body[] = "\x83\x19\x27\x0f\x61m\xf6";
+    writeRaw (test_fd[FD_SEND], body, sizeof (body) - 1);
+
+    CPPUNIT_ASSERT (!codius_read_request (test_fd[FD_RECV]));
+  }
+
+  // An ID only means something on the connection that defined it, and the
+  // receiver never has to intern anything itself
+  void testNamesDefinedPerConnection() {
+    int id = codius_intern_name ("per_connection_api");
+    CPPUNIT_ASSERT (id >= 0 && id < 24);
+
+    for (int i = 0; i < 2; i++) {
+      codius_request_t* req = codius_request_new ("per_connection_api", "m");
+      req->encoding = CODIUS_ENCODING_CBOR;
+      CPPUNIT_ASSERT_EQUAL (0, codius_write_request (test_fd[FD_SEND], req));
+      codius_request_free (req);
+
+      codius_request_t* sent_req = codius_read_request (test_fd[FD_RECV]);
+      CPPUNIT_ASSERT (sent_req);
+      CPPUNIT_ASSERT_EQUAL (std::string ("per_connection_api"), std::string (sent_req->api_name));
+      codius_request_free (sent_req);
+    }
+
+    int other[2];
+    socketpair (AF_UNIX, SOCK_STREAM, 0, other);
+
+    // [id, "m", null] before the ID was defined on this connection
+    const char body[] = {(char)(0x80 | 3), (char)id, 0x61, 'm', (char)0xf6};
+    writeRaw (other[FD_SEND], body, sizeof (body));
+    CPPUNIT_ASSERT (!codius_read_request (other[FD_RECV]));
+
+    codius_request_t* req = codius_request_new ("per_connection_api", "m");
+    req->encoding = CODIUS_ENCODING_CBOR;
+    CPPUNIT_ASSERT_EQUAL (0, codius_write_request (other[FD_SEND], req));
+    codius_request_free (req);
+
+    codius_request_t* sent_req = codius_read_request (other[FD_RECV]);
+    CPPUNIT_ASSERT (sent_req);
+    CPPUNIT_ASSERT_EQUAL (std::string ("per_connection_api"), std::string (sent_req->api_name));
+    codius_request_free (sent_req);
+
+    codius_forget_fd (other[0]);
+    codius_forget_fd (other[1]);
+    close (other[0]);
+    close (other[1]);
+  }
+
+  void setUp() {
+    socketpair (AF_UNIX, SOCK_STREAM, 0, test_fd);
+  }
+
+  void tearDown() {
+    codius_forget_fd (test_fd[0]);
+    codius_forget_fd (test_fd[1]);
+    close (test_fd[0]);
+    close (test_fd[1]);
+  }
+
+private:
+  int test_fd[2];
+};
+
+class IPCFramingTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (IPCFramingTest);
+  CPPUNIT_TEST (testShortReads);
+  CPPUNIT_TEST (testSeveralFramesPerRead);
+  CPPUNIT_TEST (testLargeResult);
+  CPPUNIT_TEST (testStreamedResults);
+  CPPUNIT_TEST (testQueuedReplies);
+  CPPUNIT_TEST (testNonBlockingReads);
+  CPPUNIT_TEST (testMalformedRequests);
+  CPPUNIT_TEST (testReplyBacklog);
+  CPPUNIT_TEST (testForgottenDescriptor);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  struct Dribble {
+    int fd;
+    std::string data;
+  };
+
+  // Writes one byte at a time, so the reader sees every possible split
+  static void* dribbleThread(void* data) {
+    Dribble* d = static_cast<Dribble*> (data);
+    for (size_t i = 0; i < d->data.size(); i++) {
+      write (d->fd, &d->data[i], 1);
+      usleep (100);
+    }
+    return NULL;
+  }
+
+  static void* writeAllThread(void* data) {
+    Dribble* d = static_cast<Dribble*> (data);
+    for (size_t i = 0; i < d->data.size(); ) {
+      ssize_t ret = write (d->fd, d->data.data() + i, d->data.size() - i);
+      if (ret <= 0)
+        break;
+      i += ret;
+    }
+    return NULL;
+  }
+
+  struct LargeWrite {
+    int fd;
+    codius_result_t* result;
+  };
+
+  static void* writeResultThread(void* data) {
+    LargeWrite* w = static_cast<LargeWrite*> (data);
+    codius_write_result (w->fd, w->result);
+    return NULL;
+  }
+
+  static void* readResultThread(void* data) {
+    LargeWrite* w = static_cast<LargeWrite*> (data);
+    w->result = codius_read_result (w->fd);
+    return NULL;
+  }
+
+  std::string frame(const std::string& body, unsigned long id) {
+    codius_rpc_header_t header;
+    header.magic_bytes = CODIUS_MAGIC_BYTES;
+    header.callback_id = id;
+    header.size = body.size();
+    return std::string (reinterpret_cast<char*> (&header), sizeof (header)) + body;
+  }
+
+public:
+  void testShortReads() {
+    Dribble d;
+    d.fd = test_fd[FD_SEND];
+    d.data = frame ("{\"api\":\"a\",\"method\":\"m\",\"arguments\":[1,2,3]}", 7);
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, IPCFramingTest::dribbleThread, &d);
+    codius_request_t* req = codius_read_request (test_fd[FD_RECV]);
+    pthread_join (thread, NULL);
+
+    CPPUNIT_ASSERT (req);
+    CPPUNIT_ASSERT_EQUAL (7ul, req->_id);
+    CPPUNIT_ASSERT_EQUAL (std::string ("m"), std::string (req->method_name));
+    CPPUNIT_ASSERT_EQUAL (JSON_ARRAY, req->data->tag);
+    json_delete (req->data);
+    codius_request_free (req);
+  }
+
+  void testSeveralFramesPerRead() {
+    std::string frames = frame ("{\"api\":\"a\",\"method\":\"first\",\"arguments\":null}", 1) +
+                         frame ("{\"api\":\"a\",\"method\":\"second\",\"arguments\":null}", 2);
+    write (test_fd[FD_SEND], frames.data(), frames.size());
+
+    CPPUNIT_ASSERT (!codius_has_buffered_message (test_fd[FD_RECV]));
+    codius_request_t* first = codius_read_request (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (codius_has_buffered_message (test_fd[FD_RECV]));
+
+    // Nothing is left on the socket, so this must come from the buffer
+    codius_request_t* second = codius_read_request (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (!codius_has_buffered_message (test_fd[FD_RECV]));
+
+    CPPUNIT_ASSERT_EQUAL (std::string ("first"), std::string (first->method_name));
+    CPPUNIT_ASSERT_EQUAL (std::string ("second"), std::string (second->method_name));
+    CPPUNIT_ASSERT_EQUAL (2ul, second->_id);
+    codius_request_free (first);
+    codius_request_free (second);
+  }
+
+  void testLargeResult() {
+    std::string payload (4 * 1024 * 1024, 'x');
+    LargeWrite w;
+    w.fd = test_fd[FD_SEND];
+    w.result = codius_result_new ();
+    w.result->data = json_mkstring (payload.c_str());
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, IPCFramingTest::writeResultThread, &w);
+    codius_result_t* result = codius_read_result (test_fd[FD_RECV]);
+    pthread_join (thread, NULL);
+
+    CPPUNIT_ASSERT (result && result->data);
+    CPPUNIT_ASSERT_EQUAL (payload, std::string (result->data->string_));
+    codius_result_free (result);
+    codius_result_free (w.result);
+  }
+
+  // Large JSON results are parsed as they arrive; the frames after them must
+  // still be read intact, even when the large body is not valid JSON
+  void testStreamedResults() {
+    std::string big = "[";
+    for (int i = 0; i < 50000; i++)
+      big += (i ? "," : "") + std::string ("{\"n\":") + std::to_string (i) + ",\"s\":\"abc\"}";
+    big += "]";
+    std::string bad (big);
+    bad[bad.size() / 2] = '!';
+
+    Dribble d;
+    d.fd = test_fd[FD_SEND];
+    d.data = frame (big, 1) + frame (bad, 2) + frame ("[3]", 3);
+    CPPUNIT_ASSERT (big.size() > CODIUS_MAX_MESSAGE_SIZE);
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, IPCFramingTest::writeAllThread, &d);
+
+    codius_result_t* result = codius_read_result (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (result && result->data);
+    CPPUNIT_ASSERT_EQUAL (1ul, result->_id);
+    JsonNode* last = json_find_element (result->data, 49999);
+    CPPUNIT_ASSERT (last);
+    CPPUNIT_ASSERT_EQUAL (49999.0, json_find_member (last, "n")->number_);
+    codius_result_free (result);
+
+    result = codius_read_result (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (result);
+    CPPUNIT_ASSERT_EQUAL (2ul, result->_id);
+    CPPUNIT_ASSERT (!result->data);
+    codius_result_free (result);
+
+    result = codius_read_result (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (result && result->data);
+    CPPUNIT_ASSERT_EQUAL (3ul, result->_id);
+    codius_result_free (result);
+
+    pthread_join (thread, NULL);
+  }
+
+  void testQueuedReplies() {
+    codius_encoding_t encodings[] = {CODIUS_ENCODING_JSON, CODIUS_ENCODING_CBOR, CODIUS_ENCODING_JSON};
+    unsigned long ids[3];
+
+    for (int i = 0; i < 3; i++) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      req->encoding = encodings[i];
+      ids[i] = req->_id;
+      codius_write_request (test_fd[FD_SEND], req);
+      codius_request_free (req);
+    }
+
+    for (int i = 0; i < 3; i++) {
+      codius_request_t* sent_req = codius_read_request (test_fd[FD_RECV]);
+      codius_result_t* result = codius_result_new ();
+      if (i != 2)
+        result->data = json_mknumber (i);
+      CPPUNIT_ASSERT_EQUAL (0, codius_queue_reply (sent_req, result));
+      codius_result_free (result);
+      codius_request_free (sent_req);
+    }
+
+    char byte;
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-1, recv (test_fd[FD_SEND], &byte, 1, MSG_DONTWAIT | MSG_PEEK));
+    CPPUNIT_ASSERT_EQUAL (0, codius_flush_all_replies ());
+
+    for (int i = 0; i < 3; i++) {
+      codius_result_t* result = codius_read_result (test_fd[FD_SEND]);
+      CPPUNIT_ASSERT (result);
+      CPPUNIT_ASSERT_EQUAL (ids[i], result->_id);
+      CPPUNIT_ASSERT_EQUAL (encodings[i], result->_encoding);
+      if (i != 2)
+        CPPUNIT_ASSERT_EQUAL ((double)i, result->data->number_);
+      else
+        CPPUNIT_ASSERT (!result->data);
+      codius_result_free (result);
+    }
+    CPPUNIT_ASSERT (!codius_has_buffered_message (test_fd[FD_SEND]));
+  }
+
+  // A partial frame on a non-blocking descriptor is kept until the rest
+  // arrives, and replies larger than the socket buffer go out as it drains
+  void testNonBlockingReads() {
+    int recv_fd = test_fd[FD_RECV];
+    fcntl (recv_fd, F_SETFL, fcntl (recv_fd, F_GETFL) | O_NONBLOCK);
+
+    std::string data = frame ("{\"api\":\"a\",\"method\":\"m\",\"arguments\":[1]}", 5);
+    size_t splits[] = {0, 3, sizeof (codius_rpc_header_t) + 4, data.size()};
+
+    for (int i = 0; i < 3; i++) {
+      write (test_fd[FD_SEND], data.data() + splits[i], splits[i + 1] - splits[i]);
+      codius_request_t* req = codius_read_request (recv_fd);
+      if (i < 2) {
+        CPPUNIT_ASSERT (!req);
+        CPPUNIT_ASSERT_EQUAL (EAGAIN, errno);
+        continue;
+      }
+
+      CPPUNIT_ASSERT (req);
+      CPPUNIT_ASSERT_EQUAL (5ul, req->_id);
+
+      LargeWrite w;
+      w.fd = test_fd[FD_SEND];
+      w.result = NULL;
+      pthread_t thread;
+      pthread_create (&thread, NULL, IPCFramingTest::readResultThread, &w);
+
+      std::string payload (4 * 1024 * 1024, 'x');
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mkstring (payload.c_str());
+      CPPUNIT_ASSERT_EQUAL (0, codius_send_reply (req, result));
+      while (codius_reply_backlog (recv_fd)) {
+        struct pollfd pfd = {recv_fd, POLLOUT, 0};
+        CPPUNIT_ASSERT_EQUAL (1, poll (&pfd, 1, 5000));
+        CPPUNIT_ASSERT_EQUAL (0, codius_flush_replies (recv_fd));
+      }
+      pthread_join (thread, NULL);
+
+      CPPUNIT_ASSERT (w.result && w.result->data);
+      CPPUNIT_ASSERT_EQUAL (payload, std::string (w.result->data->string_));
+      codius_result_free (w.result);
+      codius_result_free (result);
+      codius_request_free (req);
+    }
+
+    close (test_fd[FD_SEND]);
+    CPPUNIT_ASSERT (!codius_read_request (recv_fd));
+    CPPUNIT_ASSERT_EQUAL (ECONNRESET, errno);
+    test_fd[FD_SEND] = open ("/dev/null", O_RDONLY);
+  }
+
+  // A guest's bad request fails the read, rather than bringing the host down
+  void testMalformedRequests() {
+    const char* bodies[] = {"not json", "[1,2]", "{\"api\":1,\"method\":\"m\",\"arguments\":null}",
+                            "{\"api\":\"a\",\"method\":\"m\"}"};
+
+    for (const char* body : bodies) {
+      std::string data = frame (body, 1);
+      write (test_fd[FD_SEND], data.data(), data.size());
+      CPPUNIT_ASSERT (!codius_read_request (test_fd[FD_RECV]));
+      CPPUNIT_ASSERT_EQUAL (EPROTO, errno);
+    }
+
+    codius_rpc_header_t header;
+    header.magic_bytes = CODIUS_MAGIC_BYTES;
+    header.callback_id = 1;
+    header.size = CODIUS_MAX_REQUEST_SIZE + 1;
+    write (test_fd[FD_SEND], &header, sizeof (header));
+    CPPUNIT_ASSERT (!codius_read_request (test_fd[FD_RECV]));
+    CPPUNIT_ASSERT_EQUAL (EMSGSIZE, errno);
+  }
+
+  // A guest that never reads its replies runs out of backlog, rather than
+  // blocking the host
+  void testReplyBacklog() {
+    int recv_fd = test_fd[FD_RECV];
+    fcntl (recv_fd, F_SETFL, fcntl (recv_fd, F_GETFL) | O_NONBLOCK);
+
+    std::string data = frame ("{\"api\":\"a\",\"method\":\"m\",\"arguments\":[]}", 1);
+    std::string payload (16 * 1024, 'x');
+    int sent = 0;
+    for (;;) {
+      write (test_fd[FD_SEND], data.data(), data.size());
+      codius_request_t* req = codius_read_request (recv_fd);
+      CPPUNIT_ASSERT (req);
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mkstring (payload.c_str());
+      int ret = codius_send_reply (req, result);
+      codius_result_free (result);
+      codius_request_free (req);
+      if (ret != 0)
+        break;
+      sent++;
+    }
+    CPPUNIT_ASSERT_EQUAL (ENOBUFS, errno);
+    CPPUNIT_ASSERT (codius_reply_backlog (recv_fd) > 0);
+    CPPUNIT_ASSERT (codius_reply_backlog (recv_fd) <= CODIUS_MAX_REPLY_BACKLOG);
+
+    // Once the guest catches up, everything that was accepted arrives
+    for (int i = 0; i < sent; i++) {
+      CPPUNIT_ASSERT_EQUAL (0, codius_flush_replies (recv_fd));
+      codius_result_t* result = codius_read_result (test_fd[FD_SEND]);
+      CPPUNIT_ASSERT (result && result->data);
+      CPPUNIT_ASSERT_EQUAL (payload.size(), strlen (result->data->string_));
+      codius_result_free (result);
+    }
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, codius_reply_backlog (recv_fd));
+  }
+
+  // Requests read before their descriptor was forgotten cannot be replied
+  // to, even once the number belongs to a new channel
+  void testForgottenDescriptor() {
+    std::string data = frame ("{\"api\":\"a\",\"method\":\"m\",\"arguments\":[]}", 1);
+    write (test_fd[FD_SEND], data.data(), data.size());
+    codius_request_t* stale = codius_read_request (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (stale);
+    codius_forget_fd (test_fd[FD_RECV]);
+
+    codius_result_t* result = codius_result_new ();
+    CPPUNIT_ASSERT (codius_queue_reply (stale, result) != 0);
+    CPPUNIT_ASSERT_EQUAL (EBADF, errno);
+
+    data = frame ("{\"api\":\"a\",\"method\":\"m\",\"arguments\":[]}", 2);
+    write (test_fd[FD_SEND], data.data(), data.size());
+    codius_request_t* req = codius_read_request (test_fd[FD_RECV]);
+    CPPUNIT_ASSERT (req);
+    CPPUNIT_ASSERT (codius_send_reply (stale, result) != 0);
+    CPPUNIT_ASSERT_EQUAL (EBADF, errno);
+    CPPUNIT_ASSERT_EQUAL (0, codius_send_reply (req, result));
+    codius_result_free (result);
+
+    result = codius_read_result (test_fd[FD_SEND]);
+    CPPUNIT_ASSERT (result);
+    CPPUNIT_ASSERT_EQUAL (2ul, result->_id);
+    CPPUNIT_ASSERT (!codius_has_buffered_message (test_fd[FD_SEND]));
+    codius_result_free (result);
+    codius_request_free (stale);
+    codius_request_free (req);
+  }
+
+  void setUp() {
+    socketpair (AF_UNIX, SOCK_STREAM, 0, test_fd);
+  }
+
+  void tearDown() {
+    codius_forget_fd (test_fd[0]);
+    codius_forget_fd (test_fd[1]);
+    close (test_fd[0]);
+    close (test_fd[1]);
+  }
+
+private:
+  int test_fd[2];
+};
+
+class IPCClientTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (IPCClientTest);
+  CPPUNIT_TEST (testOutOfOrder);
+  CPPUNIT_TEST (testWait);
+  CPPUNIT_TEST (testNonBlockingDispatch);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  struct Host {
+    int fd;
+    int count;
+  };
+
+  // Reads every request before answering any, then answers newest first
+  static void* reverseHostThread(void* data) {
+    Host* host = static_cast<Host*> (data);
+    std::vector<codius_request_t*> requests;
+
+    for (int i = 0; i < host->count; i++)
+      requests.push_back (codius_read_request (host->fd));
+
+    for (int i = host->count - 1; i >= 0; i--) {
+      codius_result_t* result = codius_result_new ();
+      result->data = json_mknumber (requests[i]->_id);
+      codius_send_reply (requests[i], result);
+      codius_result_free (result);
+      codius_request_free (requests[i]);
+    }
+    return NULL;
+  }
+
+  struct Completion {
+    unsigned long id;
+    bool done;
+  };
+
+  static void onResult(codius_result_t* result, void* user_data) {
+    Completion* c = static_cast<Completion*> (user_data);
+    CPPUNIT_ASSERT (!c->done);
+    CPPUNIT_ASSERT_EQUAL ((double)c->id, result->data->number_);
+    c->done = true;
+    codius_result_free (result);
+  }
+
+public:
+  void testOutOfOrder() {
+    const int count = 500;
+    Host host = {test_fd[FD_RECV], count};
+    std::vector<Completion> completions (count);
+    codius_client_t* client = codius_client_new (test_fd[FD_SEND]);
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, IPCClientTest::reverseHostThread, &host);
+
+    for (int i = 0; i < count; i++) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      completions[i].id = req->_id;
+      completions[i].done = false;
+      CPPUNIT_ASSERT_EQUAL (0, codius_client_submit (client, req, onResult, &completions[i]));
+      codius_request_free (req);
+    }
+    CPPUNIT_ASSERT_EQUAL ((size_t)count, codius_client_pending (client));
+
+    int completed = 0;
+    while (completed < count) {
+      int ret = codius_client_dispatch (client, 1);
+      CPPUNIT_ASSERT (ret > 0);
+      completed += ret;
+    }
+    pthread_join (thread, NULL);
+
+    for (int i = 0; i < count; i++)
+      CPPUNIT_ASSERT (completions[i].done);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, codius_client_pending (client));
+    codius_client_free (client);
+  }
+
+  void testWait() {
+    Host host = {test_fd[FD_RECV], 3};
+    codius_client_t* client = codius_client_new (test_fd[FD_SEND]);
+    unsigned long ids[3];
+
+    pthread_t thread;
+    pthread_create (&thread, NULL, IPCClientTest::reverseHostThread, &host);
+
+    for (int i = 0; i < 3; i++) {
+      codius_request_t* req = codius_request_new ("test_api", "test_method");
+      ids[i] = req->_id;
+      codius_client_submit (client, req, NULL, NULL);
+      codius_request_free (req);
+    }
+
+    // The first request is answered last, so the others are held until asked for
+    codius_result_t* first = codius_client_wait (client, ids[0]);
+    CPPUNIT_ASSERT_EQUAL ((double)ids[0], first->data->number_);
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, codius_client_pending (client));
+
+    for (int i = 1; i < 3; i++) {
+      codius_result_t* result = codius_client_wait (client, ids[i]);
+      CPPUNIT_ASSERT_EQUAL ((double)ids[i], result->data->number_);
+      codius_result_free (result);
+    }
+    pthread_join (thread, NULL);
+
+    CPPUNIT_ASSERT (!codius_client_wait (client, ids[0]));
+    codius_result_free (first);
+    codius_client_free (client);
+  }
+
+  void testNonBlockingDispatch() {
+    codius_client_t* client = codius_client_new (test_fd[FD_SEND]);
+    Completion c = {0, false};
+
+    codius_request_t* req = codius_request_new ("test_api", "test_method");
+    c.id = req->_id;
+    codius_client_submit (client, req, onResult, &c);
+    codius_request_free (req);
+
+    CPPUNIT_ASSERT_EQUAL (0, codius_client_dispatch (client, 0));
+
+    codius_request_t* sent_req = codius_read_request (test_fd[FD_RECV]);
+    codius_result_t* result = codius_result_new ();
+    result->data = json_mknumber (c.id);
+    codius_send_reply (sent_req, result);
+    codius_result_free (result);
+    codius_request_free (sent_req);
+
+    CPPUNIT_ASSERT_EQUAL (1, codius_client_dispatch (client, 0));
+    CPPUNIT_ASSERT (c.done);
+    codius_client_free (client);
+  }
+
+  void setUp() {
+    socketpair (AF_UNIX, SOCK_STREAM, 0, test_fd);
+  }
+
+  void tearDown() {
+    codius_forget_fd (test_fd[0]);
+    codius_forget_fd (test_fd[1]);
+    close (test_fd[0]);
+    close (test_fd[1]);
+  }
+
+private:
+  int test_fd[2];
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (IPCClientTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (IPCFramingTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (IPCCborTest);
 CPPUNIT_TEST_SUITE_REGISTRATION (IPCRequestTest);
 CPPUNIT_TEST_SUITE_REGISTRATION (IPCResultTest);
 CPPUNIT_TEST_SUITE_REGISTRATION (IPCMessagingTest);
@@ -0,0 +1,276 @@
+/*
+ * Compares json_decode() on a fully buffered payload, with the tree on the heap
+ * or in an arena, and the streaming parser fed in 64 KiB reads, the way large
+ * IPC results arrive: building an arena tree, and with SAX callbacks alone.
+ * Freeing the tree is timed separately.
+ *
+ * Then decodes and encodes a number-heavy payload: descriptors, sizes and
+ * offsets as integers, timestamps and ratios as doubles.
+ *
+ * Usage: json-bench [megabytes]
+ *
+ * Each parser runs in its own process, so the peak RSS it reports belongs to
+ * that parser alone.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "json.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+enum {
+  MODE_DECODE,
+  MODE_ARENA,
+  MODE_STREAMING,
+  MODE_SAX
+};
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes an array of records shaped like typical host call results */
+static size_t
+generate (int fd, size_t target)
+{
+  char record[256];
+  size_t written = 0;
+  unsigned long i;
+  int len;
+
+  written += write (fd, "[", 1);
+  for (i = 0; written < target; i++) {
+    len = snprintf (record, sizeof (record),
+                    "%s{\"fd\":%lu,\"path\":\"/usr/lib/node_modules/file-%lu.js\","
+                    "\"size\":%lu,\"mtime\":%lu.%03lu,\"dir\":%s,\"tags\":[\"a\",\"b\\n\"]}",
+                    i ? "," : "", i % 1024, i, i * 37, 1400000000 + i, i % 1000,
+                    i % 2 ? "true" : "false");
+    written += write (fd, record, len);
+  }
+  written += write (fd, "]", 1);
+
+  return written;
+}
+
+static long
+peak_rss_kb ()
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static JsonNode*
+parse_buffered (int fd, size_t size, JsonArena* arena)
+{
+  char* buf = malloc (size + 1);
+  size_t pos = 0;
+  ssize_t ret;
+  JsonNode* node;
+
+  while (pos < size && (ret = read (fd, buf + pos, size - pos)) > 0)
+    pos += ret;
+  buf[pos] = 0;
+
+  node = json_decode_in (buf, arena);
+  free (buf);
+  return node;
+}
+
+static bool
+count_value (void* ctx)
+{
+  (*(size_t*) ctx)++;
+  return true;
+}
+
+static bool
+count_number (void* ctx, double n)
+{
+  return count_value (ctx);
+}
+
+static bool
+count_string (void* ctx, const char* str, size_t len)
+{
+  return count_value (ctx);
+}
+
+static bool
+count_bool (void* ctx, bool b)
+{
+  return count_value (ctx);
+}
+
+static const JsonCallbacks count_callbacks = {
+  count_value, count_bool, count_number, count_string,
+  count_value, NULL, count_value, NULL, NULL
+};
+
+/*
+ * Feeds @p fd to the parser in CHUNK_SIZE reads. Builds a tree in @p arena, or
+ * only counts the values if @p arena is NULL, in which case a NULL node is
+ * returned for success.
+ */
+static JsonNode*
+parse_streaming (int fd, JsonArena* arena, int* ok)
+{
+  static size_t values;
+  JsonParser* parser = arena ? json_parser_new_tree_in (arena)
+                             : json_parser_new (&count_callbacks, &values);
+  char buf[CHUNK_SIZE];
+  ssize_t ret;
+  JsonNode* node = NULL;
+
+  *ok = 1;
+  while (*ok && (ret = read (fd, buf, sizeof (buf))) > 0)
+    *ok = json_parser_feed (parser, buf, ret);
+
+  *ok = *ok && json_parser_finish (parser);
+  if (*ok && arena)
+    node = json_parser_take_root (parser);
+  json_parser_free (parser);
+  return node;
+}
+
+static void
+run (const char* name, const char* path, size_t size, int mode)
+{
+  pid_t pid;
+  int status;
+
+  fflush (stdout);
+  pid = fork ();
+  if (pid == 0) {
+    int fd = open (path, O_RDONLY);
+    long base_rss = peak_rss_kb ();
+    JsonArena* arena = mode == MODE_ARENA || mode == MODE_STREAMING ? json_arena_new () : NULL;
+    double start = now ();
+    JsonNode* node;
+    double elapsed;
+    double freed;
+    int ok = 1;
+
+    if (mode == MODE_STREAMING || mode == MODE_SAX)
+      node = parse_streaming (fd, arena, &ok);
+    else
+      node = parse_buffered (fd, size, arena);
+    elapsed = now () - start;
+
+    if (!ok || (!node && mode != MODE_SAX)) {
+      fprintf (stderr, "%s: parse failed\n", name);
+      exit (EXIT_FAILURE);
+    }
+
+    start = now ();
+    json_delete (node);
+    json_arena_free (arena);
+    freed = now () - start;
+
+    printf ("%-10s %8.3f s %8.1f MB/s   free %6.3f s   peak RSS +%ld MB\n", name,
+            elapsed, size / elapsed / 1e6, freed, (peak_rss_kb () - base_rss) / 1024);
+    exit (EXIT_SUCCESS);
+  }
+
+  waitpid (pid, &status, 0);
+}
+
+/* Returns a buffer of about @p target bytes of numeric records */
+static char*
+generate_numbers (size_t target, size_t* size)
+{
+  char* buf = malloc (target + 256);
+  size_t len = 0;
+  unsigned long i;
+
+  buf[len++] = '[';
+  for (i = 0; len < target; i++) {
+    len += sprintf (buf + len,
+                    "%s{\"fd\":%lu,\"offset\":%lu,\"size\":%lu,\"mtime\":%lu.%03lu,\"ratio\":%.17g}",
+                    i ? "," : "", i % 1024, i * 4096, (i * 7919) % 65536,
+                    1400000000 + i, i % 1000, (double)i / 7);
+  }
+  buf[len++] = ']';
+  buf[len] = 0;
+
+  *size = len;
+  return buf;
+}
+
+static void
+bench_numbers (size_t target)
+{
+  size_t size;
+  size_t encoded_len = 0;
+  char* payload = generate_numbers (target, &size);
+  double decode_time = 1e9;
+  double encode_time = 1e9;
+  int i;
+
+  // Best of three
+  for (i = 0; i < 3; i++) {
+    double start = now ();
+    JsonNode* node = json_decode (payload);
+    double elapsed = now () - start;
+    char* encoded;
+
+    if (!node) {
+      fprintf (stderr, "numbers: parse failed\n");
+      exit (EXIT_FAILURE);
+    }
+    if (elapsed < decode_time)
+      decode_time = elapsed;
+
+    start = now ();
+    encoded = json_encode_n (node, size, &encoded_len);
+    elapsed = now () - start;
+    if (elapsed < encode_time)
+      encode_time = elapsed;
+
+    free (encoded);
+    json_delete (node);
+  }
+
+  printf ("numbers: %zu bytes, %zu re-encoded\n", size, encoded_len);
+  printf ("%-10s %8.3f s %8.1f MB/s\n", "decode", decode_time, size / decode_time / 1e6);
+  printf ("%-10s %8.3f s %8.1f MB/s\n", "encode", encode_time, size / encode_time / 1e6);
+  free (payload);
+}
+
+int main(int argc, char** argv)
+{
+  size_t target = (argc > 1 ? atoi (argv[1]) : 64) * 1024 * 1024;
+  char path[] = "/tmp/json-bench-XXXXXX";
+  int fd = mkstemp (path);
+  size_t size;
+
+  if (fd < 0) {
+    perror ("mkstemp()");
+    return EXIT_FAILURE;
+  }
+
+  size = generate (fd, target);
+  close (fd);
+  printf ("payload: %zu bytes\n", size);
+
+  run ("decode", path, size, MODE_DECODE);
+  run ("arena", path, size, MODE_ARENA);
+  run ("streaming", path, size, MODE_STREAMING);
+  run ("sax", path, size, MODE_SAX);
+
+  unlink (path);
+  bench_numbers (target / 4);
+  return 0;
+}
@@ -0,0 +1,645 @@
+#include "json.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class JsonParserTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonParserTest);
+  CPPUNIT_TEST (testMatchesDecode);
+  CPPUNIT_TEST (testInvalid);
+  CPPUNIT_TEST (testCallbacks);
+  CPPUNIT_TEST (testAbort);
+  CPPUNIT_TEST (testDepthLimit);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  // Parses @p doc fed @p chunk bytes at a time, and returns it re-encoded
+  std::string parse(const std::string& doc, size_t chunk, bool* ok) {
+    JsonParser* parser = json_parser_new_tree ();
+    std::string ret;
+
+    *ok = true;
+    for (size_t i = 0; i < doc.size() && *ok; i += chunk)
+      *ok = json_parser_feed (parser, doc.data() + i, std::min (chunk, doc.size() - i));
+    *ok = *ok && json_parser_finish (parser);
+
+    JsonNode* root = json_parser_take_root (parser);
+    CPPUNIT_ASSERT_EQUAL (*ok, root != NULL);
+    if (root) {
+      char* encoded = json_encode (root);
+      ret = encoded;
+      free (encoded);
+      json_delete (root);
+    }
+    json_parser_free (parser);
+    return ret;
+  }
+
+  static std::string decodeEncode(const std::string& doc) {
+    JsonNode* node = json_decode (doc.c_str());
+    CPPUNIT_ASSERT (node);
+    char* encoded = json_encode (node);
+    std::string ret (encoded);
+    free (encoded);
+    json_delete (node);
+    return ret;
+  }
+
+  struct Events {
+    std::string log;
+    int stopAfter;
+  };
+
+  static bool note(void* ctx, const std::string& what) {
+    Events* e = static_cast<Events*> (ctx);
+    e->log += what + " ";
+    return --e->stopAfter != 0;
+  }
+
+  static bool onNull(void* ctx) {return note (ctx, "null");}
+  static bool onBool(void* ctx, bool b) {return note (ctx, b ? "true" : "false");}
+  static bool onNumber(void* ctx, double n) {return note (ctx, std::to_string ((int)n));}
+  static bool onString(void* ctx, const char* s, size_t len) {return note (ctx, "s:" + std::string (s, len));}
+  static bool onStartArray(void* ctx) {return note (ctx, "[");}
+  static bool onEndArray(void* ctx) {return note (ctx, "]");}
+  static bool onStartObject(void* ctx) {return note (ctx, "{");}
+  static bool onKey(void* ctx, const char* s, size_t len) {return note (ctx, "k:" + std::string (s, len));}
+  static bool onEndObject(void* ctx) {return note (ctx, "}");}
+
+  static const JsonCallbacks callbacks;
+
+public:
+  void testMatchesDecode() {
+    const char* docs[] = {
+      "null", "true", " false ", "0", "-12.5e3", "123456789",
+      "\"\"", "\"plain\"", "\"esc\\\"aped\\\\ \\n\\t\\/\"",
+      "\"\\u00e9\\ud83d\\ude00 \xc3\xa9\"",
+      "[]", "{}", "[1,[2,[3,[]]],{}]",
+      "{\"a\":1,\"b\":[true,false,null],\"c\":{\"d\":\"e\"}}",
+      " { \"k\" : [ 1 , 2 ] } \n"
+    };
+
+    for (size_t i = 0; i < sizeof (docs) / sizeof (docs[0]); i++) {
+      std::string expected = decodeEncode (docs[i]);
+      for (size_t chunk = 1; chunk <= strlen (docs[i]); chunk++) {
+        bool ok;
+        CPPUNIT_ASSERT_EQUAL (expected, parse (docs[i], chunk, &ok));
+        CPPUNIT_ASSERT (ok);
+      }
+    }
+  }
+
+  void testInvalid() {
+    const char* docs[] = {
+      "", " ", "[", "]", "[1,]", "[1 2]", "{\"a\"}", "{\"a\":1,}", "{1:2}",
+      "tru", "nulll", "\"abc", "01", "1.", "-", "1 2", "[1]]", "[}",
+      "\"\\u0000\"", "\"\\x\"", "\"\\ud800\"", "\"\x01\"", "\"\xff\""
+    };
+
+    for (size_t i = 0; i < sizeof (docs) / sizeof (docs[0]); i++) {
+      for (size_t chunk = 1; chunk <= std::max ((size_t)1, strlen (docs[i])); chunk++) {
+        bool ok;
+        parse (docs[i], chunk, &ok);
+        CPPUNIT_ASSERT_MESSAGE (docs[i], !ok);
+      }
+    }
+  }
+
+  void testCallbacks() {
+    const std::string doc = "{\"a\":[1,\"x\",null],\"b\":{\"c\":true}}";
+
+    for (size_t chunk = 1; chunk <= doc.size(); chunk++) {
+      Events e = {"", -1};
+      JsonParser* parser = json_parser_new (&callbacks, &e);
+      for (size_t i = 0; i < doc.size(); i += chunk)
+        CPPUNIT_ASSERT (json_parser_feed (parser, doc.data() + i, std::min (chunk, doc.size() - i)));
+      CPPUNIT_ASSERT (json_parser_finish (parser));
+      CPPUNIT_ASSERT (!json_parser_take_root (parser));
+      json_parser_free (parser);
+
+      CPPUNIT_ASSERT_EQUAL (std::string ("{ k:a [ 1 s:x null ] k:b { k:c true } } "), e.log);
+    }
+  }
+
+  void testAbort() {
+    Events e = {"", 3};
+    JsonParser* parser = json_parser_new (&callbacks, &e);
+    CPPUNIT_ASSERT (!json_parser_feed (parser, "[1,2,3]", 7));
+    CPPUNIT_ASSERT (!json_parser_feed (parser, " ", 1));
+    CPPUNIT_ASSERT (!json_parser_finish (parser));
+    CPPUNIT_ASSERT_EQUAL (std::string ("[ 1 2 "), e.log);
+    json_parser_free (parser);
+  }
+
+  void testDepthLimit() {
+    std::string deep = std::string (JSON_PARSER_MAX_DEPTH, '[') + std::string (JSON_PARSER_MAX_DEPTH, ']');
+    bool ok;
+
+    parse (deep, 4096, &ok);
+    CPPUNIT_ASSERT (ok);
+    parse ("[" + deep + "]", 4096, &ok);
+    CPPUNIT_ASSERT (!ok);
+  }
+};
+
+const JsonCallbacks JsonParserTest::callbacks = {
+  onNull, onBool, onNumber, onString,
+  onStartArray, onEndArray, onStartObject, onKey, onEndObject
+};
+
+class JsonArenaTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonArenaTest);
+  CPPUNIT_TEST (testDecodeMatches);
+  CPPUNIT_TEST (testInvalid);
+  CPPUNIT_TEST (testLargeStrings);
+  CPPUNIT_TEST (testManipulation);
+  CPPUNIT_TEST (testStreaming);
+  CPPUNIT_TEST (testSharedKeys);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  static std::string encode(const JsonNode* node) {
+    char* encoded = json_encode (node);
+    std::string ret (encoded);
+    free (encoded);
+    return ret;
+  }
+
+public:
+  void testDecodeMatches() {
+    const char* docs[] = {
+      "null", "-12.5e3", "\"\"", "\"esc\\\"aped\\\\ \\n\\u00e9\\ud83d\\ude00\"",
+      "[1,[2,[3,[]]],{}]",
+      "{\"a\":1,\"b\":[true,false,null],\"c\":{\"d\":\"e\"}}"
+    };
+
+    for (size_t i = 0; i < sizeof (docs) / sizeof (docs[0]); i++) {
+      JsonArena* arena = json_arena_new ();
+      JsonNode* heap = json_decode (docs[i]);
+      JsonNode* node = json_decode_in (docs[i], arena);
+
+      CPPUNIT_ASSERT (node);
+      CPPUNIT_ASSERT (node->in_arena);
+      CPPUNIT_ASSERT_EQUAL (encode (heap), encode (node));
+      CPPUNIT_ASSERT (json_check (node, NULL));
+
+      json_delete (heap);
+      json_delete (node);
+      json_arena_free (arena);
+    }
+  }
+
+  void testInvalid() {
+    const char* docs[] = {"[1,\"abc", "{\"a\":\"\\x\"}", "{\"a\" 1}", "[\"\\ud800\"]"};
+    JsonArena* arena = json_arena_new ();
+
+    for (size_t i = 0; i < sizeof (docs) / sizeof (docs[0]); i++)
+      CPPUNIT_ASSERT (!json_decode_in (docs[i], arena));
+    json_arena_free (arena);
+  }
+
+  void testLargeStrings() {
+    // Bigger than any block, so each one needs a block of its own
+    std::string big (3 * 1024 * 1024, 'x');
+    std::string doc = "[\"" + big + "\",\"" + big + "\",\"short\"]";
+    JsonArena* arena = json_arena_new ();
+    JsonNode* node = json_decode_in (doc.c_str(), arena);
+
+    CPPUNIT_ASSERT (node);
+    CPPUNIT_ASSERT_EQUAL (big, std::string (json_find_element (node, 1)->string_));
+    CPPUNIT_ASSERT_EQUAL (std::string ("short"), std::string (json_find_element (node, 2)->string_));
+    json_arena_free (arena);
+  }
+
+  void testManipulation() {
+    JsonArena* arena = json_arena_new ();
+    JsonNode* obj = json_decode_in ("{\"a\":1,\"b\":[2,3]}", arena);
+
+    json_append_member (obj, "c", json_mkstring_in (arena, "four!", 4));
+    json_append_member_n (obj, "dd", 1, json_mkbool_in (arena, true));
+    json_prepend_member (obj, "z", json_mknull_in (arena));
+    json_delete (json_find_member (obj, "a"));
+    json_append_element (json_find_member (obj, "b"), json_mknumber_in (arena, 5));
+
+    CPPUNIT_ASSERT_EQUAL (std::string ("{\"z\":null,\"b\":[2,3,5],\"c\":\"four\",\"d\":true}"),
+                          encode (obj));
+    CPPUNIT_ASSERT (json_check (obj, NULL));
+
+    // An arena subtree can be moved into a heap tree and back out again
+    JsonNode* heap = json_mkobject ();
+    JsonNode* b = json_find_member (obj, "b");
+    json_remove_from_parent (b);
+    json_append_member (heap, "moved", b);
+    CPPUNIT_ASSERT_EQUAL (std::string ("{\"moved\":[2,3,5]}"), encode (heap));
+    json_remove_from_parent (b);
+    json_delete (heap);
+
+    json_delete (obj);
+    json_arena_free (arena);
+  }
+
+  void testStreaming() {
+    const std::string doc = "{\"a\":[1,\"x\\ny\",null],\"b\":{\"c\":true}}";
+
+    for (size_t chunk = 1; chunk <= doc.size(); chunk++) {
+      JsonArena* arena = json_arena_new ();
+      JsonParser* parser = json_parser_new_tree_in (arena);
+
+      for (size_t i = 0; i < doc.size(); i += chunk)
+        CPPUNIT_ASSERT (json_parser_feed (parser, doc.data() + i, std::min (chunk, doc.size() - i)));
+      CPPUNIT_ASSERT (json_parser_finish (parser));
+
+      JsonNode* root = json_parser_take_root (parser);
+      CPPUNIT_ASSERT (root->in_arena);
+      CPPUNIT_ASSERT_EQUAL (doc, encode (root));
+      json_parser_free (parser);
+      json_arena_free (arena);
+    }
+
+    // A parse abandoned halfway leaves nothing behind but the arena
+    JsonArena* arena = json_arena_new ();
+    JsonParser* parser = json_parser_new_tree_in (arena);
+    CPPUNIT_ASSERT (json_parser_feed (parser, "{\"k\":[\"abc", 10));
+    json_parser_free (parser);
+    json_arena_free (arena);
+  }
+
+  // The objects of an arena share one copy of each key
+  void testSharedKeys() {
+    const char doc[] = "[{\"name\":1,\"x\\u0079\":2},{\"name\":3,\"xy\":4}]";
+    JsonArena* arena = json_arena_new ();
+    JsonParser* parser = json_parser_new_tree_in (arena);
+    JsonNode* trees[2];
+
+    trees[0] = json_decode_in (doc, arena);
+    CPPUNIT_ASSERT (json_parser_feed (parser, doc, sizeof (doc) - 1));
+    CPPUNIT_ASSERT (json_parser_finish (parser));
+    trees[1] = json_parser_take_root (parser);
+    json_parser_free (parser);
+
+    for (JsonNode* tree : trees) {
+      JsonNode* first = json_find_element (tree, 0);
+      JsonNode* second = json_find_element (tree, 1);
+      CPPUNIT_ASSERT_EQUAL (json_find_member (first, "name")->key, json_find_member (second, "name")->key);
+      CPPUNIT_ASSERT_EQUAL (json_find_member (first, "xy")->key, json_find_member (second, "xy")->key);
+      CPPUNIT_ASSERT_EQUAL (4.0, json_find_member (second, "xy")->number_);
+    }
+
+    JsonNode* obj = json_mkobject_in (arena);
+    json_append_member (obj, "name", json_mknull_in (arena));
+    json_append_member (obj, "nam", json_mknull_in (arena));
+    CPPUNIT_ASSERT_EQUAL (json_find_member (json_find_element (trees[0], 0), "name")->key,
+                          json_find_member (obj, "name")->key);
+    CPPUNIT_ASSERT_EQUAL (std::string ("nam"), std::string (json_find_member (obj, "nam")->key));
+    CPPUNIT_ASSERT_EQUAL (std::string ("[{\"name\":1,\"xy\":2},{\"name\":3,\"xy\":4}]"), encode (trees[1]));
+    json_arena_free (arena);
+  }
+};
+
+class JsonIndexTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonIndexTest);
+  CPPUNIT_TEST (testLookup);
+  CPPUNIT_TEST (testDuplicates);
+  CPPUNIT_TEST (testRandomEdits);
+  CPPUNIT_TEST (testArena);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  // What json_find_member() returned before objects were indexed
+  static JsonNode* linearFind(JsonNode* object, const char* key) {
+    JsonNode* member;
+    json_foreach (member, object)
+      if (strcmp (member->key, key) == 0)
+        return member;
+    return NULL;
+  }
+
+  static std::string key(int i) {
+    return "key" + std::to_string (i);
+  }
+
+public:
+  void testLookup() {
+    JsonNode* obj = json_mkobject ();
+    for (int i = 0; i < 200; i++)
+      json_append_member (obj, key (i).c_str(), json_mknumber (i));
+
+    CPPUNIT_ASSERT (!obj->children.index);
+    CPPUNIT_ASSERT (!json_find_member (obj, "missing"));
+    CPPUNIT_ASSERT (obj->children.index);
+
+    for (int i = 0; i < 200; i++)
+      CPPUNIT_ASSERT_EQUAL ((double)i, json_find_member (obj, key (i).c_str())->number_);
+    CPPUNIT_ASSERT (json_check (obj, NULL));
+
+    // Iteration order is untouched
+    int i = 0;
+    JsonNode* member;
+    json_foreach (member, obj)
+      CPPUNIT_ASSERT_EQUAL (key (i++), std::string (member->key));
+    json_delete (obj);
+
+    // Small objects are not indexed
+    obj = json_decode ("{\"a\":1,\"b\":2}");
+    CPPUNIT_ASSERT (!json_find_member (obj, "c"));
+    CPPUNIT_ASSERT (!obj->children.index);
+    json_delete (obj);
+  }
+
+  void testDuplicates() {
+    JsonNode* obj = json_mkobject ();
+    for (int i = 0; i < 40; i++)
+      json_append_member (obj, key (i % 20).c_str(), json_mknumber (i));
+    json_find_member (obj, "missing");
+    CPPUNIT_ASSERT (obj->children.index);
+
+    // The first member with a key is the one found
+    CPPUNIT_ASSERT_EQUAL (5.0, json_find_member (obj, "key5")->number_);
+    json_delete (json_find_member (obj, "key5"));
+    CPPUNIT_ASSERT_EQUAL (25.0, json_find_member (obj, "key5")->number_);
+    json_delete (json_find_member (obj, "key5"));
+    CPPUNIT_ASSERT (!json_find_member (obj, "key5"));
+
+    json_prepend_member (obj, "key6", json_mknumber (-6));
+    CPPUNIT_ASSERT_EQUAL (-6.0, json_find_member (obj, "key6")->number_);
+    json_append_member (obj, "key7", json_mknumber (-7));
+    CPPUNIT_ASSERT_EQUAL (7.0, json_find_member (obj, "key7")->number_);
+    CPPUNIT_ASSERT (json_check (obj, NULL));
+    json_delete (obj);
+  }
+
+  void testRandomEdits() {
+    JsonNode* obj = json_mkobject ();
+    srand (47);
+
+    for (int i = 0; i < 20000; i++) {
+      std::string k = key (rand () % 300);
+      JsonNode* found = json_find_member (obj, k.c_str());
+
+      CPPUNIT_ASSERT_EQUAL (linearFind (obj, k.c_str()), found);
+      switch (rand () % 4) {
+        case 0:
+          json_delete (found);
+          break;
+        case 1:
+          json_prepend_member (obj, k.c_str(), json_mknumber (i));
+          break;
+        default:
+          json_append_member (obj, k.c_str(), json_mknumber (i));
+      }
+    }
+
+    CPPUNIT_ASSERT (json_check (obj, NULL));
+    json_delete (obj);
+  }
+
+  void testArena() {
+    // Only objects pay for the arena and index pointers
+    CPPUNIT_ASSERT (sizeof (JsonNode) <= 8 * sizeof (void*));
+
+    JsonArena* arena = json_arena_new ();
+    std::string doc = "{";
+    for (int i = 0; i < 500; i++)
+      doc += (i ? ",\"" : "\"") + key (i) + "\":" + std::to_string (i);
+    doc += "}";
+
+    JsonNode* obj = json_decode_in (doc.c_str(), arena);
+    for (int i = 499; i >= 0; i -= 7)
+      CPPUNIT_ASSERT_EQUAL ((double)i, json_find_member (obj, key (i).c_str())->number_);
+    CPPUNIT_ASSERT (obj->children.index);
+
+    json_delete (json_find_member (obj, "key10"));
+    for (int i = 0; i < 1000; i++)
+      json_append_member (obj, key (1000 + i).c_str(), json_mknull_in (arena));
+    CPPUNIT_ASSERT (!json_find_member (obj, "key10"));
+    CPPUNIT_ASSERT_EQUAL (JSON_NULL, json_find_member (obj, "key1999")->tag);
+    CPPUNIT_ASSERT (json_check (obj, NULL));
+    json_arena_free (arena);
+  }
+};
+
+class JsonStringTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonStringTest);
+  CPPUNIT_TEST (testRunBoundaries);
+  CPPUNIT_TEST (testInvalidInRuns);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  static std::string quote(const std::string& raw) {
+    std::string ret = "\"";
+    for (size_t i = 0; i < raw.size(); i++) {
+      if (raw[i] == '"' || raw[i] == '\\')
+        ret += '\\';
+      if (raw[i] == '\n')
+        ret += "\\n";
+      else
+        ret += raw[i];
+    }
+    return ret + "\"";
+  }
+
+public:
+  // Special characters at every position of every run length, at every
+  // alignment, so that runs end in every lane of a vector
+  void testRunBoundaries() {
+    const char* specials[] = {"\"", "\\", "\n", "\xc3\xa9", "\x7f"};
+
+    for (size_t k = 0; k < sizeof (specials) / sizeof (specials[0]); k++) {
+      for (size_t len = 0; len < 70; len++) {
+        for (size_t pos = 0; pos <= len; pos++) {
+          std::string raw = std::string (pos, 'a') + specials[k] + std::string (len - pos, 'b');
+          std::string literal = quote (raw);
+          size_t pad = (len * 7 + pos) % 64;
+          std::string doc = std::string (pad, ' ') + "[" + literal + "]" + std::string (pad, '\n');
+
+          JsonNode* node = json_decode (doc.c_str());
+          CPPUNIT_ASSERT_MESSAGE (doc, node);
+          CPPUNIT_ASSERT_EQUAL (raw, std::string (json_first_child (node)->string_));
+
+          char* encoded = json_encode (node);
+          CPPUNIT_ASSERT_EQUAL ("[" + literal + "]", std::string (encoded));
+          free (encoded);
+          json_delete (node);
+
+          // Through the streaming scanner, split in two at the special character
+          JsonParser* parser = json_parser_new_tree ();
+          size_t split = pad + 2 + pos;
+          CPPUNIT_ASSERT (json_parser_feed (parser, doc.data(), split));
+          CPPUNIT_ASSERT (json_parser_feed (parser, doc.data() + split, doc.size() - split));
+          CPPUNIT_ASSERT (json_parser_finish (parser));
+          node = json_parser_take_root (parser);
+          CPPUNIT_ASSERT_EQUAL (raw, std::string (json_first_child (node)->string_));
+          json_delete (node);
+          json_parser_free (parser);
+        }
+      }
+    }
+  }
+
+  void testInvalidInRuns() {
+    const char* bad[] = {"\x01", "\x1f", "\xff", "\xc3", "\xed\xa0\x80"};
+
+    for (size_t k = 0; k < sizeof (bad) / sizeof (bad[0]); k++) {
+      for (size_t pos = 0; pos < 70; pos++) {
+        std::string doc = "\"" + std::string (pos, 'a') + bad[k] + std::string (40, 'b') + "\"";
+        CPPUNIT_ASSERT (!json_decode (doc.c_str()));
+        CPPUNIT_ASSERT (!json_validate (doc.c_str()));
+      }
+    }
+  }
+};
+
+class JsonEncodeTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonEncodeTest);
+  CPPUNIT_TEST (testEncodeN);
+  CPPUNIT_TEST (testAppend);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testEncodeN() {
+    JsonNode* node = json_decode ("{\"a\":[1,2,\"three\"],\"b\":null}");
+    char* expected = json_encode (node);
+
+    for (size_t hint = 0; hint < 100; hint += 7) {
+      size_t len = 0;
+      char* encoded = json_encode_n (node, hint, &len);
+      CPPUNIT_ASSERT_EQUAL (std::string (expected), std::string (encoded));
+      CPPUNIT_ASSERT_EQUAL (strlen (expected), len);
+      free (encoded);
+    }
+
+    free (expected);
+    json_delete (node);
+  }
+
+  void testAppend() {
+    JsonNode* node = json_decode ("[\"x\",{\"y\":true}]");
+    const std::string encoded = "[\"x\",{\"y\":true}]";
+    char* buf = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+
+    // Grows from nothing, keeping what was written before
+    for (int i = 0; i < 100; i++) {
+      size_t prev = len;
+      len = json_encode_append (node, &buf, &cap, len);
+      CPPUNIT_ASSERT_EQUAL (prev + encoded.size(), len);
+      CPPUNIT_ASSERT (cap > len);
+      CPPUNIT_ASSERT_EQUAL ('\0', buf[len]);
+      CPPUNIT_ASSERT_EQUAL (encoded, std::string (buf + prev, len - prev));
+    }
+    CPPUNIT_ASSERT_EQUAL (encoded, std::string (buf, encoded.size()));
+
+    // A buffer with room to spare is used as is
+    char* big = static_cast<char*> (malloc (1024));
+    char* orig = big;
+    cap = 1024;
+    memcpy (big, "HEADER", 6);
+    len = json_encode_append (node, &big, &cap, 6);
+    CPPUNIT_ASSERT (big == orig);
+    CPPUNIT_ASSERT_EQUAL ("HEADER" + encoded, std::string (big));
+
+    free (big);
+    free (buf);
+    json_delete (node);
+  }
+};
+
+class JsonNumberTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (JsonNumberTest);
+  CPPUNIT_TEST (testFormat);
+  CPPUNIT_TEST (testParse);
+  CPPUNIT_TEST (testRoundTrip);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  static std::string format(double n) {
+    JsonNode* node = json_mknumber (n);
+    char* encoded = json_encode (node);
+    std::string ret (encoded);
+    free (encoded);
+    json_delete (node);
+    return ret;
+  }
+
+  static double parse(const char* text) {
+    JsonNode* node = json_decode (text);
+    CPPUNIT_ASSERT_MESSAGE (text, node && node->tag == JSON_NUMBER);
+    double ret = node->number_;
+    json_delete (node);
+    return ret;
+  }
+
+  static bool sameBits(double a, double b) {
+    return memcmp (&a, &b, sizeof (a)) == 0;
+  }
+
+public:
+  void testFormat() {
+    const struct {
+      double value;
+      const char* text;
+    } cases[] = {
+      {0, "0"}, {-0.0, "-0"}, {3, "3"}, {-42, "-42"}, {65536, "65536"},
+      {9007199254740992.0, "9007199254740992"}, {1e21, "1e+21"}, {1.5e300, "1.5e+300"},
+      {123456789012345680000.0, "123456789012345680000"},
+      {0.1, "0.1"}, {0.1 + 0.2, "0.30000000000000004"}, {-2.5, "-2.5"},
+      {1e-6, "0.000001"}, {1.5e-7, "1.5e-7"}, {5e-324, "5e-324"},
+      {1.7976931348623157e308, "1.7976931348623157e+308"},
+      {2.2250738585072014e-308, "2.2250738585072014e-308"},
+      {1.0 / 3, "0.3333333333333333"}, {2.0 / 3, "0.6666666666666666"}
+    };
+
+    for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++)
+      CPPUNIT_ASSERT_EQUAL (std::string (cases[i].text), format (cases[i].value));
+
+    double zero = 0;
+    CPPUNIT_ASSERT_EQUAL (std::string ("null"), format (1 / zero));
+    CPPUNIT_ASSERT_EQUAL (std::string ("null"), format (zero / zero));
+  }
+
+  void testParse() {
+    CPPUNIT_ASSERT (sameBits (-0.0, parse ("-0")));
+    CPPUNIT_ASSERT (sameBits (0.0, parse ("0e999")));
+    CPPUNIT_ASSERT_EQUAL (0.1, parse ("0.1"));
+    CPPUNIT_ASSERT_EQUAL (0.1, parse ("1e-1"));
+    CPPUNIT_ASSERT_EQUAL (1e23, parse ("1e23"));
+    CPPUNIT_ASSERT_EQUAL (1e23, parse ("100000000000000000000000"));
+    CPPUNIT_ASSERT_EQUAL (123.456, parse ("0.000123456e6"));
+    CPPUNIT_ASSERT_EQUAL (9007199254740992.0, parse ("9007199254740993"));
+    CPPUNIT_ASSERT_EQUAL (1.7976931348623157e308, parse ("1.7976931348623157e308"));
+    CPPUNIT_ASSERT_EQUAL (5e-324, parse ("4.9406564584124654e-324"));
+    CPPUNIT_ASSERT_EQUAL (0.30000000000000004, parse ("0.30000000000000004"));
+    CPPUNIT_ASSERT_EQUAL (12345678901234567890.0, parse ("12345678901234567890"));
+    CPPUNIT_ASSERT_EQUAL (-1e-30, parse ("-0.000000000000000000000000000001"));
+  }
+
+  void testRoundTrip() {
+    uint64_t state = 88172645463325252ull;
+
+    for (int i = 0; i < 200000; i++) {
+      double value;
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      memcpy (&value, &state, sizeof (value));
+      if (value != value || value - value != 0)
+        continue;
+
+      std::string text = format (value);
+      CPPUNIT_ASSERT_MESSAGE (text, sameBits (value, parse (text.c_str())));
+      CPPUNIT_ASSERT_MESSAGE (text, sameBits (value, strtod (text.c_str(), NULL)));
+    }
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonParserTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonNumberTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonEncodeTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonStringTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonArenaTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (JsonIndexTest);
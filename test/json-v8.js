@@ -0,0 +1,36 @@
+var assert = require('assert');
+// Test hooks are only built into this copy of the addon
+var nativeModule = require('bindings')('node-codius-sandbox-test.node');
+
+// Converts a value to a JsonNode tree and back, as IPC results and requests are
+var roundTrip = nativeModule._jsonRoundTrip;
+
+function nested(depth) {
+  var value = 0;
+  for (var i = 0; i < depth; i++)
+    value = [value];
+  return value;
+}
+
+// toJSON() is honoured, at the top level and for members
+assert.strictEqual (roundTrip (new Date (0)), '1970-01-01T00:00:00.000Z');
+assert.deepEqual (roundTrip ({a: {toJSON: function () { return 42; }}}), {a: 42});
+assert.throws (function () {
+  roundTrip ({toJSON: function () { throw new Error ('nope'); }});
+});
+
+// Holes, undefined and functions become null in arrays and are dropped from
+// objects
+assert.deepEqual (roundTrip ([1, , undefined, function () {}]), [1, null, null, null]);
+assert.deepEqual (roundTrip ({a: undefined, b: function () {}, c: 1}), {c: 1});
+assert.strictEqual (roundTrip (undefined), undefined);
+
+// Non-finite numbers become null
+assert.deepEqual (roundTrip ([NaN, Infinity, -Infinity, 1.5]), [null, null, null, 1.5]);
+
+// Nesting is limited to 512 levels, which also stops cycles
+assert.deepEqual (roundTrip (nested (512)), nested (512));
+assert.throws (function () { roundTrip (nested (513)); }, TypeError);
+var cycle = {};
+cycle.self = cycle;
+assert.throws (function () { roundTrip (cycle); }, TypeError);
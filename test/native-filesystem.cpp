@@ -0,0 +1,166 @@
+#include "native-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Exposes the lookup that kernels without openat2() use
+ */
+class WalkingFilesystem : public NativeFilesystem {
+public:
+  WalkingFilesystem(const std::string& root) : NativeFilesystem (root) {}
+
+  int walk(const char* path, int flags) {
+    int fd = openWalk (m_rootFD, path, flags, 0644);
+    if (fd >= 0)
+      ::close (fd);
+    return fd < 0 ? fd : 0;
+  }
+};
+
+class NativeFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (NativeFilesystemTest);
+  CPPUNIT_TEST (testOpen);
+  CPPUNIT_TEST (testStat);
+  CPPUNIT_TEST (testEscape);
+  CPPUNIT_TEST (testSymlinkWithinRoot);
+  CPPUNIT_TEST (testModify);
+  CPPUNIT_TEST (testWalk);
+  CPPUNIT_TEST (testAliasedDirectory);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::string root;
+  std::string outside;
+
+  void writeFile(const std::string& path, const std::string& contents) {
+    FILE* fh = fopen (path.c_str(), "w");
+    fwrite (contents.data(), 1, contents.size(), fh);
+    fclose (fh);
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-native-XXXXXX";
+    outside = mkdtemp (tmpl);
+    root = outside + "/root";
+    mkdir (root.c_str(), 0755);
+    mkdir ((root + "/a").c_str(), 0755);
+    mkdir ((root + "/a/b").c_str(), 0755);
+    writeFile (root + "/a/b/file.js", "inside");
+    writeFile (outside + "/secret", "outside");
+    symlink ("/etc", (root + "/absolute").c_str());
+    symlink ("../../secret", (root + "/a/up").c_str());
+    symlink ("../a/b/file.js", (root + "/a/link.js").c_str());
+    symlink ("b", (root + "/a/alias").c_str());
+    symlink ("loop", (root + "/a/loop").c_str());
+  }
+
+  void tearDown() {
+    std::string cmd = "rm -rf " + outside;
+    CPPUNIT_ASSERT_EQUAL (0, system (cmd.c_str()));
+  }
+
+  void testOpen() {
+    NativeFilesystem fs (root);
+    char buf[16];
+    int fd = fs.open ("/a/b/file.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)6, fs.read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "inside", 6));
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.open ("/a/b/missing.js", O_RDONLY, 0));
+  }
+
+  void testStat() {
+    NativeFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/a/b/file.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)6, sbuf.st_size);
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/", &sbuf));
+    CPPUNIT_ASSERT (S_ISDIR (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (0, fs.lstat ("/absolute", &sbuf));
+    CPPUNIT_ASSERT (S_ISLNK (sbuf.st_mode));
+    CPPUNIT_ASSERT_EQUAL (0, fs.access ("/a/b/file.js", R_OK));
+
+    char buf[64];
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)4, fs.readlink ("/absolute", buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "/etc", 4));
+  }
+
+  void testEscape() {
+    NativeFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT (fs.open ("/absolute/passwd", O_RDONLY, 0) < 0);
+    CPPUNIT_ASSERT (fs.open ("/a/up", O_RDONLY, 0) < 0);
+    CPPUNIT_ASSERT (fs.stat ("/a/up", &sbuf) < 0);
+    CPPUNIT_ASSERT (fs.access ("/absolute/passwd", F_OK) < 0);
+    CPPUNIT_ASSERT (fs.stat ("/../secret", &sbuf) < 0);
+  }
+
+  void testSymlinkWithinRoot() {
+    NativeFilesystem fs (root);
+    char buf[16];
+    int fd = fs.open ("/a/link.js", O_RDONLY, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)6, fs.read (fd, buf, sizeof (buf)));
+    fs.close (fd);
+  }
+
+  void testModify() {
+    NativeFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/a/b/c", 0755));
+    int fd = fs.open ("/a/b/c/new.js", O_WRONLY | O_CREAT, 0644);
+    CPPUNIT_ASSERT (fd >= 0);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/a/b/c/new.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL (-ENOTEMPTY, fs.rmdir ("/a/b/c"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/a/b/c/new.js"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.rmdir ("/a/b/c"));
+
+    // The cached descriptor for the removed directory must not be reused
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/a/b/c", 0755));
+    fd = fs.open ("/a/b/c/again.js", O_WRONLY | O_CREAT, 0644);
+    CPPUNIT_ASSERT (fd >= 0);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (0, access ((root + "/a/b/c/again.js").c_str(), F_OK));
+  }
+
+  void testWalk() {
+    WalkingFilesystem fs (root);
+    CPPUNIT_ASSERT_EQUAL (0, fs.walk ("a/b/file.js", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (0, fs.walk ("a/link.js", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (0, fs.walk ("a/alias/../b/file.js", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (0, fs.walk (".", O_RDONLY | O_DIRECTORY));
+    CPPUNIT_ASSERT_EQUAL (-EXDEV, fs.walk ("a/up", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (-EXDEV, fs.walk ("absolute/passwd", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (-EXDEV, fs.walk ("../secret", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (-ELOOP, fs.walk ("a/loop", O_RDONLY));
+    CPPUNIT_ASSERT_EQUAL (-ELOOP, fs.walk ("a/link.js", O_RDONLY | O_NOFOLLOW));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, fs.walk ("a/b/file.js/x", O_RDONLY));
+  }
+
+  void testAliasedDirectory() {
+    NativeFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.stat ("/a/alias/file.js", &sbuf));
+
+    // Replacing the directory behind the alias must not leave the alias cached
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/a/b/file.js"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.rmdir ("/a/b"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/a/b", 0755));
+    int fd = fs.open ("/a/alias/new.js", O_WRONLY | O_CREAT, 0644);
+    CPPUNIT_ASSERT (fd >= 0);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (0, access ((root + "/a/b/new.js").c_str(), F_OK));
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (NativeFilesystemTest);
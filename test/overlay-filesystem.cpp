@@ -0,0 +1,220 @@
+#include "overlay-filesystem.h"
+#include "image-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+class OverlayFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (OverlayFilesystemTest);
+  CPPUNIT_TEST (testReadThrough);
+  CPPUNIT_TEST (testCopyUp);
+  CPPUNIT_TEST (testCreate);
+  CPPUNIT_TEST (testWhiteout);
+  CPPUNIT_TEST (testOpaqueDirectory);
+  CPPUNIT_TEST (testCopyOnWrite);
+  CPPUNIT_TEST (testTruncate);
+  CPPUNIT_TEST (testQuota);
+  CPPUNIT_TEST (testSeekOverflow);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  static const size_t quota = 64;
+
+  std::string root;
+  std::string imagePath;
+  std::shared_ptr<Filesystem> lower;
+
+  void writeFile(const std::string& path, const std::string& contents) {
+    FILE* fh = fopen ((root + path).c_str(), "w");
+    fwrite (contents.data(), 1, contents.size(), fh);
+    fclose (fh);
+  }
+
+  std::string readFile(Filesystem& fs, const char* path) {
+    char buf[256];
+    int fd = fs.open (path, O_RDONLY, 0);
+    if (fd < 0)
+      return std::string();
+    ssize_t len = fs.read (fd, buf, sizeof (buf));
+    fs.close (fd);
+    return std::string (buf, std::max (len, (ssize_t)0));
+  }
+
+  std::vector<std::string> listDirectory(Filesystem& fs, const char* path) {
+    char buf[4096];
+    std::vector<std::string> names;
+    int fd = fs.open (path, O_RDONLY | O_DIRECTORY, 0);
+    int len = fs.getdents64 (fd, (struct linux_dirent64*)buf, sizeof (buf));
+    for (int pos = 0; pos < len;) {
+      linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf + pos);
+      names.push_back (ent->d_name);
+      pos += ent->d_reclen;
+    }
+    fs.close (fd);
+    return names;
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-overlay-XXXXXX";
+    root = mkdtemp (tmpl);
+    mkdir ((root + "/lib").c_str(), 0755);
+    writeFile ("/index.js", "lower");
+    writeFile ("/lib/a.js", "a");
+    writeFile ("/lib/b.js", "b");
+
+    imagePath = root + ".img";
+    CPPUNIT_ASSERT (FilesystemImage::pack (root, imagePath));
+    lower = std::shared_ptr<Filesystem> (new ImageFilesystem (FilesystemImage::open (imagePath)));
+  }
+
+  void tearDown() {
+    lower.reset();
+    std::string cmd = "rm -rf " + root + " " + imagePath;
+    CPPUNIT_ASSERT_EQUAL (0, system (cmd.c_str()));
+  }
+
+  void testReadThrough() {
+    OverlayFilesystem fs (lower, quota);
+    CPPUNIT_ASSERT_EQUAL (std::string ("lower"), readFile (fs, "/index.js"));
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.upperSize());
+    CPPUNIT_ASSERT_EQUAL (0, fs.access ("/index.js", W_OK));
+  }
+
+  void testCopyUp() {
+    OverlayFilesystem first (lower, quota);
+    OverlayFilesystem second (lower, quota);
+    int fd = first.open ("/index.js", O_WRONLY | O_APPEND, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)6, first.write (fd, (void*)" upper", 6));
+    first.close (fd);
+
+    CPPUNIT_ASSERT_EQUAL (std::string ("lower upper"), readFile (first, "/index.js"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("lower"), readFile (second, "/index.js"));
+    CPPUNIT_ASSERT_EQUAL (std::string ("lower"), readFile (*lower, "/index.js"));
+
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, first.stat ("/index.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)11, sbuf.st_size);
+  }
+
+  void testCreate() {
+    OverlayFilesystem fs (lower, quota);
+    int fd = fs.open ("/lib/c.js", O_WRONLY | O_CREAT | O_EXCL, 0644);
+    CPPUNIT_ASSERT (fd >= 0);
+    fs.write (fd, (void*)"c", 1);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (-EEXIST, fs.open ("/lib/c.js", O_WRONLY | O_CREAT | O_EXCL, 0644));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.open ("/missing/c.js", O_WRONLY | O_CREAT, 0644));
+    CPPUNIT_ASSERT_EQUAL (std::string ("c"), readFile (fs, "/lib/c.js"));
+
+    std::vector<std::string> names = listDirectory (fs, "/lib");
+    CPPUNIT_ASSERT_EQUAL ((size_t)3, names.size());
+    CPPUNIT_ASSERT_EQUAL (std::string ("c.js"), names[2]);
+  }
+
+  void testSeekOverflow() {
+    OverlayFilesystem fs (lower, quota);
+    const off_t max = std::numeric_limits<off_t>::max();
+    int fd = fs.open ("/lib/c.js", O_RDWR | O_CREAT, 0644);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)3, fs.write (fd, (void*)"abc", 3));
+    CPPUNIT_ASSERT_EQUAL (max, fs.lseek (fd, max, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs.lseek (fd, 1, SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs.lseek (fd, max, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, std::numeric_limits<off_t>::min(), SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, -4, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL ((off_t)1, fs.lseek (fd, -2, SEEK_END));
+    CPPUNIT_ASSERT_EQUAL (0, fs.close (fd));
+  }
+
+  void testWhiteout() {
+    OverlayFilesystem fs (lower, quota);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/lib/a.js"));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.stat ("/lib/a.js", &sbuf));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.unlink ("/lib/a.js"));
+    CPPUNIT_ASSERT_EQUAL (-EISDIR, fs.unlink ("/lib"));
+    CPPUNIT_ASSERT_EQUAL (-ENOTEMPTY, fs.rmdir ("/lib"));
+
+    std::vector<std::string> names = listDirectory (fs, "/lib");
+    CPPUNIT_ASSERT_EQUAL ((size_t)1, names.size());
+    CPPUNIT_ASSERT_EQUAL (std::string ("b.js"), names[0]);
+
+    int fd = fs.open ("/lib/a.js", O_WRONLY | O_CREAT, 0644);
+    fs.write (fd, (void*)"new", 3);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (std::string ("new"), readFile (fs, "/lib/a.js"));
+  }
+
+  void testOpaqueDirectory() {
+    OverlayFilesystem fs (lower, quota);
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/lib/a.js"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/lib/b.js"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.rmdir ("/lib"));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.open ("/lib/b.js", O_RDONLY, 0));
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/lib", 0755));
+    CPPUNIT_ASSERT_EQUAL (-EEXIST, fs.mkdir ("/lib", 0755));
+    CPPUNIT_ASSERT (listDirectory (fs, "/lib").empty());
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.open ("/lib/b.js", O_RDONLY, 0));
+  }
+
+  void testCopyOnWrite() {
+    OverlayFilesystem fs (lower, quota);
+    int fd = fs.open ("/index.js", O_RDWR, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    char buf[8];
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)3, fs.read (fd, buf, 3));
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.upperSize());
+
+    // The copy keeps the offset the lower file had reached
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)2, fs.write (fd, (void*)"ER", 2));
+    CPPUNIT_ASSERT_EQUAL ((size_t)5, fs.upperSize());
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (std::string ("lowER"), readFile (fs, "/index.js"));
+
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/index.js"));
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.upperSize());
+  }
+
+  void testTruncate() {
+    OverlayFilesystem fs (lower, quota);
+    int fd = fs.open ("/index.js", O_WRONLY | O_TRUNC, 0);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.upperSize());
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.fstat (fd, &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)0, sbuf.st_size);
+    fs.write (fd, (void*)"new", 3);
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL (std::string ("new"), readFile (fs, "/index.js"));
+  }
+
+  void testQuota() {
+    OverlayFilesystem fs (lower, quota);
+    char buf[quota];
+    memset (buf, 'x', sizeof (buf));
+    int fd = fs.open ("/big", O_WRONLY | O_CREAT, 0644);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)quota, fs.write (fd, buf, quota));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-ENOSPC, fs.write (fd, buf, 1));
+
+    // Copying a lower file up counts against the quota as well
+    int lowerFD = fs.open ("/lib/a.js", O_WRONLY | O_APPEND, 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-ENOSPC, fs.write (lowerFD, buf, 1));
+    fs.close (lowerFD);
+
+    // A deleted file keeps its space until it is closed
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/big"));
+    CPPUNIT_ASSERT_EQUAL ((size_t)quota, fs.upperSize());
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.upperSize());
+    CPPUNIT_ASSERT_EQUAL (std::string ("a"), readFile (fs, "/lib/a.js"));
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (OverlayFilesystemTest);
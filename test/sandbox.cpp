@@ -1,5 +1,7 @@
 #include "sandbox.h"
 #include "sandbox-ipc.h"
+#include "vfs.h"
+#include "tmp-filesystem.h"
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <string.h>
@@ -83,6 +85,7 @@ class SandboxTest : public CppUnit::TestFixture {
   CPPUNIT_TEST_SUITE (SandboxTest);
   CPPUNIT_TEST (testSimpleProgram);
   CPPUNIT_TEST (testExitStatus);
+  CPPUNIT_TEST (testMountpoint);
   CPPUNIT_TEST_SUITE_END ();
 
 private:
@@ -138,6 +141,20 @@ public:
       CPPUNIT_ASSERT_EQUAL (EFAULT, sbox->exitStatus);
     }
 
+    void testMountpoint()
+    {
+      std::shared_ptr<Filesystem> tmp (new TmpFilesystem (4096));
+      sbox->getVFS().mountFilesystem ("/tmp/", tmp);
+
+      auto fs = sbox->getVFS().getFilesystem ("/tmp/a");
+      CPPUNIT_ASSERT (fs.second == tmp);
+      CPPUNIT_ASSERT_EQUAL (std::string ("/a"), fs.first);
+      fs = sbox->getVFS().getFilesystem ("/tmp");
+      CPPUNIT_ASSERT (fs.second == tmp);
+      CPPUNIT_ASSERT_EQUAL (std::string ("/"), fs.first);
+      CPPUNIT_ASSERT (!sbox->getVFS().getFilesystem ("/tmpfs").second);
+    }
+
     void testInterceptSyscall()
     {
       _run (SYS_accept);
@@ -0,0 +1,170 @@
+#include "tmp-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <string.h>
+#include <sys/stat.h>
+
+class TmpFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (TmpFilesystemTest);
+  CPPUNIT_TEST (testReadWrite);
+  CPPUNIT_TEST (testHoles);
+  CPPUNIT_TEST (testDirectories);
+  CPPUNIT_TEST (testUnlinkWhileOpen);
+  CPPUNIT_TEST (testQuota);
+  CPPUNIT_TEST (testReuse);
+  CPPUNIT_TEST (testSeekOverflow);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testReadWrite() {
+    TmpFilesystem fs (1 << 20);
+    std::string data (10000, 'x');
+    data[5000] = 'y';
+    int fd = fs.open ("/scratch", O_RDWR | O_CREAT, 0600);
+    CPPUNIT_ASSERT (fd >= 0);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)data.size(), fs.write (fd, (void*)data.data(), data.size()));
+    CPPUNIT_ASSERT_EQUAL ((off_t)0, fs.lseek (fd, 0, SEEK_SET));
+
+    std::vector<char> buf (20000);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)data.size(), fs.read (fd, buf.data(), buf.size()));
+    CPPUNIT_ASSERT_EQUAL (data, std::string (buf.data(), data.size()));
+
+    // In-place reads stop at the end of a chunk
+    const void* ptr;
+    fs.lseek (fd, 4000, SEEK_SET);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)96, fs.readInPlace (fd, 1000, &ptr));
+    fs.close (fd);
+
+    fd = fs.open ("/scratch", O_WRONLY | O_TRUNC, 0);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL (0, fs.fstat (fd, &sbuf));
+    CPPUNIT_ASSERT_EQUAL ((off_t)0, sbuf.st_size);
+    CPPUNIT_ASSERT_EQUAL (-EBADF, (int)fs.read (fd, buf.data(), 1));
+    fs.close (fd);
+  }
+
+  void testHoles() {
+    TmpFilesystem fs (1 << 20);
+    char buf[16];
+    int fd = fs.open ("/sparse", O_RDWR | O_CREAT, 0600);
+    fs.lseek (fd, 3 * TmpFilesystem::chunkSize, SEEK_SET);
+    fs.write (fd, (void*)"end", 3);
+
+    struct stat sbuf;
+    fs.fstat (fd, &sbuf);
+    CPPUNIT_ASSERT_EQUAL ((off_t)(3 * TmpFilesystem::chunkSize + 3), sbuf.st_size);
+    CPPUNIT_ASSERT_EQUAL ((blkcnt_t)(TmpFilesystem::chunkSize / 512), sbuf.st_blocks);
+
+    fs.lseek (fd, 100, SEEK_SET);
+    memset (buf, 1, sizeof (buf));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)sizeof (buf), fs.read (fd, buf, sizeof (buf)));
+    for (size_t i = 0; i < sizeof (buf); i++)
+      CPPUNIT_ASSERT_EQUAL (0, (int)buf[i]);
+    fs.close (fd);
+  }
+
+  void testSeekOverflow() {
+    TmpFilesystem fs (1 << 20);
+    const off_t max = TmpFilesystem::maxFileSize;
+    int fd = fs.open ("/big", O_RDWR | O_CREAT, 0600);
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, std::numeric_limits<off_t>::max(), SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, max + 1, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, std::numeric_limits<off_t>::min(), SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EINVAL, fs.lseek (fd, -1, SEEK_END));
+
+    // Writes stop at the largest file size instead of sizing the chunk table
+    // from the offset
+    CPPUNIT_ASSERT_EQUAL (max, fs.lseek (fd, max, SEEK_SET));
+    CPPUNIT_ASSERT_EQUAL ((off_t)-EOVERFLOW, fs.lseek (fd, std::numeric_limits<off_t>::max(), SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-EFBIG, fs.write (fd, (void*)"x", 1));
+    CPPUNIT_ASSERT_EQUAL (max - 2, fs.lseek (fd, -2, SEEK_CUR));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-ENOSPC, fs.write (fd, (void*)"xyz", 3));
+    fs.close (fd);
+  }
+
+  void testDirectories() {
+    TmpFilesystem fs (1 << 20);
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/a", 0755));
+    CPPUNIT_ASSERT_EQUAL (-EEXIST, fs.mkdir ("/a", 0755));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.mkdir ("/b/c", 0755));
+    fs.close (fs.open ("/a/one", O_WRONLY | O_CREAT, 0644));
+    fs.close (fs.open ("/a/two", O_WRONLY | O_CREAT, 0644));
+    CPPUNIT_ASSERT_EQUAL (-ENOTDIR, fs.open ("/a/one/x", O_RDONLY, 0));
+
+    char buf[4096];
+    std::vector<std::string> names;
+    int fd = fs.open ("/a", O_RDONLY | O_DIRECTORY, 0);
+    int len = fs.getdents64 (fd, (struct linux_dirent64*)buf, sizeof (buf));
+    for (int pos = 0; pos < len;) {
+      linux_dirent64* ent = reinterpret_cast<linux_dirent64*>(buf + pos);
+      struct stat sbuf;
+      names.push_back (ent->d_name);
+      CPPUNIT_ASSERT_EQUAL (0, fs.stat (("/a/" + names.back()).c_str(), &sbuf));
+      CPPUNIT_ASSERT_EQUAL ((uint64_t)sbuf.st_ino, ent->d_ino);
+      CPPUNIT_ASSERT_EQUAL ((unsigned char)DT_REG, ent->d_type);
+      pos += ent->d_reclen;
+    }
+    fs.close (fd);
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, names.size());
+    CPPUNIT_ASSERT_EQUAL (std::string ("one"), names[0]);
+    CPPUNIT_ASSERT_EQUAL (std::string ("two"), names[1]);
+
+    CPPUNIT_ASSERT_EQUAL (-ENOTEMPTY, fs.rmdir ("/a"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/a/one"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/a/two"));
+    CPPUNIT_ASSERT_EQUAL (0, fs.rmdir ("/a"));
+    CPPUNIT_ASSERT_EQUAL (-EBUSY, fs.rmdir ("/"));
+  }
+
+  void testUnlinkWhileOpen() {
+    TmpFilesystem fs (1 << 20);
+    char buf[8];
+    int fd = fs.open ("/f", O_RDWR | O_CREAT, 0600);
+    fs.write (fd, (void*)"data", 4);
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/f"));
+    CPPUNIT_ASSERT_EQUAL (-ENOENT, fs.access ("/f", F_OK));
+    fs.lseek (fd, 0, SEEK_SET);
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)4, fs.read (fd, buf, sizeof (buf)));
+    CPPUNIT_ASSERT_EQUAL (0, fs.close (fd));
+  }
+
+  void testQuota() {
+    TmpFilesystem fs (65536);
+    std::string data (TmpFilesystem::chunkSize, 'q');
+    int fd = fs.open ("/big", O_WRONLY | O_CREAT, 0600);
+    ssize_t ret;
+    size_t written = 0;
+    while ((ret = fs.write (fd, (void*)data.data(), data.size())) > 0)
+      written += ret;
+    CPPUNIT_ASSERT_EQUAL (-ENOSPC, (int)ret);
+    CPPUNIT_ASSERT (written > 0);
+    CPPUNIT_ASSERT (fs.used() <= 65536);
+    fs.close (fd);
+
+    // Freed chunks are reused, so the same amount fits again
+    CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/big"));
+    fd = fs.open ("/big", O_WRONLY | O_CREAT, 0600);
+    size_t rewritten = 0;
+    while ((ret = fs.write (fd, (void*)data.data(), data.size())) > 0)
+      rewritten += ret;
+    CPPUNIT_ASSERT (rewritten >= written - TmpFilesystem::chunkSize);
+    fs.close (fd);
+  }
+
+  void testReuse() {
+    TmpFilesystem fs (1 << 20);
+    std::string data (TmpFilesystem::chunkSize * 4, 'r');
+    for (int i = 0; i < 1000; i++) {
+      int fd = fs.open ("/churn", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      CPPUNIT_ASSERT_EQUAL ((ssize_t)data.size(), fs.write (fd, (void*)data.data(), data.size()));
+      fs.close (fd);
+      CPPUNIT_ASSERT_EQUAL (0, fs.unlink ("/churn"));
+    }
+    CPPUNIT_ASSERT (fs.used() <= 2 * 65536);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (TmpFilesystemTest);
@@ -0,0 +1,285 @@
+#include "token-pool.h"
+#include "sandbox.h"
+#include "vfs.h"
+#include "tmp-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <functional>
+#include <malloc.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static size_t s_allocations = 0;
+
+/**
+ * Counts the allocations a pool makes, and nothing else
+ */
+template<typename T>
+struct CountingAllocator : public std::allocator<T> {
+  template<typename U> struct rebind {using other = CountingAllocator<U>;};
+
+  CountingAllocator() {}
+  template<typename U> CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n, const void* hint = 0)
+  {
+    s_allocations++;
+    return std::allocator<T>::allocate (n);
+  }
+};
+
+class TokenPoolTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (TokenPoolTest);
+  CPPUNIT_TEST (testAcquireRelease);
+  CPPUNIT_TEST (testStaleToken);
+  CPPUNIT_TEST (testSlotReuse);
+  CPPUNIT_TEST (testClear);
+  CPPUNIT_TEST (testReleaseIf);
+  CPPUNIT_TEST (testSoak);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void testAcquireRelease() {
+    TokenPool<int> pool;
+    int value = 0;
+    TokenPool<int>::Token a = pool.acquire (1);
+    TokenPool<int>::Token b = pool.acquire (2);
+
+    CPPUNIT_ASSERT (a != b);
+    CPPUNIT_ASSERT (a != TokenPool<int>::invalidToken);
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, pool.size());
+    CPPUNIT_ASSERT_EQUAL (2, *pool.get (b));
+    CPPUNIT_ASSERT (pool.release (a, value));
+    CPPUNIT_ASSERT_EQUAL (1, value);
+    CPPUNIT_ASSERT (pool.release (b, value));
+    CPPUNIT_ASSERT_EQUAL (2, value);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, pool.size());
+  }
+
+  void testStaleToken() {
+    TokenPool<int> pool;
+    int value = 0;
+    TokenPool<int>::Token a = pool.acquire (1);
+
+    CPPUNIT_ASSERT (pool.release (a, value));
+    CPPUNIT_ASSERT (!pool.release (a, value));
+    CPPUNIT_ASSERT (pool.get (a) == nullptr);
+    CPPUNIT_ASSERT (!pool.release (TokenPool<int>::invalidToken, value));
+    CPPUNIT_ASSERT (!pool.release (12345, value));
+  }
+
+  void testSlotReuse() {
+    TokenPool<int> pool;
+    int value = 0;
+    TokenPool<int>::Token a = pool.acquire (1);
+    pool.release (a, value);
+    TokenPool<int>::Token b = pool.acquire (2);
+
+    // Same slot, new generation
+    CPPUNIT_ASSERT (a != b);
+    CPPUNIT_ASSERT_EQUAL ((size_t)1, pool.capacity());
+    CPPUNIT_ASSERT (pool.get (a) == nullptr);
+    CPPUNIT_ASSERT_EQUAL (2, *pool.get (b));
+  }
+
+  void testClear() {
+    TokenPool<int> pool;
+    int value = 0;
+    TokenPool<int>::Token a = pool.acquire (1);
+    TokenPool<int>::Token b = pool.acquire (2);
+
+    std::vector<int> released = pool.clear();
+    CPPUNIT_ASSERT_EQUAL ((size_t)2, released.size());
+    CPPUNIT_ASSERT_EQUAL (3, released[0] + released[1]);
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, pool.size());
+    CPPUNIT_ASSERT (!pool.release (a, value));
+    CPPUNIT_ASSERT (pool.get (b) == nullptr);
+    CPPUNIT_ASSERT (pool.acquire (3) != b);
+  }
+
+  void testReleaseIf() {
+    TokenPool<int> pool;
+    TokenPool<int>::Token tokens[6];
+    for (int i = 0; i < 6; i++)
+      tokens[i] = pool.acquire (i);
+
+    std::vector<int> odd = pool.releaseIf ([] (int n) {return n % 2;});
+    CPPUNIT_ASSERT_EQUAL ((size_t)3, odd.size());
+    CPPUNIT_ASSERT_EQUAL ((size_t)3, pool.size());
+    for (int i = 0; i < 6; i++)
+      CPPUNIT_ASSERT_EQUAL (i % 2 == 0, pool.get (tokens[i]) != nullptr);
+    CPPUNIT_ASSERT (pool.releaseIf ([] (int n) {return n > 10;}).empty());
+  }
+
+  void testSoak() {
+    using Callback = std::function<void(int)>;
+    TokenPool<Callback, CountingAllocator<Callback>> pool;
+    TokenPool<Callback>::Token tokens[8];
+    Callback callback;
+    int calls = 0;
+
+    // Warm up so the pool reaches its steady-state size
+    for (int j = 0; j < 8; j++)
+      tokens[j] = pool.acquire ([&calls] (int n) {calls += n;});
+    for (int j = 0; j < 8; j++)
+      pool.release (tokens[j], callback);
+
+    size_t allocations = s_allocations;
+    for (int i = 0; i < 1000000 / 8; i++) {
+      for (int j = 0; j < 8; j++)
+        tokens[j] = pool.acquire ([&calls] (int n) {calls += n;});
+      for (int j = 7; j >= 0; j--) {
+        CPPUNIT_ASSERT (pool.release (tokens[j], callback));
+        callback (1);
+      }
+    }
+
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, s_allocations - allocations);
+    CPPUNIT_ASSERT_EQUAL ((size_t)8, pool.capacity());
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, pool.size());
+    CPPUNIT_ASSERT_EQUAL (1000000, calls);
+  }
+};
+
+/**
+ * Bytes of heap currently handed out by malloc
+ */
+static size_t
+heapInUse()
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return mallinfo().uordblks;
+#endif
+}
+
+class SoakSandbox : public Sandbox {
+public:
+  SyscallCall handleSyscall(const SyscallCall& call) override {return call;}
+  void handleIPC(codius_request_t*) override {}
+  void handleSignal(int signal) override {}
+  void handleExit(int status) override {}
+};
+
+/**
+ * Holds on to stat() completions like a backend with the call still in
+ * flight, until finish() writes the result
+ */
+class ParkingFilesystem : public Filesystem {
+public:
+  void statAsync(const char* path, struct stat* buf, Completion done) override {
+    m_buf = buf;
+    m_done = done;
+  }
+
+  void finish() {
+    memset (m_buf, 0, sizeof (*m_buf));
+    m_done (0);
+    m_done = Completion();
+  }
+
+private:
+  struct stat* m_buf;
+  Completion m_done;
+};
+
+/**
+ * Runs emulated syscalls through a VFS on behalf of a stopped child. The
+ * child is a fork of this process, so addresses of static buffers are the
+ * same on both sides.
+ */
+class VFSSoakTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (VFSSoakTest);
+  CPPUNIT_TEST (testSoak);
+  CPPUNIT_TEST (testDroppedVFS);
+  CPPUNIT_TEST_SUITE_END ();
+
+public:
+  void setUp() {
+    int status;
+
+    child = fork();
+    if (child == 0) {
+      ptrace (PTRACE_TRACEME, 0, 0, 0);
+      raise (SIGSTOP);
+      _exit (0);
+    }
+    waitpid (child, &status, 0);
+    CPPUNIT_ASSERT (WIFSTOPPED (status));
+
+    sbox.getVFS().mountFilesystem ("/tmp/", std::shared_ptr<Filesystem> (new TmpFilesystem (1024 * 1024)));
+  }
+
+  void tearDown() {
+    ::kill (child, SIGKILL);
+    waitpid (child, NULL, 0);
+  }
+
+  Sandbox::Word call(int id, Sandbox::Word a, Sandbox::Word b = 0, Sandbox::Word c = 0) {
+    Sandbox::SyscallCall call (child);
+    call.id = id;
+    call.args[0] = a;
+    call.args[1] = b;
+    call.args[2] = c;
+    call = sbox.getVFS().handleSyscall (call);
+    CPPUNIT_ASSERT (!call.deferred);
+    return call.returnVal;
+  }
+
+  void testSoak() {
+    static const char path[] = "/tmp/soak";
+    static char data[16];
+    static struct stat sbuf;
+
+    long fd = call (SYS_open, (Sandbox::Address)path, O_CREAT | O_RDWR, 0644);
+    CPPUNIT_ASSERT (VFS::firstVirtualFD <= fd);
+    CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)sizeof (data), call (SYS_write, fd, (Sandbox::Address)data, sizeof (data)));
+
+    // Warm up, then a million calls must not grow the heap
+    for (int i = 0; i < 1000; i++)
+      call (SYS_lseek, fd, 0, SEEK_SET);
+    size_t inUse = heapInUse();
+
+    for (int i = 0; i < 1000000 / 4; i++) {
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)0, call (SYS_lseek, fd, 0, SEEK_SET));
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)sizeof (data), call (SYS_read, fd, (Sandbox::Address)data, sizeof (data)));
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)0, call (SYS_fstat, fd, (Sandbox::Address)&sbuf));
+      CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)0, call (SYS_stat, (Sandbox::Address)path, (Sandbox::Address)&sbuf));
+    }
+
+    CPPUNIT_ASSERT (heapInUse() <= inUse + 4096);
+    CPPUNIT_ASSERT_EQUAL ((Sandbox::Word)0, call (SYS_close, fd));
+  }
+
+  // The backend may still write into the buffer after the VFS is gone
+  void testDroppedVFS() {
+    static const char path[] = "/park/file";
+    static struct stat sbuf;
+    std::shared_ptr<ParkingFilesystem> fs (new ParkingFilesystem);
+    VFS* vfs = new VFS (&sbox);
+    vfs->mountFilesystem ("/park/", fs);
+
+    Sandbox::SyscallCall call (child);
+    call.id = SYS_stat;
+    call.args[0] = (Sandbox::Address)path;
+    call.args[1] = (Sandbox::Address)&sbuf;
+    call = vfs->handleSyscall (call);
+    CPPUNIT_ASSERT (call.deferred);
+
+    delete vfs;
+    fs->finish();
+  }
+
+private:
+  pid_t child;
+  SoakSandbox sbox;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (TokenPoolTest);
+CPPUNIT_TEST_SUITE_REGISTRATION (VFSSoakTest);
@@ -0,0 +1,231 @@
+#include "uring-filesystem.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class UringFilesystemTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE (UringFilesystemTest);
+  CPPUNIT_TEST (testReadWrite);
+  CPPUNIT_TEST (testStat);
+  CPPUNIT_TEST (testEscape);
+  CPPUNIT_TEST (testOverlap);
+  CPPUNIT_TEST (testEventLoop);
+  CPPUNIT_TEST (testDirectoryHeld);
+  CPPUNIT_TEST (testPollLifetime);
+  CPPUNIT_TEST_SUITE_END ();
+
+private:
+  std::string outside;
+  std::string root;
+
+  /**
+   * Runs an asynchronous call to completion
+   */
+  ssize_t wait(UringFilesystem& fs, std::function<void(Filesystem::Completion)> op) {
+    bool finished = false;
+    ssize_t result = 0;
+    op ([&] (ssize_t ret) {
+      finished = true;
+      result = ret;
+    });
+    while (!finished) {
+      struct pollfd pfd = {fs.ringFD(), POLLIN, 0};
+      CPPUNIT_ASSERT (poll (&pfd, 1, 5000) == 1);
+      fs.reap();
+    }
+    return result;
+  }
+
+public:
+  void setUp() {
+    char tmpl[] = "/tmp/codius-uring-XXXXXX";
+    outside = mkdtemp (tmpl);
+    root = outside + "/root";
+    mkdir (root.c_str(), 0755);
+    FILE* fh = fopen ((root + "/data.txt").c_str(), "w");
+    fputs ("hello, uring", fh);
+    fclose (fh);
+    mkdir ((root + "/dir").c_str(), 0755);
+    fh = fopen ((root + "/dir/nested.txt").c_str(), "w");
+    fputs ("nested", fh);
+    fclose (fh);
+    symlink ("/etc/passwd", (root + "/escape").c_str());
+  }
+
+  void tearDown() {
+    std::string cmd = "rm -rf " + outside;
+    CPPUNIT_ASSERT_EQUAL (0, system (cmd.c_str()));
+  }
+
+  void testReadWrite() {
+    UringFilesystem fs (root);
+    char buf[32];
+    ssize_t fd = wait (fs, [&] (Filesystem::Completion done) {
+      fs.openAsync ("/data.txt", O_RDWR, 0, done);
+    });
+    CPPUNIT_ASSERT (fd >= 0);
+
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)5, wait (fs, [&] (Filesystem::Completion done) {
+      fs.readAsync (fd, buf, 5, done);
+    }));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, "hello", 5));
+
+    // Reads continue from the file position
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)7, wait (fs, [&] (Filesystem::Completion done) {
+      fs.readAsync (fd, buf, sizeof (buf), done);
+    }));
+    CPPUNIT_ASSERT_EQUAL (0, memcmp (buf, ", uring", 7));
+
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)1, wait (fs, [&] (Filesystem::Completion done) {
+      fs.writeAsync (fd, (void*)"!", 1, done);
+    }));
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, wait (fs, [&] (Filesystem::Completion done) {
+      fs.closeAsync (fd, done);
+    }));
+    CPPUNIT_ASSERT_EQUAL ((size_t)0, fs.pending());
+
+    struct stat sbuf;
+    ::stat ((root + "/data.txt").c_str(), &sbuf);
+    CPPUNIT_ASSERT_EQUAL ((off_t)13, sbuf.st_size);
+  }
+
+  void testStat() {
+    UringFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, wait (fs, [&] (Filesystem::Completion done) {
+      fs.statAsync ("/data.txt", &sbuf, done);
+    }));
+    CPPUNIT_ASSERT_EQUAL ((off_t)12, sbuf.st_size);
+    CPPUNIT_ASSERT (S_ISREG (sbuf.st_mode));
+
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)0, wait (fs, [&] (Filesystem::Completion done) {
+      fs.lstatAsync ("/escape", &sbuf, done);
+    }));
+    CPPUNIT_ASSERT (S_ISLNK (sbuf.st_mode));
+
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)-ENOENT, wait (fs, [&] (Filesystem::Completion done) {
+      fs.statAsync ("/missing", &sbuf, done);
+    }));
+  }
+
+  void testEscape() {
+    UringFilesystem fs (root);
+    struct stat sbuf;
+    CPPUNIT_ASSERT (wait (fs, [&] (Filesystem::Completion done) {
+      fs.openAsync ("/escape", O_RDONLY, 0, done);
+    }) < 0);
+    CPPUNIT_ASSERT (wait (fs, [&] (Filesystem::Completion done) {
+      fs.statAsync ("/escape", &sbuf, done);
+    }) < 0);
+  }
+
+  void testOverlap() {
+    UringFilesystem fs (root);
+    if (!fs.isAsync())
+      return;
+
+    const int count = 32;
+    std::vector<std::vector<char> > bufs (count, std::vector<char> (16));
+    std::vector<int> fds;
+    for (int i = 0; i < count; i++)
+      fds.push_back (fs.open ("/data.txt", O_RDONLY, 0));
+
+    int finished = 0;
+    for (int i = 0; i < count; i++) {
+      fs.readAsync (fds[i], bufs[i].data(), bufs[i].size(), [&] (ssize_t ret) {
+        CPPUNIT_ASSERT_EQUAL ((ssize_t)12, ret);
+        finished++;
+      });
+    }
+    while (finished < count) {
+      struct pollfd pfd = {fs.ringFD(), POLLIN, 0};
+      CPPUNIT_ASSERT (poll (&pfd, 1, 5000) == 1);
+      fs.reap();
+    }
+    for (int i = 0; i < count; i++)
+      fs.close (fds[i]);
+  }
+
+  void testEventLoop() {
+    UringFilesystem fs (root);
+    if (!fs.isAsync())
+      return;
+
+    // Nothing reaps by hand here; the default loop has to
+    bool finished = false;
+    ssize_t fd = -1;
+    fs.openAsync ("/data.txt", O_RDONLY, 0, [&] (ssize_t ret) {
+      finished = true;
+      fd = ret;
+    });
+    for (int i = 0; !finished && i < 10; i++)
+      uv_run (uv_default_loop(), UV_RUN_ONCE);
+    CPPUNIT_ASSERT (finished);
+    CPPUNIT_ASSERT (fd >= 0);
+    fs.close (fd);
+  }
+
+  // The poll handle is closed through the loop, which may outlive us
+  void testPollLifetime() {
+    for (int i = 0; i < 3; i++) {
+      UringFilesystem* fs = new UringFilesystem (root);
+      if (!fs->isAsync()) {
+        delete fs;
+        return;
+      }
+
+      bool finished = false;
+      ssize_t fd = -1;
+      fs->openAsync ("/data.txt", O_RDONLY, 0, [&] (ssize_t ret) {
+        finished = true;
+        fd = ret;
+      });
+      for (int j = 0; !finished && j < 10; j++)
+        uv_run (uv_default_loop(), UV_RUN_ONCE);
+      CPPUNIT_ASSERT (finished);
+      fs->close (fd);
+
+      CPPUNIT_ASSERT (fs->stopPoll());
+      CPPUNIT_ASSERT (fs->startPoll (uv_default_loop()));
+      delete fs;
+      uv_run (uv_default_loop(), UV_RUN_NOWAIT);
+    }
+  }
+
+  void testDirectoryHeld() {
+    UringFilesystem fs (root);
+    if (!fs.isAsync())
+      return;
+
+    bool finished = false;
+    ssize_t fd = -1;
+    fs.openAsync ("/dir/nested.txt", O_RDONLY, 0, [&] (ssize_t ret) {
+      finished = true;
+      fd = ret;
+    });
+
+    // Empty the directory cache and take over any descriptor it closes
+    CPPUNIT_ASSERT_EQUAL (0, fs.mkdir ("/other", 0755));
+    int reused = ::open (root.c_str(), O_PATH | O_DIRECTORY);
+
+    while (!finished) {
+      struct pollfd pfd = {fs.ringFD(), POLLIN, 0};
+      CPPUNIT_ASSERT (poll (&pfd, 1, 5000) == 1);
+      fs.reap();
+    }
+    ::close (reused);
+    CPPUNIT_ASSERT (fd >= 0);
+    char buf[16];
+    CPPUNIT_ASSERT_EQUAL ((ssize_t)6, fs.read (fd, buf, sizeof (buf)));
+    fs.close (fd);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (UringFilesystemTest);